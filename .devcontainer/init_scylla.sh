@@ -35,6 +35,47 @@ CREATE TABLE IF NOT EXISTS im.user_messages (
   timestamp bigint,
   PRIMARY KEY (user_id, timestamp, message_id)
 ) WITH CLUSTERING ORDER BY (timestamp DESC, message_id ASC);
+
+-- Partitioned by day (timestamp / 86400) so no partition grows past one day of traffic. The tables above
+-- are only read while SCYLLA_LEGACY_INBOX=1, see migrate_scylla_buckets.py.
+CREATE TABLE IF NOT EXISTS im.messages_by_day (
+  conversation_id text,
+  day bigint,
+  timestamp bigint,
+  message_id bigint,
+  sender_id bigint,
+  receiver_id bigint,
+  content_type int,
+  content blob,
+  seq bigint,
+  PRIMARY KEY ((conversation_id, day), timestamp, message_id)
+) WITH CLUSTERING ORDER BY (timestamp DESC)
+  AND compaction = {'class': 'TimeWindowCompactionStrategy', 'compaction_window_unit': 'DAYS',
+                    'compaction_window_size': 1};
+
+CREATE TABLE IF NOT EXISTS im.user_messages_by_day (
+  user_id bigint,
+  day bigint,
+  message_id bigint,
+  sender_id bigint,
+  receiver_id bigint,
+  content_type int,
+  content blob,
+  timestamp bigint,
+  seq bigint,
+  PRIMARY KEY ((user_id, day), timestamp, message_id)
+) WITH CLUSTERING ORDER BY (timestamp DESC, message_id ASC)
+  AND compaction = {'class': 'TimeWindowCompactionStrategy', 'compaction_window_unit': 'DAYS',
+                    'compaction_window_size': 1};
+
+-- Highest P2PMessage.seq written per conversation, seeds the seqs after a restart. Written USING TIMESTAMP <seq>
+-- so the highest seq wins. Only the server (and migrate_scylla_buckets.py) writes it, always that way, and rows
+-- are never deleted: an ordinary write or DELETE carries a wall-clock timestamp far above any seq and would shadow
+-- every later seq of the conversation for good.
+CREATE TABLE IF NOT EXISTS im.conversation_seq (
+  conversation_id text PRIMARY KEY,
+  seq bigint
+);
 CQL
 
 echo "[scylla] init done."
@@ -0,0 +1,91 @@
+#!/usr/bin/env python3
+"""Copy im.messages and im.user_messages into their day-bucketed tables (im.*_by_day).
+
+Migration path from the unbucketed tables:
+  1. init_scylla.sh creates the *_by_day tables, start the new server. It writes only the bucketed tables
+     and, with SCYLLA_LEGACY_INBOX=1 (the default), tops syncs up from im.user_messages.
+  2. Run this script once. It is idempotent (same primary keys), so it may be rerun or interrupted. Each
+     migrated conversation gets an im.conversation_seq row at its number of legacy messages, so the seqs handed
+     out after the restart below come after them (a higher seq the server wrote meanwhile wins).
+  3. Restart the server with SCYLLA_LEGACY_INBOX=0, then TRUNCATE im.messages and im.user_messages.
+
+usage: migrate_scylla_buckets.py [host] [port]
+"""
+import sys
+
+from cassandra.cluster import Cluster
+from cassandra.concurrent import execute_concurrent_with_args
+
+BUCKET_SECONDS = 24 * 60 * 60  # MsgScyllaDao::kBucketSeconds
+PAGE_SIZE = 1000
+CONCURRENCY = 64
+
+
+def copy_table(session, select, insert, to_params, on_row=None):
+    insert_stmt = session.prepare(insert)
+    copied = 0
+    # Paged by the driver (default_fetch_size), the whole table never sits in memory
+    rows = session.execute(select)
+    batch = []
+    for row in rows:
+        if on_row:
+            on_row(row)
+        batch.append(to_params(row))
+        if len(batch) == PAGE_SIZE:
+            execute_concurrent_with_args(session, insert_stmt, batch, concurrency=CONCURRENCY,
+                                         raise_on_first_error=True)
+            copied += len(batch)
+            batch.clear()
+    if batch:
+        execute_concurrent_with_args(session, insert_stmt, batch, concurrency=CONCURRENCY,
+                                     raise_on_first_error=True)
+        copied += len(batch)
+    return copied
+
+
+def main():
+    host = sys.argv[1] if len(sys.argv) > 1 else "scylla"
+    port = int(sys.argv[2]) if len(sys.argv) > 2 else 9042
+    cluster = Cluster([host], port=port)
+    session = cluster.connect()
+    session.default_fetch_size = PAGE_SIZE
+    session.default_timeout = 60
+
+    counts = {}
+
+    def count(row):
+        counts[row.conversation_id] = counts.get(row.conversation_id, 0) + 1
+
+    n = copy_table(
+        session,
+        "SELECT conversation_id, timestamp, message_id, sender_id, receiver_id, content_type, content "
+        "FROM im.messages",
+        "INSERT INTO im.messages_by_day (conversation_id, day, timestamp, message_id, sender_id, receiver_id, "
+        "content_type, content) VALUES (?, ?, ?, ?, ?, ?, ?, ?)",
+        lambda r: (r.conversation_id, r.timestamp // BUCKET_SECONDS, r.timestamp, r.message_id, r.sender_id,
+                   r.receiver_id, r.content_type, r.content),
+        on_row=count)
+    print(f"im.messages -> im.messages_by_day: {n} rows")
+
+    # Written at the seq as its timestamp like the server does, the highest seq of a conversation wins
+    seq_stmt = session.prepare(
+        "INSERT INTO im.conversation_seq (conversation_id, seq) VALUES (?, ?) USING TIMESTAMP ?")
+    execute_concurrent_with_args(session, seq_stmt, [(conv, seq, seq) for conv, seq in counts.items()],
+                                 concurrency=CONCURRENCY, raise_on_first_error=True)
+    print(f"im.conversation_seq: {len(counts)} conversations")
+
+    n = copy_table(
+        session,
+        "SELECT user_id, message_id, sender_id, receiver_id, content_type, content, timestamp "
+        "FROM im.user_messages",
+        "INSERT INTO im.user_messages_by_day (user_id, day, message_id, sender_id, receiver_id, content_type, "
+        "content, timestamp) VALUES (?, ?, ?, ?, ?, ?, ?, ?)",
+        lambda r: (r.user_id, r.timestamp // BUCKET_SECONDS, r.message_id, r.sender_id, r.receiver_id,
+                   r.content_type, r.content, r.timestamp))
+    print(f"im.user_messages -> im.user_messages_by_day: {n} rows")
+
+    cluster.shutdown()
+
+
+if __name__ == "__main__":
+    main()
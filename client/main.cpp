@@ -131,8 +131,14 @@ private:
         });
 
         // Set message callback
-        NetworkManager::GetInstance().SetOnMessageCallback(
-            [this](const im::P2PMessage& msg) { screen_.Post(Event::Custom); });
+        NetworkManager::GetInstance().SetOnMessageCallback([this](const im::P2PMessage& msg) {
+            // A seq jump means pushes were missed, fetched on the main thread like the friend list
+            screen_.Post([] {
+                std::string err;
+                NetworkManager::GetInstance().FillSeqGaps(err);
+            });
+            screen_.Post(Event::Custom);
+        });
     }
 
     int current_page_ = (int)Page::AUTH;
@@ -155,10 +155,15 @@ void NetworkManager::ListenerLoop() {
             {
                 std::lock_guard<std::mutex> lock(mutex_);
                 p2p_chat_history_[msg.sender_id()].push_back(msg);
+                NoteSeq(msg.sender_id(), msg.seq(), msg.timestamp(), true);
             }
             if (on_message_callback_) {
                 on_message_callback_(msg);
             }
+        } else if (env.cmd() == im::CMD_SYNC_MSGS_RES && env.sync_msgs_res().more_frames()) {
+            // Streamed sync, the last frame is the response SyncMessages waits for
+            std::lock_guard<std::mutex> lock(mutex_);
+            MergeSyncedMessages(env.sync_msgs_res());
         } else {
             std::lock_guard<std::mutex> lock(mutex_);
             response_envelope_ = env;
@@ -231,6 +236,15 @@ bool NetworkManager::Login(const std::string& username, const std::string& passw
             user_id_ = resp.user_info().user_id();
             username_ = resp.user_info().username();
         }
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (history_user_id_ != user_id_) {
+            p2p_chat_history_.clear();
+            history_user_id_ = user_id_;
+            sync_cursor_ts_ = 0;
+            sync_cursor_msg_id_ = 0;
+            conv_seq_.clear();
+            seq_gaps_.clear();
+        }
         return true;
     } else {
         error_msg = resp.error_msg();
@@ -252,8 +266,8 @@ void NetworkManager::ClearAuth() {
     user_id_ = 0;
     username_.clear();
     {
+        // The history stays for the next login of the same user, see Login
         std::lock_guard<std::mutex> lock(mutex_);
-        p2p_chat_history_.clear();
         pending_friend_requests_.clear();
     }
 }
@@ -353,6 +367,7 @@ void NetworkManager::RemovePendingRequest(uint64_t req_id) {
 
 bool NetworkManager::SendP2PMessage(uint64_t receiver_id, const std::string& content, std::string& error_msg) {
     im::P2PMessage req;
+    req.set_msg_id(next_client_msg_id_.fetch_add(1, std::memory_order_relaxed));
     req.set_sender_id(user_id_);
     req.set_receiver_id(receiver_id);
     req.set_content(content);
@@ -363,17 +378,30 @@ bool NetworkManager::SendP2PMessage(uint64_t receiver_id, const std::string& con
     env.set_timestamp(time(nullptr));
     *env.mutable_p2p_msg_req() = req;
 
+    // The server refuses messages while its persistence queue is full, resend after the hinted delay. A lost ack
+    // is resent too: under the same msg_id the server answers with the first send's ack instead of a duplicate.
+    const int kMaxAttempts = 3;
     im::Envelope resp_env;
-    if (!SendRequestAndWait(env, resp_env, im::CMD_MSG_ACK)) {
-        error_msg = "Request timeout or network error";
-        return false;
+    for (int attempt = 1;; attempt++) {
+        if (!SendRequestAndWait(env, resp_env, im::CMD_MSG_ACK)) {
+            if (attempt < kMaxAttempts) continue;
+            error_msg = "Request timeout or network error";
+            return false;
+        }
+        const auto& ack = resp_env.msg_ack();
+        if (ack.success() || !ack.retryable() || attempt == kMaxAttempts) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(ack.retry_after_ms()));
     }
 
     const auto& resp = resp_env.msg_ack();
     if (resp.success()) {
+        // Under the server's id, as a sync returns it
+        req.set_msg_id(resp.msg_id());
+        req.set_seq(resp.ref_seq());
         {
             std::lock_guard<std::mutex> lock(mutex_);
             p2p_chat_history_[receiver_id].push_back(req);
+            NoteSeq(receiver_id, req.seq(), req.timestamp(), false);
         }
         return true;
     } else {
@@ -385,32 +413,176 @@ bool NetworkManager::SendP2PMessage(uint64_t receiver_id, const std::string& con
 bool NetworkManager::SyncMessages(std::string& error_msg) {
     im::SyncMessagesReq req;
     req.set_user_id(user_id_);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        req.set_since_timestamp(sync_cursor_ts_);
+        req.set_since_msg_id(sync_cursor_msg_id_);
+        sync_incremental_ = sync_cursor_ts_ != 0;
+    }
+    req.set_page_size(kSyncPageSize);
+    req.set_stream(true);
+
+    // Without a cursor one response holds the latest messages, with one the pages follow until has_more is off
+    while (true) {
+        im::Envelope env;
+        env.set_cmd(im::CMD_SYNC_MSGS_REQ);
+        env.set_timestamp(time(nullptr));
+        *env.mutable_sync_msgs_req() = req;
+
+        im::Envelope resp_env;
+        if (!SendRequestAndWait(env, resp_env, im::CMD_SYNC_MSGS_RES)) {
+            error_msg = "Request timeout or network error";
+            return false;
+        }
+
+        const auto& resp = resp_env.sync_msgs_res();
+        if (!resp.success()) {
+            error_msg = resp.error_msg();
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        MergeSyncedMessages(resp);
+        if (!sync_incremental_ || !resp.has_more()) {
+            return true;
+        }
+        req.set_continuation(resp.continuation());
+    }
+}
+
+void NetworkManager::MergeSyncedMessages(const im::SyncMessagesResp& resp) {
+    // Messages may repeat what we have (pushed since the login)
+    for (const auto& msg : resp.messages()) {
+        uint64_t chat_partner_id = (msg.sender_id() == user_id_) ? msg.receiver_id() : msg.sender_id();
+        NoteSeq(chat_partner_id, msg.seq(), msg.timestamp(), false);
+        auto& history = p2p_chat_history_[chat_partner_id];
+        bool known = std::any_of(history.begin(), history.end(),
+                                 [&](const im::P2PMessage& m) { return m.msg_id() == msg.msg_id(); });
+        if (sync_incremental_) {
+            // Oldest first
+            if (!known) {
+                history.push_back(msg);
+            }
+            sync_cursor_ts_ = msg.timestamp();
+            sync_cursor_msg_id_ = msg.msg_id();
+            continue;
+        }
+        // Newest first, each one older than the history so far
+        if (!known) {
+            history.insert(history.begin(), msg);
+        }
+        if (sync_cursor_ts_ == 0) {
+            sync_cursor_ts_ = msg.timestamp();
+            sync_cursor_msg_id_ = msg.msg_id();
+        }
+    }
+}
+
+int NetworkManager::LoadOlderHistory(uint64_t peer_id, std::string& error_msg) {
+    im::GetHistoryReq req;
+    req.set_peer_id(peer_id);
+    {
+        // From the oldest second we have, its smallest id: the server returns the rest of that second first
+        std::lock_guard<std::mutex> lock(mutex_);
+        const auto& history = p2p_chat_history_[peer_id];
+        for (const auto& msg : history) {
+            if (req.before_timestamp() == 0 || msg.timestamp() < req.before_timestamp() ||
+                (msg.timestamp() == req.before_timestamp() && msg.msg_id() < req.before_msg_id())) {
+                req.set_before_timestamp(msg.timestamp());
+                req.set_before_msg_id(msg.msg_id());
+            }
+        }
+    }
 
     im::Envelope env;
-    env.set_cmd(im::CMD_SYNC_MSGS_REQ);
+    env.set_cmd(im::CMD_GET_HISTORY_REQ);
     env.set_timestamp(time(nullptr));
-    *env.mutable_sync_msgs_req() = req;
+    *env.mutable_get_history_req() = req;
 
     im::Envelope resp_env;
-    if (!SendRequestAndWait(env, resp_env, im::CMD_SYNC_MSGS_RES)) {
+    if (!SendRequestAndWait(env, resp_env, im::CMD_GET_HISTORY_RES)) {
         error_msg = "Request timeout or network error";
-        return false;
+        return -1;
+    }
+    const auto& resp = resp_env.get_history_res();
+    if (!resp.success()) {
+        error_msg = resp.error_msg();
+        return -1;
     }
 
-    const auto& resp = resp_env.sync_msgs_res();
-    if (resp.success()) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& history = p2p_chat_history_[peer_id];
+    int added = 0;
+    // Newest first, each one goes in front of the history so far
+    for (const auto& msg : resp.messages()) {
+        bool known = std::any_of(history.begin(), history.end(),
+                                 [&](const im::P2PMessage& m) { return m.msg_id() == msg.msg_id(); });
+        if (!known) {
+            history.insert(history.begin(), msg);
+            added++;
+        }
+    }
+    return added;
+}
+
+void NetworkManager::NoteSeq(uint64_t peer_id, uint64_t seq, int64_t timestamp, bool pushed) {
+    if (seq == 0) return;
+    auto& last = conv_seq_[peer_id];
+    // Our own sends and syncs fill in what they return, only pushes arrive one by one
+    if (pushed && last != 0 && seq > last + 1) {
+        seq_gaps_.push_back({peer_id, last, seq - last - 1, timestamp});
+    }
+    last = std::max(last, seq);
+}
+
+int NetworkManager::FillSeqGaps(std::string& error_msg) {
+    std::vector<SeqGap> gaps;
+    {
         std::lock_guard<std::mutex> lock(mutex_);
-        p2p_chat_history_.clear();
-        for (int i = resp.messages_size() - 1; i >= 0; --i) {
-            const auto& msg = resp.messages(i);
-            uint64_t chat_partner_id = (msg.sender_id() == user_id_) ? msg.receiver_id() : msg.sender_id();
-            p2p_chat_history_[chat_partner_id].push_back(msg);
+        gaps.swap(seq_gaps_);
+    }
+    const uint32_t kMaxPage = 100;
+    int added = 0;
+    for (size_t i = 0; i < gaps.size(); i++) {
+        const auto& gap = gaps[i];
+        // Everything up to the end of the push's second, back to the seq we had
+        im::GetHistoryReq req;
+        req.set_peer_id(gap.peer_id);
+        req.set_before_timestamp(gap.before_timestamp + 1);
+        req.set_before_msg_id(UINT64_MAX);
+        req.set_after_seq(gap.after_seq);
+        req.set_limit(static_cast<uint32_t>(std::min<uint64_t>(gap.missing + 1, kMaxPage)));
+
+        im::Envelope env;
+        env.set_cmd(im::CMD_GET_HISTORY_REQ);
+        env.set_timestamp(time(nullptr));
+        *env.mutable_get_history_req() = req;
+
+        im::Envelope resp_env;
+        if (!SendRequestAndWait(env, resp_env, im::CMD_GET_HISTORY_RES) || !resp_env.get_history_res().success()) {
+            error_msg = resp_env.get_history_res().error_msg().empty() ? "Request timeout or network error"
+                                                                        : resp_env.get_history_res().error_msg();
+            // Tried again with the next push
+            std::lock_guard<std::mutex> lock(mutex_);
+            seq_gaps_.insert(seq_gaps_.end(), gaps.begin() + i, gaps.end());
+            return -1;
         }
-        return true;
-    } else {
-        error_msg = resp.error_msg();
-        return false;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& history = p2p_chat_history_[gap.peer_id];
+        for (const auto& msg : resp_env.get_history_res().messages()) {
+            bool known = std::any_of(history.begin(), history.end(),
+                                     [&](const im::P2PMessage& m) { return m.msg_id() == msg.msg_id(); });
+            if (!known) {
+                history.push_back(msg);
+                added++;
+            }
+        }
+        std::stable_sort(history.begin(), history.end(), [](const im::P2PMessage& a, const im::P2PMessage& b) {
+            return a.timestamp() < b.timestamp();
+        });
     }
+    return added;
 }
 
 std::vector<im::P2PMessage> NetworkManager::GetP2PHistory(uint64_t receiver_id) {
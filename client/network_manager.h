@@ -6,6 +6,7 @@
 #include <atomic>
 #include <condition_variable>
 #include <cstdint>
+#include <ctime>
 #include <functional>
 #include <mutex>
 #include <string>
@@ -46,6 +47,10 @@ public:
     bool SendP2PMessage(uint64_t receiver_id, const std::string& content, std::string& error_msg);
     bool SyncMessages(std::string& error_msg);
     std::vector<im::P2PMessage> GetP2PHistory(uint64_t receiver_id);
+    // Page in the messages with peer_id before the oldest one we have, returns how many were new (-1 on error)
+    int LoadOlderHistory(uint64_t peer_id, std::string& error_msg);
+    // Fetch the messages pushes skipped over (a seq jump), returns how many were new (-1 on error)
+    int FillSeqGaps(std::string& error_msg);
 
     // Getters
     bool IsLoggedIn() const { return !token_.empty(); }
@@ -64,6 +69,10 @@ private:
     bool SendEnvelope(const im::Envelope& env);
     bool SendRequestAndWait(const im::Envelope& request, im::Envelope& response, im::CommandType expected_cmd);
     void ListenerLoop();
+    // Add the messages of a sync response or frame to the history and move the cursor, caller holds mutex_
+    void MergeSyncedMessages(const im::SyncMessagesResp& resp);
+    // Track the seq of a message with peer_id, a push past the next one records a gap; caller holds mutex_
+    void NoteSeq(uint64_t peer_id, uint64_t seq, int64_t timestamp, bool pushed);
     void HeartbeatLoop();
     void ClearAuth();
     void Disconnect();
@@ -99,4 +108,27 @@ private:
 
     std::vector<im::FriendReqPush> pending_friend_requests_;
     std::unordered_map<uint64_t, std::vector<im::P2PMessage>> p2p_chat_history_;
+    // Owner of p2p_chat_history_ and the newest message a sync returned, kept across logouts so that
+    // logging in again only syncs what was missed
+    uint64_t history_user_id_ = 0;
+    int64_t sync_cursor_ts_ = 0;
+    uint64_t sync_cursor_msg_id_ = 0;
+    // The running sync pages forward from the cursor (oldest first), otherwise it gets the latest newest first
+    bool sync_incremental_ = false;
+    // Highest seq seen per peer, and the seq ranges pushes jumped over
+    struct SeqGap {
+        uint64_t peer_id;
+        uint64_t after_seq;
+        uint64_t missing;
+        // Of the push after the gap, the missing messages are at or before it
+        int64_t before_timestamp;
+    };
+    std::unordered_map<uint64_t, uint64_t> conv_seq_;
+    std::vector<SeqGap> seq_gaps_;
+    // Our own id of the next message sent, the server answers with the id it stores the message under. Starts
+    // from the clock so that a restarted client does not reuse the ids of its last run.
+    std::atomic<uint64_t> next_client_msg_id_{static_cast<uint64_t>(time(nullptr)) << 20};
+
+    // Messages per SyncMessages page once there is a cursor
+    static constexpr uint32_t kSyncPageSize = 200;
 };
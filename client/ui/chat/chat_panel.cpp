@@ -54,6 +54,20 @@ ChatPanel BuildChatPanel(const uint64_t& friend_id, const std::string& friend_na
     };
 
     auto msg_menu = Menu(&state->dummy_entries, &state->selected, option);
+    // Up past the oldest message pages in older ones from the server
+    msg_menu |= CatchEvent([state, &friend_id](const Event& event) {
+        if (event != Event::ArrowUp || state->selected != 0 || friend_id == 0) {
+            return false;
+        }
+        std::string error_msg;
+        int added = NetworkManager::GetInstance().LoadOlderHistory(friend_id, error_msg);
+        if (added <= 0) {
+            return false;
+        }
+        state->dummy_entries.resize(state->dummy_entries.size() + added);
+        state->selected = added - 1;
+        return true;
+    });
 
     auto btn_layout = Container::Horizontal({
         input_content,
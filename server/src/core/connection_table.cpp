@@ -0,0 +1,44 @@
+#include "connection_table.h"
+
+ConnectionTable::ConnectionTable(int max_fd)
+    : max_fd_(max_fd), chunks_(new std::atomic<TcpConnection*>[(max_fd + kChunkSize - 1) / kChunkSize]) {
+    for (int i = 0; i < (max_fd_ + kChunkSize - 1) / kChunkSize; i++) {
+        chunks_[i].store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+ConnectionTable::~ConnectionTable() {
+    for (int i = 0; i < (max_fd_ + kChunkSize - 1) / kChunkSize; i++) {
+        delete[] chunks_[i].load(std::memory_order_relaxed);
+    }
+}
+
+TcpConnection* ConnectionTable::Acquire(int fd) {
+    if (fd < 0 || fd >= max_fd_) {
+        return nullptr;
+    }
+    std::atomic<TcpConnection*>& slot = chunks_[fd / kChunkSize];
+    TcpConnection* chunk = slot.load(std::memory_order_acquire);
+    if (!chunk) {
+        // Reactors accepting in the same range race here, the lock makes sure only one chunk is allocated
+        std::lock_guard<std::mutex> lock(grow_mtx_);
+        chunk = slot.load(std::memory_order_relaxed);
+        if (!chunk) {
+            chunk = new TcpConnection[kChunkSize];
+            slot.store(chunk, std::memory_order_release);
+            chunk_count_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    return &chunk[fd % kChunkSize];
+}
+
+TcpConnection* ConnectionTable::Get(int fd) const {
+    if (fd < 0 || fd >= max_fd_) {
+        return nullptr;
+    }
+    TcpConnection* chunk = chunks_[fd / kChunkSize].load(std::memory_order_acquire);
+    if (!chunk || chunk[fd % kChunkSize].is_closed()) {
+        return nullptr;
+    }
+    return &chunk[fd % kChunkSize];
+}
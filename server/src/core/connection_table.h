@@ -0,0 +1,44 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include "tcp_connection.h"
+
+/**
+ * ConnectionTable - fd-indexed slab of TcpConnection objects
+ *
+ * Slots are allocated in chunks of kChunkSize connections the first time an fd in that range is
+ * accepted and are never freed until the table is destroyed. A closed connection stays in its slot
+ * and is recycled by the next accept that gets the same fd, so init() reuses the already grown
+ * read/write buffers instead of allocating a new connection per accept.
+ *
+ * fds are unique across the process, so a single table is shared by all reactors. Lookups are
+ * lock-free; only growing a chunk takes a lock.
+ */
+class ConnectionTable {
+public:
+    explicit ConnectionTable(int max_fd = 65536);
+    ~ConnectionTable();
+
+    ConnectionTable(const ConnectionTable&) = delete;
+    ConnectionTable& operator=(const ConnectionTable&) = delete;
+
+    // Slot for a newly accepted fd, nullptr if fd is out of range
+    TcpConnection* Acquire(int fd);
+    // The open connection on fd, nullptr if there is none
+    TcpConnection* Get(int fd) const;
+
+    int max_fd() const { return max_fd_; }
+    // Number of connection objects allocated so far
+    size_t capacity() const { return chunk_count_.load(std::memory_order_relaxed) * kChunkSize; }
+
+private:
+    static constexpr int kChunkSize = 1024;
+
+    int max_fd_;
+    std::mutex grow_mtx_;
+    std::atomic<size_t> chunk_count_{0};
+    std::unique_ptr<std::atomic<TcpConnection*>[]> chunks_;
+};
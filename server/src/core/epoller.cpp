@@ -1,14 +1,46 @@
 #include "epoller.h"
+#include <sys/socket.h>
+#include <cerrno>
+#include "../log/log.h"
+#include "uring_poller.h"
+
+std::unique_ptr<Epoller> Epoller::Create(IoBackend backend, int maxEvent) {
+    if (backend != IoBackend::EPOLL) {
+        auto uring = std::make_unique<UringPoller>(maxEvent, backend == IoBackend::IO_URING_SQPOLL);
+        if (uring->IsValid()) {
+            return uring;
+        }
+        LOG_WARN("io_uring backend unavailable, falling back to epoll");
+    }
+    return std::make_unique<EpollPoller>(maxEvent);
+}
+
+int Epoller::Accept(int listen_fd, sockaddr_in* addr) {
+    socklen_t len = sizeof(*addr);
+    return accept(listen_fd, reinterpret_cast<sockaddr*>(addr), &len);
+}
+
+ssize_t Epoller::Recv(int fd, Buffer& buff, int* error_code) { return buff.read_fd(fd, error_code); }
+
+ssize_t Epoller::Send(int fd, const iovec* iov, int iovcnt, int* error_code) {
+    ssize_t len = writev(fd, iov, iovcnt);
+    if (len < 0) {
+        *error_code = errno;
+    }
+    return len;
+}
+
+void Epoller::Close(int fd) { close(fd); }
 
 // The number "512" does nothing with the size of the actual limit of the epoll instance, but it needs to be greater
 // than 0.
-Epoller::Epoller(int maxEvent) : epollFd_(epoll_create(512)), events_(maxEvent) {
+EpollPoller::EpollPoller(int maxEvent) : epollFd_(epoll_create(512)), events_(maxEvent) {
     assert(epollFd_ >= 0 && events_.size() > 0);
 }
 
-Epoller::~Epoller() { close(epollFd_); }
+EpollPoller::~EpollPoller() { close(epollFd_); }
 
-bool Epoller::addFd(int fd, uint32_t events) {
+bool EpollPoller::addFd(int fd, uint32_t events) {
     if (fd < 0) return false;
     epoll_event ev = {0};
     ev.data.fd = fd;
@@ -16,7 +48,7 @@ bool Epoller::addFd(int fd, uint32_t events) {
     return 0 == epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &ev);
 }
 
-bool Epoller::modFd(int fd, uint32_t events) {
+bool EpollPoller::modFd(int fd, uint32_t events) {
     if (fd < 0) return false;
     epoll_event ev = {0};
     ev.data.fd = fd;
@@ -24,21 +56,21 @@ bool Epoller::modFd(int fd, uint32_t events) {
     return 0 == epoll_ctl(epollFd_, EPOLL_CTL_MOD, fd, &ev);
 }
 
-bool Epoller::delFd(int fd) {
+bool EpollPoller::delFd(int fd) {
     if (fd < 0) return false;
     return 0 == epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, 0);
 }
 
-int Epoller::Wait(int timeoutMs) {
+int EpollPoller::Wait(int timeoutMs) {
     return epoll_wait(epollFd_, &events_[0], static_cast<int>(events_.size()), timeoutMs);
 }
 
-int Epoller::getEventFd(size_t i) const {
+int EpollPoller::getEventFd(size_t i) const {
     assert(i >= 0 && i < events_.size());
     return events_[i].data.fd;
 }
 
-uint32_t Epoller::getEvents(size_t i) const {
+uint32_t EpollPoller::getEvents(size_t i) const {
     assert(i >= 0 && i < events_.size());
     return events_[i].events;
 }
\ No newline at end of file
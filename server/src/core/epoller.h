@@ -1,21 +1,76 @@
 #pragma once
 
 #include <assert.h>
+#include <netinet/in.h>
 #include <sys/epoll.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <memory>
 #include <vector>
+#include "../buffer/buffer.h"
 
+// Readiness backend used by the reactors, chosen at startup
+enum class IoBackend {
+    EPOLL,
+    IO_URING,         // io_uring accept, recv and send, submitted together by io_uring_enter
+    IO_URING_SQPOLL,  // io_uring with a kernel submission thread, what workers queue costs no syscall
+};
+
+inline const char* IoBackendName(IoBackend backend) {
+    switch (backend) {
+        case IoBackend::IO_URING:
+            return "io_uring";
+        case IoBackend::IO_URING_SQPOLL:
+            return "io_uring(sqpoll)";
+        default:
+            return "epoll";
+    }
+}
+
+/**
+ * Epoller - readiness notification interface of a reactor
+ *
+ * Events use the epoll flag values (EPOLLIN, EPOLLOUT, EPOLLRDHUP, EPOLLONESHOT, EPOLLET) whatever the backend.
+ * addFd/modFd/delFd may be called from any thread, Wait and the event getters only from the reactor thread.
+ *
+ * The sockets' I/O goes through Accept, Recv and Send as well, so a completion-based backend can do it in its
+ * ring (see UringPoller); here they are the plain syscalls.
+ */
 class Epoller {
 public:
-    explicit Epoller(int maxEvent = 1024);
-    ~Epoller();
-
-    bool addFd(int fd, uint32_t events);
-    bool modFd(int fd, uint32_t events);
-    bool delFd(int fd);
-    int Wait(int timeoutMs = -1);
-    int getEventFd(size_t i) const;
-    uint32_t getEvents(size_t i) const;
+    virtual ~Epoller() = default;
+
+    virtual bool addFd(int fd, uint32_t events) = 0;
+    virtual bool modFd(int fd, uint32_t events) = 0;
+    virtual bool delFd(int fd) = 0;
+    virtual int Wait(int timeoutMs = -1) = 0;
+    virtual int getEventFd(size_t i) const = 0;
+    virtual uint32_t getEvents(size_t i) const = 0;
+
+    // A connection waiting on listen_fd, -1 with errno EAGAIN if there is none
+    virtual int Accept(int listen_fd, sockaddr_in* addr);
+    // Append what has arrived on fd to buff. Like readv: 0 at end of stream, -1 with *error_code set on error.
+    virtual ssize_t Recv(int fd, Buffer& buff, int* error_code);
+    // Take what fd can take of iov now. Like writev: -1 with *error_code EAGAIN when it can take nothing.
+    virtual ssize_t Send(int fd, const iovec* iov, int iovcnt, int* error_code);
+    // Close a connection's fd, after what Send took of its output is written
+    virtual void Close(int fd);
+
+    // Falls back to epoll when the io_uring backend is not usable on this kernel
+    static std::unique_ptr<Epoller> Create(IoBackend backend, int maxEvent = 1024);
+};
+
+class EpollPoller : public Epoller {
+public:
+    explicit EpollPoller(int maxEvent = 1024);
+    ~EpollPoller() override;
+
+    bool addFd(int fd, uint32_t events) override;
+    bool modFd(int fd, uint32_t events) override;
+    bool delFd(int fd) override;
+    int Wait(int timeoutMs = -1) override;
+    int getEventFd(size_t i) const override;
+    uint32_t getEvents(size_t i) const override;
 
 private:
     // The file descriptor of the epoll instance
@@ -4,6 +4,12 @@
 #include <optional>
 #include <utility>
 
+/**
+ * MPSCQueue - unbounded multi-producer single-consumer queue (Vyukov's intrusive MPSC)
+ *
+ * enqueue is one exchange plus one store and never reads a node another thread may free. dequeue and
+ * dequeue_bulk must not run concurrently with each other.
+ */
 template <typename T>
 class MPSCQueue {
 public:
@@ -20,22 +26,9 @@ public:
 
     void enqueue(T val) {
         Node* new_node = new Node(std::move(val));
-        while (true) {
-            Node* old_tail = tail_.load(std::memory_order_acquire);
-            Node* next = old_tail->next.load(std::memory_order_acquire);
-            if (old_tail == tail_.load(std::memory_order_acquire)) {
-                if (next == nullptr) {
-                    if (old_tail->next.compare_exchange_weak(next, new_node, std::memory_order_release,
-                                                             std::memory_order_relaxed)) {
-                        tail_.compare_exchange_strong(old_tail, new_node, std::memory_order_release,
-                                                      std::memory_order_relaxed);
-                        return;
-                    }
-                } else {
-                    tail_.compare_exchange_strong(old_tail, next, std::memory_order_release, std::memory_order_relaxed);
-                }
-            }
-        }
+        Node* prev = tail_.exchange(new_node, std::memory_order_acq_rel);
+        // Producers only ever touch prev, which the consumer does not free while its next is still unset
+        prev->next.store(new_node, std::memory_order_release);
     }
 
     std::optional<T> dequeue() {
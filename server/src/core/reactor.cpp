@@ -0,0 +1,364 @@
+#include "reactor.h"
+#include <sys/eventfd.h>
+#include <cstring>
+#include "../log/log.h"
+
+Reactor::Reactor(int id, int port, bool reuse_port, int timeout_ms, uint32_t listen_event, uint32_t conn_event,
+                 ThreadPool* thread_pool, ConnectionTable* connections, IoBackend io_backend,
+                 bool run_to_completion)
+    : id_(id), port_(port), reuse_port_(reuse_port), timeout_ms_(timeout_ms), run_to_completion_(run_to_completion),
+      listen_event_(listen_event),
+      conn_event_(conn_event), thread_pool_(thread_pool), timer_(new HeapTimer()),
+      epoller_(Epoller::Create(io_backend)), connections_(connections) {
+    // Initialize timer callback, the timer is only touched by this reactor's thread
+    timer_->SetCallBack([this](int fd) {
+        if (TcpConnection* client = connections_->Get(fd)) {
+            CloseConn_(client);
+        }
+    });
+}
+
+Reactor::~Reactor() {
+    if (listen_fd_ >= 0) close(listen_fd_);
+    if (wakeup_fd_ >= 0) close(wakeup_fd_);
+}
+
+bool Reactor::Init() {
+    wakeup_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd_ < 0 || !epoller_->addFd(wakeup_fd_, EPOLLIN)) {
+        LOG_ERROR("Reactor[{}] create wakeup fd error!", id_);
+        return false;
+    }
+    return InitSocket_();
+}
+
+void Reactor::Stop() {
+    is_close_ = true;
+    if (wakeup_fd_ >= 0) {
+        uint64_t one = 1;
+        ssize_t ret = write(wakeup_fd_, &one, sizeof(one));
+        (void)ret;
+    }
+}
+
+void Reactor::Loop() {
+    int time_ms = -1;
+    loop_thread_ = std::this_thread::get_id();
+    LOG_INFO("Reactor[{}] loop start{}", id_, run_to_completion_ ? " (run-to-completion)" : "");
+    while (!is_close_) {
+        if (timeout_ms_ > 0) {
+            time_ms = timer_->GetNextTick();
+        }
+        int event_cnt = epoller_->Wait(time_ms);
+        for (int i = 0; i < event_cnt; i++) {
+            int fd = epoller_->getEventFd(i);
+            uint32_t events = epoller_->getEvents(i);
+            // If the file descriptor is the listen socket, deal with the new connection
+            if (fd == listen_fd_) {
+                DealListen_();
+                continue;
+            }
+            // Stop() was called from another thread or a signal handler
+            if (fd == wakeup_fd_) {
+                DealWakeup_();
+                continue;
+            }
+            TcpConnection* client = connections_->Get(fd);
+            // The connection was closed by a worker after the event was reported
+            if (!client) {
+                continue;
+            }
+            // If the file descriptor is an error, close the connection
+            if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                CloseConn_(client);
+            }
+            // If the file descriptor is readable, deal with the read event
+            else if (events & EPOLLIN) {
+                DealRead_(client);
+            }
+            // If the file descriptor is writable, deal with the write event
+            else if (events & EPOLLOUT) {
+                DealWrite_(client);
+            } else {
+                LOG_ERROR("Unexpected event");
+            }
+        }
+    }
+    LOG_INFO("Reactor[{}] loop stop", id_);
+}
+
+void Reactor::DealWakeup_() {
+    uint64_t cnt = 0;
+    ssize_t ret = read(wakeup_fd_, &cnt, sizeof(cnt));
+    (void)ret;
+}
+
+void Reactor::SendError_(int fd, const char* info) {
+    assert(fd > 0);
+    int ret = send(fd, info, strlen(info), 0);
+    if (ret < 0) {
+        LOG_WARN("send error to client[{}] error!", fd);
+    }
+    // The backend may have taken the fd on in Accept
+    epoller_->Close(fd);
+}
+
+void Reactor::CloseConn_(TcpConnection* client) {
+    assert(client);
+    LOG_INFO("Client[{}] quit!", client->get_fd());
+    epoller_->delFd(client->get_fd());
+    client->close_conn();
+}
+
+void Reactor::AddClient_(int fd, sockaddr_in addr) {
+    assert(fd > 0);
+    // Reuses the slot (and its buffers) left by the previous connection on this fd
+    TcpConnection* conn_ptr = connections_->Acquire(fd);
+    if (!conn_ptr) {
+        SendError_(fd, "Server busy!");
+        LOG_WARN("Client fd[{}] exceeds the connection table", fd);
+        return;
+    }
+    conn_ptr->init(fd, addr, epoller_.get());
+    if (timeout_ms_ > 0) {
+        timer_->Add(fd, timeout_ms_);
+    }
+    if (epoller_->addFd(fd, EPOLLIN | conn_event_)) {
+        conn_ptr->UpdateEvents(EPOLLIN | conn_event_);
+    }
+    SetFdNonblock(fd);
+    LOG_INFO("Client[{}] in! reactor:{}", conn_ptr->get_fd(), id_);
+}
+
+void Reactor::DealListen_() {
+    struct sockaddr_in addr;
+    // In ET mode, the loop is used to accept all incoming connections
+    do {
+        // io_uring has them accepted already
+        int fd = epoller_->Accept(listen_fd_, &addr);
+        if (fd <= 0) {
+            return;
+        } else if (TcpConnection::user_count >= connections_->max_fd()) {
+            SendError_(fd, "Server busy!");
+            LOG_WARN("Clients is full!");
+            return;
+        }
+        AddClient_(fd, addr);
+    } while (listen_event_ & EPOLLET);
+}
+
+void Reactor::DealRead_(TcpConnection* client) {
+    assert(client);
+    ExtendTime_(client);
+    if (run_to_completion_) {
+        OnReadInline_(client);
+        return;
+    }
+    thread_pool_->AddTask([this, client, generation = client->generation()]() {
+        // Dropped if the connection closed and its slot was reused by a new client meanwhile
+        if (client->is_current(generation)) {
+            OnRead_(client);
+        }
+    });
+}
+
+void Reactor::DealWrite_(TcpConnection* client) {
+    assert(client);
+    ExtendTime_(client);
+    // Writes are non-blocking sends, no need for a thread hop
+    if (run_to_completion_) {
+        OnWrite_(client);
+        return;
+    }
+    thread_pool_->AddTask([this, client, generation = client->generation()]() {
+        if (client->is_current(generation)) {
+            OnWrite_(client);
+        }
+    });
+}
+
+void Reactor::ExtendTime_(TcpConnection* client) {
+    assert(client);
+    if (timeout_ms_ > 0) {
+        timer_->Adjust(client->get_fd(), timeout_ms_);
+    }
+}
+
+void Reactor::OnRead_(TcpConnection* client) {
+    assert(client);
+    int ret = -1;
+    int readErrno = 0;
+    ret = client->read(&readErrno);
+    if (ret <= 0 && readErrno != EAGAIN) {
+        CloseConn_(client);
+        return;
+    }
+    OnProcess_(client);
+}
+
+// Resolve the request data
+void Reactor::OnProcess_(TcpConnection* client) {
+    ProcessResult result = client->process();
+    if (result == ProcessResult::PARKED) {
+        // A coroutine handler is waiting on the database, it arms EPOLLOUT itself when done
+        return;
+    }
+    if (result == ProcessResult::WRITE) {
+        // If the parsing succeeds, modify the event to EPOLLOUT(write)
+        uint32_t events = conn_event_ | EPOLLOUT;
+        epoller_->modFd(client->get_fd(), events);
+        client->UpdateEvents(events);
+    } else {
+        // If the parsing fails, modify the event to EPOLLIN(read)
+        uint32_t events = conn_event_ | EPOLLIN;
+        epoller_->modFd(client->get_fd(), events);
+        client->UpdateEvents(events);
+    }
+}
+
+void Reactor::OnReadInline_(TcpConnection* client) {
+    assert(client);
+    int readErrno = 0;
+    ssize_t ret = client->read(&readErrno);
+    if (ret <= 0 && readErrno != EAGAIN) {
+        CloseConn_(client);
+        return;
+    }
+    OnProcessInline_(client);
+}
+
+void Reactor::OnProcessInline_(TcpConnection* client) {
+    bool offload = false;
+    ProcessResult result = client->process_inline(&offload);
+    if (offload) {
+        // A BLOCKING command is next, the worker finishes the buffer and answers everything in order
+        thread_pool_->AddTask([this, client, generation = client->generation()]() {
+            if (client->is_current(generation)) {
+                OnProcess_(client);
+            }
+        });
+        return;
+    }
+    if (result == ProcessResult::PARKED) {
+        // The acks wait for the WAL group commit, which arms EPOLLOUT
+        return;
+    }
+    if (result == ProcessResult::WRITE) {
+        // Try the write right away instead of waiting for EPOLLOUT
+        OnWrite_(client);
+        return;
+    }
+    uint32_t events = conn_event_ | EPOLLIN;
+    epoller_->modFd(client->get_fd(), events);
+    client->UpdateEvents(events);
+}
+
+void Reactor::OnWrite_(TcpConnection* client) {
+    assert(client);
+    int ret = -1;
+    int writeErrno = 0;
+    ret = client->write(&writeErrno);
+    if (ret < 0 && writeErrno == EINPROGRESS) {
+        // Parked, the event is dropped and the fd stays disarmed until complete_async
+        return;
+    }
+    if (client->to_write_bytes() == 0) {
+        // Write completely
+        if (client->is_keep_alive()) {
+            // Pipelined requests left over by the per-read budget, no new EPOLLIN would report them in ET mode
+            if (client->has_pending_request()) {
+                if (run_to_completion_ && std::this_thread::get_id() == loop_thread_) {
+                    OnProcessInline_(client);
+                } else {
+                    OnProcess_(client);
+                }
+                return;
+            }
+            // If the connection is persistent, modify the event to EPOLLIN
+            uint32_t events = conn_event_ | EPOLLIN;
+            epoller_->modFd(client->get_fd(), events);
+            client->UpdateEvents(events);
+            return;
+        }
+    } else if (ret < 0) {
+        // The buffer is full
+        if (writeErrno == EAGAIN) {
+            uint32_t events = conn_event_ | EPOLLOUT;
+            epoller_->modFd(client->get_fd(), events);
+            client->UpdateEvents(events);
+            return;
+        }
+    }
+    CloseConn_(client);
+}
+
+bool Reactor::InitSocket_() {
+    int ret;
+    struct sockaddr_in addr;
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port_);
+
+    // Create a socket
+    listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd_ < 0) {
+        LOG_ERROR("Create socket error! port:{}", port_);
+        return false;
+    }
+
+    // Set the socket to reuse the address
+    int optval = 1;
+    ret = setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    if (ret == -1) {
+        LOG_ERROR("Set socket error!");
+        close(listen_fd_);
+        listen_fd_ = -1;
+        return false;
+    }
+
+    // Every reactor binds its own listen socket, the kernel load-balances new connections between them
+    if (reuse_port_) {
+        ret = setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval));
+        if (ret == -1) {
+            LOG_ERROR("Set SO_REUSEPORT error!");
+            close(listen_fd_);
+            listen_fd_ = -1;
+            return false;
+        }
+    }
+
+    // Bind the socket to the address
+    ret = bind(listen_fd_, (struct sockaddr*)&addr, sizeof(addr));
+    if (ret < 0) {
+        LOG_ERROR("Bind Port:{} error!", port_);
+        close(listen_fd_);
+        listen_fd_ = -1;
+        return false;
+    }
+
+    // Start listening
+    ret = listen(listen_fd_, 8);
+    if (ret < 0) {
+        LOG_ERROR("Listen port:{} error!", port_);
+        close(listen_fd_);
+        listen_fd_ = -1;
+        return false;
+    }
+
+    // Add the listen socket to the epoll
+    ret = epoller_->addFd(listen_fd_, EPOLLIN | listen_event_);
+    if (ret == 0) {
+        LOG_ERROR("Add listen error!");
+        close(listen_fd_);
+        listen_fd_ = -1;
+        return false;
+    }
+    SetFdNonblock(listen_fd_);
+    LOG_INFO("Reactor[{}] listen port:{}", id_, port_);
+    return true;
+}
+
+int Reactor::SetFdNonblock(int fd) {
+    assert(fd > 0);
+    return fcntl(fd, F_SETFL, fcntl(fd, F_GETFD, 0) | O_NONBLOCK);
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include "../pool/threadpool.h"
+#include "../timer/heaptimer.h"
+#include "connection_table.h"
+#include "epoller.h"
+#include "tcp_connection.h"
+
+/**
+ * Reactor - One event loop ("one loop per thread")
+ *
+ * Each reactor owns its own Epoller, HeapTimer, listen socket and the connections it accepted.
+ * With more than one reactor every listen socket is bound with SO_REUSEPORT, so the kernel
+ * spreads incoming connections across the reactors and no accept/event state is shared.
+ * Reads, writes and request processing are still handed to the shared ThreadPool; the connection
+ * objects live in a ConnectionTable shared by all reactors.
+ *
+ * In run-to-completion mode the reactor reads, handles and writes INLINE commands itself and only
+ * hands connections with a BLOCKING command (see ClassifyCommand) to the ThreadPool.
+ */
+class Reactor {
+public:
+    Reactor(int id, int port, bool reuse_port, int timeout_ms, uint32_t listen_event, uint32_t conn_event,
+            ThreadPool* thread_pool, ConnectionTable* connections, IoBackend io_backend = IoBackend::EPOLL,
+            bool run_to_completion = false);
+    ~Reactor();
+
+    Reactor(const Reactor&) = delete;
+    Reactor& operator=(const Reactor&) = delete;
+
+    bool Init();
+    void Loop();
+    // Async-signal-safe: only flips a flag and writes to the wakeup eventfd
+    void Stop();
+
+    int id() const { return id_; }
+
+private:
+    bool InitSocket_();
+    void AddClient_(int fd, sockaddr_in addr);
+
+    void DealListen_();
+    void DealWrite_(TcpConnection* client);
+    void DealRead_(TcpConnection* client);
+    void DealWakeup_();
+
+    void SendError_(int fd, const char* info);
+    void ExtendTime_(TcpConnection* client);
+    void CloseConn_(TcpConnection* client);
+
+    void OnRead_(TcpConnection* client);
+    void OnWrite_(TcpConnection* client);
+    void OnProcess_(TcpConnection* client);
+    // Run-to-completion counterparts, only called on the reactor thread
+    void OnReadInline_(TcpConnection* client);
+    void OnProcessInline_(TcpConnection* client);
+
+    static int SetFdNonblock(int fd);
+
+    int id_;
+    int port_;
+    bool reuse_port_;
+    int timeout_ms_;
+    bool run_to_completion_;
+    std::thread::id loop_thread_;
+    std::atomic<bool> is_close_{false};
+    int listen_fd_{-1};
+    int wakeup_fd_{-1};
+
+    uint32_t listen_event_;
+    uint32_t conn_event_;
+
+    ThreadPool* thread_pool_;
+    std::unique_ptr<HeapTimer> timer_;
+    std::unique_ptr<Epoller> epoller_;
+    // Shared by all reactors, owned by Webserver
+    ConnectionTable* connections_;
+};
@@ -2,10 +2,12 @@
 #include <errno.h>
 #include <unistd.h>
 #include <unordered_set>
+#include <utility>
 #include "../service/push_service.h"
 #include "epoller.h"
 #include "handler/http_handler.h"
 #include "handler/protobuf_handler.h"
+#include "utils/metrics.h"
 
 std::atomic<int> TcpConnection::user_count{0};
 bool TcpConnection::is_et = false;
@@ -13,42 +15,70 @@ const char* TcpConnection::src_dir = "";
 AuthService* TcpConnection::auth_service = nullptr;
 FriendService* TcpConnection::friend_service = nullptr;
 PushService* TcpConnection::push_service = nullptr;
-Epoller* TcpConnection::epoller_ = nullptr;
 MsgService* TcpConnection::msg_service = nullptr;
 ThreadPool* TcpConnection::thread_pool = nullptr;
+ThreadPool* TcpConnection::db_pool = nullptr;
 
-TcpConnection::~TcpConnection() { close_conn(); }
+TcpConnection::~TcpConnection() {
+    // The reactors and their epollers go first at shutdown
+    epoller_ = nullptr;
+    close_conn();
+}
 
-void TcpConnection::init(int socket_fd, const sockaddr_in& addr) {
+void TcpConnection::init(int socket_fd, const sockaddr_in& addr, Epoller* epoller) {
     assert(socket_fd > 0);
     user_count++;
-    addr_ = addr;
-    fd_ = socket_fd;
     {
+        // The object may be recycled from a previous connection on the same fd, the buffers keep their capacity.
+        // Reset everything under conn_mutex_, a worker of the old connection may still be inside process().
         std::lock_guard<std::mutex> lock(conn_mutex_);
+        addr_ = addr;
+        fd_ = socket_fd;
+        epoller_ = epoller;
         write_buff_.retrieve_all();
         read_buff_.retrieve_all();
+        while (outgoing_queue_.dequeue().has_value());
+        parked_ = false;
+        streaming_ = false;
+        on_drained_ = nullptr;
+        protocol_determined_ = false;
+        conn_type_ = ConnType::HTTP;
+        handler_.reset();
+        iov_cnt_ = 0;
+        user_id_ = 0;
+        events_ = 0;
+        generation_++;
+        is_close_ = false;
     }
-    is_close_ = false;
-    protocol_determined_ = false;
-    handler_.reset();
-    iov_cnt_ = 0;
-    user_id_ = 0;
-    events_ = 0;
     LOG_INFO("Client[{}]({}:{}) in, user_count:{}", fd_, get_ip(), get_port(), (int)user_count);
 }
 
 void TcpConnection::close_conn() {
-    if (!is_close_) {
-        is_close_ = true;
+    // The reactor (timeout) and a worker (read error) may race to close the same connection
+    if (!is_close_.exchange(true)) {
         user_count--;
 
         if (user_id_ != 0 && push_service) {
             push_service->remove_client(user_id_);
         }
 
-        close(fd_);
+        if (epoller_) {
+            epoller_->Close(fd_);
+        } else {
+            close(fd_);
+        }
         LOG_INFO("Client[{}]({}:{}) quit, user_count:{}", fd_, get_ip(), get_port(), (int)user_count);
+
+        // A streamed response waiting for the socket gives up
+        std::function<void(bool)> on_drained;
+        {
+            std::lock_guard<std::mutex> lock(conn_mutex_);
+            on_drained = std::move(on_drained_);
+            on_drained_ = nullptr;
+        }
+        if (on_drained) {
+            on_drained(false);
+        }
     }
 }
 
@@ -67,8 +97,50 @@ static bool is_http_request(const char* data, size_t len) {
     return methods.find(std::string(data, 4)) != methods.end();
 }
 
-bool TcpConnection::process() {
+ProcessResult TcpConnection::process() {
+    std::lock_guard<std::mutex> lock(conn_mutex_);
+    if (parked_) {
+        // A read event took the place of the EPOLLOUT that stream_async armed, arm it again
+        return streaming_ ? ProcessResult::WRITE : ProcessResult::PARKED;
+    }
+    if (!determine_protocol()) {
+        return ProcessResult::READ;
+    }
+
+    bool has_response = handler_ && handler_->Process(read_buff_, write_buff_);
+    // Decided under conn_mutex_, so complete_async cannot re-arm before the reactor knows to stay away
+    if (parked_) {
+        return ProcessResult::PARKED;
+    }
+    if (has_response) {
+        // Setup iov for HTTP file sending
+        if (conn_type_ == ConnType::HTTP) {
+            setup_iov_for_http();
+        }
+        return ProcessResult::WRITE;
+    }
+    return ProcessResult::READ;
+}
+
+ProcessResult TcpConnection::process_inline(bool* offload) {
     std::lock_guard<std::mutex> lock(conn_mutex_);
+    *offload = false;
+    if (parked_) {
+        // process() on the worker reports PARKED and leaves the events alone
+        *offload = true;
+        return ProcessResult::READ;
+    }
+    if (!determine_protocol()) {
+        return ProcessResult::READ;
+    }
+    bool has_response = handler_ && handler_->ProcessInline(read_buff_, write_buff_, offload);
+    if (parked_) {
+        return ProcessResult::PARKED;
+    }
+    return has_response && !*offload ? ProcessResult::WRITE : ProcessResult::READ;
+}
+
+bool TcpConnection::determine_protocol() {
     if (!protocol_determined_) {
         if (read_buff_.readable_bytes() == 0) {
             return false;
@@ -77,25 +149,23 @@ bool TcpConnection::process() {
         const char* data = read_buff_.peek();
         auto len = read_buff_.readable_bytes();
         if (is_http_request(data, len)) {
-            handler_ = std::make_unique<HttpHandler>();
+            handler_ = std::make_shared<HttpHandler>(Metrics::Instance()->ServesPeer(addr_));
             conn_type_ = ConnType::HTTP;
             LOG_INFO("Protocol determined: HTTP");
         } else {
-            handler_ = std::make_unique<ProtobufHandler>(this, auth_service, friend_service, msg_service, thread_pool);
+            handler_ = std::make_shared<ProtobufHandler>(this, auth_service, friend_service, msg_service, thread_pool,
+                                                         db_pool);
             conn_type_ = ConnType::PROTOBUF;
             LOG_INFO("Protocol determined: Protobuf");
         }
         protocol_determined_ = true;
     }
+    return true;
+}
 
-    if (handler_ && handler_->Process(read_buff_, write_buff_)) {
-        // Setup iov for HTTP file sending
-        if (conn_type_ == ConnType::HTTP) {
-            setup_iov_for_http();
-        }
-        return true;
-    }
-    return false;
+bool TcpConnection::has_pending_request() {
+    std::lock_guard<std::mutex> lock(conn_mutex_);
+    return !parked_ && handler_ && handler_->HasPendingRequest(read_buff_);
 }
 
 void TcpConnection::setup_iov_for_http() {
@@ -137,7 +207,8 @@ ssize_t TcpConnection::read(int* error_code) {
     std::lock_guard<std::mutex> lock(conn_mutex_);
     ssize_t len = -1;
     do {
-        len = read_buff_.read_fd(fd_, error_code);
+        // Through the backend, io_uring has it received already
+        len = epoller_ ? epoller_->Recv(fd_, read_buff_, error_code) : read_buff_.read_fd(fd_, error_code);
         if (len <= 0) {
             break;
         }
@@ -148,16 +219,20 @@ ssize_t TcpConnection::read(int* error_code) {
 ssize_t TcpConnection::write(int* error_code) {
     std::lock_guard<std::mutex> lock(conn_mutex_);
     ssize_t len = -1;
+    if (parked_ && !streaming_) {
+        // Woken by a push (notify_writable), complete_async arms EPOLLOUT again when the responses may go
+        *error_code = EINPROGRESS;
+        return len;
+    }
 
     // Flush queued push messages into write buffer before sending
     flush_pending_to_buffer();
 
-    // Use writev for HTTP to support zero-copy file sending
+    // Header and file in one writev (io_uring copies them into its send queue)
     if (conn_type_ == ConnType::HTTP && iov_cnt_ > 0) {
         while (true) {
-            len = writev(fd_, iov_, iov_cnt_);
+            len = send_(iov_, iov_cnt_, error_code);
             if (len <= 0) {
-                *error_code = errno;
                 break;
             }
 
@@ -185,10 +260,12 @@ ssize_t TcpConnection::write(int* error_code) {
         }
     } else {
         while (write_buff_.readable_bytes() > 0) {
-            len = write_buff_.write_fd(fd_, error_code);
+            struct iovec iov = write_buff_.ToIovec();
+            len = send_(&iov, 1, error_code);
             if (len <= 0) {
                 break;
             }
+            write_buff_.retrieve(len);
             // In ET mode, we must write until EAGAIN or empty
             // In LT mode, we stop after one write or continue if data is large to reduce events
             if (!is_et && write_buff_.readable_bytes() < 10240) {
@@ -196,6 +273,29 @@ ssize_t TcpConnection::write(int* error_code) {
             }
         }
     }
+    if (parked_) {
+        // Streaming: let the handler append more once most is out, the fd stays disarmed when all is
+        if (on_drained_ && write_buff_.readable_bytes() <= kStreamBufferBytes) {
+            std::exchange(on_drained_, nullptr)(true);
+        }
+        if (write_buff_.readable_bytes() == 0) {
+            streaming_ = false;
+            *error_code = EINPROGRESS;
+            return -1;
+        }
+    }
+    return len;
+}
+
+ssize_t TcpConnection::send_(const iovec* iov, int iovcnt, int* error_code) {
+    // Through the backend, io_uring copies it and sends with the next loop iteration
+    if (epoller_) {
+        return epoller_->Send(fd_, iov, iovcnt, error_code);
+    }
+    ssize_t len = writev(fd_, iov, iovcnt);
+    if (len < 0) {
+        *error_code = errno;
+    }
     return len;
 }
 
@@ -209,6 +309,20 @@ void TcpConnection::enqueue_message(std::string data) {
     notify_writable();
 }
 
+bool TcpConnection::is_current(uint64_t generation) {
+    std::lock_guard<std::mutex> lock(conn_mutex_);
+    return !is_closed() && generation_ == generation;
+}
+
+bool TcpConnection::deliver(uint64_t generation, std::string data) {
+    std::lock_guard<std::mutex> lock(conn_mutex_);
+    if (is_closed() || generation_ != generation) {
+        return false;
+    }
+    enqueue_message(std::move(data));
+    return true;
+}
+
 bool TcpConnection::flush_pending_to_buffer() {
     bool has_data = false;
 
@@ -230,3 +344,13 @@ void TcpConnection::notify_writable() {
         events_ = events;
     }
 }
+
+void TcpConnection::arm_writable_() {
+    uint32_t events = EPOLLOUT | EPOLLRDHUP | EPOLLONESHOT;
+    if (!epoller_) return;
+    if (is_et) events |= EPOLLET;
+
+    if (epoller_->modFd(fd_, events)) {
+        events_ = events;
+    }
+}
@@ -4,6 +4,7 @@
 #include <sys/uio.h>
 #include <atomic>
 #include <cstdint>
+#include <functional>
 #include <memory>
 #include <mutex>
 #include "../buffer/buffer.h"
@@ -25,6 +26,14 @@ public:
 
     virtual bool Process(Buffer& read_buff, Buffer& write_buff) = 0;
     virtual bool IsKeepAlive() const { return false; }
+    // Run-to-completion variant called on the reactor thread, handles only what cannot block and sets
+    // *offload when the rest must go to the thread pool. By default everything is offloaded.
+    virtual bool ProcessInline(Buffer& read_buff, Buffer& write_buff, bool* offload) {
+        *offload = true;
+        return false;
+    }
+    // Whether read_buff still holds a complete request that Process left for later
+    virtual bool HasPendingRequest(const Buffer& read_buff) const { return false; }
 };
 
 enum class ConnType {
@@ -32,19 +41,81 @@ enum class ConnType {
     PROTOBUF,
 };
 
+// What the reactor should wait for after TcpConnection::process
+enum class ProcessResult {
+    READ,    // Nothing to send, wait for more input
+    WRITE,   // Responses are buffered
+    PARKED,  // A coroutine handler (or the WAL) owns the connection and re-arms it in complete_async
+};
+
 class TcpConnection {
 public:
     TcpConnection() = default;
     ~TcpConnection();
 
-    void init(int socket_fd, const sockaddr_in& addr);
+    void init(int socket_fd, const sockaddr_in& addr, Epoller* epoller);
 
     ssize_t read(int* error_code);
+    // Fails with EINPROGRESS while parked: the buffered responses are not released yet
     ssize_t write(int* error_code);
 
     void close_conn();
-
-    bool process();
+    bool is_closed() const { return is_close_.load(std::memory_order_acquire); }
+
+    ProcessResult process();
+    // Reactor thread part of process() in run-to-completion mode, see ProtocolHandler::ProcessInline.
+    // Never WRITE together with *offload.
+    ProcessResult process_inline(bool* offload);
+    // A complete request is still buffered, e.g. pipelined frames beyond the per-read budget
+    bool has_pending_request();
+
+    // Called by a handler from inside Process/ProcessInline (conn_mutex_ held) when it hands the request to a
+    // coroutine or holds its responses back (until the WAL has synced the acks). The connection gets no more
+    // events until complete_async, so later requests stay in order.
+    void park() { parked_ = true; }
+    // Identifies this use of the recycled slot. Caller must hold conn_mutex_ (i.e. be inside Process) or be the
+    // reactor thread, whose init is the only writer.
+    uint64_t generation() const { return generation_; }
+    // The connection is open and still the use identified by generation, i.e. a task posted for it is not stale
+    bool is_current(uint64_t generation);
+
+    // Called by the coroutine when it is done: finish(write_buff) appends the response, then the connection
+    // is armed for EPOLLOUT. Does nothing and returns false if the connection was closed or reused meanwhile.
+    template <typename F>
+    bool complete_async(uint64_t generation, F&& finish) {
+        std::lock_guard<std::mutex> lock(conn_mutex_);
+        if (is_closed() || generation_ != generation) {
+            return false;
+        }
+        finish(write_buff_);
+        parked_ = false;
+        streaming_ = false;
+        arm_writable_();
+        return true;
+    }
+
+    // Part of a response sent while still parked (a streamed sync): finish(write_buff) appends it and the
+    // connection is armed for EPOLLOUT, requests behind it keep waiting for complete_async. When more than
+    // kStreamBufferBytes are left to write, *waiting is set and on_drained(open) runs (under conn_mutex_) once the
+    // socket has taken them, or with open = false when the connection closes first. Returns false without calling
+    // finish if the connection was closed or reused meanwhile.
+    template <typename F>
+    bool stream_async(uint64_t generation, F&& finish, std::function<void(bool open)> on_drained, bool* waiting) {
+        std::lock_guard<std::mutex> lock(conn_mutex_);
+        *waiting = false;
+        if (is_closed() || generation_ != generation) {
+            return false;
+        }
+        finish(write_buff_);
+        if (write_buff_.readable_bytes() > kStreamBufferBytes) {
+            on_drained_ = std::move(on_drained);
+            *waiting = true;
+        }
+        streaming_ = true;
+        arm_writable_();
+        return true;
+    }
+    static constexpr size_t kStreamBufferBytes = 256 * 1024;
 
     bool is_keep_alive() const;
     ConnType get_type() const;
@@ -66,6 +137,9 @@ public:
 
     // Message queue for push service
     void enqueue_message(std::string data);
+    // enqueue_message for a response sent after its request has left Process (e.g. an ack on persist). Does
+    // nothing and returns false if the connection was closed or reused meanwhile.
+    bool deliver(uint64_t generation, std::string data);
     bool flush_pending_to_buffer();
     bool has_pending_messages() const { return !outgoing_queue_.empty(); }
 
@@ -80,19 +154,24 @@ public:
     static FriendService* friend_service;
     static PushService* push_service;
     static MsgService* msg_service;
-    static Epoller* epoller_;
     static ThreadPool* thread_pool;
+    // Runs blocking MySQL calls for coroutine handlers, nullptr keeps the handlers synchronous
+    static ThreadPool* db_pool;
 
 protected:
     int fd_{-1};
     // Store the network address info of the client
     struct sockaddr_in addr_ {};
-    bool is_close_{true};
+    // Read by the reactor while a worker may be closing the connection
+    std::atomic<bool> is_close_{true};
+    // The epoller of the reactor that owns this connection
+    Epoller* epoller_{nullptr};
 
     std::mutex conn_mutex_;
     Buffer read_buff_;
     Buffer write_buff_;
-    std::unique_ptr<ProtocolHandler> handler_;
+    // Shared so a suspended coroutine can keep the handler alive past a close
+    std::shared_ptr<ProtocolHandler> handler_;
 
     // iovec for zero-copy file sending (used by HTTP)
     struct iovec iov_[2]{};
@@ -104,9 +183,20 @@ protected:
     MPSCQueue<std::string> outgoing_queue_;
 
 private:
+    // Pick the handler from the first bytes, caller must hold conn_mutex_
+    bool determine_protocol();
     void setup_iov_for_http();
     void notify_writable();
+    void arm_writable_();
+    // writev through epoller_, caller must hold conn_mutex_
+    ssize_t send_(const iovec* iov, int iovcnt, int* error_code);
 
     uint64_t user_id_{0};
+    // All guarded by conn_mutex_
+    bool parked_{false};
+    uint64_t generation_{0};
+    // Parked with stream_async output still to write, and who waits for it to drain
+    bool streaming_{false};
+    std::function<void(bool open)> on_drained_;
     std::atomic<uint32_t> events_{0};
 };
@@ -0,0 +1,758 @@
+#include "uring_poller.h"
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include "../log/log.h"
+
+namespace {
+int uring_setup(unsigned entries, io_uring_params* p) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+}
+
+int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, const void* arg, size_t arg_size) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size));
+}
+
+int uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args) {
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+unsigned load_acquire(unsigned* p) { return std::atomic_ref<unsigned>(*p).load(std::memory_order_acquire); }
+void store_release(unsigned* p, unsigned v) { std::atomic_ref<unsigned>(*p).store(v, std::memory_order_release); }
+
+// Strip the epoll-only flags, the remaining bits share their values with poll(2)
+uint32_t to_poll_mask(uint32_t events) { return events & ~(EPOLLET | EPOLLONESHOT); }
+
+// 24 bits of generation, a completion that old is long gone
+constexpr uint32_t kGenMask = 0xffffff;
+
+template <typename Op>
+uint64_t make_user_data(Op op, int fd, uint32_t gen) {
+    return (static_cast<uint64_t>(op) << 56) | (static_cast<uint64_t>(gen & kGenMask) << 32) |
+           static_cast<uint32_t>(fd);
+}
+
+// Multishot recv came with 6.0, provided buffer rings with 5.19
+bool kernel_has_multishot_recv() {
+    utsname name;
+    int major = 0, minor = 0;
+    return uname(&name) == 0 && sscanf(name.release, "%d.%d", &major, &minor) == 2 && major >= 6;
+}
+}  // namespace
+
+UringPoller::UringPoller(int maxEvent, bool sqpoll, bool completions) : fds_(kMaxFd), events_(maxEvent) {
+    assert(events_.size() > 0);
+    // Leave room for the rearms, sends and removals queued during one loop iteration
+    unsigned entries = 1;
+    while (entries < static_cast<unsigned>(maxEvent) * 2) entries <<= 1;
+    if (!Setup_(entries, sqpoll) && sqpoll) {
+        // SQPOLL may be refused (old kernel, missing privileges), plain io_uring still beats nothing
+        Setup_(entries, false);
+    }
+    if (IsValid() && completions && kernel_has_multishot_recv()) {
+        completions_ = SetupBufferRing_();
+    }
+}
+
+UringPoller::~UringPoller() {
+    Teardown_();
+    for (int fd : accepted_) {
+        close(fd);
+    }
+}
+
+bool UringPoller::Setup_(unsigned entries, bool sqpoll) {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    // Each fd has at most one armed poll plus one pending removal
+    p.cq_entries = entries * 4;
+    if (sqpoll) {
+        p.flags |= IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = 2000;
+    }
+
+    int fd = uring_setup(entries, &p);
+    if (fd < 0) {
+        return false;
+    }
+    // EXT_ARG is needed for the Wait timeout, NODROP keeps completions when the CQ ring overflows
+    if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP)) {
+        close(fd);
+        return false;
+    }
+    ring_fd_ = fd;
+    sqpoll_ = sqpoll;
+
+    sq_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+    }
+
+    sq_ptr_ = mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+    if (sq_ptr_ == MAP_FAILED) {
+        sq_ptr_ = nullptr;
+        Teardown_();
+        return false;
+    }
+    if (single_mmap) {
+        cq_ptr_ = sq_ptr_;
+    } else {
+        cq_ptr_ =
+            mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+        if (cq_ptr_ == MAP_FAILED) {
+            cq_ptr_ = nullptr;
+            Teardown_();
+            return false;
+        }
+    }
+    sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+    void* sqes =
+        mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        Teardown_();
+        return false;
+    }
+    sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+    auto* sq = static_cast<char*>(sq_ptr_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    sq_flags_ = reinterpret_cast<unsigned*>(sq + p.sq_off.flags);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    sq_entries_ = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_entries);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    sqe_tail_ = *sq_tail_;
+
+    auto* cq = static_cast<char*>(cq_ptr_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+    return true;
+}
+
+bool UringPoller::SetupBufferRing_() {
+    buf_ring_size_ = kRecvBuffers * sizeof(io_uring_buf);
+    void* ring = mmap(nullptr, buf_ring_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        return false;
+    }
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+    reg.ring_entries = kRecvBuffers;
+    reg.bgid = kBufferGroup;
+    if (uring_register(ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(ring, buf_ring_size_);
+        return false;
+    }
+    buf_ring_ = static_cast<io_uring_buf_ring*>(ring);
+    recv_buffers_.resize(kRecvBuffers * kRecvBufferSize);
+    for (unsigned bid = 0; bid < kRecvBuffers; bid++) {
+        ReturnBuffer_(static_cast<uint16_t>(bid));
+    }
+    std::atomic_ref<uint16_t>(buf_ring_->tail).store(buf_tail_, std::memory_order_release);
+    return true;
+}
+
+void UringPoller::Teardown_() {
+    if (sqes_) munmap(sqes_, sqes_size_);
+    if (cq_ptr_ && cq_ptr_ != sq_ptr_) munmap(cq_ptr_, cq_size_);
+    if (sq_ptr_) munmap(sq_ptr_, sq_size_);
+    if (ring_fd_ >= 0) close(ring_fd_);
+    // Closing the ring ends its requests, the buffers are no longer written to
+    if (buf_ring_) munmap(buf_ring_, buf_ring_size_);
+    sqes_ = nullptr;
+    cq_ptr_ = sq_ptr_ = nullptr;
+    buf_ring_ = nullptr;
+    ring_fd_ = -1;
+}
+
+unsigned UringPoller::PendingSqes_() const { return sqe_tail_ - load_acquire(sq_head_); }
+
+int UringPoller::Submit_(unsigned min_complete, unsigned flags, const void* arg, size_t arg_size) {
+    store_release(sq_tail_, sqe_tail_);
+    unsigned to_submit = PendingSqes_();
+    if (sqpoll_) {
+        // The kernel thread consumes the SQ ring by itself, it only needs a kick after going idle
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (load_acquire(sq_flags_) & IORING_SQ_NEED_WAKEUP) {
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        }
+        to_submit = 0;
+        if (min_complete == 0 && !(flags & IORING_ENTER_SQ_WAKEUP)) {
+            return 0;
+        }
+    } else if (to_submit == 0 && min_complete == 0) {
+        return 0;
+    }
+    return uring_enter(ring_fd_, to_submit, min_complete, flags, arg, arg_size);
+}
+
+io_uring_sqe* UringPoller::GetSqe_() {
+    while (sqe_tail_ - load_acquire(sq_head_) >= sq_entries_) {
+        // SQ ring is full, hand what we have to the kernel to make room
+        if (sqpoll_) {
+            store_release(sq_tail_, sqe_tail_);
+            uring_enter(ring_fd_, 0, 0, IORING_ENTER_SQ_WAKEUP | IORING_ENTER_SQ_WAIT, nullptr, 0);
+        } else {
+            Submit_(0, 0, nullptr, 0);
+        }
+    }
+    unsigned idx = sqe_tail_ & sq_mask_;
+    io_uring_sqe* sqe = &sqes_[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array_[idx] = idx;
+    sqe_tail_++;
+    return sqe;
+}
+
+void UringPoller::PrepPollAdd_(int fd, FdState& st) {
+    st.gen++;
+    st.armed = true;
+    st.polled = 0;
+    io_uring_sqe* sqe = GetSqe_();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = to_poll_mask(st.events);
+    sqe->user_data = make_user_data(Op::POLL, fd, st.gen);
+}
+
+void UringPoller::PrepPollRemove_(int fd, const FdState& st) {
+    io_uring_sqe* sqe = GetSqe_();
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = make_user_data(Op::POLL, fd, st.gen);
+    sqe->user_data = kIgnoreData;
+}
+
+void UringPoller::PrepCancel_(uint64_t user_data) {
+    io_uring_sqe* sqe = GetSqe_();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->user_data = kIgnoreData;
+}
+
+void UringPoller::PrepAccept_(int fd, const FdState& st) {
+    io_uring_sqe* sqe = GetSqe_();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = make_user_data(Op::ACCEPT, fd, st.gen);
+}
+
+void UringPoller::PrepRecv_(int fd, ConnIo& io) {
+    io_uring_sqe* sqe = GetSqe_();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = kBufferGroup;
+    sqe->user_data = make_user_data(Op::RECV, fd, io.gen);
+    io.recv = RecvState::ARMED;
+}
+
+void UringPoller::PrepSend_(int fd, ConnIo& io) {
+    if (io.send_in_flight) return;
+    if (io.sending.empty()) {
+        io.sending.swap(io.output);
+    }
+    if (io.sending.empty()) return;
+    io_uring_sqe* sqe = GetSqe_();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(io.sending.data());
+    sqe->len = static_cast<uint32_t>(io.sending.size());
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = make_user_data(Op::SEND, fd, io.gen);
+    io.send_in_flight = true;
+}
+
+void UringPoller::PrepNop_() {
+    io_uring_sqe* sqe = GetSqe_();
+    sqe->opcode = IORING_OP_NOP;
+    sqe->user_data = kIgnoreData;
+}
+
+bool UringPoller::OnLoopThread_() const {
+    return loop_thread_.load(std::memory_order_relaxed) == std::this_thread::get_id();
+}
+
+void UringPoller::FlushIfRemote_() {
+    // The reactor thread submits its own requests with the next Wait
+    if (!OnLoopThread_()) {
+        Submit_(0, 0, nullptr, 0);
+    }
+}
+
+UringPoller::ConnIo* UringPoller::ActiveConn_(int fd) {
+    if (!completions_ || fd < 0 || fd >= kMaxFd) return nullptr;
+    ConnIo* io = fds_[fd].conn.get();
+    return io && io->active ? io : nullptr;
+}
+
+void UringPoller::ActivateConn_(int fd) {
+    if (fd < 0 || fd >= kMaxFd) return;
+    auto& conn = fds_[fd].conn;
+    if (!conn) {
+        conn = std::make_unique<ConnIo>();
+    }
+    // Close kept the fd number until the previous connection's output was written, only its recv's
+    // completions may still come
+    conn->gen++;
+    conn->active = true;
+    conn->recv = RecvState::IDLE;
+    conn->input.clear();
+    conn->eof = false;
+    conn->error = 0;
+    conn->output.clear();
+    conn->sending.clear();
+}
+
+void UringPoller::Deactivate_(int fd, ConnIo& io) {
+    if (io.recv != RecvState::IDLE) {
+        PrepCancel_(make_user_data(Op::RECV, fd, io.gen));
+    }
+    // The output stays, Close writes it before closing
+    io.active = false;
+    io.recv = RecvState::IDLE;
+    io.input.clear();
+}
+
+void UringPoller::MarkReady_(int fd, FdState& st) {
+    if (!st.in_ready) {
+        st.in_ready = true;
+        ready_.push_back(fd);
+    }
+}
+
+uint32_t UringPoller::Readiness_(int fd, const FdState& st) const {
+    if (fd == accept_fd_) {
+        return accepted_.empty() ? 0 : EPOLLIN;
+    }
+    const ConnIo* io = st.conn.get();
+    if (!io || !io->active) {
+        return st.polled;
+    }
+    uint32_t revents = io->error ? EPOLLERR : 0;
+    if ((st.events & EPOLLIN) && (!io->input.empty() || io->eof)) {
+        revents |= EPOLLIN;
+    }
+    if ((st.events & EPOLLRDHUP) && io->eof && io->input.empty()) {
+        revents |= EPOLLRDHUP;
+    }
+    // Half empty, so a large response does not wake the reactor for every send that completes
+    if ((st.events & EPOLLOUT) && io->output.size() + io->sending.size() <= kSendQueueBytes / 2) {
+        revents |= EPOLLOUT;
+    }
+    return revents;
+}
+
+bool UringPoller::addFd(int fd, uint32_t events) {
+    if (fd < 0 || fd >= kMaxFd) return false;
+    std::lock_guard<std::mutex> lock(mtx_);
+    FdState& st = fds_[fd];
+    st.events = events;
+    if (ConnIo* io = ActiveConn_(fd)) {
+        // Readiness is the connection's own state, nothing to tell the kernel
+        st.armed = true;
+        if (io->recv == RecvState::IDLE && !io->eof && !io->error) {
+            PrepRecv_(fd, *io);
+        }
+        MarkReady_(fd, st);
+        if (!OnLoopThread_() && Readiness_(fd, st)) {
+            // Wake the reactor, it may be waiting for completions
+            PrepNop_();
+        }
+        FlushIfRemote_();
+        return true;
+    }
+    if (fd == accept_fd_) {
+        st.armed = true;
+        return true;
+    }
+    if (st.armed) {
+        PrepPollRemove_(fd, st);
+    }
+    PrepPollAdd_(fd, st);
+    FlushIfRemote_();
+    return true;
+}
+
+bool UringPoller::modFd(int fd, uint32_t events) {
+    // A one-shot poll cannot be modified in place; cancel the armed one (if any) and arm a new generation
+    return addFd(fd, events);
+}
+
+bool UringPoller::delFd(int fd) {
+    if (fd < 0 || fd >= kMaxFd) return false;
+    std::lock_guard<std::mutex> lock(mtx_);
+    FdState& st = fds_[fd];
+    if (ConnIo* io = ActiveConn_(fd)) {
+        Deactivate_(fd, *io);
+    } else if (fd == accept_fd_) {
+        PrepCancel_(make_user_data(Op::ACCEPT, fd, st.gen));
+        accept_fd_ = -1;
+        for (int accepted : accepted_) {
+            close(accepted);
+        }
+        accepted_.clear();
+    } else if (st.armed) {
+        PrepPollRemove_(fd, st);
+    }
+    st.armed = false;
+    st.polled = 0;
+    // Invalidate completions already sitting in the CQ ring
+    st.gen++;
+    FlushIfRemote_();
+    return true;
+}
+
+int UringPoller::Accept(int listen_fd, sockaddr_in* addr) {
+    if (!completions_ || listen_fd < 0 || listen_fd >= kMaxFd) {
+        return Epoller::Accept(listen_fd, addr);
+    }
+    int fd = -1;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        FdState& listen = fds_[listen_fd];
+        if (listen_fd == accept_fd_) {
+            if (accepted_.empty()) {
+                errno = EAGAIN;
+                return -1;
+            }
+            fd = accepted_.front();
+            accepted_.pop_front();
+            // Level-triggered like the poll it replaced
+            if (!accepted_.empty()) {
+                MarkReady_(listen_fd, listen);
+            }
+        } else if (accept_fd_ < 0) {
+            // From now on the ring accepts, this call still takes the connection the poll reported
+            if (listen.armed) {
+                PrepPollRemove_(listen_fd, listen);
+            }
+            listen.gen++;
+            listen.polled = 0;
+            accept_fd_ = listen_fd;
+            PrepAccept_(listen_fd, listen);
+            FlushIfRemote_();
+        }
+    }
+    if (fd >= 0) {
+        socklen_t len = sizeof(*addr);
+        getpeername(fd, reinterpret_cast<sockaddr*>(addr), &len);
+    } else {
+        fd = Epoller::Accept(listen_fd, addr);
+    }
+    if (fd >= 0) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        ActivateConn_(fd);
+    }
+    return fd;
+}
+
+ssize_t UringPoller::Recv(int fd, Buffer& buff, int* error_code) {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (ConnIo* io = ActiveConn_(fd)) {
+            if (!io->input.empty()) {
+                ssize_t len = static_cast<ssize_t>(io->input.size());
+                buff.append(io->input.data(), io->input.size());
+                io->input.clear();
+                // Paused while the input was full
+                if (io->recv == RecvState::IDLE && !io->eof && !io->error) {
+                    PrepRecv_(fd, *io);
+                    FlushIfRemote_();
+                }
+                return len;
+            }
+            if (io->error) {
+                *error_code = io->error;
+                return -1;
+            }
+            if (io->eof) {
+                return 0;
+            }
+            *error_code = EAGAIN;
+            return -1;
+        }
+    }
+    return Epoller::Recv(fd, buff, error_code);
+}
+
+ssize_t UringPoller::Send(int fd, const iovec* iov, int iovcnt, int* error_code) {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (ConnIo* io = ActiveConn_(fd)) {
+            if (io->error) {
+                *error_code = io->error;
+                return -1;
+            }
+            size_t queued = io->output.size() + io->sending.size();
+            if (queued >= kSendQueueBytes) {
+                *error_code = EAGAIN;
+                return -1;
+            }
+            size_t room = kSendQueueBytes - queued;
+            size_t taken = 0;
+            for (int i = 0; i < iovcnt && taken < room; i++) {
+                size_t len = std::min(iov[i].iov_len, room - taken);
+                io->output.append(static_cast<const char*>(iov[i].iov_base), len);
+                taken += len;
+            }
+            PrepSend_(fd, *io);
+            FlushIfRemote_();
+            return static_cast<ssize_t>(taken);
+        }
+        if (completions_ && fd >= 0 && fd < kMaxFd && fds_[fd].conn && fds_[fd].conn->close_after_send) {
+            // Closed, only its last output is still going out
+            *error_code = EPIPE;
+            return -1;
+        }
+    }
+    return Epoller::Send(fd, iov, iovcnt, error_code);
+}
+
+void UringPoller::Close(int fd) {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        ConnIo* io = completions_ && fd >= 0 && fd < kMaxFd ? fds_[fd].conn.get() : nullptr;
+        if (io && io->active) {
+            Deactivate_(fd, *io);
+        }
+        if (io && (io->send_in_flight || (!io->error && !io->output.empty()))) {
+            // Closed by OnSend_ once the output is written: the kernel still writes from sending, and the fd
+            // number must not go to a new connection before
+            io->close_after_send = true;
+            PrepSend_(fd, *io);
+            FlushIfRemote_();
+            return;
+        }
+    }
+    Epoller::Close(fd);
+}
+
+int UringPoller::Wait(int timeoutMs) {
+    loop_thread_.store(std::this_thread::get_id(), std::memory_order_relaxed);
+
+    struct __kernel_timespec ts;
+    io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    if (timeoutMs >= 0) {
+        ts.tv_sec = timeoutMs / 1000;
+        ts.tv_nsec = static_cast<long long>(timeoutMs % 1000) * 1000000;
+        arg.ts = reinterpret_cast<uint64_t>(&ts);
+    }
+
+    while (true) {
+        unsigned to_submit;
+        bool have_ready;
+        {
+            // Only the submission needs the lock, blocking for completions must not stall other threads' modFd
+            std::lock_guard<std::mutex> lock(mtx_);
+            store_release(sq_tail_, sqe_tail_);
+            to_submit = sqpoll_ ? 0 : PendingSqes_();
+            have_ready = !ready_.empty();
+        }
+        unsigned flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        unsigned sq_flags = load_acquire(sq_flags_);
+        if (sqpoll_ && (sq_flags & IORING_SQ_NEED_WAKEUP)) flags |= IORING_ENTER_SQ_WAKEUP;
+
+        // With completions or ready fds already waiting only submit, otherwise submit and block in the same syscall
+        unsigned min_complete = have_ready || load_acquire(cq_head_) != load_acquire(cq_tail_) ? 0 : 1;
+        bool need_enter = min_complete > 0 || to_submit > 0 || (flags & IORING_ENTER_SQ_WAKEUP) ||
+                          (sq_flags & IORING_SQ_CQ_OVERFLOW);
+        if (need_enter && uring_enter(ring_fd_, to_submit, min_complete, flags, &arg, sizeof(arg)) < 0 &&
+            errno != ETIME && errno != EBUSY) {
+            // EINTR is reported like epoll_wait does
+            return -1;
+        }
+
+        bool consumed = false;
+        int n = Harvest_(&consumed);
+        // Completions that were all stale do not count as a wakeup, keep waiting
+        if (n > 0 || !consumed) {
+            return n;
+        }
+    }
+}
+
+void UringPoller::ReturnBuffer_(uint16_t bid) {
+    // Not buf_ring_->bufs: compiled as C++ the header's flexible array sits behind an empty struct, 8 bytes off
+    io_uring_buf* buf = reinterpret_cast<io_uring_buf*>(buf_ring_) + (buf_tail_ & (kRecvBuffers - 1));
+    buf->addr = reinterpret_cast<uint64_t>(recv_buffers_.data() + bid * kRecvBufferSize);
+    buf->len = kRecvBufferSize;
+    buf->bid = bid;
+    buf_tail_++;
+}
+
+void UringPoller::OnRecv_(int fd, uint32_t gen, const io_uring_cqe* cqe) {
+    ConnIo* io = ActiveConn_(fd);
+    bool current = io && (io->gen & kGenMask) == gen;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        uint16_t bid = static_cast<uint16_t>(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        if (current && cqe->res > 0) {
+            io->input.append(recv_buffers_.data() + bid * kRecvBufferSize, cqe->res);
+        }
+        ReturnBuffer_(bid);
+    }
+    if (!current) return;
+
+    if (cqe->res == 0) {
+        io->eof = true;
+    } else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+        io->error = -cqe->res;
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        // Ended: by the peer, an error, the cancel below or the buffers running out (armed again right away)
+        io->recv = RecvState::IDLE;
+        if (!io->eof && !io->error && io->input.size() < kRecvInputBytes) {
+            PrepRecv_(fd, *io);
+        }
+    } else if (io->recv == RecvState::ARMED && io->input.size() >= kRecvInputBytes) {
+        // Recv takes it back up once the input is drained
+        PrepCancel_(make_user_data(Op::RECV, fd, io->gen));
+        io->recv = RecvState::CANCELLING;
+    }
+    MarkReady_(fd, fds_[fd]);
+}
+
+void UringPoller::OnSend_(int fd, int res) {
+    ConnIo* io = fds_[fd].conn.get();
+    if (!io || !io->send_in_flight) return;
+    io->send_in_flight = false;
+    if (res <= 0) {
+        io->error = res < 0 ? -res : EPIPE;
+        io->sending.clear();
+        io->output.clear();
+    } else {
+        io->sending.erase(0, static_cast<size_t>(res));
+        PrepSend_(fd, *io);
+    }
+    if (io->close_after_send && !io->send_in_flight) {
+        io->close_after_send = false;
+        io->sending.clear();
+        io->output.clear();
+        close(fd);
+        return;
+    }
+    if (io->active) {
+        MarkReady_(fd, fds_[fd]);
+    }
+}
+
+void UringPoller::OnAccept_(int fd, uint32_t gen, const io_uring_cqe* cqe) {
+    FdState& st = fds_[fd];
+    bool current = fd == accept_fd_ && (st.gen & kGenMask) == gen;
+    if (cqe->res >= 0) {
+        if (current) {
+            accepted_.push_back(cqe->res);
+            MarkReady_(fd, st);
+        } else {
+            close(cqe->res);
+        }
+    }
+    if (!current || (cqe->flags & IORING_CQE_F_MORE)) return;
+    if (cqe->res < 0) {
+        // Back to polling, the next Accept tries the ring again
+        LOG_WARN("io_uring accept on fd {} failed: {}", fd, strerror(-cqe->res));
+        accept_fd_ = -1;
+        PrepPollAdd_(fd, st);
+    } else {
+        PrepAccept_(fd, st);
+    }
+}
+
+int UringPoller::Harvest_(bool* consumed) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    unsigned head = *cq_head_;
+    unsigned tail = load_acquire(cq_tail_);
+    // Fds queued as ready that turn out not to be count like stale completions
+    *consumed = head != tail || !ready_.empty();
+    uint16_t buf_tail = buf_tail_;
+    while (head != tail) {
+        const io_uring_cqe* cqe = &cqes_[head & cq_mask_];
+        head++;
+        if (cqe->user_data == kIgnoreData) continue;
+
+        int fd = static_cast<int>(static_cast<uint32_t>(cqe->user_data));
+        uint32_t gen = static_cast<uint32_t>(cqe->user_data >> 32) & kGenMask;
+        auto op = static_cast<Op>(cqe->user_data >> 56);
+        if (fd < 0 || fd >= kMaxFd) continue;
+        FdState& st = fds_[fd];
+        switch (op) {
+            case Op::RECV:
+                OnRecv_(fd, gen, cqe);
+                break;
+            case Op::SEND:
+                // The fd number stays with the connection until its sends are done (Close)
+                OnSend_(fd, cqe->res);
+                break;
+            case Op::ACCEPT:
+                OnAccept_(fd, gen, cqe);
+                break;
+            case Op::POLL:
+                // Stale: modified or deleted after it was armed
+                if (!st.armed || (st.gen & kGenMask) != gen) break;
+                st.polled = cqe->res < 0 ? EPOLLERR : static_cast<uint32_t>(cqe->res);
+                MarkReady_(fd, st);
+                break;
+        }
+    }
+    store_release(cq_head_, head);
+    if (buf_tail_ != buf_tail) {
+        std::atomic_ref<uint16_t>(buf_ring_->tail).store(buf_tail_, std::memory_order_release);
+    }
+
+    // Reported in the order they became ready, what does not fit waits for the next Wait
+    int n = 0;
+    size_t i = 0;
+    for (; i < ready_.size() && n < static_cast<int>(events_.size()); i++) {
+        int fd = ready_[i];
+        FdState& st = fds_[fd];
+        st.in_ready = false;
+        uint32_t revents = st.armed ? Readiness_(fd, st) : 0;
+        if (revents == 0) continue;
+
+        events_[n].data.fd = fd;
+        events_[n].events = revents;
+        n++;
+        if (st.polled) {
+            // The poll request is used up
+            st.polled = 0;
+            st.armed = false;
+            if (!(st.events & EPOLLONESHOT)) {
+                PrepPollAdd_(fd, st);
+            }
+        } else if (st.events & EPOLLONESHOT) {
+            st.armed = false;
+        }
+    }
+    ready_.erase(ready_.begin(), ready_.begin() + static_cast<std::ptrdiff_t>(i));
+    return n;
+}
+
+int UringPoller::getEventFd(size_t i) const {
+    assert(i < events_.size());
+    return events_[i].data.fd;
+}
+
+uint32_t UringPoller::getEvents(size_t i) const {
+    assert(i < events_.size());
+    return events_[i].events;
+}
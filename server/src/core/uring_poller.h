@@ -0,0 +1,167 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "epoller.h"
+
+/**
+ * UringPoller - Epoller backed by io_uring
+ *
+ * The connections Accept hands out do their I/O in the ring instead of with syscalls of their own:
+ *  - the listen socket gets a multishot IORING_OP_ACCEPT on its first Accept, later calls take the connections
+ *    it has completed;
+ *  - every connection has a multishot IORING_OP_RECV into a ring of kRecvBuffers provided buffers
+ *    (IORING_REGISTER_PBUF_RING). Wait copies what arrives to the connection's input and gives the buffer back
+ *    right away, Recv hands the input over. Past kRecvInputBytes of input the recv is cancelled until Recv
+ *    drains it, as a full socket buffer would stop the peer;
+ *  - Send copies to the connection's output, at most kSendQueueBytes, and one IORING_OP_SEND at a time
+ *    writes it. Close leaves the fd open until the output is written, so its number is not reused meanwhile.
+ * Their readiness follows from that state (input waiting, room for output), so arming a one-shot registration
+ * costs no syscall. What the reactor thread queues goes to the kernel with the next Wait, so a loop iteration is
+ * one io_uring_enter however many connections it answered. What worker threads queue is submitted right away (a
+ * NOP wakes the reactor when it made a connection ready), or picked up by the kernel SQ thread without a syscall
+ * in SQPOLL mode.
+ *
+ * Other fds (wakeup eventfd, a listen socket before its first Accept) and every fd on kernels without multishot
+ * recv (before 6.0) get one-shot IORING_OP_POLL_ADD requests, which map directly onto the EPOLLONESHOT
+ * connection events and leave the I/O to the plain syscalls; registrations without EPOLLONESHOT are re-armed
+ * by Wait after each event.
+ *
+ * user_data carries (op << 56 | generation << 32 | fd); a poll or recv completion whose generation no longer
+ * matches the fd's current registration (modified or deleted in the meantime) is dropped, its buffer given back.
+ */
+class UringPoller : public Epoller {
+public:
+    // completions = false keeps the I/O on syscalls and only polls through the ring (tests/bench/bench_poller)
+    explicit UringPoller(int maxEvent = 1024, bool sqpoll = false, bool completions = true);
+    ~UringPoller() override;
+
+    bool IsValid() const { return ring_fd_ >= 0; }
+    // Accept, Recv and Send go through the ring
+    bool DoesCompletions() const { return completions_; }
+
+    bool addFd(int fd, uint32_t events) override;
+    bool modFd(int fd, uint32_t events) override;
+    bool delFd(int fd) override;
+    int Wait(int timeoutMs = -1) override;
+    int getEventFd(size_t i) const override;
+    uint32_t getEvents(size_t i) const override;
+
+    int Accept(int listen_fd, sockaddr_in* addr) override;
+    ssize_t Recv(int fd, Buffer& buff, int* error_code) override;
+    ssize_t Send(int fd, const iovec* iov, int iovcnt, int* error_code) override;
+    void Close(int fd) override;
+
+    static constexpr unsigned kRecvBuffers = 1024;            // Power of two, the ring size
+    static constexpr size_t kRecvBufferSize = 4096;
+    static constexpr size_t kRecvInputBytes = 1 << 20;        // Received but not taken by Recv
+    static constexpr size_t kSendQueueBytes = 256 * 1024;     // Taken by Send but not written
+
+private:
+    enum class Op : uint8_t { POLL, RECV, SEND, ACCEPT };
+    enum class RecvState : uint8_t { IDLE, ARMED, CANCELLING };
+
+    // I/O state of a connection Accept handed out, reused by the next connection on the fd number
+    struct ConnIo {
+        bool active{false};   // Between Accept and delFd/Close
+        uint32_t gen{0};      // Tags the recv requests, bumped for every connection
+        RecvState recv{RecvState::IDLE};
+        std::string input;
+        bool eof{false};
+        int error{0};
+        std::string output;   // Not handed to the kernel yet
+        std::string sending;  // Owned by the kernel while send_in_flight
+        bool send_in_flight{false};
+        bool close_after_send{false};
+    };
+
+    struct FdState {
+        uint32_t events{0};
+        uint32_t gen{0};
+        bool armed{false};
+        bool in_ready{false};
+        uint32_t polled{0};  // Events of a POLL_ADD completion not reported yet
+        std::unique_ptr<ConnIo> conn;
+    };
+
+    bool Setup_(unsigned entries, bool sqpoll);
+    bool SetupBufferRing_();
+    void Teardown_();
+
+    // Caller must hold mtx_
+    io_uring_sqe* GetSqe_();
+    void PrepPollAdd_(int fd, FdState& st);
+    void PrepPollRemove_(int fd, const FdState& st);
+    void PrepCancel_(uint64_t user_data);
+    void PrepAccept_(int fd, const FdState& st);
+    void PrepRecv_(int fd, ConnIo& io);
+    void PrepSend_(int fd, ConnIo& io);
+    void PrepNop_();
+    int Submit_(unsigned min_complete, unsigned flags, const void* arg, size_t arg_size);
+    bool OnLoopThread_() const;
+    void FlushIfRemote_();
+    ConnIo* ActiveConn_(int fd);
+    void ActivateConn_(int fd);
+    void Deactivate_(int fd, ConnIo& io);
+    void MarkReady_(int fd, FdState& st);
+    uint32_t Readiness_(int fd, const FdState& st) const;
+    void OnRecv_(int fd, uint32_t gen, const io_uring_cqe* cqe);
+    void OnSend_(int fd, int res);
+    void OnAccept_(int fd, uint32_t gen, const io_uring_cqe* cqe);
+    void ReturnBuffer_(uint16_t bid);
+    int Harvest_(bool* consumed);
+    unsigned PendingSqes_() const;
+
+    static constexpr uint64_t kIgnoreData = ~0ULL;
+    static constexpr int kMaxFd = 65536;
+    static constexpr uint16_t kBufferGroup = 0;
+
+    int ring_fd_{-1};
+    bool sqpoll_{false};
+    bool completions_{false};
+
+    // SQ ring
+    void* sq_ptr_{nullptr};
+    size_t sq_size_{0};
+    unsigned* sq_head_{nullptr};
+    unsigned* sq_tail_{nullptr};
+    unsigned* sq_flags_{nullptr};
+    unsigned sq_mask_{0};
+    unsigned sq_entries_{0};
+    unsigned* sq_array_{nullptr};
+    io_uring_sqe* sqes_{nullptr};
+    size_t sqes_size_{0};
+    unsigned sqe_tail_{0};
+
+    // CQ ring, only consumed by the reactor thread
+    void* cq_ptr_{nullptr};
+    size_t cq_size_{0};
+    unsigned* cq_head_{nullptr};
+    unsigned* cq_tail_{nullptr};
+    unsigned cq_mask_{0};
+    io_uring_cqe* cqes_{nullptr};
+
+    // Provided buffers of the recvs, given back by the reactor thread
+    io_uring_buf_ring* buf_ring_{nullptr};
+    size_t buf_ring_size_{0};
+    std::vector<char> recv_buffers_;
+    uint16_t buf_tail_{0};
+
+    std::mutex mtx_;
+    std::vector<FdState> fds_;
+    // Fds whose readiness Wait looks at next
+    std::vector<int> ready_;
+    // The listen socket with the multishot accept, and the connections it completed
+    int accept_fd_{-1};
+    std::deque<int> accepted_;
+    std::atomic<std::thread::id> loop_thread_{};
+    std::vector<struct epoll_event> events_;
+};
@@ -1,15 +1,20 @@
 #include "webserver.h"
 #include <cstdlib>
+#include "../handler/protobuf_handler.h"
+#include "../dao/async_msg_writer.h"
+#include "../dao/msg_wal.h"
 #include "../log/log.h"
 #include "../pool/scylla_session.h"
 
 Webserver::Webserver(int port, int trig_mode, int timeout_ms, int sql_port, const char* sql_user, const char* sql_pwd,
                      const char* db_name, int conn_pool_num, int thread_num, bool open_log, int log_level,
-                     int log_que_size)
-    : port_(port), timeout_ms_(timeout_ms), is_close_(false), timer_(new HeapTimer()),
-      thread_pool_(new ThreadPool(thread_num)), epoller_(new Epoller()), push_service_(new PushService()),
-      auth_service_(new AuthService()), friend_service_(new FriendService(push_service_.get())),
-      msg_service_(new MsgService(push_service_.get())) {
+                     int log_que_size, int reactor_num, IoBackend io_backend, int frames_per_read,
+                     bool run_to_completion, bool async_handlers)
+    : port_(port), timeout_ms_(timeout_ms), is_close_(false), thread_pool_(new ThreadPool(thread_num)),
+      db_pool_(async_handlers ? new ThreadPool(conn_pool_num) : nullptr), push_service_(new PushService()),
+      auth_service_(new AuthService()),
+      friend_service_(new FriendService(push_service_.get())), msg_service_(new MsgService(push_service_.get())),
+      connections_(new ConnectionTable()) {
     const char* sql_env_host = getenv("MYSQL_HOST") ? getenv("MYSQL_HOST") : "localhost";
 
     if (open_log) {
@@ -23,7 +28,11 @@ Webserver::Webserver(int port, int trig_mode, int timeout_ms, int sql_port, cons
             LOG_INFO("LogSys level: {}", log_level);
             LOG_INFO("src_dir: {}", TcpConnection::src_dir);
             LOG_INFO("MySQL Host: {}", sql_env_host);
-            LOG_INFO("SqlConnPool num: {}, ThreadPool num: {}", conn_pool_num, thread_num);
+            LOG_INFO("SqlConnPool num: {}, ThreadPool num: {}, Reactor num: {}", conn_pool_num, thread_num,
+                     reactor_num);
+            LOG_INFO("IO backend: {}, protobuf frames per read: {}, run-to-completion: {}", IoBackendName(io_backend),
+                     frames_per_read, run_to_completion);
+            LOG_INFO("Blocking commands: {}", async_handlers ? "coroutines" : "synchronous");
         }
     }
 
@@ -37,15 +46,9 @@ Webserver::Webserver(int port, int trig_mode, int timeout_ms, int sql_port, cons
     TcpConnection::friend_service = friend_service_.get();
     TcpConnection::push_service = push_service_.get();
     TcpConnection::msg_service = msg_service_.get();
-    TcpConnection::epoller_ = epoller_.get();
     TcpConnection::thread_pool = thread_pool_.get();
-
-    // Initialize timer callback
-    timer_->SetCallBack([this](int fd) {
-        if (connections_.count(fd)) {
-            CloseConn_(connections_[fd].get());
-        }
-    });
+    TcpConnection::db_pool = db_pool_.get();
+    ProtobufHandler::max_frames_per_read = frames_per_read > 0 ? frames_per_read : 1;
 
     // Initialize MySQL connection pool and Scylla session
     SqlConnPool::Instance()->Init(sql_env_host, sql_port, sql_user, sql_pwd, db_name, conn_pool_num);
@@ -56,21 +59,49 @@ Webserver::Webserver(int port, int trig_mode, int timeout_ms, int sql_port, cons
     if (const char* scylla_port_str = getenv("SCYLLA_PORT"); scylla_port_str && *scylla_port_str) {
         scylla_port = static_cast<uint16_t>(std::strtoul(scylla_port_str, nullptr, 10));
     }
-    if (!ScyllaSession::Instance()->Init(scylla_host, scylla_port, scylla_user, scylla_pwd)) {
+    if (!ScyllaSession::Instance()->Init(scylla_host, scylla_port, scylla_user, scylla_pwd,
+                                         ScyllaOptions::FromEnv())) {
         LOG_WARN("Scylla session init failed. Message persistence may be unavailable.");
     } else {
         LOG_INFO("Scylla session initialized successfully.");
     }
+    // Messages acked by the previous process but not yet in Scylla go back to the writer
+    std::vector<MsgWal::Record> recovered;
+    if (MsgWal::Instance()->Open(MsgWal::Options::FromEnv(), &recovered)) {
+        for (auto& record : recovered) {
+            AsyncMsgWriter::GetInstance()->Restore(std::move(record.msg), record.lsn);
+        }
+    }
     InitEventMode_(trig_mode);
-    if (!InitSocket_()) {
-        is_close_ = true;
+
+    // Every reactor gets its own SO_REUSEPORT listen socket once there is more than one
+    if (reactor_num < 1) reactor_num = 1;
+    for (int i = 0; i < reactor_num; i++) {
+        auto reactor = std::make_unique<Reactor>(i, port_, reactor_num > 1, timeout_ms_, listen_event_, conn_event_,
+                                                 thread_pool_.get(), connections_.get(), io_backend,
+                                                 run_to_completion);
+        if (!reactor->Init()) {
+            is_close_ = true;
+            break;
+        }
+        reactors_.push_back(std::move(reactor));
     }
 }
 
 Webserver::~Webserver() {
     LOG_INFO("========== Server shutting down ==========");
-    close(listen_fd_);
     is_close_ = true;
+    // Finish in-flight reads/writes while the reactors and connections still exist. MySQL calls first,
+    // their coroutines resume on thread_pool_.
+    if (db_pool_) {
+        db_pool_->Shutdown();
+    }
+    thread_pool_->Shutdown();
+    // Drain the writer while Scylla is still connected, then drop the WAL segments it has retired. Both run
+    // callbacks that re-arm connections in their reactor's epoller, so before the reactors go.
+    AsyncMsgWriter::GetInstance()->Stop();
+    MsgWal::Instance()->Close();
+    reactors_.clear();
     free(src_dir_);
     SqlConnPool::Instance()->ClosePool();
     ScyllaSession::Instance()->Close();
@@ -103,215 +134,28 @@ void Webserver::InitEventMode_(int trig_mode) {
 }
 
 void Webserver::Start() {
-    int time_ms = -1;
-    if (!is_close_) {
-        LOG_INFO("========== Server start ==========");
-    }
-    while (!is_close_) {
-        if (timeout_ms_ > 0) {
-            time_ms = timer_->GetNextTick();
-        }
-        int event_cnt = epoller_->Wait(time_ms);
-        for (int i = 0; i < event_cnt; i++) {
-            int fd = epoller_->getEventFd(i);
-            uint32_t events = epoller_->getEvents(i);
-            // If the file descriptor is the listen socket, deal with the new connection
-            if (fd == listen_fd_) {
-                DealListen_();
-            }
-            // If the file descriptor is an error, close the connection
-            else if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
-                CloseConn_(connections_.at(fd).get());
-            }
-            // If the file descriptor is readable, deal with the read event
-            else if (events & EPOLLIN) {
-                assert(connections_.count(fd) > 0);
-                DealRead_(connections_[fd].get());
-            }
-            // If the file descriptor is writable, deal with the write event
-            else if (events & EPOLLOUT) {
-                assert(connections_.count(fd) > 0);
-                DealWrite_(connections_[fd].get());
-            } else {
-                LOG_ERROR("Unexpected event");
-            }
-        }
-    }
-}
-
-void Webserver::SendError_(int fd, const char* info) {
-    assert(fd > 0);
-    int ret = send(fd, info, strlen(info), 0);
-    if (ret < 0) {
-        LOG_WARN("send error to client[{}] error!", fd);
-    }
-    close(fd);
-}
-
-void Webserver::CloseConn_(TcpConnection* client) {
-    assert(client);
-    LOG_INFO("Client[{}] quit!", client->get_fd());
-    epoller_->delFd(client->get_fd());
-    client->close_conn();
-}
-
-void Webserver::AddClient_(int fd, sockaddr_in addr) {
-    assert(fd > 0);
-    auto conn = std::make_unique<TcpConnection>();
-    conn->init(fd, addr);
-    TcpConnection* conn_ptr = conn.get();
-    connections_[fd] = std::move(conn);
-    if (timeout_ms_ > 0) {
-        timer_->Add(fd, timeout_ms_);
-    }
-    if (epoller_->addFd(fd, EPOLLIN | conn_event_)) {
-        conn_ptr->UpdateEvents(EPOLLIN | conn_event_);
-    }
-    SetFdNonblock(fd);
-    LOG_INFO("Client[{}] in!", conn_ptr->get_fd());
-}
-
-void Webserver::DealListen_() {
-    struct sockaddr_in addr;
-    socklen_t len = sizeof(addr);
-    // In ET mode, the loop is used to accept all incoming connections
-    do {
-        int fd = accept(listen_fd_, (struct sockaddr*)&addr, &len);
-        if (fd <= 0) {
-            return;
-        } else if (TcpConnection::user_count >= MAX_FD) {
-            SendError_(fd, "Server busy!");
-            LOG_WARN("Clients is full!");
-            return;
-        }
-        AddClient_(fd, addr);
-    } while (listen_event_ & EPOLLET);
-}
-
-void Webserver::DealRead_(TcpConnection* client) {
-    assert(client);
-    ExtendTime_(client);
-    thread_pool_->AddTask(std::bind(&Webserver::OnRead_, this, client));
-}
-
-void Webserver::DealWrite_(TcpConnection* client) {
-    assert(client);
-    ExtendTime_(client);
-    thread_pool_->AddTask(std::bind(&Webserver::OnWrite_, this, client));
-}
-
-void Webserver::ExtendTime_(TcpConnection* client) {
-    assert(client);
-    if (timeout_ms_ > 0) {
-        timer_->Adjust(client->get_fd(), timeout_ms_);
-    }
-}
-
-void Webserver::OnRead_(TcpConnection* client) {
-    assert(client);
-    int ret = -1;
-    int readErrno = 0;
-    ret = client->read(&readErrno);
-    if (ret <= 0 && readErrno != EAGAIN) {
-        CloseConn_(client);
+    if (is_close_) {
         return;
     }
-    OnProcess_(client);
-}
-
-// Resolve the request data
-void Webserver::OnProcess_(TcpConnection* client) {
-    if (client->process()) {
-        // If the parsing succeeds, modify the event to EPOLLOUT(write)
-        uint32_t events = conn_event_ | EPOLLOUT;
-        epoller_->modFd(client->get_fd(), events);
-        client->UpdateEvents(events);
-    } else {
-        // If the parsing fails, modify the event to EPOLLIN(read)
-        uint32_t events = conn_event_ | EPOLLIN;
-        epoller_->modFd(client->get_fd(), events);
-        client->UpdateEvents(events);
+    LOG_INFO("========== Server start ==========");
+    for (size_t i = 1; i < reactors_.size(); i++) {
+        reactor_threads_.emplace_back(&Reactor::Loop, reactors_[i].get());
     }
-}
+    reactors_[0]->Loop();
 
-void Webserver::OnWrite_(TcpConnection* client) {
-    assert(client);
-    int ret = -1;
-    int writeErrno = 0;
-    ret = client->write(&writeErrno);
-    if (client->to_write_bytes() == 0) {
-        // Write completely
-        if (client->is_keep_alive()) {
-            // If the connection is persistent, modify the event to EPOLLIN
-            uint32_t events = conn_event_ | EPOLLIN;
-            epoller_->modFd(client->get_fd(), events);
-            client->UpdateEvents(events);
-            return;
-        }
-    } else if (ret < 0) {
-        // The buffer is full
-        if (writeErrno == EAGAIN) {
-            uint32_t events = conn_event_ | EPOLLOUT;
-            epoller_->modFd(client->get_fd(), events);
-            client->UpdateEvents(events);
-            return;
-        }
+    // The main reactor only returns after Stop(), make sure the others follow
+    for (auto& reactor : reactors_) {
+        reactor->Stop();
     }
-    CloseConn_(client);
-}
-
-bool Webserver::InitSocket_() {
-    int ret;
-    struct sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port = htons(port_);
-
-    // Create a socket
-    listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
-    if (listen_fd_ < 0) {
-        LOG_ERROR("Create socket error! port:{}", port_);
-        return false;
-    }
-
-    // Set the socket to reuse the address
-    int optval = 1;
-    ret = setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
-    if (ret == -1) {
-        LOG_ERROR("Set socket error!");
-        close(listen_fd_);
-        return false;
-    }
-
-    // Bind the socket to the address
-    ret = bind(listen_fd_, (struct sockaddr*)&addr, sizeof(addr));
-    if (ret < 0) {
-        LOG_ERROR("Bind Port:{} error!", port_);
-        close(listen_fd_);
-        return false;
+    for (auto& t : reactor_threads_) {
+        t.join();
     }
-
-    // Start listening
-    ret = listen(listen_fd_, 8);
-    if (ret < 0) {
-        LOG_ERROR("Listen port:{} error!", port_);
-        close(listen_fd_);
-        return false;
-    }
-
-    // Add the listen socket to the epoll
-    ret = epoller_->addFd(listen_fd_, EPOLLIN | listen_event_);
-    if (ret == 0) {
-        LOG_ERROR("Add listen error!");
-        close(listen_fd_);
-        return false;
-    }
-    SetFdNonblock(listen_fd_);
-    LOG_INFO("Server port:{}", port_);
-    return true;
+    reactor_threads_.clear();
 }
 
-int Webserver::SetFdNonblock(int fd) {
-    assert(fd > 0);
-    return fcntl(fd, F_SETFL, fcntl(fd, F_GETFD, 0) | O_NONBLOCK);
+void Webserver::Stop() {
+    is_close_ = true;
+    for (auto& reactor : reactors_) {
+        reactor->Stop();
+    }
 }
@@ -1,75 +1,391 @@
 #include "async_msg_writer.h"
-#include <chrono>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <functional>
 #include <iterator>
+#include <string>
 #include "../log/log.h"
+#include "../utils/env.h"
+#include "../utils/id_generator.h"
+#include "../utils/metrics.h"
+#include "msg_wal.h"
 
-void AsyncMsgWriter::Start() {
-    bool expected = false;
-    if (running_.compare_exchange_strong(expected, true)) {
-        worker_ = std::thread(&AsyncMsgWriter::WorkerLoop, this);
-        LOG_INFO("AsyncMsgWriter started.");
+namespace {
+void FutexWait(std::atomic<uint32_t>* word, uint32_t expected, std::chrono::microseconds timeout) {
+    struct timespec ts;
+    struct timespec* tsp = nullptr;
+    if (timeout.count() >= 0) {
+        ts.tv_sec = timeout.count() / 1000000;
+        ts.tv_nsec = (timeout.count() % 1000000) * 1000;
+        tsp = &ts;
     }
+    // Returns on wake, timeout, signal, or right away if *word != expected
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT_PRIVATE, expected, tsp, nullptr, 0);
+}
+
+void FutexWake(std::atomic<uint32_t>* word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+}
+}  // namespace
+
+AsyncMsgWriter::AsyncMsgWriter() {
+    // Constructed first so it is destroyed after us, our destructor still retires LSNs
+    MsgWal::Instance();
+}
+
+AsyncMsgWriter::Options AsyncMsgWriter::Options::FromEnv() {
+    Options options;
+    EnvNumber("WRITER_SHARDS", &options.shards);
+    EnvNumber("WRITER_MAX_BATCH", &options.max_batch);
+    EnvNumber("WRITER_LINGER_US", &options.linger_us);
+    EnvNumber("WRITER_HIGH_WATERMARK", &options.high_watermark);
+    EnvNumber("WRITER_RETRY_AFTER_MS", &options.retry_after_ms);
+    if (options.shards == 0) options.shards = 1;
+    if (options.max_batch == 0) options.max_batch = 1;
+    if (options.high_watermark < options.max_batch) options.high_watermark = options.max_batch;
+    return options;
+}
+
+void AsyncMsgWriter::Start(const Options& options) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (running_) return;
+    if (shards_.empty()) {
+        for (size_t i = 0; i < std::max<size_t>(options.shards, 1); i++) {
+            shards_.push_back(std::make_unique<Shard>());
+        }
+        RegisterMetrics_();
+    }
+    options_ = options;
+    options_.shards = shards_.size();
+    for (auto& shard : shards_) {
+        shard->Start(options_);
+    }
+    running_ = true;
+    LOG_INFO("AsyncMsgWriter started, shards={}, max_batch={}, linger={}us, high_watermark={}.", options_.shards,
+             options_.max_batch, options_.linger_us, options_.high_watermark);
 }
 
 void AsyncMsgWriter::Stop() {
-    bool expected = true;
-    if (running_.compare_exchange_strong(expected, false)) {
-        if (worker_.joinable()) {
-            worker_.join();
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (!running_) return;
+    running_ = false;
+    // Signal every worker before joining any, they flush what is left in their queues in parallel
+    for (auto& shard : shards_) {
+        shard->Stop();
+    }
+    for (auto& shard : shards_) {
+        shard->Join();
+    }
+    LOG_INFO("AsyncMsgWriter stopped.");
+}
+
+bool AsyncMsgWriter::Enqueue(im::P2PMessage msg, uint64_t* wal_lsn, PersistCallback on_persisted) {
+    size_t index = ShardOf(msg, shards_.size());
+    return shards_[index]->Enqueue(std::move(msg), wal_lsn, std::move(on_persisted));
+}
+
+void AsyncMsgWriter::Restore(im::P2PMessage msg, uint64_t wal_lsn) {
+    size_t index = ShardOf(msg, shards_.size());
+    shards_[index]->Push({std::move(msg), wal_lsn, nullptr});
+}
+
+void AsyncMsgWriter::InFlightFor(uint64_t user_id, std::vector<im::P2PMessage>* out) const {
+    // A user's conversations are spread over all shards
+    for (const auto& shard : shards_) {
+        shard->InFlightFor(user_id, out);
+    }
+}
+
+uint64_t AsyncMsgWriter::HighestFailedSeq(uint64_t user_a, uint64_t user_b) const {
+    if (shards_.empty()) return 0;
+    auto conv_id = IdGenerator::GenerateP2PConvId(user_a, user_b);
+    return shards_[std::hash<std::string>{}(conv_id) % shards_.size()]->HighestFailedSeq(conv_id);
+}
+
+size_t AsyncMsgWriter::ShardOf(const im::P2PMessage& msg, size_t shard_count) {
+    if (shard_count <= 1) return 0;
+    auto conv_id = IdGenerator::GenerateP2PConvId(msg.sender_id(), msg.receiver_id());
+    return std::hash<std::string>{}(conv_id) % shard_count;
+}
+
+size_t AsyncMsgWriter::QueueDepth() const {
+    size_t depth = 0;
+    for (const auto& shard : shards_) {
+        depth += shard->QueueDepth();
+    }
+    return depth;
+}
+
+void AsyncMsgWriter::Shard::Start(const Options& options) {
+    options_ = options;
+    running_.store(true, std::memory_order_release);
+    worker_ = std::thread(&Shard::WorkerLoop, this);
+}
+
+void AsyncMsgWriter::Shard::Stop() {
+    running_.store(false, std::memory_order_release);
+    wake_.store(1, std::memory_order_release);
+    FutexWake(&wake_);
+}
+
+void AsyncMsgWriter::Shard::Join() {
+    if (worker_.joinable()) {
+        worker_.join();
+    }
+}
+
+bool AsyncMsgWriter::Shard::Enqueue(im::P2PMessage msg, uint64_t* wal_lsn, PersistCallback on_persisted) {
+    if (depth_.load(std::memory_order_relaxed) >= options_.high_watermark) {
+        rejected.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    // Logged only once accepted, a refused message must not come back on replay
+    uint64_t lsn = MsgWal::Instance()->Append(msg);
+    if (wal_lsn) *wal_lsn = lsn;
+    Push({std::move(msg), lsn, std::move(on_persisted)});
+    return true;
+}
+
+void AsyncMsgWriter::Shard::Push(Entry entry) {
+    Index_(entry.msg);
+    queue_.enqueue(std::move(entry));
+    depth_.fetch_add(1, std::memory_order_relaxed);
+    // Pairs with the fence in Park_: either the worker sees the message or we see it parked
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (parked_.load(std::memory_order_relaxed)) {
+        Wake_();
+    }
+}
+
+void AsyncMsgWriter::Shard::Index_(const im::P2PMessage& msg) {
+    auto shared = std::make_shared<const im::P2PMessage>(msg);
+    std::lock_guard<std::mutex> lock(in_flight_mtx_);
+    in_flight_[msg.sender_id()].push_back(shared);
+    if (msg.receiver_id() != msg.sender_id()) {
+        in_flight_[msg.receiver_id()].push_back(std::move(shared));
+    }
+}
+
+void AsyncMsgWriter::Shard::Unindex_(const std::vector<im::P2PMessage>& msgs) {
+    std::lock_guard<std::mutex> lock(in_flight_mtx_);
+    auto drop = [this](uint64_t owner_id, const im::P2PMessage& msg) {
+        auto it = in_flight_.find(owner_id);
+        if (it == in_flight_.end()) return;
+        auto& owned = it->second;
+        // Written in the order they were queued, so almost always the first one
+        auto pos = std::find_if(owned.begin(), owned.end(), [&](const auto& m) {
+            return m->msg_id() == msg.msg_id() && m->timestamp() == msg.timestamp();
+        });
+        if (pos != owned.end()) owned.erase(pos);
+        if (owned.empty()) in_flight_.erase(it);
+    };
+    for (const auto& msg : msgs) {
+        drop(msg.sender_id(), msg);
+        if (msg.receiver_id() != msg.sender_id()) {
+            drop(msg.receiver_id(), msg);
         }
-        LOG_INFO("AsyncMsgWriter stopped.");
     }
 }
 
-void AsyncMsgWriter::Enqueue(im::P2PMessage msg) { queue_.enqueue(std::move(msg)); }
+void AsyncMsgWriter::Shard::InFlightFor(uint64_t user_id, std::vector<im::P2PMessage>* out) const {
+    std::lock_guard<std::mutex> lock(in_flight_mtx_);
+    auto it = in_flight_.find(user_id);
+    if (it == in_flight_.end()) return;
+    for (const auto& msg : it->second) {
+        out->push_back(*msg);
+    }
+}
 
-void AsyncMsgWriter::WorkerLoop() {
-    std::vector<im::P2PMessage> batch_buffer;
-    batch_buffer.reserve(kBatchSize);
+uint64_t AsyncMsgWriter::Shard::HighestFailedSeq(const std::string& conv_id) const {
+    std::lock_guard<std::mutex> lock(in_flight_mtx_);
+    auto it = failed_seqs_.find(conv_id);
+    return it != failed_seqs_.end() ? it->second : 0;
+}
 
-    const int kMaxRetries = 3;
-    const int kBaseWaitMs = 50;
-    const int kMaxWaitMs = 1000;
+void AsyncMsgWriter::Shard::RecordFailed_(const std::vector<im::P2PMessage>& msgs, const std::vector<size_t>& failed) {
+    std::lock_guard<std::mutex> lock(in_flight_mtx_);
+    for (size_t i : failed) {
+        uint64_t& seq = failed_seqs_[IdGenerator::GenerateP2PConvId(msgs[i].sender_id(), msgs[i].receiver_id())];
+        seq = std::max(seq, msgs[i].seq());
+    }
+}
 
-    LOG_INFO("AsyncMsgWriter WorkerLoop started.");
+void AsyncMsgWriter::Shard::Wake_() {
+    // Only the producer that clears the flag pays for the syscall
+    if (parked_.exchange(false, std::memory_order_acq_rel)) {
+        wake_.store(1, std::memory_order_release);
+        FutexWake(&wake_);
+    }
+}
 
-    while (running_) {
-        auto count = queue_.dequeue_bulk(std::back_inserter(batch_buffer), kBatchSize);
+void AsyncMsgWriter::Shard::Park_(std::chrono::microseconds timeout) {
+    wake_.store(0, std::memory_order_relaxed);
+    parked_.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (queue_.empty() && running_.load(std::memory_order_acquire)) {
+        FutexWait(&wake_, 0, timeout);
+        wakeups.fetch_add(1, std::memory_order_relaxed);
+    }
+    parked_.store(false, std::memory_order_relaxed);
+}
+
+void AsyncMsgWriter::Shard::WorkerLoop() {
+    using Clock = std::chrono::steady_clock;
+    Batch batch;
+    batch.msgs.reserve(options_.max_batch);
+    batch.lsns.reserve(options_.max_batch);
+    batch.callbacks.reserve(options_.max_batch);
+    const auto linger = std::chrono::microseconds(options_.linger_us);
+    Clock::time_point batch_start;
 
+    while (running_) {
+        size_t before = batch.size();
+        auto count = Take_(batch);
         if (count > 0) {
-            bool success = false;
-            int retry_count = 0;
-            while (retry_count <= kMaxRetries) {
-                if (dao_.InsertBatch(batch_buffer)) {
-                    success = true;
-                    break;
-                }
-                retry_count++;
-                if (retry_count > kMaxRetries) break;
-                auto wait_ms = kBaseWaitMs * (1 << (retry_count - 1));
-                if (wait_ms > kMaxWaitMs) wait_ms = kMaxWaitMs;
-                LOG_WARN("Batch insert failed, retrying {}/{} in {}ms...", retry_count, kMaxRetries, wait_ms);
-                std::this_thread::sleep_for(std::chrono::milliseconds(wait_ms));
+            if (before == 0) {
+                batch_start = Clock::now();
             }
+        }
 
-            if (!success) {
-                LOG_ERROR("Failed to insert batch of {} messages.", count);
-            }
-            batch_buffer.clear();
-        } else {
-            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        if (batch.empty()) {
+            Park_(std::chrono::microseconds(-1));
+            continue;
         }
+        if (batch.size() >= options_.max_batch) {
+            flushes_full.fetch_add(1, std::memory_order_relaxed);
+            Flush_(batch, kMaxRetries);
+            continue;
+        }
+        auto waited = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - batch_start);
+        if (waited >= linger) {
+            flushes_linger.fetch_add(1, std::memory_order_relaxed);
+            Flush_(batch, kMaxRetries);
+            continue;
+        }
+        Park_(linger - waited);
     }
 
-    while (!queue_.empty()) {
-        auto count = queue_.dequeue_bulk(std::back_inserter(batch_buffer), kBatchSize);
-        if (count > 0) {
-            if (!dao_.InsertBatch(batch_buffer)) {
-                LOG_ERROR("Failed to insert batch of {} messages.", count);
-            }
-            batch_buffer.clear();
+    // Shutting down, one attempt each, what fails stays in the WAL for the next start
+    while (!queue_.empty() || !batch.empty()) {
+        Take_(batch);
+        Flush_(batch, 0);
+    }
+}
+
+size_t AsyncMsgWriter::Shard::Take_(Batch& batch) {
+    taken_.clear();
+    auto count = queue_.dequeue_bulk(std::back_inserter(taken_), options_.max_batch - batch.size());
+    depth_.fetch_sub(count, std::memory_order_relaxed);
+    for (auto& entry : taken_) {
+        batch.msgs.push_back(std::move(entry.msg));
+        batch.lsns.push_back(entry.wal_lsn);
+        batch.callbacks.push_back(std::move(entry.on_persisted));
+    }
+    return count;
+}
+
+void AsyncMsgWriter::Shard::Flush_(Batch& batch, int max_retries) {
+    const int kBaseWaitMs = 50;
+    const int kMaxWaitMs = 1000;
+
+    // Only the messages with a failed row are retried, the others are already stored
+    auto pending = dao_.InsertConcurrent(batch.msgs, kMaxInFlight);
+    std::vector<im::P2PMessage> retry;
+    int retry_count = 0;
+    while (!pending.empty() && retry_count < max_retries) {
+        retry_count++;
+        auto wait_ms = kBaseWaitMs * (1 << (retry_count - 1));
+        if (wait_ms > kMaxWaitMs) wait_ms = kMaxWaitMs;
+        LOG_WARN("{} messages not stored, retrying {}/{} in {}ms...", pending.size(), retry_count, max_retries,
+                 wait_ms);
+        std::this_thread::sleep_for(std::chrono::milliseconds(wait_ms));
+        retry.clear();
+        for (size_t i : pending) {
+            retry.push_back(batch.msgs[i]);
+        }
+        // Indices into retry, map them back to the batch
+        auto still_pending = dao_.InsertConcurrent(retry, kMaxInFlight);
+        for (auto& i : still_pending) {
+            i = pending[i];
+        }
+        pending = std::move(still_pending);
+    }
+
+    std::vector<bool> stored(batch.size(), true);
+    for (size_t i : pending) {
+        stored[i] = false;
+    }
+    if (pending.empty()) {
+        MsgWal::Instance()->Retire(batch.lsns);
+    } else {
+        std::vector<uint64_t> retired;
+        for (size_t i = 0; i < batch.size(); i++) {
+            if (stored[i]) retired.push_back(batch.lsns[i]);
         }
+        MsgWal::Instance()->Retire(retired);
+        // The failed messages stay in the WAL and are replayed on the next start (the inserts are idempotent)
+        LOG_ERROR("Failed to insert {} of {} messages{}.", pending.size(), batch.size(),
+                  MsgWal::Instance()->Enabled() ? ", kept in the WAL" : "");
+    }
+    // Stored or given up on (a failed one is back from the WAL after a restart), Scylla is all a sync gets now.
+    // A seq leaves the index only once HighestFailedSeq has it.
+    if (!pending.empty()) {
+        RecordFailed_(batch.msgs, pending);
     }
+    Unindex_(batch.msgs);
+    written.fetch_add(batch.size() - pending.size(), std::memory_order_relaxed);
+    failed.fetch_add(pending.size(), std::memory_order_relaxed);
+
+    for (size_t i = 0; i < batch.size(); i++) {
+        if (batch.callbacks[i]) batch.callbacks[i](stored[i]);
+    }
+    batch.msgs.clear();
+    batch.lsns.clear();
+    batch.callbacks.clear();
+}
 
-    LOG_INFO("AsyncMsgWriter WorkerLoop stopped. Flushed remaining messages.");
+double AsyncMsgWriter::Total_(std::atomic<uint64_t> Shard::*counter) const {
+    uint64_t total = 0;
+    for (const auto& shard : shards_) {
+        total += ((*shard).*counter).load(std::memory_order_relaxed);
+    }
+    return static_cast<double>(total);
+}
+
+void AsyncMsgWriter::RegisterMetrics_() {
+    auto* metrics = Metrics::Instance();
+    metrics->AddGauge("termchat_writer_shards", "Persistence writer shards, one thread each",
+                      [this]() { return static_cast<double>(shards_.size()); });
+    metrics->AddGauge("termchat_writer_max_batch", "Messages that flush a persistence batch at once",
+                      [this]() { return static_cast<double>(options_.max_batch); });
+    metrics->AddGauge("termchat_writer_high_watermark", "Queued messages per shard past which new ones are refused",
+                      [this]() { return static_cast<double>(options_.high_watermark); });
+    metrics->AddGauge("termchat_writer_linger_us", "Longest wait of a partial persistence batch before it flushes",
+                      [this]() { return static_cast<double>(options_.linger_us); });
+    // Samples of one metric must be adjacent in the output, so one loop per name
+    for (size_t i = 0; i < shards_.size(); i++) {
+        Shard* shard = shards_[i].get();
+        metrics->AddGauge("termchat_writer_queue_depth{shard=\"" + std::to_string(i) + "\"}",
+                          "Messages queued for persistence",
+                          [shard]() { return static_cast<double>(shard->QueueDepth()); });
+    }
+    metrics->AddCounter("termchat_writer_flushes_total{reason=\"full\"}", "Persistence batches written",
+                        [this]() { return Total_(&Shard::flushes_full); });
+    metrics->AddCounter("termchat_writer_flushes_total{reason=\"linger\"}", "Persistence batches written",
+                        [this]() { return Total_(&Shard::flushes_linger); });
+    for (size_t i = 0; i < shards_.size(); i++) {
+        Shard* shard = shards_[i].get();
+        metrics->AddCounter(
+            "termchat_writer_messages_written_total{shard=\"" + std::to_string(i) + "\"}", "Messages stored in Scylla",
+            [shard]() { return static_cast<double>(shard->written.load(std::memory_order_relaxed)); });
+    }
+    metrics->AddCounter("termchat_writer_messages_failed_total", "Messages dropped after all retries",
+                        [this]() { return Total_(&Shard::failed); });
+    metrics->AddCounter("termchat_writer_messages_rejected_total", "Messages refused because the queue was full",
+                        [this]() { return Total_(&Shard::rejected); });
+    metrics->AddCounter("termchat_writer_wakeups_total", "Times a writer thread woke from parking",
+                        [this]() { return Total_(&Shard::wakeups); });
 }
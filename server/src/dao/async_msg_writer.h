@@ -1,32 +1,184 @@
 #pragma once
 
 #include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <thread>
+#include <unordered_map>
+#include <vector>
 #include "../core/mpsc_queue.h"
 #include "message_service.pb.h"
 #include "msg_scylla_dao.h"
 
+/**
+ * AsyncMsgWriter - persists P2P messages to Scylla off the request path
+ *
+ * The writer is split into shards, each with its own queue, worker thread, batch buffer and DAO. A message
+ * goes to the shard picked by the hash of its conversation id (IdGenerator::GenerateP2PConvId), so all
+ * messages of a conversation are written by one thread in the order they were enqueued, while different
+ * conversations are written in parallel.
+ *
+ * A shard's worker parks on a futex while its queue is empty; Enqueue wakes it only when it is parked, so a
+ * busy writer costs producers no syscall and an idle one no CPU. Messages are written in batches that
+ * flush at max_batch messages or linger_us after the first message of the batch, whichever comes first:
+ * under load batches fill up at once, when quiet a message waits at most linger_us.
+ *
+ * With MsgWal open, Enqueue logs every accepted message and its LSN is retired once it is stored; a message
+ * that fails stays in the log and Restore brings it back after a restart.
+ *
+ * Until its batch is written a message is also indexed by its sender and its receiver, InFlightFor gives
+ * a sync the messages Scylla cannot have yet (read-your-writes without writing on the request path). Of the
+ * messages that finally failed only the highest seq per conversation is kept (HighestFailedSeq), for ConvSeq.
+ *
+ * A message may carry a PersistCallback, run on the shard thread with the final outcome of its write once
+ * the batch is done (after the retries). It must not block, it delays the rest of the shard.
+ *
+ * Each shard queue is bounded by high_watermark: past it Enqueue refuses the message and the caller tells
+ * the sender to retry later, instead of the queue growing until the process runs out of memory while
+ * Scylla is slow. The bound is soft, producers racing at the watermark may overshoot it by one each.
+ *
+ * Options come from WRITER_SHARDS / WRITER_MAX_BATCH / WRITER_LINGER_US / WRITER_HIGH_WATERMARK /
+ * WRITER_RETRY_AFTER_MS and are exported with the queue depth, flush and rejection counters at /metrics.
+ * The shard count is fixed by the first Start.
+ */
 class AsyncMsgWriter {
 public:
+    struct Options {
+        size_t shards = 4;
+        size_t max_batch = 100;
+        int64_t linger_us = 200;
+        // Queued messages per shard past which Enqueue refuses new ones
+        size_t high_watermark = 50000;
+        // Hint returned to refused senders
+        uint32_t retry_after_ms = 200;
+
+        static Options FromEnv();
+    };
+
+    // Whether the message is in Scylla: false once its retries ran out (a single attempt while stopping)
+    using PersistCallback = std::function<void(bool stored)>;
+
     static AsyncMsgWriter* GetInstance() {
         static AsyncMsgWriter instance;
         return &instance;
     };
 
-    void Start();
+    void Start(const Options& options = Options::FromEnv());
     void Stop();
-    void Enqueue(im::P2PMessage msg);
+    // Must not be called before the first Start. False when the message's shard is past the high
+    // watermark, the message is dropped and should be resent after RetryAfterMs. Otherwise the message is
+    // appended to MsgWal and *wal_lsn (if given) is its LSN, 0 without a WAL. on_persisted runs only for an
+    // accepted message.
+    [[nodiscard]] bool Enqueue(im::P2PMessage msg, uint64_t* wal_lsn = nullptr, PersistCallback on_persisted = nullptr);
+    // Requeue a message replayed from MsgWal, bypasses the high watermark
+    void Restore(im::P2PMessage msg, uint64_t wal_lsn);
+    uint32_t RetryAfterMs() const { return options_.retry_after_ms; }
+    // Accepted messages sent or received by user_id whose write is not done yet, appended to *out in no order
+    void InFlightFor(uint64_t user_id, std::vector<im::P2PMessage>* out) const;
+    // Highest seq of the conversation's messages whose write finally failed (only MsgWal has them until a
+    // restart replays them), 0 if none
+    uint64_t HighestFailedSeq(uint64_t user_a, uint64_t user_b) const;
+
+    size_t QueueDepth() const;
+    uint64_t WrittenCount() const { return static_cast<uint64_t>(Total_(&Shard::written)); }
+    uint64_t FailedCount() const { return static_cast<uint64_t>(Total_(&Shard::failed)); }
+    uint64_t RejectedCount() const { return static_cast<uint64_t>(Total_(&Shard::rejected)); }
+    size_t ShardCount() const { return shards_.size(); }
+    // Shard that writes msg, the same for both directions of a conversation
+    static size_t ShardOf(const im::P2PMessage& msg, size_t shard_count);
 
 private:
-    AsyncMsgWriter() = default;
+    struct Entry {
+        im::P2PMessage msg;
+        // Retired in MsgWal once the message is stored, 0 when not logged
+        uint64_t wal_lsn;
+        PersistCallback on_persisted;
+    };
+
+    // Messages taken from a shard queue, the three vectors are parallel
+    struct Batch {
+        std::vector<im::P2PMessage> msgs;
+        std::vector<uint64_t> lsns;
+        std::vector<PersistCallback> callbacks;
+
+        size_t size() const { return msgs.size(); }
+        bool empty() const { return msgs.empty(); }
+    };
+
+    class Shard {
+    public:
+        void Start(const Options& options);
+        // Stop wakes the worker, Join waits until it has flushed its queue
+        void Stop();
+        void Join();
+        bool Enqueue(im::P2PMessage msg, uint64_t* wal_lsn, PersistCallback on_persisted);
+        void Push(Entry entry);
+
+        size_t QueueDepth() const { return depth_.load(std::memory_order_relaxed); }
+        void InFlightFor(uint64_t user_id, std::vector<im::P2PMessage>* out) const;
+        uint64_t HighestFailedSeq(const std::string& conv_id) const;
+
+        std::atomic<uint64_t> flushes_full{0};
+        std::atomic<uint64_t> flushes_linger{0};
+        std::atomic<uint64_t> written{0};
+        std::atomic<uint64_t> failed{0};
+        std::atomic<uint64_t> wakeups{0};
+        std::atomic<uint64_t> rejected{0};
+
+    private:
+        void WorkerLoop();
+        // Move queued messages into batch until it holds max_batch
+        size_t Take_(Batch& batch);
+        // Write batch (retrying the failed messages with backoff), retire the LSNs of the stored messages, run
+        // the callbacks and clear it
+        void Flush_(Batch& batch, int max_retries);
+        // Sleep until Enqueue/Stop wakes us or timeout passes, a negative timeout waits without limit
+        void Park_(std::chrono::microseconds timeout);
+        void Wake_();
+        // Index msg under its sender and receiver until Unindex_ after its write
+        void Index_(const im::P2PMessage& msg);
+        // Remember the seqs of msgs that were not stored, before they are unindexed
+        void RecordFailed_(const std::vector<im::P2PMessage>& msgs, const std::vector<size_t>& failed);
+        void Unindex_(const std::vector<im::P2PMessage>& msgs);
+
+        MPSCQueue<Entry> queue_;
+        std::vector<Entry> taken_;
+        std::thread worker_;
+        std::atomic<bool> running_{false};
+        MsgScyllaDao dao_;
+        Options options_;
+
+        // Messages enqueued but not yet taken by the worker
+        std::atomic<size_t> depth_{0};
+        // Futex word and the parked flag Enqueue checks, see Park_
+        std::atomic<uint32_t> wake_{0};
+        std::atomic<bool> parked_{false};
+
+        // Queued and batched messages by participant, one copy shared by both; a resent message is in it once
+        // per copy queued
+        mutable std::mutex in_flight_mtx_;
+        std::unordered_map<uint64_t, std::vector<std::shared_ptr<const im::P2PMessage>>> in_flight_;
+        // Highest seq of each conversation with a failed message, under in_flight_mtx_
+        std::unordered_map<std::string, uint64_t> failed_seqs_;
+    };
+
+    AsyncMsgWriter();
     ~AsyncMsgWriter() { Stop(); };
 
-    void WorkerLoop();
+    void RegisterMetrics_();
+    // Sum of one counter over all shards
+    double Total_(std::atomic<uint64_t> Shard::*counter) const;
 
-    MPSCQueue<im::P2PMessage> queue_;
-    std::thread worker_;
-    std::atomic<bool> running_{false};
-    MsgScyllaDao dao_;
+    std::mutex mtx_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    Options options_;
+    bool running_{false};
 
-    static const size_t kBatchSize = 100;
+    // Outstanding single-partition writes per InsertConcurrent call, per shard
+    static const size_t kMaxInFlight = 256;
+    static const int kMaxRetries = 3;
 };
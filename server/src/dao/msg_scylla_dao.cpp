@@ -1,5 +1,13 @@
 #include "msg_scylla_dao.h"
 #include <cassandra.h>
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <numeric>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include "../log/log.h"
 #include "../pool/scylla_session.h"
 #include "../utils/id_generator.h"
@@ -14,86 +22,459 @@ std::string CassFutureError(CassFuture* future) {
     }
     return std::string(message, message_length);
 }
-}  // namespace
 
-bool MsgScyllaDao::InsertMessage(const im::P2PMessage& msg) {
-    auto* session = ScyllaSession::Instance()->Session();
-    if (!session) {
-        LOG_ERROR("Scylla session is not initialized");
-        return false;
+// Inbox buckets read together, the next wave is only sent if these fall short of the limit
+constexpr int64_t kBucketReadsInFlight = 8;
+// Outstanding content reads while a sync resolves its referencing inbox rows
+constexpr size_t kContentReadsInFlight = 256;
+
+CassFuture* ExecuteSelectLegacy(CassSession* session, uint64_t user_id) {
+    CassStatement* statement = ScyllaSession::Instance()->NewStatement(ScyllaQuery::SELECT_INBOX_LEGACY);
+    cass_statement_bind_int64(statement, 0, static_cast<cass_int64_t>(user_id));
+    CassFuture* future = cass_session_execute(session, statement);
+    cass_statement_free(statement);
+    return future;
+}
+
+CassFuture* ExecuteSelectBucket(CassSession* session, uint64_t user_id, int64_t bucket, size_t limit) {
+    CassStatement* statement = ScyllaSession::Instance()->NewStatement(ScyllaQuery::SELECT_INBOX_BUCKET);
+    cass_statement_bind_int64(statement, 0, static_cast<cass_int64_t>(user_id));
+    cass_statement_bind_int64(statement, 1, static_cast<cass_int64_t>(bucket));
+    cass_statement_bind_int32(statement, 2, static_cast<cass_int32_t>(limit));
+    CassFuture* future = cass_session_execute(session, statement);
+    cass_statement_free(statement);
+    return future;
+}
+
+// Newest and oldest inbox bucket a sync reads. Starts at tomorrow, a sender's clock may be ahead of ours
+// across midnight.
+std::pair<int64_t, int64_t> InboxBuckets() {
+    int64_t today = MsgScyllaDao::DayBucket(static_cast<int64_t>(time(nullptr)));
+    return {today + 1, today - ScyllaSession::Instance()->Options().inbox_lookback_days};
+}
+
+// Add the rows of the unbucketed table that result does not have yet (a backfill may have copied some)
+void MergeLegacy(std::vector<im::P2PMessage>* result, std::vector<im::P2PMessage> legacy) {
+    std::unordered_set<uint64_t> seen;
+    seen.reserve(result->size());
+    for (const auto& msg : *result) {
+        seen.insert(msg.msg_id());
     }
+    for (auto& msg : legacy) {
+        if (!seen.contains(msg.msg_id())) result->push_back(std::move(msg));
+    }
+    std::stable_sort(result->begin(), result->end(), [](const im::P2PMessage& a, const im::P2PMessage& b) {
+        return a.timestamp() > b.timestamp();
+    });
+}
 
-    // Use a batch to ensure atomicity and reduce round-trips
-    CassBatch* batch = cass_batch_new(CASS_BATCH_TYPE_LOGGED);
+CassFuture* ExecuteSelectContent(CassSession* session, const im::P2PMessage& msg) {
+    CassStatement* statement = ScyllaSession::Instance()->NewStatement(ScyllaQuery::SELECT_CONTENT);
+    auto p2p_conv_id = IdGenerator::GenerateP2PConvId(msg.sender_id(), msg.receiver_id());
+    cass_statement_bind_string(statement, 0, p2p_conv_id.c_str());
+    cass_statement_bind_int64(statement, 1, static_cast<cass_int64_t>(MsgScyllaDao::DayBucket(msg.timestamp())));
+    cass_statement_bind_int64(statement, 2, static_cast<cass_int64_t>(msg.timestamp()));
+    cass_statement_bind_int64(statement, 3, static_cast<cass_int64_t>(msg.msg_id()));
+    CassFuture* future = cass_session_execute(session, statement);
+    cass_statement_free(statement);
+    return future;
+}
+
+// Rows of one day of a user's inbox after a second, seconds oldest first but message ids descending within one
+CassFuture* ExecuteSelectSince(CassSession* session, uint64_t user_id, int64_t day, int64_t after_timestamp,
+                               size_t limit) {
+    CassStatement* statement = ScyllaSession::Instance()->NewStatement(ScyllaQuery::SELECT_INBOX_SINCE);
+    cass_statement_bind_int64(statement, 0, static_cast<cass_int64_t>(user_id));
+    cass_statement_bind_int64(statement, 1, static_cast<cass_int64_t>(day));
+    cass_statement_bind_int64(statement, 2, static_cast<cass_int64_t>(after_timestamp));
+    cass_statement_bind_int32(statement, 3, static_cast<cass_int32_t>(limit));
+    CassFuture* future = cass_session_execute(session, statement);
+    cass_statement_free(statement);
+    return future;
+}
+
+// Rows of one second of a user's inbox past a message id, ids ascending
+CassFuture* ExecuteSelectSinceAfterId(CassSession* session, uint64_t user_id, int64_t timestamp, uint64_t after_msg_id,
+                                      size_t limit) {
+    CassStatement* statement = ScyllaSession::Instance()->NewStatement(ScyllaQuery::SELECT_INBOX_SINCE_AFTER_ID);
+    cass_statement_bind_int64(statement, 0, static_cast<cass_int64_t>(user_id));
+    cass_statement_bind_int64(statement, 1, static_cast<cass_int64_t>(MsgScyllaDao::DayBucket(timestamp)));
+    cass_statement_bind_int64(statement, 2, static_cast<cass_int64_t>(timestamp));
+    cass_statement_bind_int64(statement, 3, static_cast<cass_int64_t>(after_msg_id));
+    cass_statement_bind_int32(statement, 4, static_cast<cass_int32_t>(limit));
+    CassFuture* future = cass_session_execute(session, statement);
+    cass_statement_free(statement);
+    return future;
+}
+
+// Last row a GetMessagesSince page returned, or the request's cursor: the next page starts right after it
+struct SincePosition {
+    int64_t timestamp;
+    uint64_t msg_id;
+
+    auto operator<=>(const SincePosition&) const = default;
+};
+
+// From the continuation token, the cursor for a first page
+SincePosition DecodeContinuation(const std::string& continuation, int64_t since_timestamp, uint64_t since_msg_id) {
+    SincePosition cursor{since_timestamp, since_msg_id};
+    if (continuation.size() != sizeof(SincePosition)) {
+        return cursor;
+    }
+    SincePosition position;
+    memcpy(&position.timestamp, continuation.data(), sizeof(int64_t));
+    memcpy(&position.msg_id, continuation.data() + sizeof(int64_t), sizeof(uint64_t));
+    // A token from another cursor cannot take us before this one
+    return std::max(position, cursor);
+}
+
+std::string EncodeContinuation(const SincePosition& position) {
+    std::string continuation(sizeof(SincePosition), '\0');
+    memcpy(continuation.data(), &position.timestamp, sizeof(int64_t));
+    memcpy(continuation.data() + sizeof(int64_t), &position.msg_id, sizeof(uint64_t));
+    return continuation;
+}
+
+// Oldest first, ids ascending within a second: the order a cursor moves in
+bool SinceOrder(const im::P2PMessage& a, const im::P2PMessage& b) {
+    return a.timestamp() != b.timestamp() ? a.timestamp() < b.timestamp() : a.msg_id() < b.msg_id();
+}
+
+// First day a GetMessagesSince page reads, no further back than the lookback
+int64_t FirstSinceDay() {
+    int64_t today = MsgScyllaDao::DayBucket(static_cast<int64_t>(time(nullptr)));
+    return today - ScyllaSession::Instance()->Options().inbox_lookback_days;
+}
+
+// Last day a GetMessagesSince page reads, tomorrow as for InboxBuckets
+int64_t LastSinceDay() { return MsgScyllaDao::DayBucket(static_cast<int64_t>(time(nullptr))) + 1; }
+
+// Rows of the cursor's second of a conversation past its message id
+CassFuture* ExecuteSelectHistoryAfterId(CassSession* session, const std::string& conv_id, int64_t timestamp,
+                                        uint64_t after_msg_id, size_t limit) {
+    CassStatement* statement = ScyllaSession::Instance()->NewStatement(ScyllaQuery::SELECT_HISTORY_AFTER_ID);
+    cass_statement_bind_string(statement, 0, conv_id.c_str());
+    cass_statement_bind_int64(statement, 1, static_cast<cass_int64_t>(MsgScyllaDao::DayBucket(timestamp)));
+    cass_statement_bind_int64(statement, 2, static_cast<cass_int64_t>(timestamp));
+    cass_statement_bind_int64(statement, 3, static_cast<cass_int64_t>(after_msg_id));
+    cass_statement_bind_int32(statement, 4, static_cast<cass_int32_t>(limit));
+    CassFuture* future = cass_session_execute(session, statement);
+    cass_statement_free(statement);
+    return future;
+}
+
+CassFuture* ExecuteSelectHistoryBefore(CassSession* session, const std::string& conv_id, int64_t day,
+                                       int64_t before_timestamp, size_t limit) {
+    CassStatement* statement = ScyllaSession::Instance()->NewStatement(ScyllaQuery::SELECT_HISTORY_BEFORE);
+    cass_statement_bind_string(statement, 0, conv_id.c_str());
+    cass_statement_bind_int64(statement, 1, static_cast<cass_int64_t>(day));
+    cass_statement_bind_int64(statement, 2, static_cast<cass_int64_t>(before_timestamp));
+    cass_statement_bind_int32(statement, 3, static_cast<cass_int32_t>(limit));
+    CassFuture* future = cass_session_execute(session, statement);
+    cass_statement_free(statement);
+    return future;
+}
+
+CassFuture* ExecuteSelectConvSeq(CassSession* session, const std::string& conv_id) {
+    CassStatement* statement = ScyllaSession::Instance()->NewStatement(ScyllaQuery::SELECT_CONV_SEQ);
+    cass_statement_bind_string(statement, 0, conv_id.c_str());
+    CassFuture* future = cass_session_execute(session, statement);
+    cass_statement_free(statement);
+    return future;
+}
+
+// Newest and oldest day a history page reads: the cursor's, or tomorrow as for InboxBuckets without one
+std::pair<int64_t, int64_t> HistoryBuckets(int64_t before_timestamp) {
+    int64_t today = MsgScyllaDao::DayBucket(static_cast<int64_t>(time(nullptr)));
+    int64_t newest = today + 1;
+    if (before_timestamp > 0) {
+        newest = std::min(newest, MsgScyllaDao::DayBucket(before_timestamp));
+    }
+    return {newest, today - ScyllaSession::Instance()->Options().history_lookback_days};
+}
+
+// Drop the rows past kInboxLimit and their references
+void TrimInbox(std::vector<im::P2PMessage>* result, std::vector<size_t>* refs) {
+    if (result->size() <= MsgScyllaDao::kInboxLimit) return;
+    result->resize(MsgScyllaDao::kInboxLimit);
+    if (refs) {
+        std::erase_if(*refs, [](size_t index) { return index >= MsgScyllaDao::kInboxLimit; });
+    }
+}
+
+void BindInbox(CassStatement* stmt, uint64_t owner_id, const im::P2PMessage& msg) {
+    const std::string& content = msg.content();
+    cass_statement_bind_int64(stmt, 0, static_cast<cass_int64_t>(owner_id));
+    cass_statement_bind_int64(stmt, 1, static_cast<cass_int64_t>(MsgScyllaDao::DayBucket(msg.timestamp())));
+    cass_statement_bind_int64(stmt, 2, static_cast<cass_int64_t>(msg.msg_id()));
+    cass_statement_bind_int64(stmt, 3, static_cast<cass_int64_t>(msg.sender_id()));
+    cass_statement_bind_int64(stmt, 4, static_cast<cass_int64_t>(msg.receiver_id()));
+    cass_statement_bind_int32(stmt, 5, static_cast<cass_int32_t>(msg.content_type()));
+    // Otherwise left unset, no cell is written and the column reads back as null
+    if (MsgScyllaDao::InlinesContent(msg)) {
+        cass_statement_bind_bytes(stmt, 6, reinterpret_cast<const cass_byte_t*>(content.data()), content.size());
+    }
+    cass_statement_bind_int64(stmt, 7, static_cast<cass_int64_t>(msg.timestamp()));
+    cass_statement_bind_int64(stmt, 8, static_cast<cass_int64_t>(msg.seq()));
+}
 
-    // 1. Insert into conversation history
-    constexpr const char* k_insert_history =
-        "INSERT INTO im.messages (conversation_id, timestamp, message_id, sender_id, "
-        "receiver_id, content_type, content) "
-        "VALUES (?, ?, ?, ?, ?, ?, ?);";
+// The three rows every message is written to, and the conversation's seq row written for the last of them
+enum class RowKind { HISTORY, RECEIVER_INBOX, SENDER_INBOX, CONV_SEQ };
+constexpr RowKind kRowKinds[] = {RowKind::HISTORY, RowKind::RECEIVER_INBOX, RowKind::SENDER_INBOX};
 
-    CassStatement* stmt_history = cass_statement_new(k_insert_history, 7);
+CassStatement* NewRowStatement(RowKind kind, const im::P2PMessage& msg) {
+    auto* scylla = ScyllaSession::Instance();
+    if (kind == RowKind::CONV_SEQ) {
+        CassStatement* conv_seq = scylla->NewStatement(ScyllaQuery::INSERT_CONV_SEQ);
+        auto p2p_conv_id = IdGenerator::GenerateP2PConvId(msg.sender_id(), msg.receiver_id());
+        cass_statement_bind_string(conv_seq, 0, p2p_conv_id.c_str());
+        cass_statement_bind_int64(conv_seq, 1, static_cast<cass_int64_t>(msg.seq()));
+        cass_statement_bind_int64(conv_seq, 2, static_cast<cass_int64_t>(msg.seq()));
+        return conv_seq;
+    }
+    if (kind != RowKind::HISTORY) {
+        CassStatement* inbox = scylla->NewStatement(ScyllaQuery::INSERT_INBOX);
+        BindInbox(inbox, kind == RowKind::RECEIVER_INBOX ? msg.receiver_id() : msg.sender_id(), msg);
+        return inbox;
+    }
+    CassStatement* history = scylla->NewStatement(ScyllaQuery::INSERT_HISTORY);
     auto p2p_conv_id = IdGenerator::GenerateP2PConvId(msg.sender_id(), msg.receiver_id());
-    cass_statement_bind_string(stmt_history, 0, p2p_conv_id.c_str());
-    cass_statement_bind_int64(stmt_history, 1, static_cast<cass_int64_t>(msg.timestamp()));
-    cass_statement_bind_int64(stmt_history, 2, static_cast<cass_int64_t>(msg.msg_id()));
-    cass_statement_bind_int64(stmt_history, 3, static_cast<cass_int64_t>(msg.sender_id()));
-    cass_statement_bind_int64(stmt_history, 4, static_cast<cass_int64_t>(msg.receiver_id()));
-    cass_statement_bind_int32(stmt_history, 5, static_cast<cass_int32_t>(msg.content_type()));
     const std::string& content = msg.content();
-    cass_statement_bind_bytes(stmt_history, 6, reinterpret_cast<const cass_byte_t*>(content.data()), content.size());
-
-    cass_batch_add_statement(batch, stmt_history);
-    cass_statement_free(stmt_history);
-
-    // 2. Insert into receiver's inbox (Sync/Offline retrieval)
-    constexpr const char* k_insert_inbox =
-        "INSERT INTO im.user_messages (user_id, message_id, sender_id, receiver_id, content_type, content, timestamp) "
-        "VALUES (?, ?, ?, ?, ?, ?, ?);";
-
-    // Insert for Receiver
-    CassStatement* stmt_inbox_receiver = cass_statement_new(k_insert_inbox, 7);
-    cass_statement_bind_int64(stmt_inbox_receiver, 0, static_cast<cass_int64_t>(msg.receiver_id()));
-    cass_statement_bind_int64(stmt_inbox_receiver, 1, static_cast<cass_int64_t>(msg.msg_id()));
-    cass_statement_bind_int64(stmt_inbox_receiver, 2, static_cast<cass_int64_t>(msg.sender_id()));
-    cass_statement_bind_int64(stmt_inbox_receiver, 3, static_cast<cass_int64_t>(msg.receiver_id()));
-    cass_statement_bind_int32(stmt_inbox_receiver, 4, static_cast<cass_int32_t>(msg.content_type()));
-    cass_statement_bind_bytes(stmt_inbox_receiver, 5, reinterpret_cast<const cass_byte_t*>(content.data()),
-                              content.size());
-    cass_statement_bind_int64(stmt_inbox_receiver, 6, static_cast<cass_int64_t>(msg.timestamp()));
-
-    cass_batch_add_statement(batch, stmt_inbox_receiver);
-    cass_statement_free(stmt_inbox_receiver);
-
-    // Insert for Sender (Sync Sent messages)
-    CassStatement* stmt_inbox_sender = cass_statement_new(k_insert_inbox, 7);
-    cass_statement_bind_int64(stmt_inbox_sender, 0, static_cast<cass_int64_t>(msg.sender_id()));
-    cass_statement_bind_int64(stmt_inbox_sender, 1, static_cast<cass_int64_t>(msg.msg_id()));
-    cass_statement_bind_int64(stmt_inbox_sender, 2, static_cast<cass_int64_t>(msg.sender_id()));
-    cass_statement_bind_int64(stmt_inbox_sender, 3, static_cast<cass_int64_t>(msg.receiver_id()));
-    cass_statement_bind_int32(stmt_inbox_sender, 4, static_cast<cass_int32_t>(msg.content_type()));
-    cass_statement_bind_bytes(stmt_inbox_sender, 5, reinterpret_cast<const cass_byte_t*>(content.data()),
-                              content.size());
-    cass_statement_bind_int64(stmt_inbox_sender, 6, static_cast<cass_int64_t>(msg.timestamp()));
-
-    cass_batch_add_statement(batch, stmt_inbox_sender);
-    cass_statement_free(stmt_inbox_sender);
-
-    // Execute Batch·
+    cass_statement_bind_string(history, 0, p2p_conv_id.c_str());
+    cass_statement_bind_int64(history, 1, static_cast<cass_int64_t>(MsgScyllaDao::DayBucket(msg.timestamp())));
+    cass_statement_bind_int64(history, 2, static_cast<cass_int64_t>(msg.timestamp()));
+    cass_statement_bind_int64(history, 3, static_cast<cass_int64_t>(msg.msg_id()));
+    cass_statement_bind_int64(history, 4, static_cast<cass_int64_t>(msg.sender_id()));
+    cass_statement_bind_int64(history, 5, static_cast<cass_int64_t>(msg.receiver_id()));
+    cass_statement_bind_int32(history, 6, static_cast<cass_int32_t>(msg.content_type()));
+    cass_statement_bind_bytes(history, 7, reinterpret_cast<const cass_byte_t*>(content.data()), content.size());
+    cass_statement_bind_int64(history, 8, static_cast<cass_int64_t>(msg.seq()));
+    return history;
+}
+
+// Index in msgs of the highest seq of each conversation, its CONV_SEQ row covers the lower ones. Messages
+// without a seq have none.
+std::vector<size_t> ConvSeqRows(const std::vector<im::P2PMessage>& msgs) {
+    std::unordered_map<std::string, size_t> highest;
+    for (size_t i = 0; i < msgs.size(); i++) {
+        if (msgs[i].seq() == 0) continue;
+        auto [it, inserted] =
+            highest.try_emplace(IdGenerator::GenerateP2PConvId(msgs[i].sender_id(), msgs[i].receiver_id()), i);
+        if (!inserted && msgs[i].seq() > msgs[it->second].seq()) {
+            it->second = i;
+        }
+    }
+    std::vector<size_t> rows;
+    rows.reserve(highest.size());
+    for (const auto& [conv_id, index] : highest) {
+        rows.push_back(index);
+    }
+    return rows;
+}
+
+// Partition a row lands in, rows with equal keys can share an UNLOGGED batch
+std::string PartitionKey(RowKind kind, const im::P2PMessage& msg) {
+    auto bucket = "/" + std::to_string(MsgScyllaDao::DayBucket(msg.timestamp()));
+    switch (kind) {
+        case RowKind::HISTORY:
+            return "c" + IdGenerator::GenerateP2PConvId(msg.sender_id(), msg.receiver_id()) + bucket;
+        case RowKind::RECEIVER_INBOX:
+            return "u" + std::to_string(msg.receiver_id()) + bucket;
+        case RowKind::CONV_SEQ:
+            return "s" + IdGenerator::GenerateP2PConvId(msg.sender_id(), msg.receiver_id());
+        case RowKind::SENDER_INBOX:
+        default:
+            return "u" + std::to_string(msg.sender_id()) + bucket;
+    }
+}
+
+CassBatch* NewInsertBatch(const std::vector<im::P2PMessage>& msgs) {
+    CassBatch* batch = cass_batch_new(CASS_BATCH_TYPE_LOGGED);
+    cass_batch_set_consistency(batch, ScyllaSession::Instance()->WriteConsistency());
+
+    for (const auto& msg : msgs) {
+        for (RowKind kind : kRowKinds) {
+            CassStatement* stmt = NewRowStatement(kind, msg);
+            cass_batch_add_statement(batch, stmt);
+            cass_statement_free(stmt);
+        }
+    }
+    for (size_t index : ConvSeqRows(msgs)) {
+        CassStatement* stmt = NewRowStatement(RowKind::CONV_SEQ, msgs[index]);
+        cass_batch_add_statement(batch, stmt);
+        cass_statement_free(stmt);
+    }
+    return batch;
+}
+
+// Rows of one partition, written in one request
+struct WriteGroup {
+    std::vector<std::pair<RowKind, size_t>> rows;  // (kind, index into msgs)
+};
+
+CassFuture* ExecuteGroup(CassSession* session, const WriteGroup& group, const std::vector<im::P2PMessage>& msgs) {
+    if (group.rows.size() == 1) {
+        CassStatement* stmt = NewRowStatement(group.rows[0].first, msgs[group.rows[0].second]);
+        CassFuture* future = cass_session_execute(session, stmt);
+        cass_statement_free(stmt);
+        return future;
+    }
+    // Single partition, so no batchlog and one replica set; routed by the first statement's key
+    CassBatch* batch = cass_batch_new(CASS_BATCH_TYPE_UNLOGGED);
+    cass_batch_set_consistency(batch, ScyllaSession::Instance()->WriteConsistency());
+    for (const auto& [kind, index] : group.rows) {
+        CassStatement* stmt = NewRowStatement(kind, msgs[index]);
+        cass_batch_add_statement(batch, stmt);
+        cass_statement_free(stmt);
+    }
     CassFuture* future = cass_session_execute_batch(session, batch);
-    cass_future_wait(future);
+    cass_batch_free(batch);
+    return future;
+}
 
-    bool ok = true;
+bool IsRetryable(CassError rc) {
+    switch (rc) {
+        case CASS_ERROR_LIB_NO_HOSTS_AVAILABLE:
+        case CASS_ERROR_LIB_REQUEST_TIMED_OUT:
+        case CASS_ERROR_LIB_NO_STREAMS:
+        case CASS_ERROR_SERVER_WRITE_TIMEOUT:
+        case CASS_ERROR_SERVER_OVERLOADED:
+        case CASS_ERROR_SERVER_UNAVAILABLE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// The server forgot a prepared id (restart or schema change), prepare again and let the caller retry once
+bool ShouldReprepare(CassFuture* future) {
+    if (cass_future_error_code(future) != CASS_ERROR_SERVER_UNPREPARED) {
+        return false;
+    }
+    LOG_WARN("Scylla statement unprepared: {}", CassFutureError(future));
+    return ScyllaSession::Instance()->Reprepare();
+}
+
+// The future of execute() (a new request each call, or sent if it is already in flight), sent once more after
+// re-preparing if the server had forgotten the statement. The caller frees it.
+template <typename F>
+Async<CassFuture*> ExecuteWithReprepare(F execute, ThreadPool* resume_pool, CassFuture* sent = nullptr) {
+    CassFuture* future = co_await CassFutureAwaiter(sent ? sent : execute(), resume_pool);
+    if (ShouldReprepare(future)) {
+        cass_future_free(future);
+        future = co_await CassFutureAwaiter(execute(), resume_pool);
+    }
+    co_return future;
+}
+
+// Rows of a finished inbox select, false if it failed. The indices in *result of the rows without content
+// (references) go to refs.
+bool ReadMessages(CassFuture* future, std::vector<im::P2PMessage>* result, std::vector<size_t>* refs = nullptr) {
     if (cass_future_error_code(future) != CASS_OK) {
-        LOG_ERROR("Scylla batch insert failed: {}", CassFutureError(future));
-        ok = false;
+        LOG_ERROR("Scylla query failed: {}", CassFutureError(future));
+        return false;
+    }
+    const CassResult* cass_result = cass_future_get_result(future);
+    CassIterator* iterator = cass_iterator_from_result(cass_result);
+
+    while (cass_iterator_next(iterator)) {
+        const CassRow* row = cass_iterator_get_row(iterator);
+        im::P2PMessage msg;
+        cass_int64_t msg_id, sender_id, receiver_id, ts;
+        cass_int32_t c_type;
+        const cass_byte_t* c_data;
+        size_t c_len;
+
+        cass_value_get_int64(cass_row_get_column(row, 0), &msg_id);
+        cass_value_get_int64(cass_row_get_column(row, 1), &sender_id);
+        cass_value_get_int64(cass_row_get_column(row, 2), &receiver_id);
+        cass_value_get_int32(cass_row_get_column(row, 3), &c_type);
+        const CassValue* content = cass_row_get_column(row, 4);
+        cass_value_get_int64(cass_row_get_column(row, 5), &ts);
+
+        msg.set_msg_id(msg_id);
+        msg.set_sender_id(sender_id);
+        msg.set_receiver_id(receiver_id);
+        msg.set_content_type(static_cast<im::ContentType>(c_type));
+        if (cass_value_is_null(content)) {
+            if (refs) refs->push_back(result->size());
+        } else {
+            cass_value_get_bytes(content, &c_data, &c_len);
+            msg.set_content(reinterpret_cast<const char*>(c_data), c_len);
+        }
+        msg.set_timestamp(ts);
+        // The unbucketed tables have no seq, rows from before seqs a null one
+        if (cass_result_column_count(cass_result) > 6) {
+            const CassValue* seq = cass_row_get_column(row, 6);
+            cass_int64_t seq_value = 0;
+            if (!cass_value_is_null(seq) && cass_value_get_int64(seq, &seq_value) == CASS_OK) {
+                msg.set_seq(static_cast<uint64_t>(seq_value));
+            }
+        }
+
+        result->push_back(std::move(msg));
     }
+    cass_iterator_free(iterator);
+    cass_result_free(cass_result);
+    return true;
+}
 
+// Content of a finished SELECT_CONTENT into msg
+void ReadContent(CassFuture* future, im::P2PMessage* msg) {
+    if (cass_future_error_code(future) != CASS_OK) {
+        LOG_ERROR("Scylla content read of message {} failed: {}", msg->msg_id(), CassFutureError(future));
+        return;
+    }
+    const CassResult* cass_result = cass_future_get_result(future);
+    const CassRow* row = cass_result_first_row(cass_result);
+    const cass_byte_t* c_data;
+    size_t c_len;
+    if (row && cass_value_get_bytes(cass_row_get_column(row, 0), &c_data, &c_len) == CASS_OK) {
+        msg->set_content(reinterpret_cast<const char*>(c_data), c_len);
+    } else {
+        // The inbox row got written but the history row not yet (or never, the writer retries the message)
+        LOG_WARN("History row of message {} not found, synced without content", msg->msg_id());
+    }
+    cass_result_free(cass_result);
+}
+
+// Fill in the content of the messages at refs from their history rows, kContentReadsInFlight at a time
+Async<void> ResolveReferencesAsync(CassSession* session, std::vector<im::P2PMessage>* msgs,
+                                   const std::vector<size_t>& refs, ThreadPool* resume_pool) {
+    std::deque<std::pair<CassFuture*, size_t>> window;
+    size_t next = 0;
+    while (next < refs.size() || !window.empty()) {
+        while (next < refs.size() && window.size() < kContentReadsInFlight) {
+            window.emplace_back(ExecuteSelectContent(session, (*msgs)[refs[next]]), refs[next]);
+            next++;
+        }
+        auto [sent, index] = window.front();
+        window.pop_front();
+        CassFuture* future = co_await ExecuteWithReprepare(
+            [&, index = index]() { return ExecuteSelectContent(session, (*msgs)[index]); }, resume_pool, sent);
+        ReadContent(future, &(*msgs)[index]);
+        cass_future_free(future);
+    }
+}
+
+// Up to limit rows of one second of a user's inbox past after_msg_id appended to *out, false if the read failed
+Async<bool> ReadSinceSecond(CassSession* session, uint64_t user_id, int64_t timestamp, uint64_t after_msg_id,
+                            size_t limit, std::vector<im::P2PMessage>* out, std::vector<size_t>* refs,
+                            ThreadPool* resume_pool) {
+    CassFuture* future = co_await ExecuteWithReprepare(
+        [&]() { return ExecuteSelectSinceAfterId(session, user_id, timestamp, after_msg_id, limit); }, resume_pool);
+    bool ok = ReadMessages(future, out, refs);
     cass_future_free(future);
-    cass_batch_free(batch);
-    return ok;
+    co_return ok;
+}
+}  // namespace
+
+bool MsgScyllaDao::InlinesContent(const im::P2PMessage& msg) {
+    return msg.content().size() <= ScyllaSession::Instance()->Options().inbox_inline_bytes;
 }
 
+bool MsgScyllaDao::InsertMessage(const im::P2PMessage& msg) { return InsertBatch({msg}); }
+
 bool MsgScyllaDao::InsertBatch(const std::vector<im::P2PMessage>& msgs) {
     if (msgs.empty()) return true;
 
@@ -103,121 +484,309 @@ bool MsgScyllaDao::InsertBatch(const std::vector<im::P2PMessage>& msgs) {
         return false;
     }
 
-    CassBatch* batch = cass_batch_new(CASS_BATCH_TYPE_LOGGED);
+    CassFuture* future = SyncWait(ExecuteWithReprepare(
+        [&]() {
+            CassBatch* batch = NewInsertBatch(msgs);
+            CassFuture* sent = cass_session_execute_batch(session, batch);
+            cass_batch_free(batch);
+            return sent;
+        },
+        SyncWaitPool()));
+    bool ok = cass_future_error_code(future) == CASS_OK;
+    if (!ok) {
+        LOG_ERROR("Scylla batch insert failed: {}", CassFutureError(future));
+    }
+    cass_future_free(future);
+    return ok;
+}
 
-    constexpr const char* k_insert_history =
-        "INSERT INTO im.messages (conversation_id, timestamp, message_id, sender_id, "
-        "receiver_id, content_type, content) "
-        "VALUES (?, ?, ?, ?, ?, ?, ?);";
+std::vector<size_t> MsgScyllaDao::InsertConcurrent(const std::vector<im::P2PMessage>& msgs, size_t max_in_flight,
+                                                   int max_retries) {
+    if (msgs.empty()) return {};
 
-    constexpr const char* k_insert_inbox =
-        "INSERT INTO im.user_messages (user_id, message_id, sender_id, receiver_id, content_type, content, timestamp) "
-        "VALUES (?, ?, ?, ?, ?, ?, ?);";
+    auto* session = ScyllaSession::Instance()->Session();
+    if (!session) {
+        LOG_ERROR("Scylla session is not initialized");
+        std::vector<size_t> all(msgs.size());
+        std::iota(all.begin(), all.end(), 0);
+        return all;
+    }
 
-    for (const auto& msg : msgs) {
-        // 1. History
-        CassStatement* stmt1 = cass_statement_new(k_insert_history, 7);
-        auto p2p_conv_id = IdGenerator::GenerateP2PConvId(msg.sender_id(), msg.receiver_id());
-        cass_statement_bind_string(stmt1, 0, p2p_conv_id.c_str());
-        cass_statement_bind_int64(stmt1, 1, static_cast<cass_int64_t>(msg.timestamp()));
-        cass_statement_bind_int64(stmt1, 2, static_cast<cass_int64_t>(msg.msg_id()));
-        cass_statement_bind_int64(stmt1, 3, static_cast<cass_int64_t>(msg.sender_id()));
-        cass_statement_bind_int64(stmt1, 4, static_cast<cass_int64_t>(msg.receiver_id()));
-        cass_statement_bind_int32(stmt1, 5, static_cast<cass_int32_t>(msg.content_type()));
-        const std::string& content = msg.content();
-        cass_statement_bind_bytes(stmt1, 6, reinterpret_cast<const cass_byte_t*>(content.data()), content.size());
-        cass_batch_add_statement(batch, stmt1);
-        cass_statement_free(stmt1);
-
-        // 2. Receiver Inbox
-        CassStatement* stmt2 = cass_statement_new(k_insert_inbox, 7);
-        cass_statement_bind_int64(stmt2, 0, static_cast<cass_int64_t>(msg.receiver_id()));
-        cass_statement_bind_int64(stmt2, 1, static_cast<cass_int64_t>(msg.msg_id()));
-        cass_statement_bind_int64(stmt2, 2, static_cast<cass_int64_t>(msg.sender_id()));
-        cass_statement_bind_int64(stmt2, 3, static_cast<cass_int64_t>(msg.receiver_id()));
-        cass_statement_bind_int32(stmt2, 4, static_cast<cass_int32_t>(msg.content_type()));
-        cass_statement_bind_bytes(stmt2, 5, reinterpret_cast<const cass_byte_t*>(content.data()), content.size());
-        cass_statement_bind_int64(stmt2, 6, static_cast<cass_int64_t>(msg.timestamp()));
-        cass_batch_add_statement(batch, stmt2);
-        cass_statement_free(stmt2);
-
-        // 3. Sender Inbox
-        CassStatement* stmt3 = cass_statement_new(k_insert_inbox, 7);
-        cass_statement_bind_int64(stmt3, 0, static_cast<cass_int64_t>(msg.sender_id()));
-        cass_statement_bind_int64(stmt3, 1, static_cast<cass_int64_t>(msg.msg_id()));
-        cass_statement_bind_int64(stmt3, 2, static_cast<cass_int64_t>(msg.sender_id()));
-        cass_statement_bind_int64(stmt3, 3, static_cast<cass_int64_t>(msg.receiver_id()));
-        cass_statement_bind_int32(stmt3, 4, static_cast<cass_int32_t>(msg.content_type()));
-        cass_statement_bind_bytes(stmt3, 5, reinterpret_cast<const cass_byte_t*>(content.data()), content.size());
-        cass_statement_bind_int64(stmt3, 6, static_cast<cass_int64_t>(msg.timestamp()));
-        cass_batch_add_statement(batch, stmt3);
-        cass_statement_free(stmt3);
+    std::vector<WriteGroup> groups;
+    std::unordered_map<std::string, size_t> group_of;
+    group_of.reserve(msgs.size() * 3);
+    for (size_t i = 0; i < msgs.size(); i++) {
+        for (RowKind kind : kRowKinds) {
+            auto [it, inserted] = group_of.try_emplace(PartitionKey(kind, msgs[i]), groups.size());
+            if (inserted) {
+                groups.emplace_back();
+            }
+            groups[it->second].rows.emplace_back(kind, i);
+        }
+    }
+    // One row per conversation, its own partition
+    for (size_t index : ConvSeqRows(msgs)) {
+        groups.emplace_back();
+        groups.back().rows.emplace_back(RowKind::CONV_SEQ, index);
     }
 
-    CassFuture* future = cass_session_execute_batch(session, batch);
-    cass_future_wait(future);
+    struct InFlight {
+        CassFuture* future;
+        size_t group;
+        int attempt;
+    };
+    std::deque<InFlight> window;
+    std::vector<bool> failed(msgs.size(), false);
+    size_t next = 0;
+    if (max_in_flight == 0) max_in_flight = 1;
+
+    // All requests are in flight together, waiting on the oldest first costs nothing over waiting on any
+    while (next < groups.size() || !window.empty()) {
+        while (next < groups.size() && window.size() < max_in_flight) {
+            window.push_back({ExecuteGroup(session, groups[next], msgs), next, 0});
+            next++;
+        }
+        InFlight head = window.front();
+        window.pop_front();
+        cass_future_wait(head.future);
+        CassError rc = cass_future_error_code(head.future);
+        if (rc != CASS_OK) {
+            bool unprepared = rc == CASS_ERROR_SERVER_UNPREPARED && ShouldReprepare(head.future);
+            if (head.attempt < max_retries && (unprepared || IsRetryable(rc))) {
+                LOG_WARN("Scylla write to one partition failed ({}), retry {}/{}", CassFutureError(head.future),
+                         head.attempt + 1, max_retries);
+                window.push_back({ExecuteGroup(session, groups[head.group], msgs), head.group, head.attempt + 1});
+            } else {
+                LOG_ERROR("Scylla write of {} rows failed: {}", groups[head.group].rows.size(),
+                          CassFutureError(head.future));
+                for (const auto& row : groups[head.group].rows) {
+                    failed[row.second] = true;
+                }
+            }
+        }
+        cass_future_free(head.future);
+    }
 
-    bool ok = true;
-    if (cass_future_error_code(future) != CASS_OK) {
-        LOG_ERROR("Scylla batch insert failed: {}", CassFutureError(future));
-        ok = false;
+    std::vector<size_t> unwritten;
+    for (size_t i = 0; i < msgs.size(); i++) {
+        if (failed[i]) unwritten.push_back(i);
     }
+    return unwritten;
+}
 
-    cass_future_free(future);
-    cass_batch_free(batch);
-    return ok;
+bool MsgScyllaDao::GetMessagesForUser(uint64_t user_id, std::vector<im::P2PMessage>* out) {
+    return SyncWait(GetMessagesForUserAsync(user_id, out, SyncWaitPool()));
 }
 
-std::vector<im::P2PMessage> MsgScyllaDao::GetMessagesForUser(uint64_t user_id) {
+Async<bool> MsgScyllaDao::GetMessagesForUserAsync(uint64_t user_id, std::vector<im::P2PMessage>* out,
+                                                  ThreadPool* resume_pool) {
     std::vector<im::P2PMessage> result;
+    InboxSink collect = [&result](int64_t, std::vector<im::P2PMessage> rows) -> Async<bool> {
+        result.insert(result.end(), std::make_move_iterator(rows.begin()), std::make_move_iterator(rows.end()));
+        co_return true;
+    };
+    if (!co_await ReadInboxAsync(user_id, collect, resume_pool)) co_return false;
+    out->insert(out->end(), std::make_move_iterator(result.begin()), std::make_move_iterator(result.end()));
+    co_return true;
+}
+
+std::vector<im::P2PMessage> MsgScyllaDao::TakeFromBucket(std::vector<im::P2PMessage>* messages, int64_t bucket) {
+    std::vector<im::P2PMessage> taken;
+    std::erase_if(*messages, [&](im::P2PMessage& msg) {
+        if (DayBucket(msg.timestamp()) < bucket) return false;
+        taken.push_back(std::move(msg));
+        return true;
+    });
+    return taken;
+}
+
+Async<bool> MsgScyllaDao::ReadInboxAsync(uint64_t user_id, const InboxSink& sink, ThreadPool* resume_pool) {
     auto* session = ScyllaSession::Instance()->Session();
-    if (!session) return result;
+    if (!session) co_return false;
+
+    // The unbucketed table has no days to walk, it is read first and its rows go out with the bucket of their day
+    std::vector<im::P2PMessage> legacy;
+    if (ScyllaSession::Instance()->Options().legacy_inbox) {
+        CassFuture* future =
+            co_await ExecuteWithReprepare([&]() { return ExecuteSelectLegacy(session, user_id); }, resume_pool);
+        bool ok = ReadMessages(future, &legacy);
+        cass_future_free(future);
+        if (!ok) co_return false;
+    }
+
+    auto [newest, oldest] = InboxBuckets();
+    size_t passed = 0;
+    bool ok = true;
+    bool wanted = true;
+    std::vector<CassFuture*> futures;
+    for (int64_t first = newest; ok && wanted && first >= oldest && passed < kInboxLimit;
+         first -= kBucketReadsInFlight) {
+        size_t limit = kInboxLimit - passed;
+        futures.clear();
+        for (int64_t bucket = first; bucket >= oldest && bucket > first - kBucketReadsInFlight; bucket--) {
+            futures.push_back(ExecuteSelectBucket(session, user_id, bucket, limit));
+        }
+        // Newest first, the older ones keep arriving meanwhile. Every future is waited for, also after a failure.
+        for (size_t i = 0; i < futures.size(); i++) {
+            int64_t bucket = first - static_cast<int64_t>(i);
+            CassFuture* future = co_await ExecuteWithReprepare(
+                [&]() { return ExecuteSelectBucket(session, user_id, bucket, limit); }, resume_pool, futures[i]);
+            std::vector<im::P2PMessage> rows;
+            std::vector<size_t> refs;
+            bool use = ok && wanted && passed < kInboxLimit;
+            // A day that failed would leave a hole that looks like an empty day, the whole read fails
+            if (use) {
+                ok = ReadMessages(future, &rows, &refs);
+            }
+            cass_future_free(future);
+            if (!use || !ok) continue;
+
+            // A bucket is asked for what was missing before its wave, so it may overshoot. Trimmed before the
+            // references are resolved, the extra rows cost no content read.
+            size_t room = kInboxLimit - passed;
+            if (rows.size() > room) {
+                rows.resize(room);
+                std::erase_if(refs, [room](size_t index) { return index >= room; });
+            }
+            co_await ResolveReferencesAsync(session, &rows, refs, resume_pool);
+            if (!legacy.empty()) {
+                // Backfilled rows are in both tables, under the same day
+                MergeLegacy(&rows, TakeFromBucket(&legacy, bucket == oldest ? INT64_MIN : bucket));
+                if (rows.size() > room) rows.resize(room);
+            }
+            passed += rows.size();
+            wanted = co_await sink(bucket, std::move(rows));
+        }
+    }
+    co_return ok;
+}
 
-    constexpr const char* k_select_latest =
-        "SELECT message_id, sender_id, receiver_id, content_type, content, timestamp FROM im.user_messages "
-        "WHERE user_id = ? ORDER BY timestamp DESC LIMIT 500;";
+bool MsgScyllaDao::GetMessagesSince(uint64_t user_id, int64_t since_timestamp, uint64_t since_msg_id,
+                                    size_t page_size, std::string* continuation, std::vector<im::P2PMessage>* out) {
+    return SyncWait(GetMessagesSinceAsync(user_id, since_timestamp, since_msg_id, page_size, continuation, out,
+                                          SyncWaitPool()));
+}
 
-    CassStatement* statement = cass_statement_new(k_select_latest, 1);
-    cass_statement_bind_int64(statement, 0, static_cast<cass_int64_t>(user_id));
+Async<bool> MsgScyllaDao::GetMessagesSinceAsync(uint64_t user_id, int64_t since_timestamp, uint64_t since_msg_id,
+                                                size_t page_size, std::string* continuation,
+                                                std::vector<im::P2PMessage>* out, ThreadPool* resume_pool) {
+    auto* session = ScyllaSession::Instance()->Session();
+    if (!session) co_return false;
+
+    auto position = DecodeContinuation(*continuation, since_timestamp, since_msg_id);
+    const int64_t first_day = FirstSinceDay();
+    const int64_t last = LastSinceDay();
+    size_t first_row = out->size();
+    std::vector<size_t> refs;
+    bool more = false;
+    if (MsgScyllaDao::DayBucket(position.timestamp) >= first_day) {
+        if (!co_await ReadSinceSecond(session, user_id, position.timestamp, position.msg_id, page_size, out, &refs,
+                                      resume_pool)) {
+            co_return false;
+        }
+        more = out->size() - first_row == page_size;
+    }
+    // Days are read one after the other, an empty one costs a round trip that returns nothing
+    for (int64_t day = std::max(MsgScyllaDao::DayBucket(position.timestamp), first_day); !more && day <= last; day++) {
+        size_t wanted = page_size - (out->size() - first_row);
+        size_t day_first = out->size();
+        CassFuture* future = co_await ExecuteWithReprepare(
+            [&]() { return ExecuteSelectSince(session, user_id, day, position.timestamp, wanted); }, resume_pool);
+        bool ok = ReadMessages(future, out, &refs);
+        cass_future_free(future);
+        if (!ok) co_return false;
+        if (out->size() - day_first < wanted) continue;
+
+        // The page is full and its last second may go on past it with lower ids. Only whole seconds are kept, the
+        // next page starts after them; a second that fills the page alone is read again in id order.
+        more = true;
+        int64_t last_second = out->back().timestamp();
+        auto cut = std::find_if(out->begin() + static_cast<ptrdiff_t>(day_first), out->end(),
+                                [&](const im::P2PMessage& msg) { return msg.timestamp() == last_second; });
+        size_t kept = static_cast<size_t>(cut - out->begin());
+        out->erase(cut, out->end());
+        std::erase_if(refs, [&](size_t index) { return index >= kept; });
+        if (kept == day_first &&
+            !co_await ReadSinceSecond(session, user_id, last_second, 0, wanted, out, &refs, resume_pool)) {
+            co_return false;
+        }
+    }
+    co_await ResolveReferencesAsync(session, out, refs, resume_pool);
+    std::stable_sort(out->begin() + static_cast<ptrdiff_t>(first_row), out->end(), SinceOrder);
+    *continuation = more && out->size() > first_row
+                        ? EncodeContinuation({out->back().timestamp(), out->back().msg_id()})
+                        : std::string();
+    co_return true;
+}
 
-    CassFuture* future = cass_session_execute(session, statement);
-    cass_future_wait(future);
-
-    if (cass_future_error_code(future) == CASS_OK) {
-        const CassResult* cass_result = cass_future_get_result(future);
-        CassIterator* iterator = cass_iterator_from_result(cass_result);
-
-        while (cass_iterator_next(iterator)) {
-            const CassRow* row = cass_iterator_get_row(iterator);
-            im::P2PMessage msg;
-            cass_int64_t msg_id, sender_id, receiver_id, ts;
-            cass_int32_t c_type;
-            const cass_byte_t* c_data;
-            size_t c_len;
-
-            cass_value_get_int64(cass_row_get_column(row, 0), &msg_id);
-            cass_value_get_int64(cass_row_get_column(row, 1), &sender_id);
-            cass_value_get_int64(cass_row_get_column(row, 2), &receiver_id);
-            cass_value_get_int32(cass_row_get_column(row, 3), &c_type);
-            cass_value_get_bytes(cass_row_get_column(row, 4), &c_data, &c_len);
-            cass_value_get_int64(cass_row_get_column(row, 5), &ts);
-
-            msg.set_msg_id(msg_id);
-            msg.set_sender_id(sender_id);
-            msg.set_receiver_id(receiver_id);
-            msg.set_content_type(static_cast<im::ContentType>(c_type));
-            msg.set_content(reinterpret_cast<const char*>(c_data), c_len);
-            msg.set_timestamp(ts);
+Async<bool> MsgScyllaDao::GetHistoryAsync(uint64_t user_id, uint64_t peer_id, int64_t before_timestamp,
+                                          uint64_t before_msg_id, size_t limit, std::vector<im::P2PMessage>* out,
+                                          ThreadPool* resume_pool) {
+    auto* session = ScyllaSession::Instance()->Session();
+    if (!session) co_return false;
+
+    auto conv_id = IdGenerator::GenerateP2PConvId(user_id, peer_id);
+    size_t first_row = out->size();
+    auto read = [&]() { return out->size() - first_row; };
+    if (before_timestamp > 0) {
+        CassFuture* future = co_await ExecuteWithReprepare(
+            [&]() { return ExecuteSelectHistoryAfterId(session, conv_id, before_timestamp, before_msg_id, limit); },
+            resume_pool);
+        bool ok = ReadMessages(future, out);
+        cass_future_free(future);
+        if (!ok) co_return false;
+    }
 
-            result.push_back(std::move(msg));
+    // History rows always hold their content, nothing to resolve
+    int64_t before = before_timestamp > 0 ? before_timestamp : INT64_MAX;
+    auto [newest, oldest] = HistoryBuckets(before_timestamp);
+    std::vector<CassFuture*> futures;
+    for (int64_t first = newest; first >= oldest && read() < limit; first -= kBucketReadsInFlight) {
+        size_t wanted = limit - read();
+        futures.clear();
+        for (int64_t day = first; day >= oldest && day > first - kBucketReadsInFlight; day--) {
+            futures.push_back(ExecuteSelectHistoryBefore(session, conv_id, day, before, wanted));
         }
-        cass_iterator_free(iterator);
-        cass_result_free(cass_result);
-    } else {
-        LOG_ERROR("Scylla query failed: {}", CassFutureError(future));
+        bool ok = true;
+        for (size_t i = 0; i < futures.size(); i++) {
+            int64_t day = first - static_cast<int64_t>(i);
+            CassFuture* future = co_await ExecuteWithReprepare(
+                [&]() { return ExecuteSelectHistoryBefore(session, conv_id, day, before, wanted); }, resume_pool,
+                futures[i]);
+            // Once a day failed the older ones cannot follow it
+            if (ok && read() < limit) {
+                ok = ReadMessages(future, out);
+            }
+            cass_future_free(future);
+        }
+        if (!ok) co_return false;
+    }
+    if (read() > limit) {
+        out->resize(first_row + limit);
     }
+    co_return true;
+}
 
+Async<bool> MsgScyllaDao::GetConversationSeqAsync(uint64_t user_id, uint64_t peer_id, uint64_t* seq,
+                                                  ThreadPool* resume_pool) {
+    auto* session = ScyllaSession::Instance()->Session();
+    if (!session) co_return false;
+
+    auto conv_id = IdGenerator::GenerateP2PConvId(user_id, peer_id);
+    CassFuture* future =
+        co_await ExecuteWithReprepare([&]() { return ExecuteSelectConvSeq(session, conv_id); }, resume_pool);
+    if (cass_future_error_code(future) != CASS_OK) {
+        LOG_ERROR("Scylla seq read of conversation {} failed: {}", conv_id, CassFutureError(future));
+        cass_future_free(future);
+        co_return false;
+    }
+    const CassResult* cass_result = cass_future_get_result(future);
+    const CassRow* row = cass_result_first_row(cass_result);
+    cass_int64_t value = 0;
+    // No row: nothing written with a seq yet
+    bool found = row && cass_value_get_int64(cass_row_get_column(row, 0), &value) == CASS_OK;
+    *seq = found ? static_cast<uint64_t>(value) : 0;
+    cass_result_free(cass_result);
     cass_future_free(future);
-    cass_statement_free(statement);
-    return result;
+    co_return true;
 }
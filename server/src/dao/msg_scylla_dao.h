@@ -1,13 +1,96 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+#include "../pool/threadpool.h"
+#include "../utils/coro.h"
 #include "message_service.pb.h"
 
+/**
+ * MsgScyllaDao - P2P message rows in Scylla
+ *
+ * Conversation history (im.messages_by_day) and inboxes (im.user_messages_by_day) are partitioned by day
+ * (DayBucket of the message timestamp) so a heavy user's partitions stop growing after a day. An inbox read
+ * goes back from the newest bucket, kBucketReadsInFlight buckets at a time, until it has its limit or has
+ * covered SCYLLA_INBOX_LOOKBACK_DAYS, and hands each bucket on as soon as it and the newer ones are read (a
+ * streamed sync sends them before the older days arrive). With SCYLLA_LEGACY_INBOX the old unbucketed table is
+ * read first and its rows join the bucket of their day.
+ *
+ * Only the history row always holds the content. An inbox row copies it when it is at most
+ * SCYLLA_INBOX_INLINE_BYTES (short text), otherwise its content is left null and the row is a reference:
+ * conversation id (from sender and receiver), timestamp and message id locate the history row, which a sync
+ * reads with concurrent point reads once it knows which rows it returns.
+ *
+ * GetMessagesSince pages forward from a (timestamp, message id) cursor, oldest first and ids ascending within a
+ * second: the rest of the cursor's second, then the later seconds one day after the other. Those come with ids
+ * descending, so a page ends on a whole second (or reads a second that fills it alone in id order). Its
+ * continuation token is [i64 timestamp][u64 message id] of its last message, opaque to clients. It is not the
+ * driver's paging state: that resumes one statement, while a page may span several day partitions read as
+ * separate statements and is trimmed to whole seconds. Tokens are not compatible across changes of the bucket
+ * layout.
+ *
+ * Every message carries its conversation seq (see ConvSeq). Besides its rows, each write of messages stores the
+ * highest seq of each conversation in it in im.conversation_seq, which seeds the seqs after a restart. The row is
+ * written with the seq as its write timestamp, so the highest seq wins whatever order the writes land in (a
+ * message replayed from MsgWal after a restart is older than what was written since).
+ *
+ * The blocking reads run their Async twin to completion (SyncWait), so each is implemented once.
+ *
+ * GetHistoryAsync pages backward through one conversation from a (timestamp, message id) cursor in stored order
+ * (newest second first, message ids ascending within one): the rest of the cursor's second, then the days
+ * before it in waves as for the inbox, no further back than SCYLLA_HISTORY_LOOKBACK_DAYS.
+ */
 class MsgScyllaDao {
 public:
+    // Width of a partition of the bucketed tables, timestamps are in seconds
+    static constexpr int64_t kBucketSeconds = 24 * 60 * 60;
+    // Most inbox rows a sync returns
+    static constexpr size_t kInboxLimit = 500;
+
     MsgScyllaDao() = default;
     ~MsgScyllaDao() = default;
 
+    static int64_t DayBucket(int64_t timestamp) { return timestamp / kBucketSeconds; }
+    // The messages of *messages in bucket or a newer one, removed from it
+    static std::vector<im::P2PMessage> TakeFromBucket(std::vector<im::P2PMessage>* messages, int64_t bucket);
+    // Whether the inbox rows of msg carry its content, rather than reference the history row
+    static bool InlinesContent(const im::P2PMessage& msg);
+
     bool InsertMessage(const im::P2PMessage& msg);
+    // All rows of msgs in one LOGGED batch, all or nothing (kept for comparison, see bench_scylla_write)
     bool InsertBatch(const std::vector<im::P2PMessage>& msgs);
-    std::vector<im::P2PMessage> GetMessagesForUser(uint64_t user_id);
+    // Rows grouped by partition, each group written as one single-partition statement or UNLOGGED batch,
+    // with at most max_in_flight requests outstanding. A group that fails is resent up to max_retries times
+    // (the inserts are idempotent). Returns the indices in msgs of the messages that still have an unwritten row.
+    std::vector<size_t> InsertConcurrent(const std::vector<im::P2PMessage>& msgs, size_t max_in_flight = 256,
+                                         int max_retries = 3);
+    // Latest kInboxLimit inbox rows, newest first, appended to *out. False if a read failed, *out is then left as it
+    // was rather than given an inbox with a day missing.
+    bool GetMessagesForUser(uint64_t user_id, std::vector<im::P2PMessage>* out);
+    // Same query, suspends on the driver callback instead of blocking and resumes on resume_pool
+    Async<bool> GetMessagesForUserAsync(uint64_t user_id, std::vector<im::P2PMessage>* out, ThreadPool* resume_pool);
+    // Gets the rows of one bucket, newest first (none for an empty day), and returns whether to read on
+    using InboxSink = std::function<Async<bool>(int64_t bucket, std::vector<im::P2PMessage> rows)>;
+    // The rows GetMessagesForUserAsync returns, bucket by bucket from the newest: sink gets each bucket once it
+    // and the newer ones are read, while the older ones are still on their way. False if a read failed, sink
+    // may have had the newer buckets by then.
+    Async<bool> ReadInboxAsync(uint64_t user_id, const InboxSink& sink, ThreadPool* resume_pool);
+    // Up to page_size inbox rows after the cursor, that is newer than since_timestamp or within it with a message
+    // id above since_msg_id, oldest first, appended to *out. *continuation resumes the previous page (empty for
+    // the first) and is set to resume after this one, empty once there is nothing more. False if a read failed.
+    bool GetMessagesSince(uint64_t user_id, int64_t since_timestamp, uint64_t since_msg_id, size_t page_size,
+                          std::string* continuation, std::vector<im::P2PMessage>* out);
+    Async<bool> GetMessagesSinceAsync(uint64_t user_id, int64_t since_timestamp, uint64_t since_msg_id,
+                                      size_t page_size, std::string* continuation, std::vector<im::P2PMessage>* out,
+                                      ThreadPool* resume_pool);
+    // Up to limit messages between user_id and peer_id stored after the cursor, that is older than
+    // before_timestamp or within it with a message id above before_msg_id, appended to *out in stored order.
+    // A before_timestamp of 0 starts at the newest message. False if a read failed.
+    Async<bool> GetHistoryAsync(uint64_t user_id, uint64_t peer_id, int64_t before_timestamp, uint64_t before_msg_id,
+                                size_t limit, std::vector<im::P2PMessage>* out, ThreadPool* resume_pool);
+    // Highest seq written for the conversation of user_id and peer_id (0 if none), false if the read failed
+    Async<bool> GetConversationSeqAsync(uint64_t user_id, uint64_t peer_id, uint64_t* seq, ThreadPool* resume_pool);
 };
@@ -0,0 +1,461 @@
+#include "msg_wal.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include "../log/log.h"
+#include "../utils/env.h"
+#include "../utils/metrics.h"
+
+namespace {
+// Payload length, CRC32C of the payload, LSN
+constexpr size_t kHeaderSize = 4 + 4 + 8;
+
+uint32_t Crc32c(const char* data, size_t len) {
+    static const auto kTable = []() {
+        std::array<uint32_t, 256> table{};
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int k = 0; k < 8; k++) {
+                crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78u : crc >> 1;
+            }
+            table[i] = crc;
+        }
+        return table;
+    }();
+    uint32_t crc = ~0u;
+    for (size_t i = 0; i < len; i++) {
+        crc = kTable[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+std::string SegmentName(uint64_t first_lsn) {
+    char name[32];
+    snprintf(name, sizeof(name), "%020lu.wal", static_cast<unsigned long>(first_lsn));
+    return name;
+}
+
+// Open a segment file and allocate it up front, so appending does not change the file size and fdatasync
+// skips the inode
+int CreateSegmentFile(const std::string& path, size_t bytes) {
+    int fd = open(path.c_str(), O_CREAT | O_WRONLY | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOG_ERROR("Message WAL: cannot create {}: {}", path, strerror(errno));
+        return -1;
+    }
+    if (int err = posix_fallocate(fd, 0, static_cast<off_t>(bytes)); err != 0) {
+        LOG_WARN("Message WAL: cannot preallocate {}: {}", path, strerror(err));
+    }
+    return fd;
+}
+
+// New directory entries are only durable once the directory itself is synced
+void SyncDir(const std::string& dir) {
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return;
+    fsync(fd);
+    close(fd);
+}
+}  // namespace
+
+MsgWal::Options MsgWal::Options::FromEnv() {
+    Options options;
+    if (const char* dir = getenv("WAL_DIR")) {
+        options.dir = dir;
+    }
+    size_t segment_mb = options.segment_bytes >> 20;
+    EnvNumber("WAL_SEGMENT_MB", &segment_mb);
+    options.segment_bytes = std::max<size_t>(segment_mb, 1) << 20;
+    EnvBool("WAL_SYNC", &options.sync);
+    return options;
+}
+
+MsgWal* MsgWal::Instance() {
+    static MsgWal instance;
+    return &instance;
+}
+
+bool MsgWal::Open(const Options& options, std::vector<Record>* recovered) {
+    // Outside mtx_, Metrics::Render holds its own lock while the segments gauge takes ours
+    std::call_once(metrics_once_, [this]() { RegisterMetrics_(); });
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (enabled_.load(std::memory_order_relaxed)) return true;
+    if (options.dir.empty()) {
+        LOG_INFO("Message WAL disabled, acks are not durable until Scylla has the message.");
+        return false;
+    }
+    options_ = options;
+
+    std::error_code ec;
+    std::filesystem::create_directories(options_.dir, ec);
+    if (ec) {
+        LOG_ERROR("Message WAL disabled, cannot create {}: {}", options_.dir, ec.message());
+        return false;
+    }
+    std::vector<std::string> paths;
+    for (const auto& entry : std::filesystem::directory_iterator(options_.dir, ec)) {
+        if (!entry.is_regular_file()) continue;
+        if (entry.path().extension() == ".wal") {
+            paths.push_back(entry.path().string());
+        } else if (entry.path().extension() == ".spare") {
+            // Never written to, a record goes in only after the rename
+            unlink(entry.path().c_str());
+        }
+    }
+    // Zero-padded first LSNs, so name order is log order
+    std::sort(paths.begin(), paths.end());
+
+    uint64_t max_lsn = 0;
+    size_t replayed = 0;
+    for (const auto& path : paths) {
+        size_t count = ReplaySegment_(path, recovered, &max_lsn);
+        if (count == 0) {
+            unlink(path.c_str());
+            continue;
+        }
+        uint64_t first_lsn = std::strtoull(std::filesystem::path(path).stem().c_str(), nullptr, 10);
+        Segment& segment = segments_[first_lsn];
+        segment.path = path;
+        segment.outstanding = count;
+        replayed += count;
+    }
+    next_lsn_ = max_lsn + 1;
+    durable_lsn_.store(max_lsn, std::memory_order_release);
+    if (!OpenSegment_(next_lsn_)) {
+        segments_.clear();
+        return false;
+    }
+
+    stopping_ = false;
+    enabled_.store(true, std::memory_order_release);
+    committer_ = std::thread(&MsgWal::CommitLoop_, this);
+    LOG_INFO("Message WAL opened in {}, {} messages to replay, segment={}MB, sync={}.", options_.dir, replayed,
+             options_.segment_bytes >> 20, options_.sync);
+    return true;
+}
+
+size_t MsgWal::ReplaySegment_(const std::string& path, std::vector<Record>* recovered, uint64_t* max_lsn) {
+    std::ifstream in(path, std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    size_t count = 0;
+    size_t pos = 0;
+    while (data.size() - pos >= kHeaderSize) {
+        uint32_t length;
+        uint32_t crc;
+        uint64_t lsn;
+        memcpy(&length, data.data() + pos, 4);
+        memcpy(&crc, data.data() + pos + 4, 4);
+        memcpy(&lsn, data.data() + pos + 8, 8);
+        // A zero length is the preallocated tail, anything short or corrupt is a write the crash tore
+        if (length == 0 || data.size() - pos - kHeaderSize < length) break;
+        const char* payload = data.data() + pos + kHeaderSize;
+        Record record{lsn, {}};
+        if (Crc32c(payload, length) != crc || !record.msg.ParseFromArray(payload, static_cast<int>(length))) {
+            LOG_WARN("Message WAL {}: corrupt record at offset {}, ignoring the rest of the segment", path, pos);
+            break;
+        }
+        recovered->push_back(std::move(record));
+        *max_lsn = std::max(*max_lsn, lsn);
+        count++;
+        pos += kHeaderSize + length;
+    }
+    return count;
+}
+
+bool MsgWal::OpenSegment_(uint64_t first_lsn) {
+    std::string path = options_.dir + "/" + SegmentName(first_lsn);
+    int fd = CreateSegmentFile(path, options_.segment_bytes);
+    if (fd < 0) {
+        return false;
+    }
+    SyncDir(options_.dir);
+    Segment& segment = segments_[first_lsn];
+    segment.path = path;
+    segment.fd = fd;
+    return true;
+}
+
+void MsgWal::PrepareSpare_() {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (spare_fd_ >= 0 || stopping_) return;
+    }
+    // The name only has to be unique, the file is renamed when it becomes a segment
+    std::string path = options_.dir + "/" + std::to_string(++spares_created_) + ".spare";
+    int fd = CreateSegmentFile(path, options_.segment_bytes);
+    if (fd < 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mtx_);
+    spare_fd_ = fd;
+    spare_path_ = std::move(path);
+}
+
+void MsgWal::Close() {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        stopping_ = true;
+    }
+    cv_.notify_one();
+    if (committer_.joinable()) {
+        committer_.join();
+    }
+    enabled_.store(false, std::memory_order_release);
+    ReleaseWaiters_();
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (spare_fd_ >= 0) {
+        close(spare_fd_);
+        unlink(spare_path_.c_str());
+        spare_fd_ = -1;
+    }
+    for (auto& [first_lsn, segment] : segments_) {
+        if (segment.fd >= 0) {
+            close(segment.fd);
+            segment.fd = -1;
+        }
+        // Retired by a clean AsyncMsgWriter::Stop, the rest is replayed by the next Open. A segment still under
+        // its spare name was never written (the log was disabled first).
+        if (!segment.spare_path.empty()) {
+            unlink(segment.spare_path.c_str());
+        } else if (segment.outstanding == 0) {
+            unlink(segment.path.c_str());
+        }
+    }
+    if (!segments_.empty()) {
+        LOG_INFO("Message WAL closed, {} segments kept for replay.",
+                 std::count_if(segments_.begin(), segments_.end(), [](const auto& s) { return s.second.outstanding; }));
+    }
+    segments_.clear();
+    pending_.clear();
+}
+
+uint64_t MsgWal::Append(const im::P2PMessage& msg) {
+    if (!Enabled()) return 0;
+
+    // Serialized outside the lock, only the copy into the commit buffer is serialized between senders
+    thread_local std::string record;
+    uint32_t length = static_cast<uint32_t>(msg.ByteSizeLong());
+    record.resize(kHeaderSize + length);
+    msg.SerializeWithCachedSizesToArray(reinterpret_cast<uint8_t*>(record.data() + kHeaderSize));
+    uint32_t crc = Crc32c(record.data() + kHeaderSize, length);
+    memcpy(record.data(), &length, 4);
+    memcpy(record.data() + 4, &crc, 4);
+
+    uint64_t lsn;
+    bool wake;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (!enabled_.load(std::memory_order_relaxed) || stopping_) return 0;
+        lsn = next_lsn_++;
+        memcpy(record.data() + 8, &lsn, 8);
+
+        auto active = std::prev(segments_.end());
+        if (active->second.bytes > 0 && active->second.bytes + record.size() > options_.segment_bytes &&
+            spare_fd_ >= 0) {
+            // No I/O under the lock, the committer names the file and prepares the next spare
+            Segment& next = segments_[lsn];
+            next.path = options_.dir + "/" + SegmentName(lsn);
+            next.spare_path = std::move(spare_path_);
+            next.fd = std::exchange(spare_fd_, -1);
+            active = std::prev(segments_.end());
+        }
+        Segment& segment = active->second;
+        segment.bytes += record.size();
+        segment.outstanding++;
+
+        wake = pending_.empty();
+        if (pending_.empty() || pending_.back().segment != active->first) {
+            pending_.push_back({active->first, {}});
+        }
+        pending_.back().data += record;
+    }
+    records_.fetch_add(1, std::memory_order_relaxed);
+    // The committer only sleeps when pending_ was empty
+    if (wake) {
+        cv_.notify_one();
+    }
+    return lsn;
+}
+
+bool MsgWal::WhenDurable(uint64_t lsn, Task fn) {
+    if (lsn == 0 || lsn <= DurableLsn()) return false;
+    std::lock_guard<std::mutex> lock(mtx_);
+    // Rechecked under the lock, the committer advances durable_lsn_ before it collects the waiters
+    if (!enabled_.load(std::memory_order_relaxed) || lsn <= DurableLsn()) return false;
+    waiters_.push_back({lsn, std::move(fn)});
+    return true;
+}
+
+void MsgWal::Retire(const std::vector<uint64_t>& lsns) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (segments_.empty()) return;
+    bool emptied = false;
+    for (uint64_t lsn : lsns) {
+        auto it = segments_.upper_bound(lsn);
+        if (lsn == 0 || it == segments_.begin()) continue;
+        Segment& segment = std::prev(it)->second;
+        if (segment.outstanding > 0 && --segment.outstanding == 0) {
+            emptied = true;
+        }
+    }
+    if (emptied) {
+        TrimLocked_();
+    }
+}
+
+void MsgWal::TrimLocked_() {
+    uint64_t durable = DurableLsn();
+    for (auto it = segments_.begin(); it != segments_.end();) {
+        auto next = std::next(it);
+        // The active segment stays, as does one whose records are not all written and synced yet
+        if (next == segments_.end() || durable + 1 < next->first) {
+            it = next;
+            continue;
+        }
+        Segment& segment = it->second;
+        if (segment.fd >= 0) {
+            close(segment.fd);
+            segment.fd = -1;
+        }
+        if (segment.outstanding == 0) {
+            unlink(segment.path.c_str());
+            segments_.erase(it);
+        }
+        it = next;
+    }
+}
+
+void MsgWal::CommitLoop_() {
+    std::vector<Chunk> chunks;
+    PrepareSpare_();
+    while (true) {
+        uint64_t last_lsn;
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            cv_.wait(lock, [this]() { return !pending_.empty() || stopping_; });
+            if (pending_.empty()) break;
+            chunks.swap(pending_);
+            last_lsn = next_lsn_ - 1;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        bool ok = WriteChunks_(chunks);
+        chunks.clear();
+        if (!ok) {
+            Disable_();
+            break;
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        sync_us_.fetch_add(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count(),
+                           std::memory_order_relaxed);
+        commits_.fetch_add(1, std::memory_order_relaxed);
+
+        durable_lsn_.store(last_lsn, std::memory_order_release);
+        ReleaseWaiters_();
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            TrimLocked_();
+        }
+        // After the waiters, a rollover just took the spare
+        PrepareSpare_();
+    }
+}
+
+bool MsgWal::WriteChunks_(std::vector<Chunk>& chunks) {
+    // Segments are not erased before they are synced and the map never moves its nodes, so the pointers
+    // stay valid without the lock. fd and written are only touched by this thread from here on.
+    std::vector<Segment*> targets;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        for (const auto& chunk : chunks) {
+            targets.push_back(&segments_.at(chunk.segment));
+        }
+    }
+    for (size_t i = 0; i < chunks.size(); i++) {
+        Segment* segment = targets[i];
+        if (!segment->spare_path.empty()) {
+            // Named before the first record lands in it, so a crash never leaves records in a spare
+            if (rename(segment->spare_path.c_str(), segment->path.c_str()) != 0) {
+                LOG_ERROR("Message WAL: cannot rename {} to {}: {}", segment->spare_path, segment->path,
+                          strerror(errno));
+                return false;
+            }
+            SyncDir(options_.dir);
+            segment->spare_path.clear();
+        }
+        const std::string& data = chunks[i].data;
+        size_t done = 0;
+        while (done < data.size()) {
+            ssize_t n = pwrite(segment->fd, data.data() + done, data.size() - done,
+                               static_cast<off_t>(segment->written + done));
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                LOG_ERROR("Message WAL: write to {} failed: {}", segment->path, strerror(errno));
+                return false;
+            }
+            done += static_cast<size_t>(n);
+        }
+        segment->written += data.size();
+    }
+    if (options_.sync) {
+        for (size_t i = 0; i < targets.size(); i++) {
+            // Consecutive chunks of one segment share a sync
+            if (i + 1 < targets.size() && targets[i + 1] == targets[i]) continue;
+            if (fdatasync(targets[i]->fd) != 0) {
+                LOG_ERROR("Message WAL: fdatasync of {} failed: {}", targets[i]->path, strerror(errno));
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void MsgWal::Disable_() {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        enabled_.store(false, std::memory_order_release);
+        pending_.clear();
+        durable_lsn_.store(next_lsn_ - 1, std::memory_order_release);
+    }
+    LOG_ERROR("Message WAL disabled after an I/O error, acks are no longer durable before Scylla has the message.");
+    ReleaseWaiters_();
+}
+
+void MsgWal::ReleaseWaiters_() {
+    std::vector<Waiter> ready;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        uint64_t durable = DurableLsn();
+        bool all = !enabled_.load(std::memory_order_relaxed);
+        auto split = std::partition(waiters_.begin(), waiters_.end(),
+                                    [&](const Waiter& w) { return !all && w.lsn > durable; });
+        std::move(split, waiters_.end(), std::back_inserter(ready));
+        waiters_.erase(split, waiters_.end());
+    }
+    for (auto& waiter : ready) {
+        waiter.fn();
+    }
+}
+
+void MsgWal::RegisterMetrics_() {
+    auto* metrics = Metrics::Instance();
+    metrics->AddCounter("termchat_wal_records_total", "Messages appended to the write-ahead log",
+                        [this]() { return static_cast<double>(records_.load(std::memory_order_relaxed)); });
+    metrics->AddCounter("termchat_wal_commits_total", "Group commits (one write and sync each) of the write-ahead log",
+                        [this]() { return static_cast<double>(commits_.load(std::memory_order_relaxed)); });
+    metrics->AddCounter("termchat_wal_commit_seconds_total", "Time spent writing and syncing the write-ahead log",
+                        [this]() { return sync_us_.load(std::memory_order_relaxed) / 1e6; });
+    metrics->AddGauge("termchat_wal_segments", "Write-ahead log segment files", [this]() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return static_cast<double>(segments_.size());
+    });
+}
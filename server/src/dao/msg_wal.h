@@ -0,0 +1,144 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../pool/task.h"
+#include "../utils/coro.h"
+#include "message_service.pb.h"
+
+/**
+ * MsgWal - local write-ahead log of accepted P2P messages, makes a MessageAck durable before Scylla has the message
+ *
+ * Append copies a record into the commit buffer and returns its LSN without any I/O. A single committer
+ * thread writes whatever accumulated while the previous fdatasync ran and syncs it once (group commit),
+ * then advances DurableLsn and runs the WhenDurable callbacks it covers. Under load one sync covers every
+ * message that arrived during the last one, so a message pays a share of a sync rather than a whole one.
+ *
+ * The log is a directory of preallocated segment files named after their first LSN. Record:
+ *   [u32 payload length][u32 crc32c of payload][u64 lsn][serialized P2PMessage]
+ * The committer keeps the next segment created and preallocated as a spare (*.spare), so a rollover in
+ * Append only swaps file descriptors; the committer gives the file its name before writing to it. Without
+ * a spare ready the active segment grows past its size until there is one.
+ * Once AsyncMsgWriter has stored a message in Scylla it retires its LSN. A segment whose records are all
+ * retired is deleted as soon as a newer segment is active and it is fully synced.
+ *
+ * Open replays the segments left by the previous process, up to the first torn or corrupt record of each,
+ * and returns their records, which the caller re-enqueues with the same LSNs (the Scylla inserts are
+ * idempotent). If a write or sync fails the log disables itself and releases every waiter: acks fall
+ * back to in-memory durability rather than stalling.
+ *
+ * Options: WAL_DIR (empty disables the log), WAL_SEGMENT_MB, WAL_SYNC=0 to skip fdatasync (survives a
+ * process crash, not a power loss).
+ */
+class MsgWal {
+public:
+    struct Options {
+        std::string dir = "./wal";
+        size_t segment_bytes = 64u << 20;
+        bool sync = true;
+
+        static Options FromEnv();
+    };
+
+    struct Record {
+        uint64_t lsn;
+        im::P2PMessage msg;
+    };
+
+    static MsgWal* Instance();
+
+    // Replays the existing segments into *recovered and starts the committer. False (and the log stays
+    // disabled) when options.dir is empty or cannot be used.
+    bool Open(const Options& options, std::vector<Record>* recovered);
+    // Commits what is buffered, releases the waiters and deletes the fully retired segments
+    void Close();
+
+    bool Enabled() const { return enabled_.load(std::memory_order_acquire); }
+    // LSN of the record for msg, 0 when the log is disabled
+    uint64_t Append(const im::P2PMessage& msg);
+    uint64_t DurableLsn() const { return durable_lsn_.load(std::memory_order_acquire); }
+    // Runs fn on the committer thread once lsn is durable. False, without running fn, if it already is.
+    bool WhenDurable(uint64_t lsn, Task fn);
+    // The messages with these LSNs are in Scylla
+    void Retire(const std::vector<uint64_t>& lsns);
+
+private:
+    struct Segment {
+        std::string path;
+        // The spare file it was taken from, renamed to path by the committer before its first write
+        std::string spare_path;
+        int fd = -1;
+        // Bytes assigned to the segment by Append, written or still in pending_
+        size_t bytes = 0;
+        // Bytes written by the committer
+        size_t written = 0;
+        size_t outstanding = 0;
+    };
+    struct Chunk {
+        uint64_t segment;
+        std::string data;
+    };
+    struct Waiter {
+        uint64_t lsn;
+        Task fn;
+    };
+
+    MsgWal() = default;
+    ~MsgWal() { Close(); }
+
+    void CommitLoop_();
+    // Write and sync chunks, false on an I/O error
+    bool WriteChunks_(std::vector<Chunk>& chunks);
+    void Disable_();
+    // Run the waiters up to durable_lsn_, caller must not hold mtx_
+    void ReleaseWaiters_();
+    // Caller holds mtx_
+    bool OpenSegment_(uint64_t first_lsn);
+    // Create and preallocate the spare segment if there is none, on the committer thread
+    void PrepareSpare_();
+    // Close the segments that are fully synced, delete those also fully retired. Caller holds mtx_.
+    void TrimLocked_();
+    size_t ReplaySegment_(const std::string& path, std::vector<Record>* recovered, uint64_t* max_lsn);
+    void RegisterMetrics_();
+
+    Options options_;
+    std::atomic<bool> enabled_{false};
+
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    bool stopping_{false};
+    uint64_t next_lsn_{1};
+    // By first LSN, the last one is active
+    std::map<uint64_t, Segment> segments_;
+    int spare_fd_{-1};
+    std::string spare_path_;
+    // Committer only
+    uint64_t spares_created_{0};
+    std::vector<Chunk> pending_;
+    std::vector<Waiter> waiters_;
+    std::atomic<uint64_t> durable_lsn_{0};
+    std::thread committer_;
+
+    std::atomic<uint64_t> commits_{0};
+    std::atomic<uint64_t> records_{0};
+    std::atomic<uint64_t> sync_us_{0};
+    std::once_flag metrics_once_;
+};
+
+// co_await WalDurable{lsn, pool} continues on pool once lsn is durable, right away if it already is or lsn is 0
+struct WalDurable {
+    uint64_t lsn;
+    ThreadPool* pool;
+
+    bool await_ready() const noexcept { return lsn <= MsgWal::Instance()->DurableLsn(); }
+    bool await_suspend(std::coroutine_handle<> h) {
+        return MsgWal::Instance()->WhenDurable(lsn, [pool = pool, h]() { ResumeOn(pool, h); });
+    }
+    void await_resume() const noexcept {}
+};
@@ -1,4 +1,5 @@
 #include "http_handler.h"
+#include "../utils/metrics.h"
 
 HttpHandler::~HttpHandler() { response_.UnmapFile(); }
 
@@ -12,6 +13,10 @@ bool HttpHandler::Process(Buffer& read_buff, Buffer& write_buff) {
     if (request_.parse(read_buff)) {
         LOG_DEBUG("HTTP request path: {}", request_.path());
         response_.Init(TcpConnection::src_dir, request_.path(), request_.IsKeepAlive(), 200);
+        if (serve_metrics_ && request_.path() == "/metrics") {
+            response_.MakeBodyResponse(write_buff, Metrics::Instance()->Render());
+            return true;
+        }
     } else {
         response_.Init(TcpConnection::src_dir, request_.path(), false, 400);
     }
@@ -6,7 +6,8 @@
 
 class HttpHandler : public ProtocolHandler {
 public:
-    HttpHandler() = default;
+    // serve_metrics: the peer may read /metrics (Metrics::ServesPeer), otherwise it is a missing file
+    explicit HttpHandler(bool serve_metrics) : serve_metrics_(serve_metrics) {}
     ~HttpHandler() override;
 
     bool Process(Buffer& read_buff, Buffer& write_buff) override;
@@ -18,4 +19,5 @@ public:
 private:
     HttpRequest request_;
     HttpResponse response_;
+    bool serve_metrics_;
 };
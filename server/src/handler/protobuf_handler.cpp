@@ -1,30 +1,265 @@
 #include "protobuf_handler.h"
 #include <arpa/inet.h>
+#include <algorithm>
+#include <coroutine>
+#include <utility>
+#include "../dao/msg_wal.h"
+#include "../service/conv_seq.h"
 
 ProtobufHandler::ProtobufHandler(TcpConnection* conn, AuthService* auth_service, FriendService* friend_service,
-                                 MsgService* msg_service, ThreadPool* thread_pool)
+                                 MsgService* msg_service, ThreadPool* thread_pool, ThreadPool* db_pool)
     : conn_(conn), auth_service_(auth_service), friend_service_(friend_service), msg_service_(msg_service),
-      thread_pool_(thread_pool) {}
+      thread_pool_(thread_pool), db_pool_(db_pool) {}
+
+size_t ProtobufHandler::max_frames_per_read = 64;
+
+namespace {
+// co_await StreamFrame{...} lets append(write_buff) add a frame on the parked connection and resumes on pool once
+// the socket has caught up (TcpConnection::stream_async), true unless the connection went away
+template <typename F>
+struct StreamFrame {
+    TcpConnection* conn;
+    uint64_t generation;
+    F append;
+    ThreadPool* pool;
+    bool open = false;
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> h) {
+        bool waiting = false;
+        // Once waiting, on_drained may resume h right away on another thread, this is not touched again
+        conn->stream_async(
+            generation,
+            [this](Buffer& write_buff) {
+                append(write_buff);
+                open = true;
+            },
+            [this, h](bool still_open) {
+                open = still_open;
+                ResumeOn(pool, h);
+            },
+            &waiting);
+        return waiting;
+    }
+    bool await_resume() const noexcept { return open; }
+};
+}  // namespace
+
+CommandClass ClassifyCommand(im::CommandType cmd) {
+    switch (cmd) {
+        // MySQL
+        case im::CMD_REGISTER_REQ:
+        case im::CMD_LOGIN_REQ:
+        case im::CMD_ADD_FRIEND_REQ:
+        case im::CMD_HANDLE_FRIEND_REQ:
+        case im::CMD_GET_FRIEND_LIST_REQ:
+        // Synchronous Scylla read
+        case im::CMD_SYNC_MSGS_REQ:
+        case im::CMD_GET_HISTORY_REQ:
+            return CommandClass::BLOCKING;
+        // Queued to AsyncMsgWriter and pushed through PushService, the ack waits for the WAL without blocking. The
+        // first message of a conversation ConvSeq does not know is handed to a worker by HandleP2PMsg.
+        case im::CMD_P2P_MSG_REQ:
+        case im::CMD_HEARTBEAT:
+        default:
+            return CommandClass::INLINE;
+    }
+}
 
 bool ProtobufHandler::Process(Buffer& read_buff, Buffer& write_buff) {
-    im::Envelope request;
+    bool responded = false;
+    // Drain pipelined frames, the remainder (if the budget runs out) is picked up after the write. A deferred
+    // request is handled whatever the budget, nothing else would pick it up.
+    for (size_t i = 0; deferred_ || (i < max_frames_per_read && HasCompleteFrame(read_buff)); i++) {
+        im::Envelope request;
+        bool unseeded = false;
+        if (deferred_) {
+            // From ProcessInline, or a P2P message HandleP2PMsg found unseeded (there or just now)
+            request = std::move(*deferred_);
+            deferred_.reset();
+            unseeded = request.cmd() == im::CMD_P2P_MSG_REQ;
+        } else if (!TryDecodeMessage(read_buff, request)) {
+            // Malformed frame was dropped, continue with the next one
+            continue;
+        }
+        if (RunsAsync(request, unseeded)) {
+            // Frames behind it wait in read_buff until the coroutine delivers its response
+            StartAsync(std::move(request));
+            break;
+        }
+        if (unseeded) {
+            conv_seq_ = SyncWait(
+                ConvSeq::Instance()->NextAsync(user_id_, request.p2p_msg_req().receiver_id(), SyncWaitPool()));
+        }
+        responded |= HandleRequest(request, write_buff);
+    }
+    HoldForWal_();
+    // Frames left by the budget are picked up after the write, even with nothing to write (ACK_NONE)
+    return responded || HasCompleteFrame(read_buff);
+}
 
-    if (!TryDecodeMessage(read_buff, request)) {
+bool ProtobufHandler::ProcessInline(Buffer& read_buff, Buffer& write_buff, bool* offload) {
+    *offload = false;
+    bool responded = false;
+    for (size_t i = 0; i < max_frames_per_read && HasCompleteFrame(read_buff); i++) {
+        im::Envelope request;
+        if (!TryDecodeMessage(read_buff, request)) {
+            continue;
+        }
+        if (ClassifyCommand(request.cmd()) == CommandClass::BLOCKING) {
+            deferred_ = std::move(request);
+        } else {
+            responded |= HandleRequest(request, write_buff);
+        }
+        // A BLOCKING command, or a P2P message whose conversation is seeded first
+        if (deferred_) {
+            *offload = true;
+            break;
+        }
+    }
+    // When offloading, the worker's Process waits for the WAL together with the deferred request
+    if (!*offload) {
+        HoldForWal_();
+    }
+    return responded || HasCompleteFrame(read_buff);
+}
+
+bool ProtobufHandler::HoldForWal_() {
+    if (unsynced_lsn_ == 0) {
         return false;
     }
+    uint64_t lsn = std::exchange(unsynced_lsn_, 0);
+    auto self = shared_from_this();
+    uint64_t generation = conn_->generation();
+    // conn_mutex_ is held until we return, so the callback cannot release the connection before it is parked
+    bool waiting = MsgWal::Instance()->WhenDurable(
+        lsn, [self, generation]() { self->conn_->complete_async(generation, [](Buffer&) {}); });
+    if (waiting) {
+        conn_->park();
+    }
+    return waiting;
+}
 
+bool ProtobufHandler::HandleRequest(const im::Envelope& request, Buffer& write_buff) {
     LOG_DEBUG("Received message: cmd={}, seq={}", request.cmd(), request.seq());
 
     im::Envelope response;
     response.set_seq(request.seq());
     response.set_timestamp(time(nullptr));
     Dispatch(request, response);
+    if (std::exchange(no_response_, false)) {
+        return false;
+    }
+    FinishLogin(response);
     EncodeMessage(response, write_buff);
 
     LOG_DEBUG("Sent response: cmd={}, seq={}", response.cmd(), response.seq());
     return true;
 }
 
+bool ProtobufHandler::RunsAsync(const im::Envelope& request, bool unseeded) const {
+    return db_pool_ && (unseeded || ClassifyCommand(request.cmd()) == CommandClass::BLOCKING);
+}
+
+void ProtobufHandler::StartAsync(im::Envelope request) {
+    conn_->park();
+    HandleAsync_(shared_from_this(), conn_->generation(), std::exchange(unsynced_lsn_, 0), std::move(request));
+}
+
+Detached ProtobufHandler::HandleAsync_(std::shared_ptr<ProtobufHandler> self, uint64_t generation, uint64_t wal_lsn,
+                                       im::Envelope request) {
+    // Get out of TcpConnection::process first, complete_async takes the conn_mutex_ it is holding
+    co_await Reschedule(self->thread_pool_);
+
+    LOG_DEBUG("Received message: cmd={}, seq={}", request.cmd(), request.seq());
+
+    im::Envelope response;
+    response.set_seq(request.seq());
+    response.set_timestamp(time(nullptr));
+    bool no_response = false;
+    if (request.cmd() == im::CMD_P2P_MSG_REQ) {
+        // Only the first message of a conversation ConvSeq does not know gets here, Scylla is read for its seed
+        self->conv_seq_ = co_await ConvSeq::Instance()->NextAsync(
+            self->user_id_, request.p2p_msg_req().receiver_id(), self->thread_pool_);
+        self->HandleP2PMsg(request, response, generation);
+        wal_lsn = std::max(wal_lsn, std::exchange(self->unsynced_lsn_, 0));
+        no_response = std::exchange(self->no_response_, false);
+    } else if (request.cmd() == im::CMD_SYNC_MSGS_REQ && request.sync_msgs_req().stream() && self->user_id_ != 0) {
+        // The acks ahead of the first frame go out with it
+        co_await WalDurable{std::exchange(wal_lsn, 0), self->thread_pool_};
+        co_await self->StreamSyncMessagesAsync_(generation, request, response);
+    } else if (request.cmd() == im::CMD_SYNC_MSGS_REQ) {
+        co_await self->HandleSyncMessages(request, response, self->thread_pool_);
+    } else if (request.cmd() == im::CMD_GET_HISTORY_REQ) {
+        co_await self->HandleGetHistory(request, response, self->thread_pool_);
+    } else {
+        // The MySQL connector has no non-blocking API, the calls block a db_pool thread instead of a worker
+        try {
+            co_await RunBlocking(self->db_pool_, self->thread_pool_, [&]() { self->Dispatch(request, response); });
+        } catch (const std::exception& e) {
+            // No response, but the connection is released for the frames behind it
+            LOG_ERROR("Request failed: cmd={}, seq={}: {}", request.cmd(), request.seq(), e.what());
+            no_response = true;
+        }
+    }
+    // The acks queued ahead of this response go out with it
+    co_await WalDurable{wal_lsn, self->thread_pool_};
+
+    bool delivered = self->conn_->complete_async(generation, [&](Buffer& write_buff) {
+        if (no_response) return;
+        self->FinishLogin(response);
+        self->EncodeMessage(response, write_buff);
+    });
+    if (delivered) {
+        LOG_DEBUG("Sent response: cmd={}, seq={}", response.cmd(), response.seq());
+    } else {
+        LOG_DEBUG("Connection closed before response: cmd={}, seq={}", response.cmd(), response.seq());
+    }
+}
+
+void ProtobufHandler::FinishLogin(const im::Envelope& response) {
+    if (response.cmd() != im::CMD_LOGIN_RES || !response.login_res().success()) {
+        return;
+    }
+    auto user_id = response.login_res().user_info().user_id();
+    user_id_ = user_id;
+    conn_->set_user_id(user_id);
+
+    auto* friend_svc = friend_service_;
+    thread_pool_->AddTask([user_id, friend_svc]() {
+        auto pending_reqs = friend_svc->GetPendingRequests(user_id);
+        if (pending_reqs.empty()) return;
+        if (TcpConnection::push_service) {
+            for (const auto& req : pending_reqs) {
+                im::Envelope env;
+                env.set_cmd(im::CMD_FRIEND_REQ_PUSH);
+                env.set_seq(0);
+                env.set_timestamp(time(nullptr));
+                auto* payload = env.mutable_friend_req_push();
+                *payload = req;
+                std::string serialized;
+                if (env.SerializeToString(&serialized)) {
+                    TcpConnection::push_service->push_to_user(user_id, std::move(serialized));
+                    LOG_INFO("Pushed {} pending friend requests to user: {}", pending_reqs.size(), user_id);
+                } else {
+                    LOG_ERROR("Failed to serialize friend request push message");
+                }
+            }
+        }
+    });
+}
+
+bool ProtobufHandler::HasCompleteFrame(const Buffer& read_buff) {
+    if (read_buff.readable_bytes() < kHeaderSize) {
+        return false;
+    }
+    uint32_t msg_len = 0;
+    memcpy(&msg_len, read_buff.peek(), kHeaderSize);
+    msg_len = ntohl(msg_len);
+    // An oversized header counts as complete so TryDecodeMessage gets to drop it
+    return msg_len > kMaxMessageSize || read_buff.readable_bytes() >= kHeaderSize + msg_len;
+}
+
 bool ProtobufHandler::TryDecodeMessage(Buffer& read_buff, im::Envelope& envelope) {
     if (read_buff.readable_bytes() < kHeaderSize) {
         return false;
@@ -87,10 +322,14 @@ void ProtobufHandler::Dispatch(const im::Envelope& request, im::Envelope& respon
             HandleGetFriendList(request, response);
             break;
         case im::CMD_P2P_MSG_REQ:
-            HandleP2PMsg(request, response);
+            // Inside Process, conn_mutex_ is held and generation() is ours
+            HandleP2PMsg(request, response, conn_->generation());
             break;
         case im::CMD_SYNC_MSGS_REQ:
-            HandleSyncMessages(request, response);
+            SyncWait(HandleSyncMessages(request, response, SyncWaitPool()));
+            break;
+        case im::CMD_GET_HISTORY_REQ:
+            SyncWait(HandleGetHistory(request, response, SyncWaitPool()));
             break;
         case im::CMD_HEARTBEAT:
             // Heartbeat received, connection timer is already refreshed by OnRead_
@@ -133,36 +372,11 @@ void ProtobufHandler::HandleLogin(const im::Envelope& request, im::Envelope& res
     const auto& req = request.login_req();
     LOG_INFO("Login request: username={}", req.username());
 
+    // The session is recorded by FinishLogin once the response is about to be sent
     im::LoginResp login_resp;
-    auth_service_->user_login(conn_, req, &login_resp);
+    auth_service_->user_login(nullptr, req, &login_resp);
     response.set_cmd(im::CMD_LOGIN_RES);
     response.mutable_login_res()->CopyFrom(login_resp);
-
-    if (login_resp.success()) {
-        auto user_id = login_resp.user_info().user_id();
-        auto* friend_svc = friend_service_;
-        thread_pool_->AddTask([user_id, friend_svc]() {
-            auto pending_reqs = friend_svc->GetPendingRequests(user_id);
-            if (pending_reqs.empty()) return;
-            if (TcpConnection::push_service) {
-                for (const auto& req : pending_reqs) {
-                    im::Envelope env;
-                    env.set_cmd(im::CMD_FRIEND_REQ_PUSH);
-                    env.set_seq(0);
-                    env.set_timestamp(time(nullptr));
-                    auto* payload = env.mutable_friend_req_push();
-                    *payload = req;
-                    std::string serialized;
-                    if (env.SerializeToString(&serialized)) {
-                        TcpConnection::push_service->push_to_user(user_id, std::move(serialized));
-                        LOG_INFO("Pushed {} pending friend requests to user: {}", pending_reqs.size(), user_id);
-                    } else {
-                        LOG_ERROR("Failed to serialize friend request push message");
-                    }
-                }
-            }
-        });
-    }
 }
 
 void ProtobufHandler::HandleAddFriend(const im::Envelope& request, im::Envelope& response) {
@@ -228,7 +442,8 @@ void ProtobufHandler::HandleGetFriendList(const im::Envelope& request, im::Envel
     response.mutable_get_friend_list_res()->CopyFrom(get_friend_list_resp);
 }
 
-void ProtobufHandler::HandleP2PMsg(const im::Envelope& request, im::Envelope& response) {
+void ProtobufHandler::HandleP2PMsg(const im::Envelope& request, im::Envelope& response, uint64_t generation) {
+    uint64_t conv_seq = std::exchange(conv_seq_, 0);
     if (RequireAuth(response, im::CMD_MSG_ACK)) return;
 
     if (!request.has_p2p_msg_req()) {
@@ -244,13 +459,51 @@ void ProtobufHandler::HandleP2PMsg(const im::Envelope& request, im::Envelope& re
     LOG_INFO("P2P Msg request: from={} to={}, msg_id={}", CurrentUserId(), req.receiver_id(), req.msg_id());
 
     im::MessageAck msg_ack;
-    msg_service_->send_p2p_message(CurrentUserId(), req, &msg_ack);
+    uint64_t wal_lsn = 0;
+    MsgService::PersistAckCallback on_persisted;
+    if (req.ack_mode() == im::ACK_ON_PERSIST) {
+        on_persisted = [self = shared_from_this(), generation, seq = request.seq()](const im::MessageAck& ack) {
+            self->DeliverPersistAck_(generation, seq, ack);
+        };
+    }
+    auto result =
+        msg_service_->send_p2p_message(CurrentUserId(), req, &msg_ack, &wal_lsn, std::move(on_persisted), conv_seq);
+    if (result == MsgService::SendResult::UNSEEDED) {
+        // Seeding reads Scylla, Process hands the message to HandleAsync_ or waits for the seed on the worker
+        deferred_ = request;
+        no_response_ = true;
+        return;
+    }
+    // Errors (invalid or refused message) are answered right away in every mode, so is a resend whose first
+    // send is already stored
+    if (result == MsgService::SendResult::ACK_ON_PERSIST || (msg_ack.success() && req.ack_mode() == im::ACK_NONE)) {
+        no_response_ = true;
+        return;
+    }
+    unsynced_lsn_ = std::max(unsynced_lsn_, wal_lsn);
     response.set_cmd(im::CMD_MSG_ACK);
     response.mutable_msg_ack()->CopyFrom(msg_ack);
 }
 
-void ProtobufHandler::HandleSyncMessages(const im::Envelope& request, im::Envelope& response) {
-    if (RequireAuth(response, im::CMD_SYNC_MSGS_RES)) return;
+void ProtobufHandler::DeliverPersistAck_(uint64_t generation, uint64_t seq, const im::MessageAck& ack) {
+    im::Envelope envelope;
+    envelope.set_cmd(im::CMD_MSG_ACK);
+    envelope.set_seq(seq);
+    envelope.set_timestamp(time(nullptr));
+    *envelope.mutable_msg_ack() = ack;
+    std::string serialized;
+    if (!envelope.SerializeToString(&serialized)) {
+        LOG_ERROR("Failed to serialize protobuf message");
+        return;
+    }
+    if (!conn_->deliver(generation, std::move(serialized))) {
+        LOG_DEBUG("Connection closed before persist ack: msg_id={}, seq={}", ack.msg_id(), seq);
+    }
+}
+
+Async<void> ProtobufHandler::HandleSyncMessages(const im::Envelope& request, im::Envelope& response,
+                                                ThreadPool* resume_pool) {
+    if (RequireAuth(response, im::CMD_SYNC_MSGS_RES)) co_return;
 
     if (!request.has_sync_msgs_req()) {
         LOG_ERROR("CMD_SYNC_MSGS_REQ received but payload is missing");
@@ -258,25 +511,98 @@ void ProtobufHandler::HandleSyncMessages(const im::Envelope& request, im::Envelo
         auto* resp = response.mutable_sync_msgs_res();
         resp->set_success(false);
         resp->set_error_msg("Invalid request: missing sync messages payload");
-        return;
+        co_return;
     }
 
     const auto& req = request.sync_msgs_req();
     LOG_INFO("Sync messages request: user={}", CurrentUserId());
 
     im::SyncMessagesResp sync_resp;
-    msg_service_->sync_messages(CurrentUserId(), req, &sync_resp);
+    co_await msg_service_->sync_messages_async(CurrentUserId(), req, &sync_resp, resume_pool);
     response.set_cmd(im::CMD_SYNC_MSGS_RES);
     response.mutable_sync_msgs_res()->CopyFrom(sync_resp);
 }
 
+Async<void> ProtobufHandler::HandleGetHistory(const im::Envelope& request, im::Envelope& response,
+                                              ThreadPool* resume_pool) {
+    if (RequireAuth(response, im::CMD_GET_HISTORY_RES)) co_return;
+
+    if (!request.has_get_history_req()) {
+        LOG_ERROR("CMD_GET_HISTORY_REQ received but payload is missing");
+        response.set_cmd(im::CMD_GET_HISTORY_RES);
+        auto* resp = response.mutable_get_history_res();
+        resp->set_success(false);
+        resp->set_error_msg("Invalid request: missing get history payload");
+        co_return;
+    }
+
+    const auto& req = request.get_history_req();
+    LOG_INFO("Get history request: user={}, peer={}", CurrentUserId(), req.peer_id());
+
+    response.set_cmd(im::CMD_GET_HISTORY_RES);
+    co_await msg_service_->get_history_async(CurrentUserId(), req, response.mutable_get_history_res(), resume_pool);
+}
+
+Async<void> ProtobufHandler::StreamSyncMessagesAsync_(uint64_t generation, const im::Envelope& request,
+                                                      im::Envelope& response) {
+    const auto& req = request.sync_msgs_req();
+    LOG_INFO("Streamed sync messages request: user={}", CurrentUserId());
+    response.set_cmd(im::CMD_SYNC_MSGS_RES);
+    auto* resp = response.mutable_sync_msgs_res();
+
+    if (req.since_timestamp() == 0 && req.continuation().empty()) {
+        // Frames go out day bucket by day bucket, while the older days are still being read
+        MsgService::FrameSender send_frame = [&](std::vector<im::P2PMessage> messages) -> Async<bool> {
+            co_return co_await SendSyncFrame_(generation, request.seq(), std::move(messages));
+        };
+        co_await msg_service_->stream_latest_async(CurrentUserId(), kSyncFrameMessages, send_frame, resp,
+                                                   thread_pool_);
+        co_return;
+    }
+
+    // One frame per read, the last read's result is the response
+    size_t remaining = MsgService::sync_page_size(req);
+    im::SyncMessagesReq part_req = req;
+    while (true) {
+        part_req.set_page_size(static_cast<uint32_t>(std::min(remaining, kSyncFrameMessages)));
+        im::SyncMessagesResp part;
+        co_await msg_service_->sync_messages_async(CurrentUserId(), part_req, &part, thread_pool_);
+        remaining -= std::min<size_t>(remaining, part.messages_size());
+        if (!part.success() || !part.has_more() || remaining == 0) {
+            *resp = std::move(part);
+            co_return;
+        }
+        part_req.set_continuation(part.continuation());
+        std::vector<im::P2PMessage> frame(std::make_move_iterator(part.mutable_messages()->begin()),
+                                          std::make_move_iterator(part.mutable_messages()->end()));
+        if (!co_await SendSyncFrame_(generation, request.seq(), std::move(frame))) {
+            co_return;
+        }
+    }
+}
+
+Async<bool> ProtobufHandler::SendSyncFrame_(uint64_t generation, uint64_t seq, std::vector<im::P2PMessage> messages) {
+    im::Envelope envelope;
+    envelope.set_cmd(im::CMD_SYNC_MSGS_RES);
+    envelope.set_seq(seq);
+    envelope.set_timestamp(time(nullptr));
+    auto* resp = envelope.mutable_sync_msgs_res();
+    resp->set_success(true);
+    resp->set_more_frames(true);
+    for (auto& msg : messages) {
+        *resp->add_messages() = std::move(msg);
+    }
+    co_return co_await StreamFrame{
+        conn_, generation, [&](Buffer& write_buff) { EncodeMessage(envelope, write_buff); }, thread_pool_};
+}
+
 void ProtobufHandler::HandleUnknown(const im::Envelope& request, im::Envelope& response) {
     LOG_WARN("Unknown command received: {}", request.cmd());
     response.set_cmd(im::CMD_UNKNOWN);
 }
 
 bool ProtobufHandler::RequireAuth(im::Envelope& response, im::CommandType resp_cmd) {
-    if (!conn_ || !conn_->is_logged_in()) {
+    if (user_id_ == 0) {
         LOG_WARN("Unauthorized request: user not logged in");
         response.set_cmd(resp_cmd);
         return true;
@@ -284,4 +610,4 @@ bool ProtobufHandler::RequireAuth(im::Envelope& response, im::CommandType resp_c
     return false;
 }
 
-uint64_t ProtobufHandler::CurrentUserId() const { return conn_ ? conn_->get_user_id() : 0; }
+uint64_t ProtobufHandler::CurrentUserId() const { return user_id_; }
@@ -1,12 +1,24 @@
 #pragma once
 
 #include <cstdint>
+#include <memory>
+#include <optional>
+#include <vector>
 #include "../service/auth_service.h"
 #include "../service/friend_service.h"
 #include "../service/msg_service.h"
+#include "../utils/coro.h"
 #include "core/tcp_connection.h"
 #include "protocol.pb.h"
 
+// Where a command may run in run-to-completion mode
+enum class CommandClass {
+    INLINE,    // Never blocks (in-memory state, AsyncMsgWriter queue), runs on the reactor thread
+    BLOCKING,  // Waits on MySQL or Scylla, runs on the thread pool (as a coroutine when a DB pool is set)
+};
+
+CommandClass ClassifyCommand(im::CommandType cmd);
+
 /**
  * ProtobufHandler - Handles binary protobuf protocol over TCP
  *
@@ -17,21 +29,75 @@
  * 2. Read payload (length bytes)
  * 3. Parse and dispatch based on CommandType
  * 4. Send response with same wire format
+ *
+ * Every complete frame in the read buffer is handled in one Process call (up to max_frames_per_read,
+ * so one pipelining client cannot hog a worker), and all responses are appended to the write buffer
+ * to go out in a single write.
+ *
+ * ProcessInline is the reactor-thread variant: it stops at the first BLOCKING command and keeps it in
+ * deferred_, the next Process call on a worker handles it first so responses stay in order. A P2P message is
+ * INLINE while ConvSeq knows its conversation; the first one of a conversation is deferred the same way, from
+ * Process as well, and waits for its seed from Scylla on the worker (in HandleAsync_ with a db_pool).
+ *
+ * With a db_pool, Process does not wait on BLOCKING commands either: it starts HandleAsync_, parks the
+ * connection and returns the worker. The coroutine awaits the Scylla driver callback (sync) or a call on
+ * db_pool (MySQL), then hands its response to TcpConnection::complete_async. Without one, every command
+ * runs synchronously on the worker as before.
+ *
+ * With the message WAL open, a MessageAck may only leave once MsgWal has synced the message. The acks are
+ * encoded as usual; when the frame loop ends with an unsynced one in write_buff, the connection is parked
+ * and the group commit releases it (HoldForWal_). A coroutine started behind such acks awaits the same
+ * LSN before it delivers. Nothing blocks, pipelined messages share one wait.
+ *
+ * P2PMessage.ack_mode picks when its MessageAck goes out: ACK_ON_ACCEPT as above, ACK_NONE never (errors
+ * only), ACK_ON_PERSIST from the writer thread once Scylla has the message, through TcpConnection::deliver.
+ *
+ * A sync with SyncMessagesReq.stream set goes out in frames of kSyncFrameMessages while the coroutine still
+ * holds the connection (TcpConnection::stream_async): a cursor sync reads one frame's worth at a time and
+ * sends it before reading the next, pausing while the socket is behind; a latest-messages sync sends the
+ * frames of each day bucket as soon as it is read, while the older days are still on their way. The last frame
+ * is the response that complete_async delivers. Without a db_pool the whole response is that last frame.
  */
-class ProtobufHandler : public ProtocolHandler {
+class ProtobufHandler : public ProtocolHandler, public std::enable_shared_from_this<ProtobufHandler> {
 public:
     ProtobufHandler(TcpConnection* conn, AuthService* auth_service, FriendService* friend_service,
-                    MsgService* msg_service, ThreadPool* thread_pool);
+                    MsgService* msg_service, ThreadPool* thread_pool, ThreadPool* db_pool = nullptr);
     ~ProtobufHandler() override = default;
 
     bool Process(Buffer& read_buff, Buffer& write_buff) override;
+    bool ProcessInline(Buffer& read_buff, Buffer& write_buff, bool* offload) override;
     bool IsKeepAlive() const override { return true; }
+    bool HasPendingRequest(const Buffer& read_buff) const override { return HasCompleteFrame(read_buff); }
+
+    // Frames handled per Process call before yielding the worker, set by Webserver
+    static size_t max_frames_per_read;
 
 private:
     // Message codec
+    static bool HasCompleteFrame(const Buffer& read_buff);
     bool TryDecodeMessage(Buffer& read_buff, im::Envelope& envelope);
     void EncodeMessage(const im::Envelope& envelope, Buffer& write_buff);
 
+    // Dispatch one request and append its response, false if it has none (yet)
+    bool HandleRequest(const im::Envelope& request, Buffer& write_buff);
+    // Whether request is handed to HandleAsync_ instead of HandleRequest, unseeded for a P2P message whose
+    // conversation ConvSeq has to seed first
+    bool RunsAsync(const im::Envelope& request, bool unseeded) const;
+    // Park the connection and start HandleAsync_ for request, caller is inside Process
+    void StartAsync(im::Envelope request);
+    // BLOCKING command (or unseeded P2P message) as a coroutine, owns a reference to the handler until the
+    // response is delivered, which also waits for wal_lsn (the acks already in the write buffer) to be durable
+    static Detached HandleAsync_(std::shared_ptr<ProtobufHandler> self, uint64_t generation, uint64_t wal_lsn,
+                                 im::Envelope request);
+    // Park the connection until the WAL has synced the acks in the write buffer, false if nothing to wait for
+    bool HoldForWal_();
+
+    // An ACK_ON_PERSIST ack, sent on the connection unless it was reused since generation
+    void DeliverPersistAck_(uint64_t generation, uint64_t seq, const im::MessageAck& ack);
+
+    // Record the session of a successful login and push the friend requests that arrived meanwhile
+    void FinishLogin(const im::Envelope& response);
+
     // Command dispatcher
     void Dispatch(const im::Envelope& request, im::Envelope& response);
 
@@ -45,8 +111,16 @@ private:
     void HandleGetFriendList(const im::Envelope& request, im::Envelope& response);
 
     // Message command handlers
-    void HandleP2PMsg(const im::Envelope& request, im::Envelope& response);
-    void HandleSyncMessages(const im::Envelope& request, im::Envelope& response);
+    // generation is the connection's while the request is handled, for its ACK_ON_PERSIST ack
+    void HandleP2PMsg(const im::Envelope& request, im::Envelope& response, uint64_t generation);
+    // Resumes on resume_pool, Dispatch runs it to completion on SyncWaitPool
+    Async<void> HandleSyncMessages(const im::Envelope& request, im::Envelope& response, ThreadPool* resume_pool);
+    // Streamed HandleSyncMessages, response gets the last frame. Stops early if the connection goes away.
+    Async<void> StreamSyncMessagesAsync_(uint64_t generation, const im::Envelope& request, im::Envelope& response);
+    // Send messages as a more_frames frame of the response to seq, false if the connection is gone
+    Async<bool> SendSyncFrame_(uint64_t generation, uint64_t seq, std::vector<im::P2PMessage> messages);
+    // Resumes on resume_pool, Dispatch runs it to completion on SyncWaitPool
+    Async<void> HandleGetHistory(const im::Envelope& request, im::Envelope& response, ThreadPool* resume_pool);
 
     void HandleUnknown(const im::Envelope& request, im::Envelope& response);
 
@@ -62,10 +136,26 @@ private:
     FriendService* friend_service_;
     MsgService* msg_service_;
     ThreadPool* thread_pool_;
+    ThreadPool* db_pool_;
+
+    // Logged in user, kept here rather than read from conn_ so a coroutine that outlives the connection
+    // still acts for the user that sent the request
+    uint64_t user_id_{0};
+
+    // Request waiting for a worker: a BLOCKING one decoded on the reactor thread, or a P2P message whose
+    // conversation is not seeded
+    std::optional<im::Envelope> deferred_;
+    // Seq ConvSeq::NextAsync took for the deferred P2P message, HandleP2PMsg uses it instead of taking one
+    uint64_t conv_seq_{0};
+    // Highest WAL LSN of an ack in the write buffer that is not released yet, 0 if none
+    uint64_t unsynced_lsn_{0};
+    // Set by a handler whose response is sent later or never, HandleRequest then encodes nothing
+    bool no_response_{false};
 
     // Constants
     static constexpr size_t kHeaderSize = 4;            // Length prefix size
     static constexpr size_t kMaxMessageSize = 1 << 20;  // 1MB max message size
+    static constexpr size_t kSyncFrameMessages = 50;    // Messages per streamed sync frame
 };
 
 // Specialization for std::format to handle im::CommandType directly
@@ -64,6 +64,16 @@ void HttpResponse::MakeResponse(Buffer& buff) {
     AddContent_(buff);
 }
 
+void HttpResponse::MakeBodyResponse(Buffer& buff, const string& body) {
+    if (code_ == -1) {
+        code_ = 200;
+    }
+    AddStateLine_(buff);
+    AddHeader_(buff);
+    buff.append("Content-length: " + to_string(body.size()) + "\r\n\r\n");
+    buff.append(body);
+}
+
 char* HttpResponse::File() { return mmFile_; }
 
 size_t HttpResponse::FileLen() const { return mmFileStat_.st_size; }
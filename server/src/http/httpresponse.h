@@ -16,6 +16,8 @@ public:
 
     void Init(const std::string& srcDir, std::string& path, bool isKeepAlive = false, int code = -1);
     void MakeResponse(Buffer& buff);
+    // Response with an in-memory body instead of a file, e.g. /metrics
+    void MakeBodyResponse(Buffer& buff, const std::string& body);
     void UnmapFile();
     char* File();
     size_t FileLen() const;
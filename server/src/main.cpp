@@ -1,5 +1,7 @@
 #include <signal.h>
 #include <unistd.h>
+#include <cstdlib>
+#include <cstring>
 #include "core/webserver.h"
 
 static Webserver* g_server = nullptr;
@@ -15,16 +17,58 @@ void signal_handler(int sig) {
 
 int main(int argc, char* argv[]) {
     bool open_log = true;
+    int reactor_num = 1;
+    IoBackend io_backend = IoBackend::EPOLL;
+    int frames_per_read = 64;
+    bool run_to_completion = false;
+    bool async_handlers = true;
+    int thread_num = 40;
     int opt;
-    const char* opt_string = "l:";
+    const char* opt_string = "l:r:b:f:ist:";
 
     while ((opt = getopt(argc, argv, opt_string)) != -1) {
         switch (opt) {
             case 'l':
                 open_log = false;
                 break;
+            case 'r':
+                // Number of event loops, each with its own SO_REUSEPORT listen socket
+                reactor_num = atoi(optarg);
+                break;
+            case 'b':
+                // Event backend, io_uring falls back to epoll when the kernel does not support it
+                if (strcmp(optarg, "epoll") == 0) {
+                    io_backend = IoBackend::EPOLL;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    io_backend = IoBackend::IO_URING;
+                } else if (strcmp(optarg, "uring_sqpoll") == 0) {
+                    io_backend = IoBackend::IO_URING_SQPOLL;
+                } else {
+                    printf("Unknown backend: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'f':
+                // Pipelined protobuf frames handled per read before yielding the worker
+                frames_per_read = atoi(optarg);
+                break;
+            case 'i':
+                // Run-to-completion: non-blocking commands are handled inline on the reactor thread
+                run_to_completion = true;
+                break;
+            case 's':
+                // Synchronous handlers: MySQL/Scylla commands block a worker until the database answers
+                async_handlers = false;
+                break;
+            case 't':
+                // Worker threads, coroutine handlers need far fewer than the synchronous ones
+                thread_num = atoi(optarg);
+                break;
             default:
-                printf("Usage: %s [-l 0[1]\n", argv[0]);
+                printf(
+                    "Usage: %s [-l 0[1] [-r reactor_num] [-b epoll|uring|uring_sqpoll] [-f frames_per_read] [-i] [-s] "
+                    "[-t thread_num]\n",
+                    argv[0]);
                 return 1;
         }
     }
@@ -38,7 +82,8 @@ int main(int argc, char* argv[]) {
     sigaction(SIGTERM, &sa, nullptr);  // kill command
 
     {
-        Webserver server(1316, 3, 60000, 3306, "root", "123456", "testdb", 50, 40, open_log, 1, 1024);
+        Webserver server(1316, 3, 60000, 3306, "root", "123456", "testdb", 50, thread_num, open_log, 1, 1024,
+                         reactor_num, io_backend, frames_per_read, run_to_completion, async_handlers);
         g_server = &server;
         server.Start();
         g_server = nullptr;
@@ -1,7 +1,9 @@
 #include "scylla_session.h"
+#include <cstdlib>
 #include <cstring>
 #include <string>
 #include "../log/log.h"
+#include "../utils/env.h"
 
 namespace {
 std::string CassFutureError(CassFuture* future) {
@@ -14,19 +16,102 @@ std::string CassFutureError(CassFuture* future) {
     return std::string(message, message_length);
 }
 
-bool has_value(const char* value) { return value != nullptr && std::strlen(value) > 0; }
+bool HasValue(const char* value) { return value != nullptr && std::strlen(value) > 0; }
+
+struct QueryDef {
+    const char* cql;
+    size_t param_count;
+    bool is_read;
+};
+
+// Indexed by ScyllaQuery
+constexpr QueryDef kQueries[] = {
+    {"INSERT INTO im.messages_by_day (conversation_id, day, timestamp, message_id, sender_id, receiver_id, "
+     "content_type, content, seq) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?);",
+     9, false},
+    {"INSERT INTO im.user_messages_by_day (user_id, day, message_id, sender_id, receiver_id, content_type, content, "
+     "timestamp, seq) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?);",
+     9, false},
+    {"SELECT message_id, sender_id, receiver_id, content_type, content, timestamp, seq FROM im.user_messages_by_day "
+     "WHERE user_id = ? AND day = ? LIMIT ?;",
+     3, true},
+    {"SELECT message_id, sender_id, receiver_id, content_type, content, timestamp FROM im.user_messages "
+     "WHERE user_id = ? ORDER BY timestamp DESC LIMIT 500;",
+     1, true},
+    {"SELECT message_id, sender_id, receiver_id, content_type, content, timestamp, seq FROM im.user_messages_by_day "
+     "WHERE user_id = ? AND day = ? AND timestamp > ? ORDER BY timestamp ASC LIMIT ?;",
+     4, true},
+    {"SELECT message_id, sender_id, receiver_id, content_type, content, timestamp, seq FROM im.user_messages_by_day "
+     "WHERE user_id = ? AND day = ? AND timestamp = ? AND message_id > ? LIMIT ?;",
+     5, true},
+    {"SELECT content FROM im.messages_by_day WHERE conversation_id = ? AND day = ? AND timestamp = ? "
+     "AND message_id = ?;",
+     4, true},
+    {"SELECT message_id, sender_id, receiver_id, content_type, content, timestamp, seq FROM im.messages_by_day "
+     "WHERE conversation_id = ? AND day = ? AND timestamp = ? AND message_id > ? LIMIT ?;",
+     5, true},
+    {"SELECT message_id, sender_id, receiver_id, content_type, content, timestamp, seq FROM im.messages_by_day "
+     "WHERE conversation_id = ? AND day = ? AND timestamp < ? LIMIT ?;",
+     4, true},
+    // Written at the seq as its timestamp, a replayed older seq never overwrites a newer one. Holds only while every
+    // write to the table does the same and nothing deletes from it, see init_scylla.sh
+    {"INSERT INTO im.conversation_seq (conversation_id, seq) VALUES (?, ?) USING TIMESTAMP ?;", 3, false},
+    {"SELECT seq FROM im.conversation_seq WHERE conversation_id = ?;", 1, true},
+};
+static_assert(sizeof(kQueries) / sizeof(kQueries[0]) == static_cast<size_t>(ScyllaQuery::COUNT));
+
+void EnvConsistency(const char* name, CassConsistency* out) {
+    static const struct {
+        const char* name;
+        CassConsistency value;
+    } kLevels[] = {
+        {"ANY", CASS_CONSISTENCY_ANY},       {"ONE", CASS_CONSISTENCY_ONE},
+        {"TWO", CASS_CONSISTENCY_TWO},       {"QUORUM", CASS_CONSISTENCY_QUORUM},
+        {"ALL", CASS_CONSISTENCY_ALL},       {"LOCAL_QUORUM", CASS_CONSISTENCY_LOCAL_QUORUM},
+        {"LOCAL_ONE", CASS_CONSISTENCY_LOCAL_ONE},
+    };
+    const char* value = getenv(name);
+    if (!HasValue(value)) return;
+    for (const auto& level : kLevels) {
+        if (strcasecmp(value, level.name) == 0) {
+            *out = level.value;
+            return;
+        }
+    }
+    LOG_WARN("Ignoring {}={}: unknown consistency level", name, value);
+}
 }  // namespace
 
+ScyllaOptions ScyllaOptions::FromEnv() {
+    ScyllaOptions options;
+    EnvNumber("SCYLLA_IO_THREADS", &options.io_threads);
+    EnvNumber("SCYLLA_CONNECTIONS_PER_HOST", &options.connections_per_host);
+    EnvBool("SCYLLA_TOKEN_AWARE", &options.token_aware);
+    EnvBool("SCYLLA_LATENCY_AWARE", &options.latency_aware);
+    EnvNumber("SCYLLA_SPECULATIVE_DELAY_MS", &options.speculative_delay_ms);
+    EnvNumber("SCYLLA_SPECULATIVE_MAX", &options.speculative_max);
+    EnvNumber("SCYLLA_REQUEST_TIMEOUT_MS", &options.request_timeout_ms);
+    EnvConsistency("SCYLLA_READ_CONSISTENCY", &options.read_consistency);
+    EnvConsistency("SCYLLA_WRITE_CONSISTENCY", &options.write_consistency);
+    EnvNumber("SCYLLA_INBOX_LOOKBACK_DAYS", &options.inbox_lookback_days);
+    EnvBool("SCYLLA_LEGACY_INBOX", &options.legacy_inbox);
+    EnvNumber("SCYLLA_INBOX_INLINE_BYTES", &options.inbox_inline_bytes);
+    EnvNumber("SCYLLA_HISTORY_LOOKBACK_DAYS", &options.history_lookback_days);
+    return options;
+}
+
 ScyllaSession* ScyllaSession::Instance() {
     static ScyllaSession instance;
     return &instance;
 }
 
-bool ScyllaSession::Init(const char* host, uint16_t port, const char* user, const char* pwd) {
+bool ScyllaSession::Init(const char* host, uint16_t port, const char* user, const char* pwd,
+                         const ScyllaOptions& options) {
     std::lock_guard<std::mutex> lock(mtx_);
     if (initialized_) {
         return true;
     }
+    options_ = options;
 
     cluster_ = cass_cluster_new();
     session_ = cass_session_new();
@@ -36,7 +121,7 @@ bool ScyllaSession::Init(const char* host, uint16_t port, const char* user, cons
         return false;
     }
 
-    if (has_value(host)) {
+    if (HasValue(host)) {
         cass_cluster_set_contact_points(cluster_, host);
     } else {
         cass_cluster_set_contact_points(cluster_, "scylla");
@@ -44,9 +129,10 @@ bool ScyllaSession::Init(const char* host, uint16_t port, const char* user, cons
     if (port != 0) {
         cass_cluster_set_port(cluster_, port);
     }
-    if (has_value(user) && has_value(pwd)) {
+    if (HasValue(user) && HasValue(pwd)) {
         cass_cluster_set_credentials(cluster_, user, pwd);
     }
+    ApplyOptions_();
 
     CassFuture* connect_future = cass_session_connect(session_, cluster_);
     cass_future_wait(connect_future);
@@ -59,11 +145,84 @@ bool ScyllaSession::Init(const char* host, uint16_t port, const char* user, cons
     }
 
     cass_future_free(connect_future);
+    if (!PrepareAll_(session_)) {
+        LOG_WARN("Scylla prepare failed, statements fall back to unprepared CQL");
+    }
     initialized_ = true;
     LOG_INFO("Scylla session initialized successfully.");
     return true;
 }
 
+void ScyllaSession::ApplyOptions_() {
+    if (options_.io_threads > 0) {
+        cass_cluster_set_num_threads_io(cluster_, options_.io_threads);
+    }
+    if (options_.connections_per_host > 0) {
+        cass_cluster_set_core_connections_per_host(cluster_, options_.connections_per_host);
+    }
+    cass_cluster_set_token_aware_routing(cluster_, options_.token_aware ? cass_true : cass_false);
+    cass_cluster_set_latency_aware_routing(cluster_, options_.latency_aware ? cass_true : cass_false);
+    if (options_.speculative_delay_ms > 0 && options_.speculative_max > 0) {
+        cass_cluster_set_constant_speculative_execution_policy(cluster_, options_.speculative_delay_ms,
+                                                               options_.speculative_max);
+    }
+    if (options_.request_timeout_ms > 0) {
+        cass_cluster_set_request_timeout(cluster_, options_.request_timeout_ms);
+    }
+    LOG_INFO("Scylla driver: io_threads={}, connections_per_host={}, token_aware={}, latency_aware={}, "
+             "speculative={}ms x{}, request_timeout={}ms",
+             options_.io_threads, options_.connections_per_host, options_.token_aware, options_.latency_aware,
+             options_.speculative_delay_ms, options_.speculative_max, options_.request_timeout_ms);
+}
+
+// Caller must hold mtx_. Entries that fail to prepare keep their previous value.
+bool ScyllaSession::PrepareAll_(CassSession* session) {
+    // Send every prepare first, then wait, one round trip instead of one per query
+    CassFuture* futures[static_cast<size_t>(ScyllaQuery::COUNT)];
+    for (size_t i = 0; i < std::size(kQueries); i++) {
+        futures[i] = cass_session_prepare(session, kQueries[i].cql);
+    }
+    bool ok = true;
+    for (size_t i = 0; i < std::size(kQueries); i++) {
+        cass_future_wait(futures[i]);
+        if (cass_future_error_code(futures[i]) == CASS_OK) {
+            prepared_[i] =
+                std::shared_ptr<const CassPrepared>(cass_future_get_prepared(futures[i]), cass_prepared_free);
+        } else {
+            LOG_ERROR("Scylla prepare failed for query {}: {}", i, CassFutureError(futures[i]));
+            ok = false;
+        }
+        cass_future_free(futures[i]);
+    }
+    return ok;
+}
+
+bool ScyllaSession::Reprepare() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (!session_) {
+        return false;
+    }
+    LOG_INFO("Re-preparing Scylla statements");
+    return PrepareAll_(session_);
+}
+
+CassStatement* ScyllaSession::NewStatement(ScyllaQuery query) {
+    auto index = static_cast<size_t>(query);
+    const QueryDef& def = kQueries[index];
+    std::shared_ptr<const CassPrepared> prepared;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        prepared = prepared_[index];
+    }
+
+    CassStatement* statement =
+        prepared ? cass_prepared_bind(prepared.get()) : cass_statement_new(def.cql, def.param_count);
+    cass_statement_set_consistency(statement, def.is_read ? options_.read_consistency : options_.write_consistency);
+    // Lets the driver retry and speculatively execute the reads, writes are never sent twice
+    cass_statement_set_is_idempotent(statement, def.is_read ? cass_true : cass_false);
+    return statement;
+}
+
 void ScyllaSession::Close() {
     std::lock_guard<std::mutex> lock(mtx_);
 
@@ -82,6 +241,10 @@ void ScyllaSession::Close() {
         cluster_ = nullptr;
     }
 
+    for (auto& prepared : prepared_) {
+        prepared.reset();
+    }
+
     initialized_ = false;
 }
 
@@ -1,19 +1,76 @@
 #pragma once
 
 #include <cassandra.h>
+#include <coroutine>
 #include <cstdint>
+#include <memory>
 #include <mutex>
+#include "threadpool.h"
+
+// Statements prepared once at Init, see kQueries in scylla_session.cpp
+enum class ScyllaQuery {
+    INSERT_HISTORY,       // im.messages_by_day, one row per conversation message
+    INSERT_INBOX,         // im.user_messages_by_day, one row per participant
+    SELECT_INBOX_BUCKET,  // Latest rows of one day of a user's inbox
+    SELECT_INBOX_LEGACY,  // Latest 500 rows of a user's inbox in the unbucketed im.user_messages
+    SELECT_INBOX_SINCE,   // Rows of one day of a user's inbox after a timestamp, oldest first
+    SELECT_INBOX_SINCE_AFTER_ID,  // Rows of one second of a user's inbox past a message id
+    SELECT_CONTENT,       // Content of one im.messages_by_day row, for an inbox row that only references it
+    SELECT_HISTORY_AFTER_ID,  // Rows of one second of a conversation's day past a message id
+    SELECT_HISTORY_BEFORE,    // Latest rows of one day of a conversation before a timestamp
+    INSERT_CONV_SEQ,          // Highest seq of a conversation written so far
+    SELECT_CONV_SEQ,          // The same, to seed the conversation's seqs after a restart
+    COUNT,
+};
+
+/**
+ * ScyllaOptions - driver settings that matter for throughput and latency
+ *
+ * Defaults match the driver's. FromEnv reads the SCYLLA_* variables (next to SCYLLA_HOST/SCYLLA_PORT),
+ * unset or unparsable ones keep the default. Speculative execution only applies to idempotent
+ * statements, which here are the reads.
+ */
+struct ScyllaOptions {
+    unsigned io_threads = 1;                                            // SCYLLA_IO_THREADS
+    unsigned connections_per_host = 1;                                  // SCYLLA_CONNECTIONS_PER_HOST
+    bool token_aware = true;                                            // SCYLLA_TOKEN_AWARE
+    bool latency_aware = false;                                         // SCYLLA_LATENCY_AWARE
+    int64_t speculative_delay_ms = 0;                                   // SCYLLA_SPECULATIVE_DELAY_MS, 0 = off
+    int speculative_max = 2;                                            // SCYLLA_SPECULATIVE_MAX
+    unsigned request_timeout_ms = 12000;                                // SCYLLA_REQUEST_TIMEOUT_MS
+    CassConsistency read_consistency = CASS_CONSISTENCY_LOCAL_ONE;      // SCYLLA_READ_CONSISTENCY
+    CassConsistency write_consistency = CASS_CONSISTENCY_LOCAL_ONE;     // SCYLLA_WRITE_CONSISTENCY
+    // Days of inbox buckets a sync reads back before giving up on filling its limit
+    int inbox_lookback_days = 30;                                       // SCYLLA_INBOX_LOOKBACK_DAYS
+    // Top syncs up from im.user_messages, until the old rows are migrated (see init_scylla.sh)
+    bool legacy_inbox = true;                                           // SCYLLA_LEGACY_INBOX
+    // Largest content copied into the inbox rows, bigger ones are read from the history row on sync
+    size_t inbox_inline_bytes = 1024;                                   // SCYLLA_INBOX_INLINE_BYTES
+    // Days of conversation buckets a history page reads back before it reports no more messages
+    int history_lookback_days = 365;                                    // SCYLLA_HISTORY_LOOKBACK_DAYS
+
+    static ScyllaOptions FromEnv();
+};
 
 class ScyllaSession {
 public:
     static ScyllaSession* Instance();
 
-    bool Init(const char* host, uint16_t port, const char* user, const char* pwd);
+    bool Init(const char* host, uint16_t port, const char* user, const char* pwd,
+              const ScyllaOptions& options = ScyllaOptions());
     void Close();
 
     CassSession* Session();
     bool IsInitialized() const;
 
+    // New statement for query, bound from the cached CassPrepared with the query's consistency and
+    // idempotence set. Falls back to an unprepared statement if preparing failed. Caller frees it.
+    CassStatement* NewStatement(ScyllaQuery query);
+    CassConsistency WriteConsistency() const { return options_.write_consistency; }
+    const ScyllaOptions& Options() const { return options_; }
+    // Prepare every query again, e.g. after a CASS_ERROR_SERVER_UNPREPARED following a schema change
+    bool Reprepare();
+
 private:
     ScyllaSession() = default;
     ~ScyllaSession() = default;
@@ -21,8 +78,50 @@ private:
     ScyllaSession(const ScyllaSession&) = delete;
     ScyllaSession& operator=(const ScyllaSession&) = delete;
 
+    void ApplyOptions_();
+    bool PrepareAll_(CassSession* session);
+
     mutable std::mutex mtx_;
     CassCluster* cluster_{nullptr};
     CassSession* session_{nullptr};
     bool initialized_{false};
+    ScyllaOptions options_;
+    // Shared so a statement can still be bound from an entry that Reprepare is replacing
+    std::shared_ptr<const CassPrepared> prepared_[static_cast<size_t>(ScyllaQuery::COUNT)];
+};
+
+/**
+ * CassFutureAwaiter - co_await a CassFuture without blocking the calling thread
+ *
+ * Registers a cass_future_set_callback; the driver calls it on its I/O thread (or right away when the
+ * future is already set) and the coroutine is resumed on resume_pool. await_resume hands the future
+ * back, the caller still owns and frees it.
+ */
+class CassFutureAwaiter {
+public:
+    CassFutureAwaiter(CassFuture* future, ThreadPool* resume_pool) : future_(future), resume_pool_(resume_pool) {}
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) {
+        handle_ = h;
+        if (cass_future_set_callback(future_, &CassFutureAwaiter::OnReady_, this) != CASS_OK) {
+            // Only fails when a callback is already set, fall back to waiting on a worker
+            resume_pool_->AddTask([this]() {
+                cass_future_wait(future_);
+                handle_.resume();
+            });
+        }
+    }
+    CassFuture* await_resume() const noexcept { return future_; }
+
+private:
+    static void OnReady_(CassFuture*, void* data) {
+        auto* self = static_cast<CassFutureAwaiter*>(data);
+        auto h = self->handle_;
+        self->resume_pool_->AddTask([h]() { h.resume(); });
+    }
+
+    CassFuture* future_;
+    ThreadPool* resume_pool_;
+    std::coroutine_handle<> handle_;
 };
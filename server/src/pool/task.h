@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/**
+ * Task - move-only void() callable with small-buffer storage, used by ThreadPool
+ *
+ * Callables that are trivially copyable and fit in kInlineSize bytes (lambdas capturing a few
+ * pointers/ids, e.g. [this, client] in Reactor or [user_id, friend_svc] in HandleLogin) are stored
+ * inline and cost no allocation. Anything else is moved into a heap box.
+ *
+ * Either way a Task is bitwise relocatable, which lets ThreadPool keep it in its queues as a plain
+ * Raw word array: Release() hands out the bytes and ownership, Adopt() takes them back.
+ */
+class Task {
+public:
+    static constexpr size_t kInlineSize = 48;
+
+    struct Raw {
+        const void* ops;
+        alignas(8) unsigned char storage[kInlineSize];
+    };
+
+    Task() = default;
+
+    template <typename F, typename Fn = std::decay_t<F>,
+              typename = std::enable_if_t<!std::is_same_v<Fn, Task> && std::is_invocable_r_v<void, Fn&>>>
+    Task(F&& f) {
+        if constexpr (kStoredInline<Fn>) {
+            ::new (static_cast<void*>(raw_.storage)) Fn(std::forward<F>(f));
+            raw_.ops = &kInlineOps<Fn>;
+        } else {
+            Fn* boxed = new Fn(std::forward<F>(f));
+            std::memcpy(raw_.storage, &boxed, sizeof(boxed));
+            raw_.ops = &kBoxedOps<Fn>;
+        }
+    }
+
+    Task(Task&& other) noexcept : raw_(other.raw_) { other.raw_.ops = nullptr; }
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            Reset_();
+            raw_ = other.raw_;
+            other.raw_.ops = nullptr;
+        }
+        return *this;
+    }
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task() { Reset_(); }
+
+    void operator()() { Ops_()->invoke(raw_.storage); }
+    explicit operator bool() const { return raw_.ops != nullptr; }
+
+    // Give up ownership as raw bytes, the Task is left empty
+    Raw Release() {
+        Raw raw = raw_;
+        raw_.ops = nullptr;
+        return raw;
+    }
+    static Task Adopt(const Raw& raw) {
+        Task task;
+        task.raw_ = raw;
+        return task;
+    }
+
+    template <typename Fn>
+    static constexpr bool kStoredInline = std::is_trivially_copyable_v<Fn> && sizeof(Fn) <= kInlineSize &&
+                                          alignof(Fn) <= 8;
+
+private:
+    struct Ops {
+        void (*invoke)(void* storage);
+        void (*destroy)(void* storage);
+    };
+
+    template <typename Fn>
+    static constexpr Ops kInlineOps = {
+        [](void* storage) { (*std::launder(static_cast<Fn*>(storage)))(); },
+        nullptr,
+    };
+
+    template <typename Fn>
+    static Fn* Unbox_(void* storage) {
+        Fn* boxed;
+        std::memcpy(&boxed, storage, sizeof(boxed));
+        return boxed;
+    }
+
+    template <typename Fn>
+    static constexpr Ops kBoxedOps = {
+        [](void* storage) { (*Unbox_<Fn>(storage))(); },
+        [](void* storage) { delete Unbox_<Fn>(storage); },
+    };
+
+    const Ops* Ops_() const { return static_cast<const Ops*>(raw_.ops); }
+
+    void Reset_() {
+        if (raw_.ops && Ops_()->destroy) {
+            Ops_()->destroy(raw_.storage);
+        }
+        raw_.ops = nullptr;
+    }
+
+    Raw raw_{};
+};
@@ -0,0 +1,173 @@
+#include "threadpool.h"
+#include <algorithm>
+
+thread_local ThreadPool* ThreadPool::current_pool_ = nullptr;
+thread_local size_t ThreadPool::current_index_ = 0;
+
+ThreadPool::ThreadPool(size_t threadCount) : injected_(1024) {
+    assert(threadCount > 0);
+    idle_.reserve(threadCount);
+    for (size_t i = 0; i < threadCount; i++) {
+        workers_.push_back(std::make_unique<Worker>());
+    }
+    // Start the threads only once every deque exists, workers steal from each other right away
+    for (size_t i = 0; i < threadCount; i++) {
+        workers_[i]->thread = std::thread(&ThreadPool::WorkerLoop_, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    Shutdown();
+    // Added after the workers exited, destroyed without running
+    for (size_t i = 0; i < inject_size_; i++) {
+        Task::Adopt(injected_[(inject_head_ + i) % injected_.size()]);
+    }
+}
+
+void ThreadPool::Shutdown() {
+    std::call_once(shutdown_once_, [this]() {
+        closed_.store(true, std::memory_order_seq_cst);
+        for (auto& worker : workers_) {
+            worker->wake.store(true, std::memory_order_release);
+            worker->wake.notify_one();
+        }
+        for (auto& worker : workers_) {
+            if (worker->thread.joinable()) {
+                worker->thread.join();
+            }
+        }
+    });
+}
+
+void ThreadPool::Submit_(Task task) {
+    if (current_pool_ == this) {
+        workers_[current_index_]->deque.Push(task.Release());
+    } else {
+        std::lock_guard<std::mutex> lock(inject_mtx_);
+        if (inject_size_ == injected_.size()) {
+            GrowInjected_();
+        }
+        injected_[(inject_head_ + inject_size_) % injected_.size()] = task.Release();
+        inject_size_++;
+        injected_count_.fetch_add(1, std::memory_order_relaxed);
+    }
+    // Pairs with the fence in Park_: either we see the sleeper or it sees the task
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleepers_.load(std::memory_order_relaxed) > 0) {
+        WakeOne_();
+    }
+}
+
+void ThreadPool::GrowInjected_() {
+    std::vector<Task::Raw> grown(injected_.size() * 2);
+    for (size_t i = 0; i < inject_size_; i++) {
+        grown[i] = injected_[(inject_head_ + i) % injected_.size()];
+    }
+    injected_.swap(grown);
+    inject_head_ = 0;
+}
+
+void ThreadPool::WakeOne_() {
+    size_t index;
+    {
+        std::lock_guard<std::mutex> lock(idle_mtx_);
+        if (idle_.empty()) return;
+        index = idle_.back();
+        idle_.pop_back();
+        sleepers_.fetch_sub(1, std::memory_order_relaxed);
+    }
+    Worker& worker = *workers_[index];
+    worker.wake.store(true, std::memory_order_release);
+    worker.wake.notify_one();
+}
+
+void ThreadPool::WorkerLoop_(size_t index) {
+    current_pool_ = this;
+    current_index_ = index;
+    while (true) {
+        Task task;
+        if (!FindTask_(index, &task)) {
+            if (closed_.load(std::memory_order_acquire)) {
+                break;
+            }
+            if (!Park_(index, &task)) continue;
+        }
+        task();
+    }
+    current_pool_ = nullptr;
+}
+
+bool ThreadPool::FindTask_(size_t index, Task* task) {
+    Task::Raw raw;
+    if (workers_[index]->deque.Pop(&raw)) {
+        *task = Task::Adopt(raw);
+        return true;
+    }
+    if (PopInjected_(index, task)) {
+        return true;
+    }
+
+    // Steal, starting from a random victim so thieves spread out
+    static thread_local uint32_t seed = static_cast<uint32_t>(index * 2654435761u + 1);
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    size_t n = workers_.size();
+    size_t start = seed % n;
+    for (size_t k = 0; k < n; k++) {
+        size_t victim = (start + k) % n;
+        if (victim != index && workers_[victim]->deque.Steal(&raw)) {
+            *task = Task::Adopt(raw);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ThreadPool::PopInjected_(size_t index, Task* task) {
+    if (injected_count_.load(std::memory_order_relaxed) == 0) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(inject_mtx_);
+    if (inject_size_ == 0) {
+        return false;
+    }
+    *task = Task::Adopt(injected_[inject_head_]);
+    inject_head_ = (inject_head_ + 1) % injected_.size();
+    inject_size_--;
+    // Take a fair share of the rest so the next few tasks need no lock, other workers can steal them
+    size_t batch = std::min(kInjectBatch, inject_size_ / workers_.size());
+    for (size_t i = 0; i < batch; i++) {
+        workers_[index]->deque.Push(injected_[inject_head_]);
+        inject_head_ = (inject_head_ + 1) % injected_.size();
+    }
+    inject_size_ -= batch;
+    injected_count_.fetch_sub(batch + 1, std::memory_order_relaxed);
+    return true;
+}
+
+bool ThreadPool::Park_(size_t index, Task* task) {
+    Worker& worker = *workers_[index];
+    {
+        std::lock_guard<std::mutex> lock(idle_mtx_);
+        idle_.push_back(index);
+        sleepers_.fetch_add(1, std::memory_order_relaxed);
+    }
+    // Pairs with the fence in Submit_, look once more now that submitters can see us
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool found = FindTask_(index, task);
+    if (found || closed_.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> lock(idle_mtx_);
+        auto it = std::find(idle_.begin(), idle_.end(), index);
+        if (it != idle_.end()) {
+            idle_.erase(it);
+            sleepers_.fetch_sub(1, std::memory_order_relaxed);
+        }
+        // Otherwise a submitter already popped us, its wake flag only causes one extra loop later
+        return found;
+    }
+    while (!worker.wake.exchange(false, std::memory_order_acquire)) {
+        worker.wake.wait(false, std::memory_order_acquire);
+    }
+    return false;
+}
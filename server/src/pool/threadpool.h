@@ -2,70 +2,92 @@
 #define THREADPOOL_H
 
 #include <assert.h>
-#include <condition_variable>
-#include <functional>
+#include <atomic>
+#include <memory>
 #include <mutex>
-#include <queue>
 #include <thread>
+#include <vector>
+#include "task.h"
+#include "work_stealing_deque.h"
 
+/**
+ * ThreadPool - work-stealing thread pool
+ *
+ * Every worker owns a WorkStealingDeque. Tasks submitted from a worker (e.g. the follow-up task
+ * posted by HandleLogin) go to that worker's deque without any lock; tasks from other threads
+ * (reactors, AsyncMsgWriter) go to the global injection queue.
+ *
+ * A worker looks for work in its own deque, then the injection queue (taking a small batch into
+ * its deque), then steals from the other workers. With nothing found it parks on its own futex.
+ * A submission wakes exactly one parked worker, and only if one is parked, so there is no
+ * thundering herd.
+ *
+ * Tasks are stored as Task::Raw by value in both the deques and the injection ring, so dispatching
+ * a small trivially copyable callable allocates nothing once the queues have grown to their
+ * working size.
+ *
+ * Shutdown (also run by the destructor) lets the workers finish the queued tasks and joins them.
+ */
 class ThreadPool {
 public:
-    ThreadPool() = default;
-    ThreadPool(ThreadPool&&) = default;
-    // Use make_shared instead of new to avoid memory fragmentation
-    explicit ThreadPool(size_t threadCount = 8) : pool_(std::make_shared<Pool>()) {
-        assert(threadCount > 0);
-        for (size_t i = 0; i < threadCount; i++) {
-            // Use detach to avoid joining the threads
-            std::thread([this]() {
-                std::unique_lock<std::mutex> locker(pool_->mtx_);
-                while (true) {
-                    if (!pool_->tasks_.empty()) {
-                        auto task = std::move(pool_->tasks_.front());
-                        pool_->tasks_.pop();
-                        // The lock is only used to protect the queue, so it can be released before executing the task
-                        locker.unlock();
-                        task();
-                        // Lock again after executing the task
-                        locker.lock();
-                    } else if (pool_->isClosed) {
-                        break;
-                    } else {
-                        pool_->cond_.wait(locker);
-                    }
-                }
-            }).detach();
-        }
-    }
+    explicit ThreadPool(size_t threadCount = 8);
+    ~ThreadPool();
 
-    ~ThreadPool() {
-        if (pool_) {
-            std::unique_lock<std::mutex> locker(pool_->mtx_);
-            pool_->isClosed = true;
-        }
-        // Notify all threads to exit
-        pool_->cond_.notify_all();
-    }
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
 
     template <typename T>
     // Universal reference is used to accept both lvalue and rvalue
     void AddTask(T&& task) {
-        std::unique_lock<std::mutex> locker(pool_->mtx_);
-        // The emplace method constructs the task object in queue directly
-        // Perfect forwarding is used to avoid unnecessary copy and checking of the task type
-        pool_->tasks_.emplace(std::forward<T>(task));
-        // Notify one thread to execute the task
-        pool_->cond_.notify_one();
+        Submit_(Task(std::forward<T>(task)));
     }
 
+    // Run what is already queued, then join the workers. Tasks added afterwards are dropped.
+    void Shutdown();
+
+    size_t thread_count() const { return workers_.size(); }
+
 private:
-    struct Pool {
-        std::mutex mtx_;
-        std::condition_variable cond_;
-        bool isClosed;
-        std::queue<std::function<void()>> tasks_;
+    struct Worker {
+        WorkStealingDeque<Task::Raw> deque;
+        // Parking futex, set by whoever wakes this worker
+        std::atomic<bool> wake{false};
+        std::thread thread;
     };
-    std::shared_ptr<Pool> pool_;
+
+    void Submit_(Task task);
+    void WorkerLoop_(size_t index);
+    bool FindTask_(size_t index, Task* task);
+    bool PopInjected_(size_t index, Task* task);
+    bool Park_(size_t index, Task* task);
+    void WakeOne_();
+    // Caller must hold inject_mtx_
+    void GrowInjected_();
+
+    // Number of injected tasks a worker moves to its own deque at once
+    static constexpr size_t kInjectBatch = 16;
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+
+    // Ring buffer that only grows, std::deque would allocate a new chunk every few tasks
+    std::mutex inject_mtx_;
+    std::vector<Task::Raw> injected_;
+    size_t inject_head_{0};
+    size_t inject_size_{0};
+    // Lets idle workers skip inject_mtx_ when there is nothing to take
+    std::atomic<size_t> injected_count_{0};
+
+    // Parked workers, the most recently parked is woken first since its cache is the warmest
+    std::mutex idle_mtx_;
+    std::vector<size_t> idle_;
+    std::atomic<size_t> sleepers_{0};
+
+    std::atomic<bool> closed_{false};
+    std::once_flag shutdown_once_;
+
+    // The pool and worker index of the current thread, nullptr outside the workers
+    static thread_local ThreadPool* current_pool_;
+    static thread_local size_t current_index_;
 };
 
-#endif
\ No newline at end of file
+#endif
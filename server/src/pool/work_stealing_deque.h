@@ -0,0 +1,134 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+/**
+ * WorkStealingDeque - Chase-Lev deque (Le, Pop, Cohen, Zappa Nardelli: "Correct and Efficient
+ * Work-Stealing for Weak Memory Models", PPoPP 2013)
+ *
+ * The owning thread pushes and pops at the bottom (LIFO, cache-warm); any other thread steals from
+ * the top (FIFO). Push/Pop never lock, Steal is a single CAS. The ring doubles when full; old rings
+ * are kept until the deque is destroyed because a thief may still be reading them.
+ *
+ * T must be trivially copyable. Slots are arrays of relaxed atomic words rather than std::atomic<T>,
+ * so T can be larger than a pointer (ThreadPool stores Task::Raw inline) and a thief that reads a slot
+ * while the owner overwrites it only gets a torn copy, which it throws away when its CAS fails.
+ */
+template <typename T>
+class WorkStealingDeque {
+    static_assert(std::is_trivially_copyable_v<T>, "WorkStealingDeque needs a trivially copyable T");
+
+public:
+    explicit WorkStealingDeque(int64_t capacity = 256) : array_(new Ring(capacity)) {}
+    ~WorkStealingDeque() { delete array_.load(std::memory_order_relaxed); }
+
+    WorkStealingDeque(const WorkStealingDeque&) = delete;
+    WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+
+    // Owner only
+    void Push(const T& item) {
+        int64_t b = bottom_.load(std::memory_order_relaxed);
+        int64_t t = top_.load(std::memory_order_acquire);
+        Ring* ring = array_.load(std::memory_order_relaxed);
+        if (b - t > ring->capacity - 1) {
+            ring = Grow_(ring, b, t);
+        }
+        ring->Put(b, item);
+        // Publishes the slot to thieves that acquire bottom_
+        bottom_.store(b + 1, std::memory_order_release);
+    }
+
+    // Owner only
+    bool Pop(T* item) {
+        int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+        Ring* ring = array_.load(std::memory_order_relaxed);
+        bottom_.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top_.load(std::memory_order_relaxed);
+        if (t > b) {
+            // Empty
+            bottom_.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+        *item = ring->Get(b);
+        if (t == b) {
+            // Last item, race the thieves for it
+            bool won = top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+            bottom_.store(b + 1, std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+
+    // Any thread. Fails when empty or when another thread took the top item first.
+    bool Steal(T* item) {
+        int64_t t = top_.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom_.load(std::memory_order_acquire);
+        if (t >= b) {
+            return false;
+        }
+        Ring* ring = array_.load(std::memory_order_acquire);
+        T stolen = ring->Get(t);
+        if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return false;
+        }
+        *item = stolen;
+        return true;
+    }
+
+    bool Empty() const {
+        return bottom_.load(std::memory_order_relaxed) <= top_.load(std::memory_order_relaxed);
+    }
+
+private:
+    static constexpr size_t kWords = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+    struct Ring {
+        explicit Ring(int64_t cap) : capacity(cap), mask(cap - 1), words(new std::atomic<uint64_t>[cap * kWords]) {}
+
+        T Get(int64_t i) const {
+            uint64_t buf[kWords];
+            const std::atomic<uint64_t>* slot = &words[(i & mask) * kWords];
+            for (size_t w = 0; w < kWords; w++) {
+                buf[w] = slot[w].load(std::memory_order_relaxed);
+            }
+            T item;
+            std::memcpy(&item, buf, sizeof(T));
+            return item;
+        }
+        void Put(int64_t i, const T& item) {
+            uint64_t buf[kWords] = {};
+            std::memcpy(buf, &item, sizeof(T));
+            std::atomic<uint64_t>* slot = &words[(i & mask) * kWords];
+            for (size_t w = 0; w < kWords; w++) {
+                slot[w].store(buf[w], std::memory_order_relaxed);
+            }
+        }
+
+        int64_t capacity;
+        int64_t mask;
+        std::unique_ptr<std::atomic<uint64_t>[]> words;
+    };
+
+    Ring* Grow_(Ring* old, int64_t b, int64_t t) {
+        Ring* ring = new Ring(old->capacity * 2);
+        for (int64_t i = t; i < b; i++) {
+            ring->Put(i, old->Get(i));
+        }
+        retired_.emplace_back(old);
+        array_.store(ring, std::memory_order_release);
+        return ring;
+    }
+
+    // top_ and bottom_ on separate cache lines, thieves hammer top_ while the owner works on bottom_
+    alignas(64) std::atomic<int64_t> top_{0};
+    alignas(64) std::atomic<int64_t> bottom_{0};
+    alignas(64) std::atomic<Ring*> array_;
+    std::vector<std::unique_ptr<Ring>> retired_;
+};
@@ -0,0 +1,94 @@
+#include "conv_seq.h"
+#include <algorithm>
+#include <iterator>
+#include <vector>
+#include "../dao/async_msg_writer.h"
+#include "../log/log.h"
+#include "../utils/env.h"
+#include "../utils/id_generator.h"
+#include "../utils/metrics.h"
+
+ConvSeq* ConvSeq::Instance() {
+    static ConvSeq instance([] {
+        size_t max_conversations = 1 << 20;
+        EnvNumber("CONV_SEQ_CONVERSATIONS", &max_conversations);
+        return max_conversations;
+    }());
+    return &instance;
+}
+
+ConvSeq::ConvSeq(size_t max_conversations) : per_shard_(std::max<size_t>(max_conversations / kShards, 1)) {
+    auto* metrics = Metrics::Instance();
+    metrics->AddGauge("termchat_conv_seq_conversations", "Conversations whose next seq is in memory",
+                      [this]() { return static_cast<double>(conversations_.load(std::memory_order_relaxed)); });
+    metrics->AddCounter("termchat_conv_seq_seeds_total", "Conversations seeded from Scylla",
+                        [this]() { return static_cast<double>(seeds_.load(std::memory_order_relaxed)); });
+    metrics->AddCounter("termchat_conv_seq_seeds_without_scylla_total",
+                        "Conversations seeded from the writer's messages alone because Scylla could not be read",
+                        [this]() {
+                            return static_cast<double>(seeds_without_scylla_.load(std::memory_order_relaxed));
+                        });
+}
+
+uint64_t ConvSeq::TryNext(uint64_t user_a, uint64_t user_b) {
+    auto conv_id = IdGenerator::GenerateP2PConvId(user_a, user_b);
+    Shard& shard = ShardOf_(conv_id);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    auto it = shard.last.find(conv_id);
+    return it != shard.last.end() ? ++it->second : 0;
+}
+
+Async<uint64_t> ConvSeq::NextAsync(uint64_t user_a, uint64_t user_b, ThreadPool* resume_pool) {
+    if (uint64_t seq = TryNext(user_a, user_b)) {
+        co_return seq;
+    }
+
+    // Read without the lock, the shard's other conversations go on meanwhile
+    uint64_t seed = co_await SeedAsync_(user_a, user_b, resume_pool);
+
+    auto conv_id = IdGenerator::GenerateP2PConvId(user_a, user_b);
+    Shard& shard = ShardOf_(conv_id);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    auto [it, inserted] = shard.last.try_emplace(conv_id, seed);
+    if (inserted) {
+        conversations_.fetch_add(1, std::memory_order_relaxed);
+        if (shard.last.size() > per_shard_) {
+            // Its seqs are in Scylla, in the writer's queue or, finally failed and only in MsgWal, in the
+            // writer's HighestFailedSeq; a later seed finds them again
+            auto victim = shard.last.begin() == it ? std::next(shard.last.begin()) : shard.last.begin();
+            shard.last.erase(victim);
+            conversations_.fetch_sub(1, std::memory_order_relaxed);
+        }
+    } else {
+        // Seeded concurrently and maybe used since, the higher one is right
+        it->second = std::max(it->second, seed);
+    }
+    co_return ++it->second;
+}
+
+Async<uint64_t> ConvSeq::SeedAsync_(uint64_t user_a, uint64_t user_b, ThreadPool* resume_pool) {
+    // Taken first, a message written while Scylla is read is then in one of the two
+    auto* writer = AsyncMsgWriter::GetInstance();
+    std::vector<im::P2PMessage> in_flight;
+    writer->InFlightFor(user_a, &in_flight);
+    uint64_t seq = 0;
+    bool read = co_await dao_.GetConversationSeqAsync(user_a, user_b, &seq, resume_pool);
+    // A failed read leaves a seed the writer's messages vouch for, better than refusing the message
+    seq = std::max(seq, writer->HighestFailedSeq(user_a, user_b));
+    for (const auto& msg : in_flight) {
+        bool same_conversation = (msg.sender_id() == user_a && msg.receiver_id() == user_b) ||
+                                 (msg.sender_id() == user_b && msg.receiver_id() == user_a);
+        if (same_conversation) {
+            seq = std::max(seq, msg.seq());
+        }
+    }
+    auto conv_id = IdGenerator::GenerateP2PConvId(user_a, user_b);
+    if (read) {
+        seeds_.fetch_add(1, std::memory_order_relaxed);
+        LOG_DEBUG("Conversation {} seeded at seq {}", conv_id, seq);
+    } else {
+        seeds_without_scylla_.fetch_add(1, std::memory_order_relaxed);
+        LOG_WARN("Conversation {} seeded at seq {} without Scylla", conv_id, seq);
+    }
+    co_return seq;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "../dao/msg_scylla_dao.h"
+#include "../pool/threadpool.h"
+#include "../utils/coro.h"
+
+/**
+ * ConvSeq - the next seq of each conversation, P2PMessage.seq
+ *
+ * Conversations are spread over kShards lock-striped maps. The first message of a conversation after a start (or
+ * after its entry was dropped) seeds it: the highest of im.conversation_seq, which lags behind by the messages
+ * AsyncMsgWriter has not written yet, of those messages themselves and of the ones it failed to write. TryNext
+ * never blocks and only knows seeded conversations; NextAsync seeds with a Scylla read the caller awaits, once per
+ * conversation. When Scylla cannot be read the seed comes from the writer alone, so messages the writer no longer
+ * holds may see their seqs again. Seqs are only consecutive while one server process takes all of a
+ * conversation's messages. im.conversation_seq keeps the highest seq by writing it at the seq as its timestamp,
+ * so it must only be written that way and never deleted from (init_scylla.sh).
+ *
+ * At most CONV_SEQ_CONVERSATIONS entries are kept (default 1M), past it a shard drops an arbitrary other entry.
+ * Seeds, with and without Scylla, are exported as termchat_conv_seq_*.
+ */
+class ConvSeq {
+public:
+    static ConvSeq* Instance();
+
+    // Seq of a new message between user_a and user_b, 0 if the conversation is not seeded (NextAsync)
+    uint64_t TryNext(uint64_t user_a, uint64_t user_b);
+    // Seq of a new message between user_a and user_b, seeding the conversation first if needed. Resumes on
+    // resume_pool.
+    Async<uint64_t> NextAsync(uint64_t user_a, uint64_t user_b, ThreadPool* resume_pool);
+
+private:
+    struct Shard {
+        std::mutex mtx;
+        // Last seq handed out
+        std::unordered_map<std::string, uint64_t> last;
+    };
+
+    static constexpr size_t kShards = 64;
+
+    explicit ConvSeq(size_t max_conversations);
+    Shard& ShardOf_(const std::string& conv_id) { return shards_[std::hash<std::string>{}(conv_id) % kShards]; }
+    // Highest seq already taken in the conversation
+    Async<uint64_t> SeedAsync_(uint64_t user_a, uint64_t user_b, ThreadPool* resume_pool);
+
+    const size_t per_shard_;
+    std::array<Shard, kShards> shards_;
+    MsgScyllaDao dao_;
+
+    std::atomic<size_t> conversations_{0};
+    std::atomic<uint64_t> seeds_{0};
+    std::atomic<uint64_t> seeds_without_scylla_{0};
+};
@@ -0,0 +1,80 @@
+#include "history_cache.h"
+#include <algorithm>
+#include <iterator>
+#include "../log/log.h"
+#include "../utils/env.h"
+#include "../utils/id_generator.h"
+
+HistoryCache::Options HistoryCache::Options::FromEnv() {
+    Options options;
+    size_t budget_mb = options.budget_bytes >> 20;
+    EnvNumber("HISTORY_CACHE_MB", &budget_mb);
+    options.budget_bytes = budget_mb << 20;
+    EnvNumber("HISTORY_CACHE_PER_CONV", &options.per_conversation);
+    return options;
+}
+
+HistoryCache* HistoryCache::Instance() {
+    static HistoryCache instance(Options::FromEnv());
+    return &instance;
+}
+
+HistoryCache::HistoryCache(const Options& options) : rings_(options.budget_bytes, options.per_conversation) {
+    if (rings_.Enabled()) {
+        LOG_INFO("History cache: {} MB, {} messages per conversation", options.budget_bytes >> 20,
+                 options.per_conversation);
+    }
+    rings_.RegisterMetrics("termchat_history_cache", "history cache");
+}
+
+void HistoryCache::Add(const im::P2PMessage& msg) {
+    rings_.Add(IdGenerator::GenerateP2PConvId(msg.sender_id(), msg.receiver_id()), msg);
+}
+
+bool HistoryCache::GetBefore(uint64_t user_id, uint64_t peer_id, int64_t before_timestamp, uint64_t before_msg_id,
+                             size_t limit, std::vector<im::P2PMessage>* out) {
+    if (limit == 0) {
+        return false;
+    }
+    std::vector<im::P2PMessage> page;
+    auto conv_id = IdGenerator::GenerateP2PConvId(user_id, peer_id);
+    bool hit = rings_.Read(conv_id, [&](const RecentMessages<std::string>::Ring& ring) {
+        page.clear();
+        const auto& messages = ring.messages;
+        auto by_timestamp = [](const im::P2PMessage& m, int64_t ts) { return m.timestamp() < ts; };
+        int64_t before = before_timestamp > 0 ? before_timestamp : INT64_MAX;
+        // Rest of the cursor's second, ids ascending as stored
+        if (before_timestamp > 0) {
+            if (before_timestamp <= ring.complete_after) {
+                return false;
+            }
+            auto rest = std::partition_point(messages.begin(), messages.end(), [&](const im::P2PMessage& m) {
+                return m.timestamp() < before_timestamp ||
+                       (m.timestamp() == before_timestamp && m.msg_id() <= before_msg_id);
+            });
+            for (; rest != messages.end() && rest->timestamp() == before_timestamp && page.size() < limit; ++rest) {
+                page.push_back(*rest);
+            }
+        }
+        // Then whole seconds before it, newest first, each only if the ring has all of it
+        auto end = std::lower_bound(messages.begin(), messages.end(), before, by_timestamp);
+        while (page.size() < limit && end != messages.begin()) {
+            int64_t second = std::prev(end)->timestamp();
+            if (second <= ring.complete_after) {
+                return false;
+            }
+            auto start = std::lower_bound(messages.begin(), end, second, by_timestamp);
+            for (auto it = start; it != end && page.size() < limit; ++it) {
+                page.push_back(*it);
+            }
+            end = start;
+        }
+        // Short of limit the rest is older than the ring, only Scylla knows if there is any
+        return page.size() == limit;
+    });
+    if (hit) {
+        rings_.CountServed(page.size());
+        out->insert(out->end(), std::make_move_iterator(page.begin()), std::make_move_iterator(page.end()));
+    }
+    return hit;
+}
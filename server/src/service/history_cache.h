@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "message_service.pb.h"
+#include "recent_messages.h"
+
+/**
+ * HistoryCache - the newest messages of recently active conversations, so that paging back through a chat
+ * can skip Scylla
+ *
+ * MsgService adds every accepted message to the ring of its conversation, the im.messages_by_day partition
+ * MsgScyllaDao writes it to. Rings hold HISTORY_CACHE_PER_CONV messages within HISTORY_CACHE_MB (0 turns it off),
+ * see RecentMessages. A history page is answered from a ring only when the ring holds all of it, otherwise it
+ * goes to Scylla. Messages sent through another server process are not seen here.
+ *
+ * Lookups by result and the messages served without a Scylla read are exported as termchat_history_cache_*.
+ */
+class HistoryCache {
+public:
+    struct Options {
+        size_t budget_bytes = 64 << 20;
+        size_t per_conversation = 200;
+
+        static Options FromEnv();
+    };
+
+    static HistoryCache* Instance();
+
+    // Add msg to the ring of its conversation
+    void Add(const im::P2PMessage& msg);
+    // Up to limit messages between user_id and peer_id stored after the cursor as in MsgScyllaDao::GetHistoryAsync,
+    // if the ring is known to hold that many of them
+    bool GetBefore(uint64_t user_id, uint64_t peer_id, int64_t before_timestamp, uint64_t before_msg_id, size_t limit,
+                   std::vector<im::P2PMessage>* out);
+
+    uint64_t Hits() const { return rings_.Hits(); }
+    uint64_t Misses() const { return rings_.Misses(); }
+
+private:
+    explicit HistoryCache(const Options& options);
+
+    RecentMessages<std::string> rings_;
+};
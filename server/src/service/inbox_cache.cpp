@@ -0,0 +1,53 @@
+#include "inbox_cache.h"
+#include <algorithm>
+#include "../log/log.h"
+#include "../utils/env.h"
+
+InboxCache::Options InboxCache::Options::FromEnv() {
+    Options options;
+    size_t budget_mb = options.budget_bytes >> 20;
+    EnvNumber("INBOX_CACHE_MB", &budget_mb);
+    options.budget_bytes = budget_mb << 20;
+    EnvNumber("INBOX_CACHE_PER_USER", &options.per_user);
+    return options;
+}
+
+InboxCache* InboxCache::Instance() {
+    static InboxCache instance(Options::FromEnv());
+    return &instance;
+}
+
+InboxCache::InboxCache(const Options& options) : rings_(options.budget_bytes, options.per_user) {
+    if (rings_.Enabled()) {
+        LOG_INFO("Inbox cache: {} MB, {} messages per user", options.budget_bytes >> 20, options.per_user);
+    }
+    rings_.RegisterMetrics("termchat_inbox_cache", "inbox cache");
+}
+
+void InboxCache::Add(uint64_t owner_id, const im::P2PMessage& msg) {
+    if (owner_id != 0) {
+        rings_.Add(owner_id, msg);
+    }
+}
+
+bool InboxCache::GetSince(uint64_t user_id, int64_t since_timestamp, size_t limit, std::vector<im::P2PMessage>* out) {
+    size_t served = 0;
+    bool hit = rings_.Read(user_id, [&](const RecentMessages<uint64_t>::Ring& ring) {
+        if (since_timestamp <= ring.complete_after) {
+            return false;
+        }
+        auto first = std::partition_point(ring.messages.begin(), ring.messages.end(),
+                                          [&](const im::P2PMessage& m) { return m.timestamp() < since_timestamp; });
+        served = static_cast<size_t>(ring.messages.end() - first);
+        // More than a page, Scylla continues it from a continuation token
+        if (served > limit) {
+            return false;
+        }
+        out->insert(out->end(), first, ring.messages.end());
+        return true;
+    });
+    if (hit) {
+        rings_.CountServed(served);
+    }
+    return hit;
+}
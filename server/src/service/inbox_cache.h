@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "message_service.pb.h"
+#include "recent_messages.h"
+
+/**
+ * InboxCache - the newest inbox messages of recently active users, so that a sync can skip Scylla
+ *
+ * MsgService adds every accepted message to the ring of its sender and of its receiver, the two inbox rows
+ * MsgScyllaDao writes for it. Rings hold INBOX_CACHE_PER_USER messages within INBOX_CACHE_MB (0 turns it off),
+ * see RecentMessages. A cursor sync is answered from a ring only when its range is within what the ring is
+ * complete for, otherwise it goes to Scylla. A sync of the latest messages always reads Scylla: a ring only
+ * covers a whole kInboxLimit page once it holds that many messages of one user. Messages sent through another
+ * server process are not seen here.
+ *
+ * Lookups by result and the messages served without a Scylla read are exported as termchat_inbox_cache_*.
+ */
+class InboxCache {
+public:
+    struct Options {
+        size_t budget_bytes = 64 << 20;
+        size_t per_user = 500;
+
+        static Options FromEnv();
+    };
+
+    static InboxCache* Instance();
+
+    // Add msg to the ring of owner_id, its sender or its receiver
+    void Add(uint64_t owner_id, const im::P2PMessage& msg);
+    // The inbox messages of user_id with a timestamp from since_timestamp on, oldest first, if the ring holds all
+    // of them and they are at most limit
+    bool GetSince(uint64_t user_id, int64_t since_timestamp, size_t limit, std::vector<im::P2PMessage>* out);
+
+    uint64_t Hits() const { return rings_.Hits(); }
+    uint64_t Misses() const { return rings_.Misses(); }
+
+private:
+    explicit InboxCache(const Options& options);
+
+    RecentMessages<uint64_t> rings_;
+};
@@ -1,62 +1,376 @@
 #include "msg_service.h"
+#include <algorithm>
 #include <ctime>
+#include <string>
+#include <unordered_set>
+#include <vector>
 #include "../dao/async_msg_writer.h"
 #include "../log/log.h"
+#include "../utils/metrics.h"
+#include "../utils/snowflake.h"
+#include "conv_seq.h"
+#include "history_cache.h"
+#include "inbox_cache.h"
+#include "send_dedup.h"
+
+namespace {
+// Whether msg is at or before the request's cursor, the client has it
+bool AtOrBeforeCursor(const im::SyncMessagesReq& req, const im::P2PMessage& msg) {
+    return msg.timestamp() < req.since_timestamp() ||
+           (msg.timestamp() == req.since_timestamp() && msg.msg_id() <= req.since_msg_id());
+}
+
+void FillSyncPage(const im::SyncMessagesReq& req, std::vector<im::P2PMessage> messages, std::string continuation,
+                  im::SyncMessagesResp* resp) {
+    resp->set_success(true);
+    for (auto& msg : messages) {
+        if (AtOrBeforeCursor(req, msg)) continue;
+        *resp->add_messages() = std::move(msg);
+    }
+    resp->set_has_more(!continuation.empty());
+    resp->set_continuation(std::move(continuation));
+}
+
+// Messages of user_id AsyncMsgWriter accepted but has not stored yet. Taken before the Scylla read, so a message
+// stored in between is in what the read returns.
+std::vector<im::P2PMessage> TakeInFlight(uint64_t user_id) {
+    std::vector<im::P2PMessage> in_flight;
+    AsyncMsgWriter::GetInstance()->InFlightFor(user_id, &in_flight);
+    return in_flight;
+}
+
+// Add the in_flight messages that messages does not have, by msg_id, keeping it ordered by timestamp (and ids
+// ascending within a second oldest first, as a cursor moves)
+void MergeInFlight(std::vector<im::P2PMessage>* messages, std::vector<im::P2PMessage> in_flight, bool newest_first) {
+    if (in_flight.empty()) return;
+    std::unordered_set<uint64_t> seen;
+    seen.reserve(messages->size());
+    for (const auto& msg : *messages) {
+        seen.insert(msg.msg_id());
+    }
+    for (auto& msg : in_flight) {
+        if (!seen.insert(msg.msg_id()).second) continue;
+        msg.clear_ack_mode();
+        messages->push_back(std::move(msg));
+    }
+    std::stable_sort(messages->begin(), messages->end(), [&](const im::P2PMessage& a, const im::P2PMessage& b) {
+        if (newest_first) return a.timestamp() > b.timestamp();
+        return a.timestamp() != b.timestamp() ? a.timestamp() < b.timestamp() : a.msg_id() < b.msg_id();
+    });
+}
+
+// A cursor sync's in-flight messages are all recent, they go in the last page (the one reaching the present) and
+// may take it over page_size. Merged into an earlier page they would move the client's cursor past the rest.
+void MergeInFlightIntoLastPage(const im::SyncMessagesReq& req, const std::string& continuation,
+                               std::vector<im::P2PMessage> in_flight, std::vector<im::P2PMessage>* messages) {
+    if (!continuation.empty()) return;
+    std::erase_if(in_flight, [&](const im::P2PMessage& msg) { return AtOrBeforeCursor(req, msg); });
+    MergeInFlight(messages, std::move(in_flight), false);
+}
+
+// The first page of a cursor sync from InboxCache, when it has all of it
+bool SyncFromCache(uint64_t user_id, const im::SyncMessagesReq& req, im::SyncMessagesResp* resp) {
+    std::vector<im::P2PMessage> messages;
+    if (!req.continuation().empty() ||
+        !InboxCache::Instance()->GetSince(user_id, req.since_timestamp(), MsgService::sync_page_size(req), &messages)) {
+        return false;
+    }
+    FillSyncPage(req, std::move(messages), std::string(), resp);
+    LOG_INFO("User[{}] synced {} messages since {} from the inbox cache.", user_id, resp->messages_size(),
+             req.since_timestamp());
+    return true;
+}
+
+// Messages a history page returns: the request's limit, 0 meaning kHistoryPageDefault
+constexpr size_t kHistoryPageDefault = 50;
+constexpr size_t kHistoryPageMax = 100;
+
+size_t HistoryLimit(const im::GetHistoryReq& req) {
+    if (req.limit() == 0) return kHistoryPageDefault;
+    return std::min<size_t>(req.limit(), kHistoryPageMax);
+}
+
+bool CheckHistoryReq(uint64_t user_id, const im::GetHistoryReq& req, im::GetHistoryResp* resp) {
+    if (user_id == 0) {
+        resp->set_success(false);
+        resp->set_error_msg("User ID is empty");
+        return false;
+    }
+    if (req.peer_id() == 0) {
+        resp->set_success(false);
+        resp->set_error_msg("Peer ID is empty");
+        return false;
+    }
+    return true;
+}
+
+// The ACK_ON_PERSIST ack of an accepted message
+im::MessageAck PersistAck(uint64_t msg_id, uint64_t client_msg_id, uint64_t seq, bool ok) {
+    im::MessageAck ack;
+    ack.set_msg_id(msg_id);
+    ack.set_client_msg_id(client_msg_id);
+    ack.set_ref_seq(seq);
+    ack.set_success(ok);
+    if (!ok) {
+        // Accepted and delivered to the receiver if online, but not stored: resending would duplicate it
+        ack.set_error_msg("Message accepted but not persisted");
+    }
+    return ack;
+}
+
+void RefuseRetryable(const im::P2PMessage& req, const char* error_msg, im::MessageAck* resp) {
+    resp->set_client_msg_id(req.msg_id());
+    resp->set_success(false);
+    resp->set_error_msg(error_msg);
+    resp->set_retryable(true);
+    resp->set_retry_after_ms(AsyncMsgWriter::GetInstance()->RetryAfterMs());
+}
+
+// The ack of a resent message's first send, false if wait_for_store took it over
+bool AnswerResend(const im::P2PMessage& req, const SendDedup::Original& original, bool wants_persist_ack,
+                  bool wait_for_store, im::MessageAck* resp, uint64_t* wal_lsn) {
+    if (original.state == SendDedup::State::CLAIMED) {
+        // Still being accepted, this one would have to wait for the seq read
+        RefuseRetryable(req, "Message in progress, retry later", resp);
+        return true;
+    }
+    if (wait_for_store) {
+        return false;
+    }
+    bool ok = !wants_persist_ack || original.state != SendDedup::State::FAILED;
+    *resp = PersistAck(original.msg_id, req.msg_id(), original.seq, ok);
+    if (wal_lsn) {
+        *wal_lsn = original.wal_lsn;
+    }
+    return true;
+}
+
+void FillHistoryPage(const im::GetHistoryReq& req, std::vector<im::P2PMessage> messages, size_t limit,
+                     im::GetHistoryResp* resp) {
+    resp->set_success(true);
+    for (auto& msg : messages) {
+        // A gap fill is done at the last message the client had
+        if (req.after_seq() != 0 && msg.seq() <= req.after_seq()) {
+            resp->set_has_more(false);
+            return;
+        }
+        *resp->add_messages() = std::move(msg);
+    }
+    resp->set_has_more(messages.size() >= limit);
+}
+}  // namespace
 
 MsgService::MsgService(PushService* push_service) : push_service_(push_service) {
     AsyncMsgWriter::GetInstance()->Start();
+    // Reads its options and registers its metrics now rather than on the first message
+    InboxCache::Instance();
+    HistoryCache::Instance();
+    Snowflake::Instance();
+    ConvSeq::Instance();
+    SendDedup::Instance();
+    Metrics::Instance()->AddCounter(
+        "termchat_sync_frames_during_read_total",
+        "Frames of streamed latest-messages syncs sent while the inbox read was still going",
+        [this]() { return static_cast<double>(frames_during_read_.load(std::memory_order_relaxed)); });
+}
+
+size_t MsgService::sync_page_size(const im::SyncMessagesReq& req) {
+    if (req.page_size() == 0) return MsgScyllaDao::kInboxLimit;
+    return std::min<size_t>(req.page_size(), MsgScyllaDao::kInboxLimit);
 }
 
-void MsgService::send_p2p_message(uint64_t sender_id, const im::P2PMessage& req, im::MessageAck* resp) {
+MsgService::SendResult MsgService::send_p2p_message(uint64_t sender_id, const im::P2PMessage& req,
+                                                   im::MessageAck* resp, uint64_t* wal_lsn,
+                                                   PersistAckCallback on_persisted, uint64_t seq) {
     if (sender_id == 0) {
         resp->set_success(false);
         resp->set_error_msg("Sender ID is empty");
-        return;
+        return SendResult::ACK;
     }
     if (req.receiver_id() == 0) {
         resp->set_success(false);
         resp->set_error_msg("Receiver ID is empty");
-        return;
+        return SendResult::ACK;
     }
     if (req.timestamp() == 0) {
         resp->set_success(false);
         resp->set_error_msg("Timestamp is empty");
-        return;
+        return SendResult::ACK;
     }
 
-    AsyncMsgWriter::GetInstance()->Enqueue(req);
+    // A resend after a lost ack gets the first send's ack, nothing is stored or pushed again
+    auto* dedup = SendDedup::Instance();
+    SendDedup::Original original;
+    bool wants_persist_ack = static_cast<bool>(on_persisted);
+    if (!dedup->Claim(sender_id, req.msg_id(), &original, &on_persisted)) {
+        LOG_INFO("Resent message from User[{}] to User[{}], msg_id={}, answered with the first ack", sender_id,
+                 req.receiver_id(), req.msg_id());
+        bool answered =
+            AnswerResend(req, original, wants_persist_ack, wants_persist_ack && !on_persisted, resp, wal_lsn);
+        return answered ? SendResult::ACK : SendResult::ACK_ON_PERSIST;
+    }
+
+    auto* writer = AsyncMsgWriter::GetInstance();
+    if (seq == 0) {
+        seq = ConvSeq::Instance()->TryNext(sender_id, req.receiver_id());
+    }
+    if (seq == 0) {
+        // Claimed again when it comes back seeded
+        dedup->Release(sender_id, req.msg_id());
+        return SendResult::UNSEEDED;
+    }
 
-    auto msg_to_push = req;
-    msg_to_push.set_sender_id(sender_id);
+    // From here on the message is known by the server's id, the sender's only comes back in the acks. It is
+    // stored under the authenticated sender, whatever the request says.
+    auto stored = req;
+    stored.clear_ack_mode();
+    stored.set_msg_id(Snowflake::Instance()->Next());
+    stored.set_sender_id(sender_id);
+    stored.set_seq(seq);
+    // Not later than the server clock: InboxCache and HistoryCache count on no message stored before a ring
+    // existed being newer than the second the ring was created in
+    stored.set_timestamp(std::min<int64_t>(req.timestamp(), time(nullptr)));
+    bool ack_on_persist = static_cast<bool>(on_persisted);
+    AsyncMsgWriter::PersistCallback on_stored;
+    if (on_persisted || dedup->Enabled()) {
+        // A resend asking for ACK_ON_PERSIST waits for this one's outcome, whatever this one asked for
+        on_stored = [on_persisted = std::move(on_persisted), sender_id, msg_id = stored.msg_id(),
+                     client_msg_id = req.msg_id(), seq](bool ok) {
+            auto ack = PersistAck(msg_id, client_msg_id, seq, ok);
+            if (on_persisted) {
+                on_persisted(ack);
+            }
+            for (auto& waiter : SendDedup::Instance()->Store(sender_id, client_msg_id, msg_id, seq, ok)) {
+                waiter(ack);
+            }
+        };
+    }
 
-    if (msg_to_push.timestamp() == 0) {
-        msg_to_push.set_timestamp(time(nullptr));
+    uint64_t lsn = 0;
+    if (!writer->Enqueue(stored, &lsn, std::move(on_stored))) {
+        // Persistence is behind: refuse before pushing, the sender resends the same message later
+        LOG_WARN("Message queue full, refusing message from User[{}] to User[{}]", sender_id, req.receiver_id());
+        dedup->Release(sender_id, req.msg_id());
+        RefuseRetryable(req, "Server busy, retry later", resp);
+        return SendResult::ACK;
+    }
+    dedup->Accept(sender_id, req.msg_id(), stored.msg_id(), seq, lsn);
+    if (wal_lsn) {
+        *wal_lsn = lsn;
     }
+    // Both inbox rows, as stored
+    auto* inbox_cache = InboxCache::Instance();
+    inbox_cache->Add(stored.sender_id(), stored);
+    inbox_cache->Add(stored.receiver_id(), stored);
+    HistoryCache::Instance()->Add(stored);
 
     if (push_service_) {
-        push_service_->push_p2p_message(msg_to_push);
+        push_service_->push_p2p_message(stored);
     }
 
-    resp->set_msg_id(req.msg_id());
+    resp->set_msg_id(stored.msg_id());
+    resp->set_client_msg_id(req.msg_id());
     resp->set_success(true);
-    resp->set_ref_seq(0);
+    resp->set_ref_seq(seq);
 
     LOG_INFO("P2P Message from User[{}] to User[{}] processed.", sender_id, req.receiver_id());
+    return ack_on_persist ? SendResult::ACK_ON_PERSIST : SendResult::ACK;
+}
+
+Async<void> MsgService::sync_messages_async(uint64_t user_id, const im::SyncMessagesReq& req,
+                                            im::SyncMessagesResp* resp, ThreadPool* resume_pool) {
+    if (user_id == 0) {
+        resp->set_success(false);
+        resp->set_error_msg("User ID is empty");
+        co_return;
+    }
+
+    if (req.since_timestamp() == 0 && req.continuation().empty()) {
+        co_await stream_latest_async(user_id, 0, nullptr, resp, resume_pool);
+        co_return;
+    }
+
+    if (SyncFromCache(user_id, req, resp)) {
+        co_return;
+    }
+    std::string continuation = req.continuation();
+    std::vector<im::P2PMessage> messages;
+    auto in_flight = TakeInFlight(user_id);
+    if (!co_await msg_scylla_dao_.GetMessagesSinceAsync(user_id, req.since_timestamp(), req.since_msg_id(),
+                                                        sync_page_size(req), &continuation, &messages, resume_pool)) {
+        resp->set_success(false);
+        resp->set_error_msg("Failed to read messages, retry the same page");
+        co_return;
+    }
+    MergeInFlightIntoLastPage(req, continuation, std::move(in_flight), &messages);
+    FillSyncPage(req, std::move(messages), std::move(continuation), resp);
+    LOG_INFO("User[{}] synced {} messages since {}, has_more={}.", user_id, resp->messages_size(),
+             req.since_timestamp(), resp->has_more());
 }
 
-void MsgService::sync_messages(uint64_t user_id, const im::SyncMessagesReq& req, im::SyncMessagesResp* resp) {
+Async<void> MsgService::stream_latest_async(uint64_t user_id, size_t frame_messages, const FrameSender& send_frame,
+                                            im::SyncMessagesResp* resp, ThreadPool* resume_pool) {
     if (user_id == 0) {
         resp->set_success(false);
         resp->set_error_msg("User ID is empty");
-        return;
+        co_return;
     }
 
-    auto messages = msg_scylla_dao_.GetMessagesForUser(user_id);
+    // Scylla has them only once the writer gets to them, each goes out with the bucket of its day
+    auto in_flight = TakeInFlight(user_id);
+    std::vector<im::P2PMessage> messages;
+    size_t total = 0;
+    bool open = true;
+    MsgScyllaDao::InboxSink sink = [&](int64_t bucket, std::vector<im::P2PMessage> rows) -> Async<bool> {
+        MergeInFlight(&rows, MsgScyllaDao::TakeFromBucket(&in_flight, bucket), true);
+        rows.resize(std::min(rows.size(), MsgScyllaDao::kInboxLimit - total));
+        total += rows.size();
+        messages.insert(messages.end(), std::make_move_iterator(rows.begin()), std::make_move_iterator(rows.end()));
+        // A frame only goes once a message follows it, the last one is the response
+        while (open && frame_messages > 0 && messages.size() > frame_messages) {
+            std::vector<im::P2PMessage> frame(std::make_move_iterator(messages.begin()),
+                                              std::make_move_iterator(messages.begin() + frame_messages));
+            messages.erase(messages.begin(), messages.begin() + frame_messages);
+            open = co_await send_frame(std::move(frame));
+            if (open) frames_during_read_.fetch_add(1, std::memory_order_relaxed);
+        }
+        co_return open && total < MsgScyllaDao::kInboxLimit;
+    };
+    if (!co_await msg_scylla_dao_.ReadInboxAsync(user_id, sink, resume_pool)) {
+        resp->set_success(false);
+        resp->set_error_msg("Failed to read messages, retry the sync");
+        co_return;
+    }
+    if (total < MsgScyllaDao::kInboxLimit) {
+        // Older than the last bucket read, they come last
+        size_t room = messages.size() + MsgScyllaDao::kInboxLimit - total;
+        MergeInFlight(&messages, std::move(in_flight), true);
+        if (messages.size() > room) messages.resize(room);
+    }
 
     resp->set_success(true);
-    for (const auto& msg : messages) {
-        *resp->add_messages() = msg;
+    for (auto& msg : messages) {
+        *resp->add_messages() = std::move(msg);
     }
+    LOG_INFO("User[{}] synced {} messages (latest 500).", user_id, total);
+}
 
-    LOG_INFO("User[{}] synced {} messages (latest 500).", user_id, messages.size());
+Async<void> MsgService::get_history_async(uint64_t user_id, const im::GetHistoryReq& req,
+                                          im::GetHistoryResp* resp, ThreadPool* resume_pool) {
+    if (!CheckHistoryReq(user_id, req, resp)) {
+        co_return;
+    }
+    size_t limit = HistoryLimit(req);
+    std::vector<im::P2PMessage> messages;
+    if (!HistoryCache::Instance()->GetBefore(user_id, req.peer_id(), req.before_timestamp(), req.before_msg_id(),
+                                             limit, &messages) &&
+        !co_await msg_scylla_dao_.GetHistoryAsync(user_id, req.peer_id(), req.before_timestamp(),
+                                                  req.before_msg_id(), limit, &messages, resume_pool)) {
+        resp->set_success(false);
+        resp->set_error_msg("Failed to read history, retry");
+        co_return;
+    }
+    FillHistoryPage(req, std::move(messages), limit, resp);
+    LOG_INFO("User[{}] read {} messages with User[{}] before {}, has_more={}.", user_id, resp->messages_size(),
+             req.peer_id(), req.before_timestamp(), resp->has_more());
 }
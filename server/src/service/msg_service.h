@@ -1,6 +1,10 @@
 #pragma once
 
+#include <atomic>
+#include <cstddef>
 #include <cstdint>
+#include <functional>
+#include "../dao/async_msg_writer.h"
 #include "../dao/msg_scylla_dao.h"
 #include "message_service.pb.h"
 #include "push_service.h"
@@ -10,12 +14,44 @@ public:
     explicit MsgService(PushService* push_service);
     ~MsgService() = default;
 
-    // Send a P2P message
-    void send_p2p_message(uint64_t sender_id, const im::P2PMessage& req, im::MessageAck* resp);
-    // Sync offline messages
-    void sync_messages(uint64_t user_id, const im::SyncMessagesReq& req, im::SyncMessagesResp* resp);
+    // The ACK_ON_PERSIST ack of an accepted message, success once it is in Scylla
+    using PersistAckCallback = std::function<void(const im::MessageAck& ack)>;
+
+    // What send_p2p_message left to the caller
+    enum class SendResult {
+        ACK,             // *resp is the ack
+        ACK_ON_PERSIST,  // on_persisted sends the ack
+        UNSEEDED,        // Nothing done: the conversation is not seeded, send again with a seq from ConvSeq::NextAsync
+    };
+
+    // Send a P2P message under a msg_id assigned here (Snowflake) and the next seq of its conversation (ConvSeq,
+    // the acks' ref_seq), req.msg_id() is echoed as the acks' client_msg_id. A resend of a message the sender sent
+    // recently (same req.msg_id(), SendDedup) gets the first send's ack and is not stored or pushed again.
+    // With the WAL on, *wal_lsn is the LSN the ack must not be sent before (MsgWal::DurableLsn), 0 if it can go
+    // right away. on_persisted runs once the accepted message is written to Scylla (or finally failed), on the
+    // writer thread, see AsyncMsgWriter::PersistCallback. seq is the one the caller took from ConvSeq::NextAsync,
+    // 0 to take it here without blocking (ConvSeq::TryNext).
+    SendResult send_p2p_message(uint64_t sender_id, const im::P2PMessage& req, im::MessageAck* resp,
+                                uint64_t* wal_lsn = nullptr, PersistAckCallback on_persisted = nullptr,
+                                uint64_t seq = 0);
+    // Sync offline messages: the latest ones, or one page from the request's cursor on. Resumes on resume_pool.
+    Async<void> sync_messages_async(uint64_t user_id, const im::SyncMessagesReq& req, im::SyncMessagesResp* resp,
+                                    ThreadPool* resume_pool);
+    // Gets one frame of a streamed sync, returns false if the connection is gone
+    using FrameSender = std::function<Async<bool>(std::vector<im::P2PMessage> messages)>;
+    // The latest-messages sync streamed: every frame_messages messages go to send_frame as soon as the day buckets
+    // holding them are read (see MsgScyllaDao::ReadInboxAsync), *resp gets the rest. Stops once send_frame returns
+    // false. With frame_messages 0 all of them go to *resp.
+    Async<void> stream_latest_async(uint64_t user_id, size_t frame_messages, const FrameSender& send_frame,
+                                    im::SyncMessagesResp* resp, ThreadPool* resume_pool);
+    // Messages a cursor sync returns at most: the request's page_size, 0 and anything above meaning 500
+    static size_t sync_page_size(const im::SyncMessagesReq& req);
+    // One page of the conversation with req.peer_id() going back from the request's cursor
+    Async<void> get_history_async(uint64_t user_id, const im::GetHistoryReq& req, im::GetHistoryResp* resp,
+                                  ThreadPool* resume_pool);
 
 private:
     PushService* push_service_;
     MsgScyllaDao msg_scylla_dao_;
+    std::atomic<uint64_t> frames_during_read_{0};
 };
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "../utils/metrics.h"
+#include "message_service.pb.h"
+
+/**
+ * RecentMessages - bounded rings of the newest messages per key, the storage of InboxCache and HistoryCache
+ *
+ * A ring keeps up to per_key messages ordered by (timestamp, msg_id) and knows the timestamp after which it
+ * has every message of its key: the second it was created in, raised to the timestamp of each message it
+ * drops to stay in bounds. Only what is added is seen, so a reader must stay within complete_after. That needs
+ * message timestamps not later than the server clock at the time they are added, MsgService clamps them.
+ *
+ * Whole rings are evicted least recently used first once the total is over budget_bytes (0 turns the cache
+ * off). Keys are spread over kShards shards with their own lock, LRU list and share of the budget.
+ */
+template <typename Key>
+class RecentMessages {
+public:
+    struct Ring {
+        // By (timestamp, msg_id), oldest first
+        std::deque<im::P2PMessage> messages;
+        // Every message with a later timestamp is in messages
+        int64_t complete_after = 0;
+        size_t bytes = 0;
+        typename std::list<Key>::iterator lru;
+    };
+
+    RecentMessages(size_t budget_bytes, size_t per_key) : budget_bytes_(budget_bytes), per_key_(per_key) {}
+
+    bool Enabled() const { return budget_bytes_ > 0 && per_key_ > 0; }
+
+    static bool KeyLess(const im::P2PMessage& a, const im::P2PMessage& b) {
+        if (a.timestamp() != b.timestamp()) return a.timestamp() < b.timestamp();
+        return a.msg_id() < b.msg_id();
+    }
+
+    void Add(const Key& key, const im::P2PMessage& msg) {
+        if (!Enabled()) {
+            return;
+        }
+        Shard& shard = ShardOf_(key);
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        auto [it, created] = shard.rings.try_emplace(key);
+        Ring& ring = it->second;
+        if (created) {
+            // Messages of this second may have been stored before the ring existed
+            ring.complete_after = time(nullptr);
+            shard.lru.push_front(key);
+            ring.lru = shard.lru.begin();
+            keys_.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            Touch_(shard, ring);
+        }
+
+        auto pos = std::lower_bound(ring.messages.begin(), ring.messages.end(), msg, KeyLess);
+        if (pos != ring.messages.end() && !KeyLess(msg, *pos)) {
+            // Sent again, Scylla overwrites the row as well
+            Charge_(shard, ring, -static_cast<int64_t>(Cost_(*pos)));
+            *pos = msg;
+        } else {
+            ring.messages.insert(pos, msg);
+        }
+        Charge_(shard, ring, static_cast<int64_t>(Cost_(msg)));
+
+        while (ring.messages.size() > per_key_) {
+            const auto& oldest = ring.messages.front();
+            ring.complete_after = std::max(ring.complete_after, oldest.timestamp());
+            Charge_(shard, ring, -static_cast<int64_t>(Cost_(oldest)));
+            ring.messages.pop_front();
+        }
+        Evict_(shard, key);
+    }
+
+    // read(const Ring&) under the ring's lock, false without calling it if key has no ring. A true result of read
+    // counts as a hit and marks the ring as used, anything else as a miss.
+    template <typename F>
+    bool Read(const Key& key, F&& read) {
+        if (!Enabled()) {
+            return false;
+        }
+        bool hit = false;
+        {
+            Shard& shard = ShardOf_(key);
+            std::lock_guard<std::mutex> lock(shard.mtx);
+            auto it = shard.rings.find(key);
+            if (it != shard.rings.end() && read(static_cast<const Ring&>(it->second))) {
+                Touch_(shard, it->second);
+                hit = true;
+            }
+        }
+        (hit ? hits_ : misses_).fetch_add(1, std::memory_order_relaxed);
+        return hit;
+    }
+
+    // Messages a hit returned, for the Scylla reads saved
+    void CountServed(size_t served) { served_.fetch_add(served, std::memory_order_relaxed); }
+
+    // Export hits, misses, messages served, evictions and memory as <prefix>_*
+    void RegisterMetrics(const std::string& prefix, const std::string& what) {
+        auto* metrics = Metrics::Instance();
+        auto counter = [](const std::atomic<uint64_t>& value) {
+            return [&value]() { return static_cast<double>(value.load(std::memory_order_relaxed)); };
+        };
+        metrics->AddCounter(prefix + "_lookups_total{result=\"hit\"}",
+                            "Reads looked up in the " + what + ", a hit needs no Scylla read", counter(hits_));
+        metrics->AddCounter(prefix + "_lookups_total{result=\"miss\"}",
+                            "Reads looked up in the " + what + ", a hit needs no Scylla read", counter(misses_));
+        metrics->AddCounter(prefix + "_messages_served_total",
+                            "Messages read from the " + what + " instead of Scylla", counter(served_));
+        metrics->AddCounter(prefix + "_evictions_total", "Rings of the " + what + " dropped to stay within budget",
+                            counter(evictions_));
+        metrics->AddGauge(prefix + "_bytes", "Estimated memory held by the " + what,
+                          [this]() { return static_cast<double>(bytes_.load(std::memory_order_relaxed)); });
+        metrics->AddGauge(prefix + "_budget_bytes", "Memory budget of the " + what,
+                          [this]() { return static_cast<double>(budget_bytes_); });
+        metrics->AddGauge(prefix + "_rings", "Rings in the " + what,
+                          [this]() { return static_cast<double>(keys_.load(std::memory_order_relaxed)); });
+    }
+
+    uint64_t Hits() const { return hits_.load(std::memory_order_relaxed); }
+    uint64_t Misses() const { return misses_.load(std::memory_order_relaxed); }
+
+private:
+    struct Shard {
+        std::mutex mtx;
+        std::unordered_map<Key, Ring> rings;
+        // Most recently used first
+        std::list<Key> lru;
+        size_t bytes = 0;
+    };
+
+    static constexpr size_t kShards = 16;
+    // Deque slot, heap block and LRU share of a message besides its encoded size
+    static constexpr size_t kMessageOverhead = 64;
+
+    Shard& ShardOf_(const Key& key) { return shards_[std::hash<Key>{}(key) % kShards]; }
+    static size_t Cost_(const im::P2PMessage& msg) { return msg.ByteSizeLong() + kMessageOverhead; }
+
+    // Caller holds shard.mtx
+    void Charge_(Shard& shard, Ring& ring, int64_t bytes) {
+        ring.bytes += bytes;
+        shard.bytes += bytes;
+        bytes_.fetch_add(bytes, std::memory_order_relaxed);
+    }
+    static void Touch_(Shard& shard, Ring& ring) { shard.lru.splice(shard.lru.begin(), shard.lru, ring.lru); }
+    // Drop least recently used rings other than keep until shard is within its budget, caller holds shard.mtx
+    void Evict_(Shard& shard, const Key& keep) {
+        size_t budget = budget_bytes_ / kShards;
+        while (shard.bytes > budget && !shard.lru.empty() && shard.lru.back() != keep) {
+            auto it = shard.rings.find(shard.lru.back());
+            shard.lru.pop_back();
+            shard.bytes -= it->second.bytes;
+            bytes_.fetch_sub(it->second.bytes, std::memory_order_relaxed);
+            shard.rings.erase(it);
+            keys_.fetch_sub(1, std::memory_order_relaxed);
+            evictions_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    const size_t budget_bytes_;
+    const size_t per_key_;
+    std::array<Shard, kShards> shards_;
+
+    std::atomic<size_t> bytes_{0};
+    std::atomic<size_t> keys_{0};
+    std::atomic<uint64_t> hits_{0};
+    std::atomic<uint64_t> misses_{0};
+    std::atomic<uint64_t> served_{0};
+    std::atomic<uint64_t> evictions_{0};
+};
@@ -0,0 +1,162 @@
+#include "send_dedup.h"
+#include <algorithm>
+#include <chrono>
+#include <utility>
+#include "../log/log.h"
+#include "../utils/env.h"
+#include "../utils/metrics.h"
+
+namespace {
+int64_t NowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// Entries per map, 0 for off
+size_t MapCapacity(int64_t window_ms, size_t max_entries, size_t maps) {
+    if (window_ms <= 0 || max_entries == 0) return 0;
+    return std::max<size_t>(max_entries / maps, 1);
+}
+}  // namespace
+
+SendDedup::Options SendDedup::Options::FromEnv() {
+    Options options;
+    int64_t window_s = options.window_ms / 1000;
+    EnvNumber("SEND_DEDUP_WINDOW_S", &window_s);
+    options.window_ms = window_s * 1000;
+    EnvNumber("SEND_DEDUP_ENTRIES", &options.max_entries);
+    return options;
+}
+
+SendDedup* SendDedup::Instance() {
+    static SendDedup instance(Options::FromEnv());
+    return &instance;
+}
+
+// Each shard has a current and a previous map
+SendDedup::SendDedup(const Options& options)
+    : window_ms_(options.window_ms), per_map_(MapCapacity(options.window_ms, options.max_entries, kShards * 2)) {
+    if (Enabled()) {
+        LOG_INFO("Send dedup: {} s window, {} messages", window_ms_ / 1000, options.max_entries);
+    }
+    int64_t now_ms = NowMs();
+    for (auto& shard : shards_) {
+        shard.rotated_at_ms = now_ms;
+    }
+
+    auto* metrics = Metrics::Instance();
+    metrics->AddGauge("termchat_send_dedup_entries", "Recently sent messages remembered to recognize resends",
+                      [this]() { return static_cast<double>(entries_.load(std::memory_order_relaxed)); });
+    metrics->AddCounter("termchat_send_dedup_duplicates_total",
+                        "Resent messages answered with the ack of the first send",
+                        [this]() { return static_cast<double>(duplicates_.load(std::memory_order_relaxed)); });
+    metrics->AddCounter("termchat_send_dedup_early_rotations_total",
+                        "Times a full map cut the dedup window short",
+                        [this]() { return static_cast<double>(early_rotations_.load(std::memory_order_relaxed)); });
+}
+
+bool SendDedup::Claim(uint64_t sender_id, uint64_t client_msg_id, Original* original, AckCallback* on_stored) {
+    // Without a client id there is nothing to recognize a resend by
+    if (!Enabled() || client_msg_id == 0) {
+        return true;
+    }
+    Key key{sender_id, client_msg_id};
+    Shard& shard = ShardOf_(key);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    if (Entry* entry = Find_(shard, key)) {
+        *original = entry->original;
+        if (entry->original.state == State::ACCEPTED && *on_stored) {
+            entry->waiters.push_back(std::move(*on_stored));
+            *on_stored = nullptr;
+        }
+        duplicates_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    Rotate_(shard, NowMs());
+    shard.current.try_emplace(key);
+    entries_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+void SendDedup::Accept(uint64_t sender_id, uint64_t client_msg_id, uint64_t msg_id, uint64_t seq,
+                       uint64_t wal_lsn) {
+    if (!Enabled() || client_msg_id == 0) {
+        return;
+    }
+    Key key{sender_id, client_msg_id};
+    Shard& shard = ShardOf_(key);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    Entry* entry = Find_(shard, key);
+    if (entry == nullptr) {
+        return;
+    }
+    entry->original.wal_lsn = wal_lsn;
+    if (entry->original.state == State::CLAIMED) {
+        entry->original.state = State::ACCEPTED;
+        entry->original.msg_id = msg_id;
+        entry->original.seq = seq;
+    }
+}
+
+void SendDedup::Release(uint64_t sender_id, uint64_t client_msg_id) {
+    if (!Enabled() || client_msg_id == 0) {
+        return;
+    }
+    Key key{sender_id, client_msg_id};
+    Shard& shard = ShardOf_(key);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    if (shard.current.erase(key) + shard.previous.erase(key) > 0) {
+        entries_.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+std::vector<SendDedup::AckCallback> SendDedup::Store(uint64_t sender_id, uint64_t client_msg_id, uint64_t msg_id,
+                                                     uint64_t seq, bool ok) {
+    std::vector<AckCallback> waiters;
+    if (!Enabled() || client_msg_id == 0) {
+        return waiters;
+    }
+    Key key{sender_id, client_msg_id};
+    Shard& shard = ShardOf_(key);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    if (Entry* entry = Find_(shard, key)) {
+        entry->original.state = ok ? State::STORED : State::FAILED;
+        entry->original.msg_id = msg_id;
+        entry->original.seq = seq;
+        waiters.swap(entry->waiters);
+    }
+    return waiters;
+}
+
+SendDedup::Entry* SendDedup::Find_(Shard& shard, const Key& key) {
+    auto it = shard.current.find(key);
+    if (it != shard.current.end()) {
+        return &it->second;
+    }
+    it = shard.previous.find(key);
+    return it != shard.previous.end() ? &it->second : nullptr;
+}
+
+void SendDedup::Rotate_(Shard& shard, int64_t now_ms) {
+    bool expired = now_ms - shard.rotated_at_ms >= window_ms_;
+    if (!expired && shard.current.size() < per_map_) {
+        return;
+    }
+    if (!expired) {
+        early_rotations_.fetch_add(1, std::memory_order_relaxed);
+    }
+    auto dropped = std::move(shard.previous);
+    shard.previous = std::move(shard.current);
+    shard.current.clear();
+    shard.rotated_at_ms = now_ms;
+    // A message not written yet moves on, the resends waiting for its outcome are answered by Store
+    size_t kept = 0;
+    for (auto& [key, entry] : dropped) {
+        State state = entry.original.state;
+        if (state == State::CLAIMED || state == State::ACCEPTED) {
+            shard.current.emplace(key, std::move(entry));
+            kept++;
+        }
+    }
+    entries_.fetch_sub(dropped.size() - kept, std::memory_order_relaxed);
+}
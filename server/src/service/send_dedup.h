@@ -0,0 +1,113 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "message_service.pb.h"
+
+/**
+ * SendDedup - the messages each sender sent recently by their client msg_id, so that a resend is answered with
+ * the ack of the first send instead of storing and pushing the message again
+ *
+ * A client resends under the same msg_id when an ack is lost. MsgService claims (sender_id, client msg_id) before
+ * it takes a seq, records the server's msg_id and seq once the message is accepted and its outcome once it is
+ * written. Keys are spread over kShards lock-striped shards, each with two maps: new keys go into the current
+ * one, which becomes the previous one every SEND_DEDUP_WINDOW_S seconds (default 300), dropping what was there
+ * except the messages not written yet, which go back into the current map. A key is thus remembered for at least
+ * the window, unless a map reaches its share of SEND_DEDUP_ENTRIES (default 1M, 0 turns it off) first and
+ * rotates early. Only this process's sends are seen.
+ *
+ * Resends answered and early rotations are exported as termchat_send_dedup_*.
+ */
+class SendDedup {
+public:
+    struct Options {
+        int64_t window_ms = 300 * 1000;
+        size_t max_entries = 1 << 20;
+
+        static Options FromEnv();
+    };
+
+    enum class State : uint8_t {
+        // The first send is still being accepted
+        CLAIMED,
+        ACCEPTED,
+        STORED,
+        FAILED,
+    };
+
+    // What is known about the first send of a message
+    struct Original {
+        State state = State::CLAIMED;
+        uint64_t msg_id = 0;
+        uint64_t seq = 0;
+        uint64_t wal_lsn = 0;
+    };
+
+    using AckCallback = std::function<void(const im::MessageAck& ack)>;
+
+    static SendDedup* Instance();
+
+    bool Enabled() const { return per_map_ > 0; }
+
+    // True if the key is new (or not deduplicated), it is then claimed by the caller until Accept or Release.
+    // Otherwise *original is the first send, and while that is ACCEPTED a non-empty *on_stored is moved into it
+    // to be called with its outcome, see Store.
+    bool Claim(uint64_t sender_id, uint64_t client_msg_id, Original* original, AckCallback* on_stored);
+    // The claimed message is accepted under msg_id and seq
+    void Accept(uint64_t sender_id, uint64_t client_msg_id, uint64_t msg_id, uint64_t seq, uint64_t wal_lsn);
+    // The claimed message was refused, a resend is a new message
+    void Release(uint64_t sender_id, uint64_t client_msg_id);
+    // The accepted message is written (or finally failed), returns the callbacks resends left for its outcome.
+    // The writer may get there before the sender's Accept, which then keeps this state.
+    std::vector<AckCallback> Store(uint64_t sender_id, uint64_t client_msg_id, uint64_t msg_id, uint64_t seq,
+                                   bool ok);
+
+    uint64_t Duplicates() const { return duplicates_.load(std::memory_order_relaxed); }
+
+private:
+    struct Key {
+        uint64_t sender_id;
+        uint64_t client_msg_id;
+
+        bool operator==(const Key& other) const = default;
+    };
+    struct KeyHash {
+        size_t operator()(const Key& key) const {
+            return std::hash<uint64_t>{}(key.sender_id * 0x9e3779b97f4a7c15ULL ^ key.client_msg_id);
+        }
+    };
+    struct Entry {
+        Original original;
+        // Resends waiting for the outcome of an ACCEPTED message
+        std::vector<AckCallback> waiters;
+    };
+    struct Shard {
+        std::mutex mtx;
+        std::unordered_map<Key, Entry, KeyHash> current;
+        std::unordered_map<Key, Entry, KeyHash> previous;
+        int64_t rotated_at_ms = 0;
+    };
+
+    static constexpr size_t kShards = 64;
+
+    explicit SendDedup(const Options& options);
+    Shard& ShardOf_(const Key& key) { return shards_[KeyHash{}(key) % kShards]; }
+    // Entry of key in either map, nullptr if there is none, caller holds shard.mtx
+    static Entry* Find_(Shard& shard, const Key& key);
+    // Start a new current map once the window is over or it is full, caller holds shard.mtx
+    void Rotate_(Shard& shard, int64_t now_ms);
+
+    const int64_t window_ms_;
+    const size_t per_map_;
+    std::array<Shard, kShards> shards_;
+
+    std::atomic<size_t> entries_{0};
+    std::atomic<uint64_t> duplicates_{0};
+    std::atomic<uint64_t> early_rotations_{0};
+};
@@ -0,0 +1,249 @@
+#pragma once
+
+#include <condition_variable>
+#include <coroutine>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include "../log/log.h"
+#include "../pool/threadpool.h"
+
+/**
+ * Minimal coroutine support for the request handlers
+ *
+ * Async<T>  - lazy coroutine returning T, started by co_await and resuming its awaiter when done.
+ * Detached  - eagerly started top-level coroutine that owns itself, nothing waits for it.
+ * SyncWait  - run an Async to completion from plain blocking code.
+ *
+ * Awaiters never resume a coroutine on the thread that completes the operation (a driver I/O thread,
+ * or the thread that is still inside TcpConnection::process holding conn_mutex_). They post the
+ * resumption to a ThreadPool instead; a coroutine_handle is one pointer, so that Task is stored inline.
+ */
+template <typename T = void>
+class Async;
+
+namespace coro_detail {
+
+template <typename T>
+struct PromiseBase {
+    std::coroutine_handle<> continuation;
+    std::exception_ptr exception;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template <typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+            auto next = h.promise().continuation;
+            return next ? next : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+    FinalAwaiter final_suspend() noexcept { return {}; }
+
+    void unhandled_exception() { exception = std::current_exception(); }
+};
+
+template <typename T>
+struct Promise : PromiseBase<T> {
+    std::optional<T> value;
+
+    Async<T> get_return_object();
+    template <typename U>
+    void return_value(U&& v) {
+        value.emplace(std::forward<U>(v));
+    }
+    T Take() {
+        if (this->exception) std::rethrow_exception(this->exception);
+        return std::move(*value);
+    }
+};
+
+template <>
+struct Promise<void> : PromiseBase<void> {
+    Async<void> get_return_object();
+    void return_void() {}
+    void Take() {
+        if (this->exception) std::rethrow_exception(this->exception);
+    }
+};
+
+}  // namespace coro_detail
+
+template <typename T>
+class Async {
+public:
+    using promise_type = coro_detail::Promise<T>;
+
+    explicit Async(std::coroutine_handle<promise_type> h) : handle_(h) {}
+    Async(Async&& other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+    Async(const Async&) = delete;
+    Async& operator=(const Async&) = delete;
+    ~Async() {
+        if (handle_) handle_.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+        handle_.promise().continuation = awaiter;
+        return handle_;
+    }
+    T await_resume() { return handle_.promise().Take(); }
+
+private:
+    std::coroutine_handle<promise_type> handle_;
+};
+
+namespace coro_detail {
+
+template <typename T>
+Async<T> Promise<T>::get_return_object() {
+    return Async<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Async<void> Promise<void>::get_return_object() {
+    return Async<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+}  // namespace coro_detail
+
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() {
+            try {
+                std::rethrow_exception(std::current_exception());
+            } catch (const std::exception& e) {
+                LOG_ERROR("Detached coroutine failed: {}", e.what());
+            } catch (...) {
+                LOG_ERROR("Detached coroutine failed: unknown exception");
+            }
+        }
+    };
+};
+
+// Resume the coroutine on a pool worker
+inline void ResumeOn(ThreadPool* pool, std::coroutine_handle<> h) {
+    pool->AddTask([h]() { h.resume(); });
+}
+
+// co_await Reschedule(pool) continues the coroutine on a pool worker, off the current call stack
+struct Reschedule {
+    ThreadPool* pool;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) { ResumeOn(pool, h); }
+    void await_resume() const noexcept {}
+};
+
+/**
+ * BlockingCall - run fn on a pool dedicated to blocking calls, resume on resume_pool with its result
+ *
+ * For libraries without a non-blocking API (sqlpp11's MySQL connector). The blocking thread is still
+ * taken, but it comes from a pool sized to the connection pool instead of the request workers. An
+ * exception fn throws is rethrown from the co_await.
+ */
+template <typename F>
+class BlockingCall {
+public:
+    using Result = std::invoke_result_t<F&>;
+
+    BlockingCall(ThreadPool* blocking_pool, ThreadPool* resume_pool, F fn)
+        : blocking_pool_(blocking_pool), resume_pool_(resume_pool), fn_(std::move(fn)) {}
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) {
+        handle_ = h;
+        blocking_pool_->AddTask([this]() {
+            try {
+                if constexpr (std::is_void_v<Result>) {
+                    fn_();
+                } else {
+                    result_.emplace(fn_());
+                }
+            } catch (...) {
+                // The coroutine must resume either way, or its connection stays parked
+                exception_ = std::current_exception();
+            }
+            ResumeOn(resume_pool_, handle_);
+        });
+    }
+    Result await_resume() {
+        if (exception_) std::rethrow_exception(exception_);
+        if constexpr (!std::is_void_v<Result>) {
+            return std::move(*result_);
+        }
+    }
+
+private:
+    using Stored = std::conditional_t<std::is_void_v<Result>, char, Result>;
+
+    ThreadPool* blocking_pool_;
+    ThreadPool* resume_pool_;
+    F fn_;
+    std::coroutine_handle<> handle_;
+    std::optional<Stored> result_;
+    std::exception_ptr exception_;
+};
+
+template <typename F>
+BlockingCall<F> RunBlocking(ThreadPool* blocking_pool, ThreadPool* resume_pool, F fn) {
+    return BlockingCall<F>(blocking_pool, resume_pool, std::move(fn));
+}
+
+// Pool the coroutines run by SyncWait resume on. Its thread never waits in SyncWait itself, so a coroutine is
+// always resumed even when every caller's thread is blocked.
+inline ThreadPool* SyncWaitPool() {
+    static ThreadPool pool(1);
+    return &pool;
+}
+
+namespace coro_detail {
+
+template <typename T>
+struct SyncWaitState {
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool done = false;
+    std::optional<std::conditional_t<std::is_void_v<T>, char, T>> result;
+    std::exception_ptr exception;
+};
+
+template <typename T>
+Detached SyncWaitRun(Async<T> task, SyncWaitState<T>* state) {
+    try {
+        if constexpr (std::is_void_v<T>) {
+            co_await task;
+        } else {
+            state->result.emplace(co_await task);
+        }
+    } catch (...) {
+        state->exception = std::current_exception();
+    }
+    // Notified under the lock, the waiter cannot return and free state before we are done with it
+    std::lock_guard<std::mutex> lock(state->mtx);
+    state->done = true;
+    state->cv.notify_one();
+}
+
+}  // namespace coro_detail
+
+// Block until task is done and return its result (or rethrow its exception), for the blocking twin of an Async
+// API. task should resume on SyncWaitPool() and must not be waited for from a SyncWaitPool thread.
+template <typename T>
+T SyncWait(Async<T> task) {
+    coro_detail::SyncWaitState<T> state;
+    coro_detail::SyncWaitRun(std::move(task), &state);
+    std::unique_lock<std::mutex> lock(state.mtx);
+    state.cv.wait(lock, [&]() { return state.done; });
+    if (state.exception) std::rethrow_exception(state.exception);
+    if constexpr (!std::is_void_v<T>) {
+        return std::move(*state.result);
+    }
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <strings.h>
+#include <cstdlib>
+#include <cstring>
+#include "../log/log.h"
+
+// Tuning knobs read from the environment, next to MYSQL_HOST/SCYLLA_HOST. Unset or unparsable
+// variables leave *out untouched so the caller's default stays.
+
+template <typename T>
+inline void EnvNumber(const char* name, T* out) {
+    const char* value = getenv(name);
+    if (value == nullptr || *value == '\0') return;
+    char* end = nullptr;
+    long long parsed = std::strtoll(value, &end, 10);
+    if (*end != '\0' || parsed < 0) {
+        LOG_WARN("Ignoring {}={}: not a non-negative number", name, value);
+        return;
+    }
+    *out = static_cast<T>(parsed);
+}
+
+inline void EnvBool(const char* name, bool* out) {
+    const char* value = getenv(name);
+    if (value == nullptr || *value == '\0') return;
+    *out = strcmp(value, "0") != 0 && strcasecmp(value, "false") != 0 && strcasecmp(value, "off") != 0;
+}
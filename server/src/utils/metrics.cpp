@@ -0,0 +1,48 @@
+#include "metrics.h"
+#include <arpa/inet.h>
+#include <cstdio>
+#include <unordered_set>
+#include "env.h"
+
+Metrics* Metrics::Instance() {
+    static Metrics instance;
+    return &instance;
+}
+
+Metrics::Metrics() { EnvBool("METRICS_REMOTE", &serve_remote_); }
+
+bool Metrics::ServesPeer(const sockaddr_in& peer) const {
+    // 127.0.0.0/8
+    return serve_remote_ || (ntohl(peer.sin_addr.s_addr) >> 24) == 127;
+}
+
+void Metrics::AddGauge(const std::string& name, const std::string& help, std::function<double()> read) {
+    Add_(name, help, "gauge", std::move(read));
+}
+
+void Metrics::AddCounter(const std::string& name, const std::string& help, std::function<double()> read) {
+    Add_(name, help, "counter", std::move(read));
+}
+
+void Metrics::Add_(const std::string& name, const std::string& help, const char* type,
+                   std::function<double()> read) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    entries_.push_back({name, help, type, std::move(read)});
+}
+
+std::string Metrics::Render() const {
+    std::lock_guard<std::mutex> lock(mtx_);
+    std::string out;
+    std::unordered_set<std::string> described;
+    for (const auto& entry : entries_) {
+        std::string base = entry.name.substr(0, entry.name.find('{'));
+        if (described.insert(base).second) {
+            out += "# HELP " + base + " " + entry.help + "\n";
+            out += "# TYPE " + base + " " + entry.type + "\n";
+        }
+        char value[32];
+        snprintf(value, sizeof(value), "%.17g", entry.read());
+        out += entry.name + " " + value + "\n";
+    }
+    return out;
+}
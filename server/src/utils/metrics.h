@@ -0,0 +1,46 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * Metrics - process-wide registry of values exported in the Prometheus text format
+ *
+ * Components keep their own atomics and register a reader for each; nothing is copied until Render,
+ * which HttpHandler serves at GET /metrics on the server port. A name may carry labels
+ * (e.g. termchat_writer_flushes_total{reason="size"}), the HELP/TYPE lines are written once per base name.
+ *
+ * The server port is the clients' port, so /metrics only answers loopback peers unless METRICS_REMOTE=1
+ * (e.g. for a scraper on another host behind a firewall).
+ */
+class Metrics {
+public:
+    static Metrics* Instance();
+
+    // The reader must stay callable for the life of the process
+    void AddGauge(const std::string& name, const std::string& help, std::function<double()> read);
+    void AddCounter(const std::string& name, const std::string& help, std::function<double()> read);
+
+    std::string Render() const;
+    // Whether a connection from peer may read /metrics
+    bool ServesPeer(const sockaddr_in& peer) const;
+
+private:
+    Metrics();
+
+    struct Entry {
+        std::string name;
+        std::string help;
+        const char* type;
+        std::function<double()> read;
+    };
+
+    void Add_(const std::string& name, const std::string& help, const char* type, std::function<double()> read);
+
+    bool serve_remote_ = false;
+    mutable std::mutex mtx_;
+    std::vector<Entry> entries_;
+};
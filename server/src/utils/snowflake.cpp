@@ -0,0 +1,29 @@
+#include "snowflake.h"
+#include <chrono>
+#include "../log/log.h"
+#include "env.h"
+
+Snowflake* Snowflake::Instance() {
+    static Snowflake instance([] {
+        uint64_t node_id = 0;
+        EnvNumber("SNOWFLAKE_NODE_ID", &node_id);
+        if (node_id > kMaxNode) {
+            LOG_WARN("SNOWFLAKE_NODE_ID={} is over {}, using {}", node_id, kMaxNode, node_id & kMaxNode);
+        }
+        return node_id & kMaxNode;
+    }());
+    return &instance;
+}
+
+Snowflake::Snowflake(uint64_t node_id) : node_(node_id & kMaxNode) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    uint64_t monotonic_ms = static_cast<uint64_t>(ts.tv_sec) * 1000 + static_cast<uint64_t>(ts.tv_nsec) / 1000000;
+    uint64_t wall_ms = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch())
+            .count());
+    // A clock before the epoch starts the ids at it
+    uint64_t since_epoch = wall_ms > kEpochMs ? wall_ms - kEpochMs : 0;
+    anchor_ms_ = since_epoch - monotonic_ms;  // Wraps, NowMs_ wraps back
+    LOG_INFO("Snowflake ids: node {}", node_);
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <time.h>
+#include <atomic>
+#include <cstdint>
+
+/**
+ * Snowflake - unique, time-ordered 64-bit ids, the server's message ids
+ *
+ * An id is [41 bits milliseconds since kEpoch][10 bits node][12 bits sequence] and stays positive as a Scylla
+ * bigint. Next is one CAS on the (millisecond, sequence) pair: a new millisecond restarts the sequence, within
+ * one it counts on, and past 4096 it runs into the next millisecond ahead of the clock, so ids of one node
+ * only ever grow.
+ *
+ * Time is CLOCK_MONOTONIC_COARSE anchored to the wall clock once at startup: a few ns to read rather than a few
+ * dozen, and NTP stepping the wall clock back cannot repeat ids. Its tick (1-4 ms) only coarsens the time part,
+ * the sequence keeps the ids apart. The clock a restarted process anchors to must be past the ids it issued
+ * before, and every process needs its own SNOWFLAKE_NODE_ID (0-1023).
+ */
+class Snowflake {
+public:
+    static constexpr int kNodeBits = 10;
+    static constexpr int kSequenceBits = 12;
+    static constexpr uint64_t kMaxNode = (1ULL << kNodeBits) - 1;
+    // Same epoch as IdGenerator::GenerateRandId, 2024-01-01 UTC
+    static constexpr uint64_t kEpochMs = 1704067200000ULL;
+
+    static Snowflake* Instance();
+
+    explicit Snowflake(uint64_t node_id);
+
+    uint64_t Next() {
+        uint64_t now = NowMs_() << kSequenceBits;
+        uint64_t last = last_.load(std::memory_order_relaxed);
+        uint64_t next;
+        do {
+            next = now > last ? now : last + 1;
+        } while (!last_.compare_exchange_weak(last, next, std::memory_order_relaxed));
+        return (next >> kSequenceBits) << (kNodeBits + kSequenceBits) | node_ << kSequenceBits |
+               (next & ((1ULL << kSequenceBits) - 1));
+    }
+
+    uint64_t NodeId() const { return node_; }
+    // Milliseconds since the Unix epoch an id was issued at
+    static int64_t TimestampMs(uint64_t id) {
+        return static_cast<int64_t>((id >> (kNodeBits + kSequenceBits)) + kEpochMs);
+    }
+
+private:
+    // Milliseconds since kEpochMs
+    uint64_t NowMs_() const {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return anchor_ms_ + static_cast<uint64_t>(ts.tv_sec) * 1000 + static_cast<uint64_t>(ts.tv_nsec) / 1000000;
+    }
+
+    const uint64_t node_;
+    // Wall clock minus monotonic clock at construction, relative to kEpochMs
+    uint64_t anchor_ms_ = 0;
+    // (millisecond << kSequenceBits) | sequence of the last id
+    std::atomic<uint64_t> last_{0};
+};
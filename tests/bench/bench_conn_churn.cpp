@@ -0,0 +1,117 @@
+// Accept/close churn: heap-allocated connections in an unordered_map vs the recycled ConnectionTable slab.
+//
+// Usage: bench_conn_churn [iterations] [concurrent_connections]
+// Every iteration opens a socketpair, initializes a connection on it, pushes a 4 KB request through the
+// read buffer and closes it again, like a short-lived client. Allocations are counted with a global
+// operator new replacement.
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "core/connection_table.h"
+#include "core/tcp_connection.h"
+
+static std::atomic<size_t> g_allocs{0};
+static std::atomic<size_t> g_alloc_bytes{0};
+
+void* operator new(size_t size) {
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    g_alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+    if (void* p = malloc(size)) return p;
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+static const std::string kRequest(4096, 'x');
+
+// Simulates one request worth of traffic on a fresh connection
+static void Exercise(TcpConnection* conn) {
+    Buffer& buff = conn->get_read_buffer();
+    buff.append(kRequest);
+    buff.retrieve_all();
+}
+
+struct Result {
+    double ns_per_conn;
+    double allocs_per_conn;
+    double bytes_per_conn;
+};
+
+template <typename Fn>
+static Result Run(int iterations, int concurrent, Fn&& open_close) {
+    std::vector<int> peers(concurrent, -1);
+    size_t allocs = g_allocs.load();
+    size_t bytes = g_alloc_bytes.load();
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+            perror("socketpair");
+            exit(1);
+        }
+        // Keep `concurrent` connections open so fds spread over a realistic range
+        int slot = i % concurrent;
+        open_close(sv[0], slot);
+        if (peers[slot] >= 0) close(peers[slot]);
+        peers[slot] = sv[1];
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    for (int fd : peers) {
+        if (fd >= 0) close(fd);
+    }
+    return {std::chrono::duration<double, std::nano>(elapsed).count() / iterations,
+            static_cast<double>(g_allocs.load() - allocs) / iterations,
+            static_cast<double>(g_alloc_bytes.load() - bytes) / iterations};
+}
+
+int main(int argc, char* argv[]) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 200000;
+    int concurrent = argc > 2 ? atoi(argv[2]) : 256;
+    sockaddr_in addr{};
+
+    // Baseline: what Reactor::AddClient_ did before, a new TcpConnection per accept stored in a map
+    Result map_result;
+    {
+        std::unordered_map<int, std::unique_ptr<TcpConnection>> connections;
+        std::vector<TcpConnection*> open(concurrent, nullptr);
+        map_result = Run(iterations, concurrent, [&](int fd, int slot) {
+            if (open[slot]) open[slot]->close_conn();
+            auto conn = std::make_unique<TcpConnection>();
+            conn->init(fd, addr, nullptr);
+            Exercise(conn.get());
+            open[slot] = conn.get();
+            connections[fd] = std::move(conn);
+        });
+    }
+
+    Result slab_result;
+    {
+        ConnectionTable connections;
+        std::vector<TcpConnection*> open(concurrent, nullptr);
+        slab_result = Run(iterations, concurrent, [&](int fd, int slot) {
+            if (open[slot]) open[slot]->close_conn();
+            TcpConnection* conn = connections.Acquire(fd);
+            conn->init(fd, addr, nullptr);
+            Exercise(conn);
+            open[slot] = conn;
+        });
+        for (TcpConnection* conn : open) {
+            if (conn) conn->close_conn();
+        }
+    }
+
+    printf("%-22s %-14s %-16s %-16s\n", "connection store", "ns/conn", "allocs/conn", "bytes/conn");
+    printf("%-22s %-14.1f %-16.2f %-16.1f\n", "unordered_map+new", map_result.ns_per_conn, map_result.allocs_per_conn,
+           map_result.bytes_per_conn);
+    printf("%-22s %-14.1f %-16.2f %-16.1f\n", "ConnectionTable", slab_result.ns_per_conn,
+           slab_result.allocs_per_conn, slab_result.bytes_per_conn);
+    return 0;
+}
@@ -0,0 +1,71 @@
+// Coroutine round trips across a worker pool and a blocking pool, as the BLOCKING handlers run them.
+//
+// Usage: bench_coro [coroutines] [workers] [blocking_threads]
+// Each coroutine hops to a worker, awaits two nested Async calls that each run a RunBlocking call on the
+// blocking pool, and checks its result; every 7th takes the synchronous-completion path and every 100th
+// throws from the blocking call, which the co_await must rethrow. Exits non-zero on a wrong result or a
+// lost coroutine, so a sanitizer build (-DCMAKE_CXX_FLAGS=-fsanitize=thread) doubles as a stress test.
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <thread>
+#include "utils/coro.h"
+
+static std::atomic<long> done{0};
+static std::atomic<long> wrong{0};
+
+static Async<int> Leaf(ThreadPool* blocking, ThreadPool* workers, int x) {
+    int r = co_await RunBlocking(blocking, workers, [x]() {
+        if (x % 100 == 0) throw std::runtime_error("blocking call failed");
+        return x * 2;
+    });
+    co_return r + 1;
+}
+
+static Async<void> Mid(ThreadPool* blocking, ThreadPool* workers, int x, int* out) {
+    *out = co_await Leaf(blocking, workers, x);
+    if (x % 7 == 0) co_return;
+    co_await RunBlocking(blocking, workers, [out]() { (*out)++; });
+}
+
+static Detached Top(ThreadPool* blocking, ThreadPool* workers, int x) {
+    co_await Reschedule{workers};
+    int out = 0;
+    bool threw = false;
+    try {
+        co_await Mid(blocking, workers, x, &out);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    bool ok = x % 100 == 0 ? threw : out == x * 2 + 1 + (x % 7 == 0 ? 0 : 1);
+    if (!ok) wrong.fetch_add(1, std::memory_order_relaxed);
+    done.fetch_add(1, std::memory_order_release);
+}
+
+int main(int argc, char* argv[]) {
+    long coroutines = argc > 1 ? atol(argv[1]) : 200000;
+    int workers = argc > 2 ? atoi(argv[2]) : 4;
+    int blocking_threads = argc > 3 ? atoi(argv[3]) : 4;
+
+    ThreadPool worker_pool(workers);
+    ThreadPool blocking_pool(blocking_threads);
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < coroutines; i++) {
+        Top(&blocking_pool, &worker_pool, static_cast<int>(i));
+    }
+    // A coroutine that never resumes shows up as a timeout instead of a hang
+    auto deadline = start + std::chrono::seconds(60);
+    while (done.load(std::memory_order_acquire) < coroutines && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::yield();
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    blocking_pool.Shutdown();
+    worker_pool.Shutdown();
+
+    printf("coroutines: %ld, workers: %d, blocking threads: %d\n", coroutines, workers, blocking_threads);
+    printf("%-12s %-12s %-12s %-16s\n", "done", "wrong", "seconds", "coroutines/s");
+    printf("%-12ld %-12ld %-12.3f %-16.0f\n", done.load(), wrong.load(), secs, done.load() / secs);
+    return done.load() == coroutines && wrong.load() == 0 ? 0 : 1;
+}
@@ -0,0 +1,83 @@
+// Inbox rows that copy the content vs rows that reference the history row (setup in scylla_bench.h).
+//
+// Usage: bench_inbox_refs [messages] [users] [payload bytes] [host] [port]
+// "copy": SCYLLA_INBOX_INLINE_BYTES past the payload, all three rows carry the content (the old model).
+// "reference": the configured SCYLLA_INBOX_INLINE_BYTES (default 1024), bigger payloads are only in history.
+// Each model writes its own users' messages with InsertConcurrent, then every user syncs once
+// (GetMessagesForUser, without the legacy table). Reports content bytes written and sync latency.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <limits>
+#include <string>
+#include <vector>
+#include "dao/msg_scylla_dao.h"
+#include "scylla_bench.h"
+
+static bool Run(const char* name, ScyllaOptions options, const char* host, uint16_t port, long count, int users,
+                uint64_t first_user, size_t payload) {
+    auto* scylla = ScyllaSession::Instance();
+    scylla->Close();
+    if (!ConnectScylla(host, port, options)) {
+        return false;
+    }
+
+    MsgScyllaDao dao;
+    auto msgs = MakeMessages(count, first_user, users, static_cast<uint64_t>(time(nullptr)) * 1000000 + first_user,
+                             std::string(payload, 'x'));
+    size_t content_bytes = 0;
+    for (const auto& msg : msgs) {
+        // History row, plus the two inbox rows when they copy it
+        content_bytes += msg.content().size() * (MsgScyllaDao::InlinesContent(msg) ? 3 : 1);
+    }
+
+    constexpr size_t kChunk = 100;  // AsyncMsgWriter max_batch
+    size_t failed = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < msgs.size(); i += kChunk) {
+        std::vector<im::P2PMessage> chunk(msgs.begin() + i, msgs.begin() + std::min(msgs.size(), i + kChunk));
+        failed += dao.InsertConcurrent(chunk).size();
+    }
+    double write_secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::vector<double> sync_ms;
+    size_t synced = 0;
+    size_t failed_syncs = 0;
+    for (int u = 0; u < users; u++) {
+        auto t0 = std::chrono::steady_clock::now();
+        std::vector<im::P2PMessage> inbox;
+        if (!dao.GetMessagesForUser(first_user + u, &inbox)) failed_syncs++;
+        synced += inbox.size();
+        sync_ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count());
+    }
+    std::sort(sync_ms.begin(), sync_ms.end());
+
+    printf("%-10s content %8.1f MB written  %7.2f s  %9.0f msgs/s  failed %zu | sync %zu rows  failed %zu  "
+           "p50 %6.2f ms  p99 %6.2f ms\n",
+           name, content_bytes / 1e6, write_secs, msgs.size() / write_secs, failed, synced, failed_syncs,
+           sync_ms[sync_ms.size() / 2], sync_ms[(sync_ms.size() - 1) * 99 / 100]);
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    long count = argc > 1 ? atol(argv[1]) : 20000;
+    int users = std::max(argc > 2 ? atoi(argv[2]) : 200, 1);
+    size_t payload = argc > 3 ? static_cast<size_t>(atol(argv[3])) : 16384;
+    const char* host = argc > 4 ? argv[4] : "127.0.0.1";
+    uint16_t port = argc > 5 ? static_cast<uint16_t>(atoi(argv[5])) : 9042;
+
+    auto options = ScyllaOptions::FromEnv();
+    options.legacy_inbox = false;
+    auto copy = options;
+    copy.inbox_inline_bytes = std::numeric_limits<size_t>::max();
+
+    // Separate users per model, a sync only sees the rows of its own model
+    uint64_t first_user = static_cast<uint64_t>(time(nullptr)) % 1000000 * 1000;
+    bool ok = Run("copy", copy, host, port, count, users, first_user, payload) &&
+              Run("reference", options, host, port, count, users, first_user + users, payload);
+
+    ScyllaSession::Instance()->Close();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,271 @@
+// Event backends in isolation: syscalls per message and round-trip latency of epoll vs io_uring on the real I/O path.
+//
+// Usage: bench_poller [connections] [messages_per_connection] [payload_bytes]
+// One reactor thread echoes messages over loopback TCP the way a run-to-completion reactor (-R) answers inline
+// commands: wait, Recv until EAGAIN, Send, re-arm the one-shot registration, with the connections taken by the
+// poller's Accept. So with io_uring the recvs and sends are the ring's (multishot recv into provided buffers,
+// IORING_OP_SEND), with epoll and io_uring(poll) (completions off, readiness only) they are readv/writev. A client
+// thread per connection ping-pongs and times every round trip. The reactor thread's syscalls during the ping-pong
+// are counted by wrapping the libc entry points the backends use (epoll_wait/epoll_ctl, syscall for io_uring_enter,
+// readv/writev/accept/getpeername for the I/O), so no perf is needed.
+// Unlike tests/bench_io_backend.sh this leaves out the protobuf handling, Scylla and the worker hand-off.
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "buffer/buffer.h"
+#include "core/epoller.h"
+#include "core/uring_poller.h"
+
+// Only the reactor thread counts
+static thread_local bool t_reactor = false;
+static thread_local long t_syscalls = 0;
+
+template <typename Fn>
+static Fn Real(const char* name) {
+    return reinterpret_cast<Fn>(dlsym(RTLD_NEXT, name));
+}
+
+extern "C" {
+int epoll_wait(int epfd, struct epoll_event* events, int maxevents, int timeout) {
+    static auto real = Real<int (*)(int, epoll_event*, int, int)>("epoll_wait");
+    if (t_reactor) t_syscalls++;
+    return real(epfd, events, maxevents, timeout);
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event* event) noexcept {
+    static auto real = Real<int (*)(int, int, int, epoll_event*)>("epoll_ctl");
+    if (t_reactor) t_syscalls++;
+    return real(epfd, op, fd, event);
+}
+
+// UringPoller enters the kernel through syscall(2), it takes at most six arguments
+long syscall(long number, ...) noexcept {
+    static auto real = Real<long (*)(long, ...)>("syscall");
+    va_list ap;
+    va_start(ap, number);
+    long args[6];
+    for (long& arg : args) arg = va_arg(ap, long);
+    va_end(ap);
+    if (t_reactor) t_syscalls++;
+    return real(number, args[0], args[1], args[2], args[3], args[4], args[5]);
+}
+
+// Buffer::read_fd and Epoller::Send
+ssize_t readv(int fd, const struct iovec* iov, int iovcnt) {
+    static auto real = Real<ssize_t (*)(int, const iovec*, int)>("readv");
+    if (t_reactor) t_syscalls++;
+    return real(fd, iov, iovcnt);
+}
+
+ssize_t writev(int fd, const struct iovec* iov, int iovcnt) {
+    static auto real = Real<ssize_t (*)(int, const iovec*, int)>("writev");
+    if (t_reactor) t_syscalls++;
+    return real(fd, iov, iovcnt);
+}
+
+int accept(int fd, struct sockaddr* addr, socklen_t* len) {
+    static auto real = Real<int (*)(int, sockaddr*, socklen_t*)>("accept");
+    if (t_reactor) t_syscalls++;
+    return real(fd, addr, len);
+}
+
+int getpeername(int fd, struct sockaddr* addr, socklen_t* len) noexcept {
+    static auto real = Real<int (*)(int, sockaddr*, socklen_t*)>("getpeername");
+    if (t_reactor) t_syscalls++;
+    return real(fd, addr, len);
+}
+}
+
+enum class Mode { EPOLL, IO_URING, IO_URING_SQPOLL, IO_URING_POLL };
+
+static const char* ModeName(Mode mode) {
+    switch (mode) {
+        case Mode::EPOLL:
+            return "epoll";
+        case Mode::IO_URING:
+            return "io_uring";
+        case Mode::IO_URING_SQPOLL:
+            return "io_uring(sqpoll)";
+        case Mode::IO_URING_POLL:
+            return "io_uring(poll)";
+    }
+    return "?";
+}
+
+static std::unique_ptr<Epoller> MakePoller(Mode mode) {
+    switch (mode) {
+        case Mode::EPOLL:
+            return Epoller::Create(IoBackend::EPOLL, 1024);
+        case Mode::IO_URING:
+            return Epoller::Create(IoBackend::IO_URING, 1024);
+        case Mode::IO_URING_SQPOLL:
+            return Epoller::Create(IoBackend::IO_URING_SQPOLL, 1024);
+        case Mode::IO_URING_POLL: {
+            auto poller = std::make_unique<UringPoller>(1024, false, false);
+            if (!poller->IsValid()) return nullptr;
+            return poller;
+        }
+    }
+    return nullptr;
+}
+
+static void Fail(const char* what) {
+    perror(what);
+    exit(1);
+}
+
+struct Result {
+    long syscalls = 0;
+    double secs = 0;
+    std::vector<double> rtt_us;
+};
+
+static Result Run(Mode mode, int connections, long per_connection, size_t payload) {
+    auto poller = MakePoller(mode);
+    if (!poller) {
+        fprintf(stderr, "%s: not available\n", ModeName(mode));
+        exit(1);
+    }
+    const uint32_t kEvents = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    const int one = 1;
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    if (listen_fd < 0 || bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+        listen(listen_fd, connections) != 0 || getsockname(listen_fd, reinterpret_cast<sockaddr*>(&addr), &addr_len)) {
+        Fail("listen");
+    }
+
+    Result result;
+    std::atomic<bool> accepted_all{false};
+    std::atomic<bool> clients_done{false};
+    std::thread reactor([&]() {
+        t_reactor = true;
+        poller->addFd(listen_fd, EPOLLIN);
+        std::vector<Buffer> buffs(1024);
+        std::vector<int> server_fds;
+        // Until the clients have every reply, io_uring sends the last ones with the next Wait
+        while (!clients_done) {
+            int n = poller->Wait(10);
+            for (int i = 0; i < n; i++) {
+                int fd = poller->getEventFd(i);
+                if (fd == listen_fd) {
+                    sockaddr_in peer;
+                    for (int conn; (conn = poller->Accept(listen_fd, &peer)) >= 0;) {
+                        fcntl(conn, F_SETFL, fcntl(conn, F_GETFL) | O_NONBLOCK);
+                        setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                        server_fds.push_back(conn);
+                        poller->addFd(conn, kEvents);
+                    }
+                    if (static_cast<int>(server_fds.size()) == connections) {
+                        // Only the ping-pong counts
+                        t_syscalls = 0;
+                        accepted_all = true;
+                    }
+                    continue;
+                }
+                Buffer& buff = buffs[fd % buffs.size()];
+                int error_code = 0;
+                while (poller->Recv(fd, buff, &error_code) > 0) {
+                }
+                while (buff.readable_bytes() > 0) {
+                    struct iovec iov = buff.ToIovec();
+                    ssize_t w = poller->Send(fd, &iov, 1, &error_code);
+                    if (w <= 0) break;
+                    buff.retrieve(w);
+                }
+                poller->modFd(fd, kEvents);
+            }
+        }
+        result.syscalls = t_syscalls;
+        t_reactor = false;
+        t_syscalls = 0;
+        for (int fd : server_fds) {
+            poller->delFd(fd);
+            poller->Close(fd);
+        }
+    });
+
+    std::vector<int> client_fds;
+    for (int c = 0; c < connections; c++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            Fail("connect");
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        client_fds.push_back(fd);
+    }
+    while (!accepted_all) {
+        std::this_thread::yield();
+    }
+
+    std::vector<std::vector<double>> rtts(connections);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> clients;
+    for (int c = 0; c < connections; c++) {
+        clients.emplace_back([&, c]() {
+            std::string msg(payload, 'x');
+            std::string reply(payload, '\0');
+            rtts[c].reserve(per_connection);
+            for (long m = 0; m < per_connection; m++) {
+                auto t0 = std::chrono::steady_clock::now();
+                if (write(client_fds[c], msg.data(), payload) != static_cast<ssize_t>(payload)) return;
+                for (size_t got = 0; got < payload;) {
+                    ssize_t r = read(client_fds[c], reply.data() + got, payload - got);
+                    if (r <= 0) return;
+                    got += r;
+                }
+                rtts[c].push_back(
+                    std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count());
+            }
+        });
+    }
+    for (auto& t : clients) t.join();
+    result.secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    clients_done = true;
+    reactor.join();
+
+    for (auto& r : rtts) result.rtt_us.insert(result.rtt_us.end(), r.begin(), r.end());
+    std::sort(result.rtt_us.begin(), result.rtt_us.end());
+    poller->delFd(listen_fd);
+    close(listen_fd);
+    for (int fd : client_fds) close(fd);
+    return result;
+}
+
+int main(int argc, char* argv[]) {
+    int connections = argc > 1 ? atoi(argv[1]) : 16;
+    long per_connection = argc > 2 ? atol(argv[2]) : 20000;
+    size_t payload = argc > 3 ? static_cast<size_t>(atol(argv[3])) : 64;
+    long messages = connections * per_connection;
+
+    printf("connections: %d, messages: %ld, payload: %zu bytes\n", connections, messages, payload);
+    printf("%-18s %-14s %-12s %-12s %-12s\n", "backend", "syscalls/msg", "msgs/s", "p50 us", "p99 us");
+    for (Mode mode : {Mode::EPOLL, Mode::IO_URING, Mode::IO_URING_SQPOLL, Mode::IO_URING_POLL}) {
+        Result r = Run(mode, connections, per_connection, payload);
+        if (r.rtt_us.empty()) {
+            fprintf(stderr, "%s: no round trips completed\n", ModeName(mode));
+            return 1;
+        }
+        printf("%-18s %-14.2f %-12.0f %-12.1f %-12.1f\n", ModeName(mode), static_cast<double>(r.syscalls) / messages,
+               messages / r.secs, r.rtt_us[r.rtt_us.size() / 2], r.rtt_us[(r.rtt_us.size() - 1) * 99 / 100]);
+    }
+    return 0;
+}
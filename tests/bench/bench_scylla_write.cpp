@@ -0,0 +1,55 @@
+// Scylla write throughput of AsyncMsgWriter's two strategies (setup in scylla_bench.h).
+//
+// Usage: bench_scylla_write [messages] [users] [host] [port]
+// "logged": InsertBatch, every 100 messages as one LOGGED batch (300 rows over up to 300 partitions).
+// "concurrent": InsertConcurrent, the same chunks as single-partition writes, 256 in flight.
+// Messages go between random pairs of `users` users.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <vector>
+#include "dao/msg_scylla_dao.h"
+#include "scylla_bench.h"
+
+template <typename Write>
+static void Run(const char* name, const std::vector<im::P2PMessage>& msgs, Write write) {
+    constexpr size_t kChunk = 100;  // AsyncMsgWriter max_batch
+    long failed = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < msgs.size(); i += kChunk) {
+        std::vector<im::P2PMessage> chunk(msgs.begin() + i, msgs.begin() + std::min(msgs.size(), i + kChunk));
+        failed += write(chunk);
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("%-11s %8zu msgs  %7.2f s  %10.0f msgs/s  failed %ld\n", name, msgs.size(), secs, msgs.size() / secs,
+           failed);
+}
+
+int main(int argc, char* argv[]) {
+    long count = argc > 1 ? atol(argv[1]) : 100000;
+    int users = argc > 2 ? atoi(argv[2]) : 1000;
+    const char* host = argc > 3 ? argv[3] : "127.0.0.1";
+    uint16_t port = argc > 4 ? static_cast<uint16_t>(atoi(argv[4])) : 9042;
+
+    if (!ConnectScylla(host, port)) {
+        return 1;
+    }
+
+    MsgScyllaDao dao;
+    uint64_t base_id = static_cast<uint64_t>(time(nullptr)) * 1000000;
+    // Separate ids per run so neither strategy overwrites rows written by the other
+    auto logged = MakeMessages(count, 1, users, base_id);
+    auto concurrent = MakeMessages(count, 1, users, base_id + count);
+
+    Run("logged", logged, [&](const std::vector<im::P2PMessage>& chunk) {
+        return dao.InsertBatch(chunk) ? 0L : static_cast<long>(chunk.size());
+    });
+    Run("concurrent", concurrent, [&](const std::vector<im::P2PMessage>& chunk) {
+        return static_cast<long>(dao.InsertConcurrent(chunk).size());
+    });
+
+    ScyllaSession::Instance()->Close();
+    return 0;
+}
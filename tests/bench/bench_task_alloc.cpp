@@ -0,0 +1,88 @@
+// Allocations per dispatched read/write event: std::function + std::bind on the old pool vs Task on ThreadPool.
+//
+// Usage: bench_task_alloc [events] [workers]
+// Each event is posted the way Reactor::DealRead_/DealWrite_ post them, from a non-pool thread, with a
+// [this, client] capture. Allocations are counted with a global operator new replacement, after a warmup
+// round that lets the queues reach their working size.
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <thread>
+#include "mutex_threadpool.h"
+#include "pool/threadpool.h"
+
+static std::atomic<size_t> g_allocs{0};
+
+void* operator new(size_t size) {
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = malloc(size)) return p;
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+struct FakeConnection {
+    std::atomic<long> handled{0};
+};
+
+// Stands in for Reactor, OnRead_/OnWrite_ only count
+struct FakeReactor {
+    void OnRead_(FakeConnection* client) { client->handled.fetch_add(1, std::memory_order_relaxed); }
+    void OnWrite_(FakeConnection* client) { client->handled.fetch_add(1, std::memory_order_relaxed); }
+};
+
+template <typename Post>
+static void Dispatch(long events, FakeConnection* client, Post&& post) {
+    long target = client->handled.load() + events;
+    for (long i = 0; i < events; i++) {
+        post(i);
+    }
+    while (client->handled.load(std::memory_order_acquire) < target) {
+        std::this_thread::yield();
+    }
+}
+
+int main(int argc, char* argv[]) {
+    long events = argc > 1 ? atol(argv[1]) : 1000000;
+    int workers = argc > 2 ? atoi(argv[2]) : 8;
+    FakeReactor reactor;
+    FakeConnection client;
+
+    printf("%-34s %-14s %-14s\n", "dispatch", "allocs/event", "Mevents/s");
+    auto run = [&](const char* name, auto&& post) {
+        Dispatch(events / 10, &client, post);  // Warmup
+        size_t allocs = g_allocs.load();
+        auto start = std::chrono::steady_clock::now();
+        Dispatch(events, &client, post);
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        printf("%-34s %-14.3f %-14.2f\n", name, static_cast<double>(g_allocs.load() - allocs) / events,
+               events / secs / 1e6);
+    };
+
+    {
+        MutexThreadPool pool(workers);
+        run("mutex pool, std::function(bind)", [&](long i) {
+            if (i & 1) {
+                pool.AddTask(std::bind(&FakeReactor::OnRead_, &reactor, &client));
+            } else {
+                pool.AddTask(std::bind(&FakeReactor::OnWrite_, &reactor, &client));
+            }
+        });
+    }
+    {
+        ThreadPool pool(workers);
+        FakeReactor* self = &reactor;
+        FakeConnection* conn = &client;
+        run("ThreadPool, Task([this, client])", [&](long i) {
+            if (i & 1) {
+                pool.AddTask([self, conn]() { self->OnRead_(conn); });
+            } else {
+                pool.AddTask([self, conn]() { self->OnWrite_(conn); });
+            }
+        });
+    }
+    return 0;
+}
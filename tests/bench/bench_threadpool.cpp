@@ -0,0 +1,77 @@
+// Thread pool throughput: the previous single-mutex ThreadPool vs the work-stealing one.
+//
+// Usage: bench_threadpool [workers] [producers] [tasks_per_producer]
+// "inject": producer threads (standing in for reactors) submit tiny tasks from outside the pool.
+// "fanout": tasks submitted from inside the pool, each spawning more tasks (like HandleLogin's follow-up).
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+#include "mutex_threadpool.h"
+#include "pool/threadpool.h"
+
+static void WaitFor(const std::atomic<long>& done, long expected) {
+    while (done.load(std::memory_order_acquire) < expected) {
+        std::this_thread::yield();
+    }
+}
+
+template <typename Pool>
+static double Inject(Pool& pool, int producers, long per_producer) {
+    std::atomic<long> done{0};
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; p++) {
+        threads.emplace_back([&]() {
+            for (long i = 0; i < per_producer; i++) {
+                pool.AddTask([&done]() { done.fetch_add(1, std::memory_order_relaxed); });
+            }
+        });
+    }
+    for (auto& t : threads) t.join();
+    WaitFor(done, producers * per_producer);
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+template <typename Pool>
+static double Fanout(Pool& pool, long roots, int children) {
+    std::atomic<long> done{0};
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < roots; i++) {
+        pool.AddTask([&pool, &done, children]() {
+            for (int c = 0; c < children; c++) {
+                pool.AddTask([&done]() { done.fetch_add(1, std::memory_order_relaxed); });
+            }
+            done.fetch_add(1, std::memory_order_relaxed);
+        });
+    }
+    WaitFor(done, roots * (children + 1));
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char* argv[]) {
+    int workers = argc > 1 ? atoi(argv[1]) : 40;
+    int producers = argc > 2 ? atoi(argv[2]) : 4;
+    long per_producer = argc > 3 ? atol(argv[3]) : 500000;
+    long roots = producers * per_producer / 17;
+    long inject_tasks = producers * per_producer;
+    long fanout_tasks = roots * 17;
+
+    printf("workers: %d, producers: %d\n", workers, producers);
+    printf("%-16s %-18s %-18s\n", "pool", "inject Mtasks/s", "fanout Mtasks/s");
+    {
+        MutexThreadPool pool(workers);
+        double inject = Inject(pool, producers, per_producer);
+        double fanout = Fanout(pool, roots, 16);
+        printf("%-16s %-18.2f %-18.2f\n", "mutex", inject_tasks / inject / 1e6, fanout_tasks / fanout / 1e6);
+    }
+    {
+        ThreadPool pool(workers);
+        double inject = Inject(pool, producers, per_producer);
+        double fanout = Fanout(pool, roots, 16);
+        printf("%-16s %-18.2f %-18.2f\n", "work-stealing", inject_tasks / inject / 1e6, fanout_tasks / fanout / 1e6);
+    }
+    return 0;
+}
@@ -0,0 +1,67 @@
+// AsyncMsgWriter throughput against the number of shards (setup in scylla_bench.h).
+//
+// Usage: bench_writer_shards [messages] [shards] [producers] [users] [host] [port]
+// `producers` threads enqueue `messages` in total between random pairs of `users` users, the clock stops
+// when every message is written or failed. A message refused at the high watermark is resent after 1 ms.
+// The shard count is fixed per process, so compare runs:
+//   for k in 1 2 4 8; do ./bench_writer_shards 200000 $k; done
+// Batch/linger settings come from the WRITER_* variables.
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <random>
+#include <thread>
+#include <vector>
+#include "dao/async_msg_writer.h"
+#include "scylla_bench.h"
+
+int main(int argc, char* argv[]) {
+    long count = argc > 1 ? atol(argv[1]) : 200000;
+    size_t shards = argc > 2 ? static_cast<size_t>(atol(argv[2])) : 4;
+    int producers = argc > 3 ? atoi(argv[3]) : 4;
+    int users = argc > 4 ? atoi(argv[4]) : 1000;
+    const char* host = argc > 5 ? argv[5] : "127.0.0.1";
+    uint16_t port = argc > 6 ? static_cast<uint16_t>(atoi(argv[6])) : 9042;
+
+    if (!ConnectScylla(host, port)) {
+        return 1;
+    }
+
+    auto options = AsyncMsgWriter::Options::FromEnv();
+    options.shards = shards;
+    auto* writer = AsyncMsgWriter::GetInstance();
+    writer->Start(options);
+
+    uint64_t base_id = static_cast<uint64_t>(time(nullptr)) * 1000000;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; p++) {
+        threads.emplace_back([&, p]() {
+            std::mt19937_64 rng(base_id + p);
+            std::uniform_int_distribution<uint64_t> user(1, users);
+            for (long i = p; i < count; i += producers) {
+                uint64_t sender_id = user(rng);
+                auto msg = MakeMessage(base_id + i, sender_id, user(rng));
+                // Past the high watermark, back off like a refused client would
+                while (!writer->Enqueue(msg)) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    while (writer->WrittenCount() + writer->FailedCount() < static_cast<uint64_t>(count)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("shards %2zu  %8ld msgs  %7.2f s  %10.0f msgs/s  failed %lu  refused %lu\n", writer->ShardCount(), count,
+           secs, count / secs, static_cast<unsigned long>(writer->FailedCount()),
+           static_cast<unsigned long>(writer->RejectedCount()));
+
+    writer->Stop();
+    ScyllaSession::Instance()->Close();
+    return 0;
+}
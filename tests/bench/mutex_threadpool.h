@@ -0,0 +1,57 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+
+// The pool as it was before the work-stealing rewrite (detached threads, one mutex + condvar)
+class MutexThreadPool {
+public:
+    explicit MutexThreadPool(size_t threadCount) : pool_(std::make_shared<Pool>()) {
+        for (size_t i = 0; i < threadCount; i++) {
+            std::thread([pool = pool_]() {
+                std::unique_lock<std::mutex> locker(pool->mtx_);
+                while (true) {
+                    if (!pool->tasks_.empty()) {
+                        auto task = std::move(pool->tasks_.front());
+                        pool->tasks_.pop();
+                        locker.unlock();
+                        task();
+                        locker.lock();
+                    } else if (pool->isClosed) {
+                        break;
+                    } else {
+                        pool->cond_.wait(locker);
+                    }
+                }
+            }).detach();
+        }
+    }
+
+    ~MutexThreadPool() {
+        {
+            std::unique_lock<std::mutex> locker(pool_->mtx_);
+            pool_->isClosed = true;
+        }
+        pool_->cond_.notify_all();
+    }
+
+    template <typename T>
+    void AddTask(T&& task) {
+        std::unique_lock<std::mutex> locker(pool_->mtx_);
+        pool_->tasks_.emplace(std::forward<T>(task));
+        pool_->cond_.notify_one();
+    }
+
+private:
+    struct Pool {
+        std::mutex mtx_;
+        std::condition_variable cond_;
+        bool isClosed = false;
+        std::queue<std::function<void()>> tasks_;
+    };
+    std::shared_ptr<Pool> pool_;
+};
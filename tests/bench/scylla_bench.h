@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <random>
+#include <string>
+#include <vector>
+#include "message_service.pb.h"
+#include "pool/scylla_session.h"
+
+// Shared by the benches that write to Scylla. They need a running Scylla with the im schema, e.g.
+//   docker run -p 9042:9042 scylladb/scylla:5.4
+//   .devcontainer/init_scylla.sh
+// and take driver settings from the SCYLLA_* variables (SCYLLA_USERNAME/SCYLLA_PASSWORD for auth).
+
+// A chat line of typical length
+inline const std::string kBenchContent = "benchmark message payload of a typical chat line length";
+
+inline im::P2PMessage MakeMessage(uint64_t msg_id, uint64_t sender_id, uint64_t receiver_id,
+                                  const std::string& content = kBenchContent) {
+    im::P2PMessage msg;
+    msg.set_msg_id(msg_id);
+    msg.set_sender_id(sender_id);
+    msg.set_receiver_id(receiver_id);
+    msg.set_content_type(content.size() > 1024 ? im::CONTENT_IMAGE : im::CONTENT_TEXT);
+    msg.set_content(content);
+    msg.set_timestamp(time(nullptr));
+    return msg;
+}
+
+// count messages with ids from first_id on between random pairs of users first_user..first_user + users - 1
+inline std::vector<im::P2PMessage> MakeMessages(long count, uint64_t first_user, int users, uint64_t first_id,
+                                                const std::string& content = kBenchContent) {
+    std::mt19937_64 rng(first_id);
+    std::uniform_int_distribution<uint64_t> user(first_user, first_user + users - 1);
+    std::vector<im::P2PMessage> msgs;
+    msgs.reserve(count);
+    for (long i = 0; i < count; i++) {
+        uint64_t sender_id = user(rng);
+        msgs.push_back(MakeMessage(first_id + i, sender_id, user(rng), content));
+    }
+    return msgs;
+}
+
+inline bool ConnectScylla(const char* host, uint16_t port, const ScyllaOptions& options = ScyllaOptions::FromEnv()) {
+    if (!ScyllaSession::Instance()->Init(host, port, getenv("SCYLLA_USERNAME"), getenv("SCYLLA_PASSWORD"),
+                                         options)) {
+        fprintf(stderr, "cannot connect to Scylla at %s:%u\n", host, port);
+        return false;
+    }
+    return true;
+}
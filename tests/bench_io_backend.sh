@@ -0,0 +1,44 @@
+#!/usr/bin/env bash
+# Compare the epoll and io_uring event backends: syscalls per message, QPS and tail latency.
+#
+# Usage: tests/bench_io_backend.sh [server_binary] [connections] [messages_per_connection] [reactors]
+# Syscalls are counted with `perf stat -e raw_syscalls:sys_enter` over the whole server process while the
+# benchmark runs, so perf must be installed and allowed to attach (kernel.perf_event_paranoid <= 1 or root).
+# MySQL and Scylla must be reachable the same way as for a normal server run.
+set -euo pipefail
+
+SERVER=${1:-./build/release/server/src/server}
+CONNS=${2:-64}
+MSGS=${3:-2000}
+REACTORS=${4:-1}
+ADDR=127.0.0.1:1316
+
+printf "%-14s %-12s %-14s %-14s %-14s\n" "backend" "QPS" "syscalls/msg" "p50 latency" "p99 latency"
+for b in epoll uring uring_sqpoll; do
+    "$SERVER" -l 0 -r "$REACTORS" -b "$b" > /dev/null 2>&1 &
+    pid=$!
+    # Give the server time to connect to MySQL/Scylla and start listening
+    sleep 3
+
+    perf_out=$(mktemp)
+    perf stat -x, -e raw_syscalls:sys_enter -p "$pid" -o "$perf_out" &
+    perf_pid=$!
+    sleep 0.5
+
+    out=$(go run tests/smoke.go -addr "$ADDR" -c "$CONNS" -n "$MSGS")
+
+    kill -INT "$perf_pid"
+    wait "$perf_pid" || true
+    # The count includes login and warmup traffic, which is small next to the measured messages
+    syscalls=$(awk -F, '/raw_syscalls:sys_enter/ {print $1}' "$perf_out")
+    rm -f "$perf_out"
+
+    qps=$(echo "$out" | awk -F': ' '/^QPS/ {print $2}')
+    p50=$(echo "$out" | awk -F': ' '/^P50 latency/ {print $2}')
+    p99=$(echo "$out" | awk -F': ' '/^P99 latency/ {print $2}')
+    per_msg=$(awk -v s="$syscalls" -v n="$((CONNS * MSGS))" 'BEGIN {printf "%.2f", s / n}')
+    printf "%-14s %-12s %-14s %-14s %-14s\n" "$b" "$qps" "$per_msg" "$p50" "$p99"
+
+    kill -INT "$pid"
+    wait "$pid" || true
+done
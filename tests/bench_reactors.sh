@@ -0,0 +1,27 @@
+#!/usr/bin/env bash
+# Compare server throughput with 1, 2, 4 and 8 reactors (event loops).
+#
+# Usage: tests/bench_reactors.sh [server_binary] [connections] [messages_per_connection]
+# MySQL and Scylla must be reachable the same way as for a normal server run.
+set -euo pipefail
+
+SERVER=${1:-./build/release/server/src/server}
+CONNS=${2:-256}
+MSGS=${3:-2000}
+ADDR=127.0.0.1:1316
+
+printf "%-10s %-12s %-16s\n" "reactors" "QPS" "avg latency"
+for r in 1 2 4 8; do
+    "$SERVER" -l 0 -r "$r" > /dev/null 2>&1 &
+    pid=$!
+    # Give the server time to connect to MySQL/Scylla and start listening
+    sleep 3
+
+    out=$(go run tests/smoke.go -addr "$ADDR" -c "$CONNS" -n "$MSGS")
+    qps=$(echo "$out" | awk -F': ' '/^QPS/ {print $2}')
+    avg=$(echo "$out" | awk -F': ' '/^Average latency/ {print $2}')
+    printf "%-10s %-12s %-16s\n" "$r" "$qps" "$avg"
+
+    kill -INT "$pid"
+    wait "$pid" || true
+done
@@ -8,6 +8,8 @@ import (
 	"io"
 	"log"
 	"net"
+	"sort"
+	"sync"
 	"time"
 
 	pb "termchat/build/release/proto/go"
@@ -18,81 +20,208 @@ import (
 var (
 	serverAddr = flag.String("addr", "127.0.0.1:1316", "server address")
 	totalMsgs  = flag.Int("n", 10000, "total messages to send")
+	clients    = flag.Int("c", 1, "number of concurrent connections, each sends n messages")
+	pipeline   = flag.Int("p", 1, "pipeline depth: messages written back-to-back before reading their acks")
+	ackFlag    = flag.String("ack", "accept", "ack mode of the measured messages: accept, persist or none")
+	ackMode    pb.AckMode
 	username   = "bench_baseline"
 )
 
+type clientResult struct {
+	total     time.Duration
+	min, max  time.Duration
+	latencies []time.Duration
+	err       error
+}
+
 func main() {
 	flag.Parse()
+	switch *ackFlag {
+	case "accept":
+		ackMode = pb.AckMode_ACK_ON_ACCEPT
+	case "persist":
+		ackMode = pb.AckMode_ACK_ON_PERSIST
+	case "none":
+		ackMode = pb.AckMode_ACK_NONE
+	default:
+		log.Fatalf("unknown ack mode %q", *ackFlag)
+	}
+
+	if *clients <= 1 {
+		fmt.Printf("=== Stage 1: Single User Benchmark ===\n")
+	} else {
+		fmt.Printf("=== Stage 2: Concurrent Users Benchmark ===\n")
+	}
+	fmt.Printf("Target server: %s, connections: %d, messages per connection: %d, pipeline depth: %d, ack: %s\n",
+		*serverAddr, *clients, *totalMsgs, *pipeline, *ackFlag)
+
+	results := make([]clientResult, *clients)
+	var wg sync.WaitGroup
+	ready := make(chan struct{})
+	var loggedIn sync.WaitGroup
+	loggedIn.Add(*clients)
 
-	fmt.Printf("=== Stage 1: Single User Benchmark ===\n")
-	fmt.Printf("Target server: %s, number of messages: %d\n", *serverAddr, *totalMsgs)
+	for c := 0; c < *clients; c++ {
+		wg.Add(1)
+		go func(id int) {
+			defer wg.Done()
+			results[id] = runClient(id, &loggedIn, ready)
+		}(c)
+	}
+
+	// Start measuring only once every connection is logged in and warmed up
+	loggedIn.Wait()
+	fmt.Println("Logged in and warmed up successfully")
+	startTime := time.Now()
+	close(ready)
+	wg.Wait()
+	totalTime := time.Since(startTime)
+
+	var totalDuration time.Duration
+	minLatency := time.Hour
+	maxLatency := time.Duration(0)
+	var latencies []time.Duration
+	for id, r := range results {
+		if r.err != nil {
+			log.Fatalf("Client %d failed: %v", id, r.err)
+		}
+		totalDuration += r.total
+		minLatency = min(minLatency, r.min)
+		maxLatency = max(maxLatency, r.max)
+		latencies = append(latencies, r.latencies...)
+	}
+	sort.Slice(latencies, func(i, j int) bool { return latencies[i] < latencies[j] })
+
+	sent := *totalMsgs * *clients
+	avgLatency := totalDuration / time.Duration(sent)
+	qps := float64(sent) / totalTime.Seconds()
+
+	// Print results
+	fmt.Printf("\n=== Results ===\n")
+	fmt.Printf("Total duration: %s\n", totalTime)
+	fmt.Printf("Total messages: %d\n", sent)
+	fmt.Printf("Min latency: %s\n", minLatency)
+	fmt.Printf("Max latency: %s\n", maxLatency)
+	fmt.Printf("Average latency: %s\n", avgLatency)
+	fmt.Printf("P50 latency: %s\n", percentile(latencies, 0.50))
+	fmt.Printf("P99 latency: %s\n", percentile(latencies, 0.99))
+	fmt.Printf("QPS: %.2f\n", qps)
+}
+
+func runClient(id int, loggedIn *sync.WaitGroup, ready <-chan struct{}) (res clientResult) {
+	signalled := false
+	defer func() {
+		if !signalled {
+			loggedIn.Done()
+		}
+	}()
 
 	// 1. Establish connection
 	conn, err := net.Dial("tcp", *serverAddr)
 	if err != nil {
-		log.Fatalf("Connection failed: %v", err)
+		return clientResult{err: fmt.Errorf("connection failed: %v", err)}
 	}
 	defer conn.Close()
 
 	// 2. Register and login
+	user := username
+	if *clients > 1 {
+		user = fmt.Sprintf("%s_%d", username, id)
+	}
 	rw := bufio.NewReadWriter(bufio.NewReader(conn), bufio.NewWriter(conn))
-	if err := doHandshake(rw, username); err != nil {
-		log.Fatalf("Handshake failed: %v", err)
+	if err := doHandshake(rw, user); err != nil {
+		return clientResult{err: fmt.Errorf("handshake failed: %v", err)}
 	}
-	fmt.Println("Logged in successfully")
 
 	// 3. Warmup
 	payload := []byte("Benchmark Payload Data")
 	for i := 0; i < 100; i++ {
-		if err := sendP2PMsg(rw, 0, payload); err != nil {
-			log.Fatalf("Warmup send failed: %v", err)
+		if err := sendP2PMsg(rw, 0, payload, pb.AckMode_ACK_ON_ACCEPT); err != nil {
+			return clientResult{err: fmt.Errorf("warmup send failed: %v", err)}
 		}
 		if _, err := readResponse(rw); err != nil {
-			log.Fatalf("Warmup read failed: %v", err)
+			return clientResult{err: fmt.Errorf("warmup read failed: %v", err)}
 		}
 	}
-	fmt.Println("Warmup completed")
+	loggedIn.Done()
+	signalled = true
+	<-ready
 
 	// 4. Send messages
-	var totalDuration time.Duration
-	minLatency := time.Hour
-	maxLatency := time.Duration(0)
-
-	startTime := time.Now()
-	for i := 0; i < *totalMsgs; i++ {
+	res.min = time.Hour
+	res.latencies = make([]time.Duration, 0, *totalMsgs)
+	depth := max(*pipeline, 1)
+	for i := 0; i < *totalMsgs; i += depth {
+		batch := min(depth, *totalMsgs-i)
 		msgStart := time.Now()
-		if err := sendP2PMsg(rw, i, payload); err != nil {
-			log.Fatalf("Failed to send message at seq %d: %v", i, err)
+		// The whole batch goes out in one flush, so the server sees the frames in one read
+		for j := 0; j < batch; j++ {
+			mode := ackMode
+			// Without acks the last message of the run asks for one: the connection's requests are handled in
+			// order, so its ack means the server has taken every message
+			if ackMode == pb.AckMode_ACK_NONE && i+j == *totalMsgs-1 {
+				mode = pb.AckMode_ACK_ON_ACCEPT
+			}
+			if err := writeP2PMsg(rw, i+j, payload, mode); err != nil {
+				return clientResult{err: fmt.Errorf("failed to send message at seq %d: %v", i+j, err)}
+			}
 		}
-		_, err := readResponse(rw)
-		if err != nil {
-			log.Fatalf("Failed to read response at seq %d: %v", i, err)
+		if err := rw.Flush(); err != nil {
+			return clientResult{err: fmt.Errorf("failed to flush batch at seq %d: %v", i, err)}
+		}
+		if ackMode == pb.AckMode_ACK_NONE {
+			// Latency is the time to hand the batch to the socket
+			if i+batch == *totalMsgs {
+				if _, err := readResponse(rw); err != nil {
+					return clientResult{err: fmt.Errorf("failed to read the final ack: %v", err)}
+				}
+			}
+			latency := time.Since(msgStart)
+			for j := 0; j < batch; j++ {
+				res.total += latency
+				res.min = min(res.min, latency)
+				res.max = max(res.max, latency)
+				res.latencies = append(res.latencies, latency)
+			}
+			continue
+		}
+		for j := 0; j < batch; j++ {
+			if _, err := readResponse(rw); err != nil {
+				return clientResult{err: fmt.Errorf("failed to read response at seq %d: %v", i+j, err)}
+			}
+			// Latency of a pipelined message runs until its own ack arrives
+			latency := time.Since(msgStart)
+			res.total += latency
+			res.min = min(res.min, latency)
+			res.max = max(res.max, latency)
+			res.latencies = append(res.latencies, latency)
 		}
-		latency := time.Since(msgStart)
-		totalDuration += latency
-		minLatency = min(minLatency, latency)
-		maxLatency = max(maxLatency, latency)
 	}
+	return res
+}
 
-	totalTime := time.Since(startTime)
-	avgLatency := totalDuration / time.Duration(*totalMsgs)
-	qps := float64(*totalMsgs) / totalTime.Seconds()
+// percentile expects sorted latencies
+func percentile(latencies []time.Duration, p float64) time.Duration {
+	if len(latencies) == 0 {
+		return 0
+	}
+	return latencies[int(float64(len(latencies)-1)*p)]
+}
 
-	// 5. Print results
-	fmt.Printf("\n=== Results ===\n")
-	fmt.Printf("Total duration: %s\n", totalTime)
-	fmt.Printf("Total messages: %d\n", *totalMsgs)
-	fmt.Printf("Min latency: %s\n", minLatency)
-	fmt.Printf("Max latency: %s\n", maxLatency)
-	fmt.Printf("Average latency: %s\n", avgLatency)
-	fmt.Printf("QPS: %.2f\n", qps)
+func sendP2PMsg(rw *bufio.ReadWriter, seq int, content []byte, mode pb.AckMode) error {
+	if err := writeP2PMsg(rw, seq, content, mode); err != nil {
+		return err
+	}
+	return rw.Flush()
 }
 
-func sendP2PMsg(rw *bufio.ReadWriter, seq int, content []byte) error {
+// writeP2PMsg buffers the frame without flushing
+func writeP2PMsg(rw *bufio.ReadWriter, seq int, content []byte, mode pb.AckMode) error {
 	msg := &pb.P2PMessage{
 		ReceiverId: 2,
 		Content:    content,
 		Timestamp:  time.Now().Unix(),
+		AckMode:    mode,
 	}
 
 	env := &pb.Envelope{
@@ -102,10 +231,17 @@ func sendP2PMsg(rw *bufio.ReadWriter, seq int, content []byte) error {
 		},
 	}
 
-	return sendPacket(rw, env)
+	return writePacket(rw, env)
 }
 
 func sendPacket(rw *bufio.ReadWriter, env *pb.Envelope) error {
+	if err := writePacket(rw, env); err != nil {
+		return err
+	}
+	return rw.Flush()
+}
+
+func writePacket(rw *bufio.ReadWriter, env *pb.Envelope) error {
 	data, err := proto.Marshal(env)
 	if err != nil {
 		return err
@@ -116,11 +252,8 @@ func sendPacket(rw *bufio.ReadWriter, env *pb.Envelope) error {
 	if _, err := rw.Write(lenBuf); err != nil {
 		return err
 	}
-	if _, err := rw.Write(data); err != nil {
-		return err
-	}
-
-	return rw.Flush()
+	_, err = rw.Write(data)
+	return err
 }
 
 func doHandshake(rw *bufio.ReadWriter, user string) error {
@@ -95,6 +95,75 @@ class TestP2PMessage(unittest.TestCase):
         
         return sock, resp.login_res.user_info.user_id
 
+    def _register_pair(self, prefix):
+        # Two fresh users named after the test, logged in on their own sockets
+        ts = int(time.time())
+        sock_a, id_a = self._register_and_login(f"{prefix}_a_{ts}", "password123")
+        sock_b, id_b = self._register_and_login(f"{prefix}_b_{ts}", "password123")
+        return sock_a, id_a, sock_b, id_b
+
+    def _p2p_request(self, seq, receiver_id, content, ack_mode=message_service_pb2.ACK_ON_ACCEPT, msg_id=None):
+        # The client's own id of the message defaults to the request seq, unique per sender within a test
+        envelope = protocol_pb2.Envelope()
+        envelope.seq = seq
+        envelope.cmd = protocol_pb2.CMD_P2P_MSG_REQ
+        envelope.timestamp = int(time.time())
+        p2p_msg = envelope.p2p_msg_req
+        p2p_msg.msg_id = seq if msg_id is None else msg_id
+        p2p_msg.receiver_id = receiver_id
+        p2p_msg.content = content.encode('utf-8')
+        p2p_msg.timestamp = int(time.time())
+        p2p_msg.ack_mode = ack_mode
+        return envelope
+
+    def _send_p2p(self, sock, seq, receiver_id, content, ack_mode=message_service_pb2.ACK_ON_ACCEPT, msg_id=None):
+        envelope = self._p2p_request(seq, receiver_id, content, ack_mode, msg_id)
+        self._send_msg(sock, envelope)
+        return envelope
+
+    def _send_pipelined(self, sock, envelopes):
+        # All frames in one write
+        data = b''
+        for envelope in envelopes:
+            serialized = envelope.SerializeToString()
+            data += struct.pack('>I', len(serialized)) + serialized
+        sock.sendall(data)
+
+    def _recv_response(self, sock, cmd, timeout=5.0):
+        # Pushes of messages sent meanwhile may come ahead of it
+        resp = self._recv_msg(sock, timeout=timeout)
+        while resp is not None and resp.cmd == protocol_pb2.CMD_P2P_MSG_PUSH:
+            resp = self._recv_msg(sock, timeout=timeout)
+        self.assertIsNotNone(resp, f"Missing response, expected cmd {cmd}")
+        self.assertEqual(resp.cmd, cmd)
+        return resp
+
+    def _recv_ack(self, sock):
+        ack = self._recv_response(sock, protocol_pb2.CMD_MSG_ACK).msg_ack
+        self.assertTrue(ack.success, ack.error_msg)
+        return ack
+
+    def _metric(self, name):
+        sock = self._create_socket()
+        sock.sendall(b"GET /metrics HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n")
+        sock.settimeout(2.0)
+        data = b''
+        try:
+            while True:
+                chunk = sock.recv(65536)
+                if not chunk:
+                    break
+                data += chunk
+                if name.encode() in data and data.endswith(b'\n'):
+                    break
+        except socket.timeout:
+            pass
+        sock.close()
+        for line in data.decode('utf-8', 'replace').splitlines():
+            if line.startswith(name + ' '):
+                return float(line.split()[1])
+        self.fail(f"{name} not in /metrics")
+
     def test_p2p_message_flow(self):
         # 1. Setup two users: Alice and Bob
         ts = int(time.time())
@@ -131,7 +200,9 @@ class TestP2PMessage(unittest.TestCase):
         ack_env = self._recv_msg(sock_a)
         self.assertIsNotNone(ack_env, "Alice should receive ACK")
         self.assertEqual(ack_env.cmd, protocol_pb2.CMD_MSG_ACK)
-        self.assertEqual(ack_env.msg_ack.msg_id, msg_id)
+        # The server assigns the id, ours comes back as client_msg_id
+        self.assertEqual(ack_env.msg_ack.client_msg_id, msg_id)
+        self.assertNotEqual(ack_env.msg_ack.msg_id, 0)
         self.assertTrue(ack_env.msg_ack.success, f"Error: {ack_env.msg_ack.error_msg}")
         print("A received ACK")
 
@@ -141,6 +212,7 @@ class TestP2PMessage(unittest.TestCase):
         self.assertEqual(push_env.cmd, protocol_pb2.CMD_P2P_MSG_PUSH)
         
         push_msg = push_env.p2p_msg_push
+        self.assertEqual(push_msg.msg_id, ack_env.msg_ack.msg_id)
         self.assertEqual(push_msg.sender_id, id_a)
         self.assertEqual(push_msg.receiver_id, id_b)
         self.assertEqual(push_msg.content.decode('utf-8'), msg_content)
@@ -184,5 +256,333 @@ class TestP2PMessage(unittest.TestCase):
         sock_a.close()
         sock_b.close()
 
+    def test_pipelined_blocking_commands_keep_order(self):
+        # Register, login and sync in one write: each waits on the database (as a coroutine unless the
+        # server runs with -s), the responses must still come back in request order and the sync must
+        # see the login that preceded it
+        username = f"pipe_{int(time.time())}"
+        sock = self._create_socket()
+
+        register = protocol_pb2.Envelope()
+        register.seq = 1
+        register.cmd = protocol_pb2.CMD_REGISTER_REQ
+        register.register_req.username = username
+        register.register_req.password = "password123"
+
+        login = protocol_pb2.Envelope()
+        login.seq = 2
+        login.cmd = protocol_pb2.CMD_LOGIN_REQ
+        login.login_req.username = username
+        login.login_req.password = "password123"
+
+        sync = protocol_pb2.Envelope()
+        sync.seq = 3
+        sync.cmd = protocol_pb2.CMD_SYNC_MSGS_REQ
+        sync.sync_msgs_req.SetInParent()
+
+        data = b''
+        for envelope in (register, login, sync):
+            serialized = envelope.SerializeToString()
+            data += struct.pack('>I', len(serialized)) + serialized
+        sock.sendall(data)
+
+        expected = [(1, protocol_pb2.CMD_REGISTER_RES), (2, protocol_pb2.CMD_LOGIN_RES),
+                    (3, protocol_pb2.CMD_SYNC_MSGS_RES)]
+        for seq, cmd in expected:
+            resp = self._recv_msg(sock, timeout=5.0)
+            self.assertIsNotNone(resp, f"No response for seq {seq}")
+            self.assertEqual(resp.seq, seq)
+            self.assertEqual(resp.cmd, cmd)
+            if cmd == protocol_pb2.CMD_LOGIN_RES:
+                self.assertTrue(resp.login_res.success)
+            if cmd == protocol_pb2.CMD_SYNC_MSGS_RES:
+                self.assertTrue(resp.sync_msgs_res.success, resp.sync_msgs_res.error_msg)
+
+        sock.close()
+
+    def test_ack_modes(self):
+        # ACK_NONE gets no ack, ACK_ON_PERSIST gets its ack once the message is in Scylla (so possibly after
+        # the ACK_ON_ACCEPT one sent behind it), and every message is pushed
+        sock_a, id_a, sock_b, id_b = self._register_pair("ackmode")
+
+        modes = [(10, message_service_pb2.ACK_NONE), (11, message_service_pb2.ACK_ON_PERSIST),
+                 (12, message_service_pb2.ACK_ON_ACCEPT)]
+        self._send_pipelined(sock_a, [self._p2p_request(seq, id_b, f"ack mode {mode}", mode) for seq, mode in modes])
+
+        acks = {}
+        for _ in range(2):
+            ack_env = self._recv_response(sock_a, protocol_pb2.CMD_MSG_ACK)
+            self.assertTrue(ack_env.msg_ack.success, ack_env.msg_ack.error_msg)
+            acks[ack_env.seq] = ack_env.msg_ack.client_msg_id
+        self.assertEqual(acks, {11: 11, 12: 12})
+        self.assertIsNone(self._recv_msg(sock_a, timeout=1.0), "ACK_NONE must not be acked")
+
+        for _ in modes:
+            push_env = self._recv_msg(sock_b)
+            self.assertIsNotNone(push_env, "Bob should receive every message")
+            self.assertEqual(push_env.cmd, protocol_pb2.CMD_P2P_MSG_PUSH)
+            self.assertEqual(push_env.p2p_msg_push.sender_id, id_a)
+            self.assertEqual(push_env.p2p_msg_push.ack_mode, message_service_pb2.ACK_ON_ACCEPT)
+
+        sock_a.close()
+        sock_b.close()
+
+    def test_sync_cursor_paging(self):
+        # With a cursor the inbox comes back oldest first in pages of page_size, following the continuation
+        # until has_more is off, every message once; a later cursor in the middle of a second skips what it has
+        ts = int(time.time())
+        sock_a, id_a, sock_b, id_b = self._register_pair("syncpage")
+
+        sent = []
+        for seq in range(20, 25):
+            self._send_p2p(sock_a, seq, id_b, f"page {seq}", message_service_pb2.ACK_ON_PERSIST)
+            sent.append(self._recv_ack(sock_a).msg_id)
+
+        received = []
+        continuation = b''
+        for page in range(20):
+            envelope = protocol_pb2.Envelope()
+            envelope.seq = 100 + page
+            envelope.cmd = protocol_pb2.CMD_SYNC_MSGS_REQ
+            envelope.sync_msgs_req.since_timestamp = ts - 1
+            envelope.sync_msgs_req.page_size = 2
+            envelope.sync_msgs_req.continuation = continuation
+            self._send_msg(sock_b, envelope)
+
+            resp = self._recv_response(sock_b, protocol_pb2.CMD_SYNC_MSGS_RES)
+            self.assertTrue(resp.sync_msgs_res.success, resp.sync_msgs_res.error_msg)
+            self.assertLessEqual(len(resp.sync_msgs_res.messages), 2)
+            received.extend(resp.sync_msgs_res.messages)
+            if not resp.sync_msgs_res.has_more:
+                break
+            continuation = resp.sync_msgs_res.continuation
+        else:
+            self.fail("Sync never caught up")
+
+        self.assertEqual([msg.msg_id for msg in received], sent)
+
+        # From the second message on, nothing of the cursor's second comes again
+        envelope = protocol_pb2.Envelope()
+        envelope.seq = 200
+        envelope.cmd = protocol_pb2.CMD_SYNC_MSGS_REQ
+        envelope.sync_msgs_req.since_timestamp = received[1].timestamp
+        envelope.sync_msgs_req.since_msg_id = received[1].msg_id
+        self._send_msg(sock_b, envelope)
+        resp = self._recv_response(sock_b, protocol_pb2.CMD_SYNC_MSGS_RES)
+        self.assertTrue(resp.sync_msgs_res.success, resp.sync_msgs_res.error_msg)
+        self.assertEqual([msg.msg_id for msg in resp.sync_msgs_res.messages], sent[2:])
+
+        sock_a.close()
+        sock_b.close()
+
+    def test_streamed_sync(self):
+        # With stream set a sync comes back as frames of at most 50 messages, every one but the last with
+        # more_frames; the latest-messages form and the cursor form stream the same way, the former while it
+        # still reads the older day buckets
+        ts = int(time.time())
+        sock_a, id_a, sock_b, id_b = self._register_pair("syncstream")
+
+        count = 120
+        self._send_pipelined(sock_a, [self._p2p_request(seq, id_b, f"stream {seq}", message_service_pb2.ACK_ON_PERSIST)
+                                      for seq in range(1, count + 1)])
+        sent = sorted(self._recv_ack(sock_a).msg_id for _ in range(count))
+
+        for seq, since in ((1000, 0), (1001, ts - 1)):
+            early = self._metric('termchat_sync_frames_during_read_total')
+            envelope = protocol_pb2.Envelope()
+            envelope.seq = seq
+            envelope.cmd = protocol_pb2.CMD_SYNC_MSGS_REQ
+            envelope.sync_msgs_req.since_timestamp = since
+            envelope.sync_msgs_req.stream = True
+            self._send_msg(sock_b, envelope)
+
+            received = []
+            frames = 0
+            while True:
+                resp = self._recv_response(sock_b, protocol_pb2.CMD_SYNC_MSGS_RES)
+                self.assertEqual(resp.seq, seq)
+                self.assertTrue(resp.sync_msgs_res.success, resp.sync_msgs_res.error_msg)
+                self.assertLessEqual(len(resp.sync_msgs_res.messages), 50)
+                received += [msg.msg_id for msg in resp.sync_msgs_res.messages]
+                frames += 1
+                if not resp.sync_msgs_res.more_frames:
+                    break
+
+            self.assertGreaterEqual(frames, 3)
+            self.assertFalse(resp.sync_msgs_res.has_more)
+            self.assertEqual(sorted(set(received)), sent)
+            if since == 0:
+                # Today's messages go out before the older days are read, not once the whole inbox is in
+                self.assertGreaterEqual(self._metric('termchat_sync_frames_during_read_total') - early, frames - 1)
+
+        sock_a.close()
+        sock_b.close()
+
+    def test_sync_reads_own_writes(self):
+        # A sync right after the acks has every acknowledged message, written to Scylla yet or not
+        sock_a, id_a, sock_b, id_b = self._register_pair("ryw")
+
+        sent = []
+        for seq in range(1, 6):
+            self._send_p2p(sock_a, seq, id_b, f"ryw {seq}")
+            sent.append(self._recv_ack(sock_a).msg_id)
+        # Ids of one server grow with every message it takes
+        self.assertEqual(sent, sorted(sent))
+
+        envelope = protocol_pb2.Envelope()
+        envelope.seq = 50
+        envelope.cmd = protocol_pb2.CMD_SYNC_MSGS_REQ
+        self._send_msg(sock_a, envelope)
+        resp = self._recv_response(sock_a, protocol_pb2.CMD_SYNC_MSGS_RES)
+        self.assertTrue(resp.sync_msgs_res.success, resp.sync_msgs_res.error_msg)
+        synced = [msg.msg_id for msg in resp.sync_msgs_res.messages]
+        self.assertEqual(sorted(synced), sent)
+        timestamps = [msg.timestamp for msg in resp.sync_msgs_res.messages]
+        self.assertEqual(timestamps, sorted(timestamps, reverse=True))
+
+        sock_a.close()
+        sock_b.close()
+
+    def test_sync_from_inbox_cache(self):
+        # The receiver's ring holds everything after the second its first message came in, a cursor sync
+        # starting later is answered from memory
+        sock_a, id_a, sock_b, id_b = self._register_pair("inboxcache")
+
+        def send(seq):
+            envelope = self._send_p2p(sock_a, seq, id_b, f"cached {seq}")
+            return envelope.p2p_msg_req.timestamp, self._recv_ack(sock_a).msg_id
+
+        first_ts, _ = send(1)
+        time.sleep(2.1)
+        later = [send(seq)[1] for seq in (2, 3, 4)]
+
+        hits = self._metric('termchat_inbox_cache_lookups_total{result="hit"}')
+        envelope = protocol_pb2.Envelope()
+        envelope.seq = 50
+        envelope.cmd = protocol_pb2.CMD_SYNC_MSGS_REQ
+        envelope.sync_msgs_req.since_timestamp = first_ts + 2
+        self._send_msg(sock_b, envelope)
+        resp = self._recv_response(sock_b, protocol_pb2.CMD_SYNC_MSGS_RES)
+        self.assertTrue(resp.sync_msgs_res.success, resp.sync_msgs_res.error_msg)
+        self.assertFalse(resp.sync_msgs_res.has_more)
+        self.assertEqual(sorted(msg.msg_id for msg in resp.sync_msgs_res.messages), later)
+        self.assertGreater(self._metric('termchat_inbox_cache_lookups_total{result="hit"}'), hits)
+
+        sock_a.close()
+        sock_b.close()
+
+    def test_get_history(self):
+        # Pages go back from the newest message, each one after the last message of the previous page; the
+        # newest come from the conversation's ring, the first message's second only from Scylla
+        sock_a, id_a, sock_b, id_b = self._register_pair("history")
+
+        def send(seq):
+            self._send_p2p(sock_a, seq, id_b, f"history {seq}", message_service_pb2.ACK_ON_PERSIST)
+            return self._recv_ack(sock_a).msg_id
+
+        sent = [send(1)]
+        time.sleep(2.1)
+        sent += [send(seq) for seq in (2, 3, 4, 5)]
+
+        hits = self._metric('termchat_history_cache_lookups_total{result="hit"}')
+        received = []
+        timestamps = []
+        before_timestamp, before_msg_id = 0, 0
+        for page in range(10):
+            envelope = protocol_pb2.Envelope()
+            envelope.seq = 200 + page
+            envelope.cmd = protocol_pb2.CMD_GET_HISTORY_REQ
+            envelope.get_history_req.peer_id = id_a
+            envelope.get_history_req.before_timestamp = before_timestamp
+            envelope.get_history_req.before_msg_id = before_msg_id
+            envelope.get_history_req.limit = 2
+            self._send_msg(sock_b, envelope)
+
+            resp = self._recv_response(sock_b, protocol_pb2.CMD_GET_HISTORY_RES)
+            self.assertTrue(resp.get_history_res.success, resp.get_history_res.error_msg)
+            self.assertLessEqual(len(resp.get_history_res.messages), 2)
+            for msg in resp.get_history_res.messages:
+                received.append(msg.msg_id)
+                timestamps.append(msg.timestamp)
+            if not resp.get_history_res.has_more:
+                break
+            last = resp.get_history_res.messages[-1]
+            before_timestamp, before_msg_id = last.timestamp, last.msg_id
+        else:
+            self.fail("History never ended")
+
+        self.assertEqual(sorted(received), sent)
+        self.assertEqual(timestamps, sorted(timestamps, reverse=True))
+        self.assertGreater(self._metric('termchat_history_cache_lookups_total{result="hit"}'), hits)
+
+        sock_a.close()
+        sock_b.close()
+
+    def test_conversation_seq(self):
+        # Seqs of a conversation are consecutive, the ack and the push carry the same one, and a history
+        # request with after_seq returns only what came after it
+        sock_a, id_a, sock_b, id_b = self._register_pair("convseq")
+
+        acked = []
+        for seq in (1, 2, 3):
+            self._send_p2p(sock_a, seq, id_b, f"seq {seq}", message_service_pb2.ACK_ON_PERSIST)
+            acked.append(self._recv_ack(sock_a).ref_seq)
+        self.assertGreater(acked[0], 0)
+        self.assertEqual(acked, [acked[0], acked[0] + 1, acked[0] + 2])
+
+        pushed = []
+        while len(pushed) < 3:
+            push = self._recv_msg(sock_b, timeout=5.0)
+            self.assertIsNotNone(push, "Missing push")
+            if push.cmd == protocol_pb2.CMD_P2P_MSG_PUSH:
+                pushed.append(push.p2p_msg_push.seq)
+        self.assertEqual(pushed, acked)
+
+        envelope = protocol_pb2.Envelope()
+        envelope.seq = 100
+        envelope.cmd = protocol_pb2.CMD_GET_HISTORY_REQ
+        envelope.get_history_req.peer_id = id_a
+        envelope.get_history_req.after_seq = acked[0]
+        envelope.get_history_req.limit = 10
+        self._send_msg(sock_b, envelope)
+        resp = self._recv_response(sock_b, protocol_pb2.CMD_GET_HISTORY_RES)
+        self.assertTrue(resp.get_history_res.success, resp.get_history_res.error_msg)
+        self.assertEqual(sorted(msg.seq for msg in resp.get_history_res.messages), acked[1:])
+        self.assertFalse(resp.get_history_res.has_more)
+
+        sock_a.close()
+        sock_b.close()
+
+    def test_resend_answered_with_first_ack(self):
+        # A message sent again under the same msg_id (a lost ack) gets the first ack back, in either ack mode,
+        # and is neither stored nor pushed again
+        sock_a, id_a, sock_b, id_b = self._register_pair("resend")
+        duplicates = self._metric('termchat_send_dedup_duplicates_total')
+
+        def send(seq, ack_mode):
+            self._send_p2p(sock_a, seq, id_b, "sent twice", ack_mode, msg_id=1)
+            ack = self._recv_ack(sock_a)
+            self.assertEqual(ack.client_msg_id, 1)
+            return ack
+
+        first = send(1, message_service_pb2.ACK_ON_ACCEPT)
+        for seq, ack_mode in ((2, message_service_pb2.ACK_ON_ACCEPT), (3, message_service_pb2.ACK_ON_PERSIST)):
+            again = send(seq, ack_mode)
+            self.assertEqual(again.msg_id, first.msg_id)
+            self.assertEqual(again.ref_seq, first.ref_seq)
+        self.assertEqual(self._metric('termchat_send_dedup_duplicates_total'), duplicates + 2)
+
+        pushes = []
+        while True:
+            push = self._recv_msg(sock_b, timeout=1.0)
+            if push is None:
+                break
+            if push.cmd == protocol_pb2.CMD_P2P_MSG_PUSH:
+                pushes.append(push.p2p_msg_push.msg_id)
+        self.assertEqual(pushes, [first.msg_id])
+
+        sock_a.close()
+        sock_b.close()
+
 if __name__ == '__main__':
     unittest.main()